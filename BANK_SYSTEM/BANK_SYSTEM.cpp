@@ -1,15 +1,41 @@
+#include "BankEngine.h"
+
 #include <iostream>
 #include <fstream>
-#include <string>
-#include <vector>
 #include <iomanip>
 #include <cctype>
 #include <limits> // Added for numeric_limits
+#include <algorithm>
+#include <cstdlib>
+#include <charconv>
+#include <system_error>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <condition_variable>
+#include <semaphore>
+#include <random>
+#include <csignal>
+#include <ctime>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-const string ClientsFileName = "Clients.txt";
-
 enum enMainMenueOptions {
     eListClients = 1,
     eAddNewClient = 2,
@@ -17,177 +43,482 @@ enum enMainMenueOptions {
     eUpdateClient = 4,
     eFindClient = 5,
     eTransactions = 6,
-    eExit = 7
+    eStatistics = 7,
+    eExit = 8
+};
+
+enum enFindOptions {
+    eFindByAccountNumber = 1,
+    eFindByName = 2,
+    eFindByPhone = 3
 };
 
 enum enTransactionsOptions {
     eDeposit = 1,
     eWithdraw = 2,
-    eTotalBalances = 3,
-    eMainMenue = 4
-};
-
-struct stClientData
-{
-    string AccountNumber;
-    string PinCode;
-    string Name;
-    string Phone;
-    double AccountBalance = 0;
-    bool MarkForDelete = false;
+    eTransfer = 3,
+    eTotalBalances = 4,
+    eAccountStatement = 5,
+    eMainMenue = 6
 };
 
 // =============================================================
 //                      Input Validation Utils
 // =============================================================
 
-// Helper to read numbers safely without crashing if text is entered
-double ReadDouble(string Message)
+// Helper to read amounts safely without crashing if text is entered
+Cents ReadMoney(string Message)
 {
-    double Number = 0;
+    string Text;
+    Cents Amount = 0;
     cout << Message;
-    while (!(cin >> Number)) {
+    while (!(cin >> Text) || !ParseMoney(Text, Amount)) {
         cin.clear();
         cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        cout << "Invalid Input. Please enter a numerical value: ";
+        cout << "Invalid Input. Please enter an amount like 150 or 150.25: ";
     }
-    // Clear buffer after reading a number to prepare for next getline
-    return Number;
+    return Amount;
+}
+
+void PrintFileLoadErrors(string FileName, const vector<stFileLoadError>& vErrors, ostream& Out = cout)
+{
+    const size_t MaxErrorsShown = 10;
+
+    for (size_t i = 0; i < vErrors.size() && i < MaxErrorsShown; i++)
+    {
+        if (vErrors[i].LineNumber == 0) // About the whole file
+            Out << FileName << ": " << vErrors[i].Message << "\n";
+        else
+            Out << FileName << " line " << vErrors[i].LineNumber << ": " << vErrors[i].Message << " (skipped)\n";
+    }
+
+    if (vErrors.size() > MaxErrorsShown)
+        Out << "... and " << vErrors.size() - MaxErrorsShown << " more line(s) skipped in " << FileName << "\n";
 }
 
 // =============================================================
-//                      String Helper Functions
+//                      Report Rendering
 // =============================================================
 
-vector<string> SplitString(string S1, string Delim)
+const size_t ReportBufferSize = 1 << 16;
+
+// Rows are formatted into one string and handed to the stream in large
+// writes, instead of going through setw and an endl flush per field.
+class clsReportBuffer
 {
-    vector<string> vString;
-    short pos = 0;
-    string sWord;
+private:
+    ostream& _Out;
+    string _Buffer;
 
-    while ((pos = S1.find(Delim)) != std::string::npos)
+    void _FlushIfFull()
     {
-        sWord = S1.substr(0, pos);
-        if (sWord != "")
-        {
-            vString.push_back(sWord);
-        }
-        S1.erase(0, pos + Delim.length());
+        if (_Buffer.size() >= ReportBufferSize)
+            Flush();
+    }
+
+public:
+    clsReportBuffer(ostream& Out) : _Out(Out)
+    {
+        _Buffer.reserve(ReportBufferSize + 256);
+    }
+
+    ~clsReportBuffer()
+    {
+        Flush();
+    }
+
+    clsReportBuffer& Append(string_view Text)
+    {
+        _Buffer.append(Text);
+        _FlushIfFull();
+        return *this;
+    }
+
+    clsReportBuffer& Append(char Character)
+    {
+        _Buffer.push_back(Character);
+        _FlushIfFull();
+        return *this;
+    }
+
+    clsReportBuffer& AppendNumber(uint64_t Number)
+    {
+        char Digits[24];
+        return Append(string_view(Digits, to_chars(Digits, Digits + sizeof(Digits), Number).ptr - Digits));
+    }
+
+    clsReportBuffer& AppendMoney(Cents Amount)
+    {
+        char Text[24];
+        return Append(string_view(Text, FormatMoney(Text, Amount) - Text));
+    }
+
+    // One table cell: "| " and the text padded to Width, like left << setw(Width).
+    clsReportBuffer& AppendCell(string_view Text, size_t Width)
+    {
+        _Buffer.append("| ").append(Text);
+        if (Text.size() < Width)
+            _Buffer.append(Width - Text.size(), ' ');
+        _FlushIfFull();
+        return *this;
+    }
+
+    clsReportBuffer& AppendMoneyCell(Cents Amount, size_t Width)
+    {
+        char Text[24];
+        return AppendCell(string_view(Text, FormatMoney(Text, Amount) - Text), Width);
+    }
+
+    void Flush()
+    {
+        _Out.write(_Buffer.data(), _Buffer.size());
+        _Out.flush();
+        _Buffer.clear();
+    }
+};
+
+const string_view ReportRule = "\n_______________________________________________________"
+"_________________________________________\n\n";
+
+// Rows of one page of a report. PageSize 0 means one page holding every row.
+struct stReportPage
+{
+    size_t Page = 1;
+    size_t PageSize = 0;
+
+    size_t FirstRow() const
+    {
+        return PageSize == 0 ? 0 : (Page - 1) * PageSize;
     }
-    if (S1 != "")
+
+    size_t EndRow(size_t RowCount) const
+    {
+        return PageSize == 0 ? RowCount : min(RowCount, FirstRow() + PageSize);
+    }
+
+    size_t PageCount(size_t RowCount) const
     {
-        vString.push_back(S1);
+        return PageSize == 0 ? 1 : max<size_t>(1, (RowCount + PageSize - 1) / PageSize);
     }
-    return vString;
+};
+
+void RenderPageTitle(clsReportBuffer& Report, string_view Title, const clsBookSnapshot& Snapshot, const stReportPage& Page)
+{
+    size_t RowCount = Snapshot.ClientCount();
+    Report.Append("\n\t\t\t\t").Append(Title).Append(" (").AppendNumber(RowCount).Append(") Client(s).");
+    if (Page.PageSize != 0)
+        Report.Append(" Page ").AppendNumber(Page.Page).Append(" of ").AppendNumber(Page.PageCount(RowCount)).Append('.');
+    Report.Append("\n\t\t\t\tAs of book version ").AppendNumber(Snapshot.Version()).Append('.');
 }
 
-string ConvertRecordToLine(stClientData Client, string Seperator = "#//#")
+// Calls Visit for the clients of one page, in insertion order.
+template <typename Visitor>
+void ForEachClientOnPage(const clsBookSnapshot& Snapshot, const stReportPage& Page, Visitor Visit)
 {
-    string stClientRecord = "";
-    stClientRecord += Client.AccountNumber + Seperator;
-    stClientRecord += Client.PinCode + Seperator;
-    stClientRecord += Client.Name + Seperator;
-    stClientRecord += Client.Phone + Seperator;
-    stClientRecord += to_string(Client.AccountBalance);
-    return stClientRecord;
+    size_t FirstRow = Page.FirstRow(), EndRow = Page.EndRow(Snapshot.ClientCount());
+    if (FirstRow < EndRow)
+        Snapshot.ForEachClient(FirstRow, EndRow - FirstRow, Visit);
 }
 
-stClientData ConvertLineToRecord(string Line, string Seperator = "#//#")
+// Reports are rendered from one snapshot, so every row and the totals
+// belong to the same version of the book while tellers keep changing it.
+void RenderClientList(const clsBankEngine& Engine, ostream& Out, const stReportPage& Page = stReportPage())
 {
-    stClientData Client;
-    vector<string> vClientData;
-    vClientData = SplitString(Line, Seperator);
+    clsStatsTimer Timer(eStatReport);
+    clsReportBuffer Report(Out);
+    clsBookSnapshot Snapshot = Engine.Snapshot();
+
+    RenderPageTitle(Report, "Client List", Snapshot, Page);
+    Report.Append(ReportRule);
+    Report.AppendCell("Account Number", 15).AppendCell("Pin Code", 10).AppendCell("Client Name", 40);
+    Report.AppendCell("Phone", 12).AppendCell("Balance", 12);
+    Report.Append(ReportRule);
+
+    ForEachClientOnPage(Snapshot, Page, [&](const stClientView& Client)
+        {
+            Report.AppendCell(Client.AccountNumber, 15).AppendCell(Client.PinCode, 10).AppendCell(Client.Name, 40);
+            Report.AppendCell(Client.Phone, 12).AppendMoneyCell(Client.AccountBalance, 12).Append('\n');
+        });
+    Report.Append(ReportRule);
+}
 
-    if (vClientData.size() == 5) // Basic validation to ensure line is not corrupted
+void RenderBalancesList(const clsBankEngine& Engine, ostream& Out, const stReportPage& Page = stReportPage())
+{
+    clsStatsTimer Timer(eStatReport);
+    clsReportBuffer Report(Out);
+    clsBookSnapshot Snapshot = Engine.Snapshot();
+    size_t ClientCount = Snapshot.ClientCount();
+
+    RenderPageTitle(Report, "Balances List", Snapshot, Page);
+    Report.Append(ReportRule);
+    Report.AppendCell("Account Number", 15).AppendCell("Client Name", 40).AppendCell("Balance", 12);
+    Report.Append(ReportRule);
+
+    if (ClientCount == 0)
+        Report.Append("\t\tNo Clients Available In the System!");
+    else
     {
-        Client.AccountNumber = vClientData[0];
-        Client.PinCode = vClientData[1];
-        Client.Name = vClientData[2];
-        Client.Phone = vClientData[3];
-        Client.AccountBalance = stod(vClientData[4]);
+        ForEachClientOnPage(Snapshot, Page, [&](const stClientView& Client)
+            {
+                Report.AppendCell(Client.AccountNumber, 15).AppendCell(Client.Name, 40);
+                Report.AppendMoneyCell(Client.AccountBalance, 12).Append('\n');
+            });
+    }
+
+    // The footer is computed over the balance column, not while printing the rows
+    Report.Append(ReportRule);
+    Report.Append("\t\t\t\t\t   Total Balances = ").AppendMoney(Snapshot.TotalBalances()).Append('\n');
+    if (ClientCount > 0)
+    {
+        Report.Append("\t\t\t\t\t   Lowest Balance = ").AppendMoney(Snapshot.MinBalance()).Append('\n');
+        Report.Append("\t\t\t\t\t  Highest Balance = ").AppendMoney(Snapshot.MaxBalance()).Append('\n');
     }
-    return Client;
 }
 
 // =============================================================
-//                      File I/O Functions
+//                      Export
 // =============================================================
 
-vector<stClientData> LoadClientsDataFromFile(string FileName)
-{
-    vector<stClientData> vClients;
-    fstream MyFile;
-    MyFile.open(FileName, ios::in); // Read Mode
+enum enExportFormat { eExportCsv = 1, eExportJson = 2 };
 
-    if (MyFile.is_open())
+// Quotes a CSV field only when it holds a comma, a quote or a line break.
+void AppendCsvField(clsReportBuffer& Export, string_view Field)
+{
+    if (Field.find_first_of(",\"\r\n") == string_view::npos)
     {
-        string Line;
-        stClientData Client;
+        Export.Append(Field);
+        return;
+    }
 
-        while (getline(MyFile, Line))
-        {
-            if (Line != "") // Avoid empty lines
-            {
-                Client = ConvertLineToRecord(Line);
-                vClients.push_back(Client);
-            }
-        }
-        MyFile.close();
+    Export.Append('"');
+    for (char Character : Field)
+    {
+        if (Character == '"')
+            Export.Append('"');
+        Export.Append(Character);
     }
-    return vClients;
+    Export.Append('"');
 }
 
-void SaveClientsDataToFile(string FileName, vector<stClientData> vClients)
+void AppendJsonString(clsReportBuffer& Export, string_view Text)
 {
-    fstream MyFile;
-    MyFile.open(FileName, ios::out); // Overwrite Mode
+    static const char HexDigits[] = "0123456789abcdef";
 
-    string DataLine;
+    Export.Append('"');
+    for (char Character : Text)
+    {
+        unsigned char Code = (unsigned char)Character;
+        if (Character == '"' || Character == '\\')
+            Export.Append('\\').Append(Character);
+        else if (Code < 0x20)
+            Export.Append("\\u00").Append(HexDigits[Code >> 4]).Append(HexDigits[Code & 15]);
+        else
+            Export.Append(Character);
+    }
+    Export.Append('"');
+}
+
+// Writes one snapshot of the book, one client at a time. Returns the
+// version exported.
+uint64_t ExportClients(const clsBankEngine& Engine, enExportFormat Format, ostream& Out)
+{
+    clsReportBuffer Export(Out);
+    clsBookSnapshot Snapshot = Engine.Snapshot();
 
-    if (MyFile.is_open())
+    if (Format == eExportCsv)
     {
-        for (stClientData C : vClients)
-        {
-            if (C.MarkForDelete == false)
+        Export.Append("AccountNumber,PinCode,Name,Phone,AccountBalance\n");
+        Snapshot.ForEachClient([&](const stClientView& Client)
             {
-                DataLine = ConvertRecordToLine(C);
-                MyFile << DataLine << endl;
-            }
-        }
-        MyFile.close();
+                AppendCsvField(Export, Client.AccountNumber);
+                Export.Append(',');
+                AppendCsvField(Export, Client.PinCode);
+                Export.Append(',');
+                AppendCsvField(Export, Client.Name);
+                Export.Append(',');
+                AppendCsvField(Export, Client.Phone);
+                Export.Append(',').AppendMoney(Client.AccountBalance).Append('\n');
+            });
+        return Snapshot.Version();
     }
+
+    bool First = true;
+    Export.Append('[');
+    Snapshot.ForEachClient([&](const stClientView& Client)
+        {
+            Export.Append(First ? "\n" : ",\n");
+            First = false;
+            Export.Append("  {\"AccountNumber\": ");
+            AppendJsonString(Export, Client.AccountNumber);
+            Export.Append(", \"PinCode\": ");
+            AppendJsonString(Export, Client.PinCode);
+            Export.Append(", \"Name\": ");
+            AppendJsonString(Export, Client.Name);
+            Export.Append(", \"Phone\": ");
+            AppendJsonString(Export, Client.Phone);
+            Export.Append(", \"AccountBalance\": ").AppendMoney(Client.AccountBalance).Append('}');
+        });
+    Export.Append("\n]\n");
+    return Snapshot.Version();
+}
+
+// --list: prints one page of the client list and exits.
+void ListClients(clsBankEngine& Engine, const stReportPage& Page)
+{
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
+    RenderClientList(Engine, cout, Page);
 }
 
-void AddDataLineToFile(string FileName, string stDataLine)
+// --export: writes the book to OutFileName, or to the console if it is empty.
+// Load errors and the exported version go to cerr so they never end up
+// inside the exported data.
+bool ExportClientsFile(clsBankEngine& Engine, enExportFormat Format, string OutFileName)
 {
-    fstream MyFile;
-    MyFile.open(FileName, ios::out | ios::app);
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors(), cerr);
+
+    if (OutFileName == "")
+    {
+        uint64_t Version = ExportClients(Engine, Format, cout);
+        cerr << "Exported book version " << Version << ".\n";
+        return true;
+    }
 
-    if (MyFile.is_open())
+    fstream Out;
+    Out.open(OutFileName, ios::out | ios::binary);
+    if (!Out.is_open())
     {
-        MyFile << stDataLine << endl;
-        MyFile.close();
+        cerr << "Cannot write export file " << OutFileName << ".\n";
+        return false;
     }
+    uint64_t Version = ExportClients(Engine, Format, Out);
+    cerr << "Exported book version " << Version << " to " << OutFileName << ".\n";
+    return true;
 }
 
 // =============================================================
-//                      Search & Display Logic
+//                      Account Statement
 // =============================================================
 
-bool FindClientByAccountNumber(string AccountNumber, vector<stClientData> vClients, stClientData& Client)
+const int64_t MillisecondsPerDay = 24 * 60 * 60 * 1000LL;
+
+// Reads a YYYY-MM-DD date as the time of its local midnight.
+bool ParseStatementDate(string_view Text, int64_t& Time)
+{
+    int Year = 0, Month = 0, Day = 0;
+    if (Text.size() != 10 || Text[4] != '-' || Text[7] != '-'
+        || from_chars(Text.data(), Text.data() + 4, Year).ptr != Text.data() + 4
+        || from_chars(Text.data() + 5, Text.data() + 7, Month).ptr != Text.data() + 7
+        || from_chars(Text.data() + 8, Text.data() + 10, Day).ptr != Text.data() + 10)
+        return false;
+
+    tm Date = {};
+    Date.tm_year = Year - 1900;
+    Date.tm_mon = Month - 1;
+    Date.tm_mday = Day;
+    Date.tm_isdst = -1;
+    time_t Seconds = mktime(&Date);
+
+    // mktime moves days that do not exist (Feb 30) into the next month
+    if (Seconds == (time_t)-1 || Date.tm_mday != Day || Date.tm_mon != Month - 1)
+        return false;
+    Time = (int64_t)Seconds * 1000;
+    return true;
+}
+
+string FormatStatementTime(int64_t Time)
+{
+    time_t Seconds = (time_t)(Time / 1000);
+    tm Local = {};
+#ifdef _WIN32
+    localtime_s(&Local, &Seconds);
+#else
+    localtime_r(&Seconds, &Local);
+#endif
+    char Text[24];
+    return string(Text, strftime(Text, sizeof(Text), "%Y-%m-%d %H:%M:%S", &Local));
+}
+
+void RenderAccountStatement(string_view AccountNumber, string_view FromDate, string_view ToDate,
+    const vector<stLedgerEntry>& vEntries, ostream& Out)
 {
-    for (stClientData C : vClients)
+    clsStatsTimer Timer(eStatReport);
+    clsReportBuffer Report(Out);
+
+    Report.Append("\n\t\t\tStatement of [").Append(AccountNumber).Append("] from ");
+    Report.Append(FromDate.empty() ? "the start" : FromDate).Append(" to ").Append(ToDate.empty() ? "now" : ToDate);
+    Report.Append(" (").AppendNumber(vEntries.size()).Append(") Entry(s).");
+    Report.Append(ReportRule);
+    Report.AppendCell("Time", 20).AppendCell("Operation", 10).AppendCell("Type", 14);
+    Report.AppendCell("Amount", 14).AppendCell("Balance", 14);
+    Report.Append(ReportRule);
+
+    if (vEntries.empty())
     {
-        if (C.AccountNumber == AccountNumber)
-        {
-            Client = C;
-            return true;
-        }
+        Report.Append("\t\tNo Transactions In This Period!");
+        Report.Append(ReportRule);
+        return;
     }
-    return false;
+
+    Cents Credits = 0, Debits = 0;
+    for (const stLedgerEntry& Entry : vEntries)
+    {
+        Report.AppendCell(FormatStatementTime(Entry.Time), 20).AppendCell(to_string(Entry.OperationId), 10);
+        Report.AppendCell(LedgerEntryTypeToString(Entry.Type), 14).AppendMoneyCell(Entry.Amount, 14);
+        Report.AppendMoneyCell(Entry.Balance, 14).Append('\n');
+        (Entry.Amount >= 0 ? Credits : Debits) += Entry.Amount;
+    }
+    Report.Append(ReportRule);
+
+    Report.Append("\t\t\t\t   Opening Balance = ").AppendMoney(vEntries.front().Balance - vEntries.front().Amount).Append('\n');
+    Report.Append("\t\t\t\t   Credits = ").AppendMoney(Credits).Append('\n');
+    Report.Append("\t\t\t\t   Debits = ").AppendMoney(Debits).Append('\n');
+    Report.Append("\t\t\t\t   Closing Balance = ").AppendMoney(vEntries.back().Balance).Append('\n');
+}
+
+// The times between two YYYY-MM-DD dates, both included. An empty date
+// leaves that end of the range open.
+bool ParseStatementRange(string_view FromDate, string_view ToDate, int64_t& FromTime, int64_t& ToTime)
+{
+    FromTime = INT64_MIN;
+    ToTime = INT64_MAX;
+    if ((!FromDate.empty() && !ParseStatementDate(FromDate, FromTime))
+        || (!ToDate.empty() && !ParseStatementDate(ToDate, ToTime)))
+        return false;
+
+    // The end of the last day is the midnight that follows it
+    if (!ToDate.empty())
+        ToTime += MillisecondsPerDay - 1;
+    return true;
+}
+
+// --statement: prints the statement of one account and exits.
+bool PrintAccountStatement(clsBankEngine& Engine, string AccountNumber, string FromDate, string ToDate)
+{
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
+
+    int64_t FromTime, ToTime;
+    if (!ParseStatementRange(FromDate, ToDate, FromTime, ToTime))
+    {
+        cout << "Dates must look like 2024-01-31.\n";
+        return false;
+    }
+
+    vector<stLedgerEntry> vEntries;
+    enEngineResult Result = Engine.Statement(AccountNumber, FromTime, ToTime, vEntries);
+    if (Result != eEngineDone)
+    {
+        cout << "Cannot print the statement: " << EngineResultToString(Result) << ".\n";
+        return false;
+    }
+    RenderAccountStatement(AccountNumber, FromDate, ToDate, vEntries, cout);
+    return true;
 }
 
-void PrintClientCard(stClientData Client)
+// =============================================================
+//                      Search & Display Logic
+// =============================================================
+
+void PrintClientCard(const stClientView& Client)
 {
     cout << "\nThe following are the client details:\n";
     cout << "-----------------------------------";
@@ -195,49 +526,27 @@ void PrintClientCard(stClientData Client)
     cout << "\nPin Code       : " << Client.PinCode;
     cout << "\nName           : " << Client.Name;
     cout << "\nPhone          : " << Client.Phone;
-    cout << "\nAccount Balance: " << Client.AccountBalance;
+    cout << "\nAccount Balance: " << FormatMoney(Client.AccountBalance);
     cout << "\n-----------------------------------\n";
 }
 
-void PrintAllClientsData(vector<stClientData> vClients)
+void PrintAllClientsData(const clsBankEngine& Engine)
 {
-    cout << "\n\t\t\t\tClient List (" << vClients.size() << ") Client(s).";
-    cout << "\n_______________________________________________________";
-    cout << "_________________________________________\n" << endl;
-    cout << "| " << left << setw(15) << "Account Number";
-    cout << "| " << left << setw(10) << "Pin Code";
-    cout << "| " << left << setw(40) << "Client Name";
-    cout << "| " << left << setw(12) << "Phone";
-    cout << "| " << left << setw(12) << "Balance";
-    cout << "\n_______________________________________________________";
-    cout << "_________________________________________\n" << endl;
-
-    for (stClientData Client : vClients)
-    {
-        cout << "| " << left << setw(15) << Client.AccountNumber;
-        cout << "| " << left << setw(10) << Client.PinCode;
-        cout << "| " << left << setw(40) << Client.Name;
-        cout << "| " << left << setw(12) << Client.Phone;
-        cout << "| " << left << setw(12) << Client.AccountBalance;
-        cout << endl;
-    }
-    cout << "\n_______________________________________________________";
-    cout << "_________________________________________\n" << endl;
+    RenderClientList(Engine, cout);
 }
 
 // =============================================================
 //                      CRUD Operations
 // =============================================================
 
-stClientData ReadNewClient(vector<stClientData>& clients)
+stClientData ReadNewClient(const clsBankEngine& Engine)
 {
     stClientData Client;
-    stClientData tempClient;
 
     cout << "Enter Account Number? ";
     getline(cin >> ws, Client.AccountNumber); // remove buffer spaces
 
-    while (FindClientByAccountNumber(Client.AccountNumber, clients, tempClient))
+    while (Engine.Exists(Client.AccountNumber))
     {
         cout << "Client with Account Number [ " << Client.AccountNumber << " ] already exists\n\n";
         cout << "Enter Account Number? ";
@@ -253,49 +562,59 @@ stClientData ReadNewClient(vector<stClientData>& clients)
     cout << "Enter Phone? ";
     getline(cin, Client.Phone);
 
-    Client.AccountBalance = ReadDouble("Enter AccountBalance? ");
+    Client.AccountBalance = ReadMoney("Enter AccountBalance? ");
 
     return Client;
 }
 
-void AddNewClients(vector<stClientData>& clients)
+bool AddNewClients(clsBankEngine& Engine)
 {
-    stClientData Client;
-    Client = ReadNewClient(clients);
-    AddDataLineToFile(ClientsFileName, ConvertRecordToLine(Client));
+    stClientData Client = ReadNewClient(Engine);
+
+    stEngineOperation Operation;
+    Operation.Type = eOperationAddClient;
+    Operation.Client = Client;
+
+    enEngineResult Result = Engine.Apply(Operation).Result;
+    if (Result != eEngineDone)
+    {
+        cout << "\nClient was not added: " << EngineResultToString(Result) << ".\n";
+        return false;
+    }
+    return true;
 }
 
-void AddNewClientScreen(vector<stClientData>& clients)
+void AddNewClientScreen(clsBankEngine& Engine)
 {
     cout << "\n-----------------------------------\n";
     cout << "\tAdd New Client Screen";
     cout << "\n-----------------------------------\n";
-    AddNewClients(clients);
-    cout << "\nClient Added Successfully, saved to file.\n";
+    if (AddNewClients(Engine))
+        cout << "\nClient Added Successfully, saved to file.\n";
 }
 
-bool DeleteClientByAccountNumber(string AccountNumber, vector<stClientData>& vClients)
+bool DeleteClientByAccountNumber(string AccountNumber, clsBankEngine& Engine)
 {
     stClientData Client;
     char Answer = 'n';
 
-    if (FindClientByAccountNumber(AccountNumber, vClients, Client))
+    if (Engine.Find(AccountNumber, Client))
     {
         PrintClientCard(Client);
         cout << "\n\nAre you sure you want delete this client? y/n ? ";
         cin >> Answer;
         if (Answer == 'y' || Answer == 'Y')
         {
-            for (stClientData& C : vClients)
+            stEngineOperation Operation;
+            Operation.Type = eOperationDeleteClient;
+            Operation.AccountNumber = AccountNumber;
+
+            enEngineResult Result = Engine.Apply(Operation).Result;
+            if (Result != eEngineDone)
             {
-                if (C.AccountNumber == AccountNumber)
-                {
-                    C.MarkForDelete = true;
-                    break;
-                }
+                cout << "\n\nClient was not deleted: " << EngineResultToString(Result) << ".";
+                return false;
             }
-            SaveClientsDataToFile(ClientsFileName, vClients);
-            vClients = LoadClientsDataFromFile(ClientsFileName); // Refresh
             cout << "\n\nClient Deleted Successfully.";
             return true;
         }
@@ -325,32 +644,35 @@ stClientData ChangeClientRecord(string AccountNumber)
     cout << "Enter Phone? ";
     getline(cin, Client.Phone);
 
-    Client.AccountBalance = ReadDouble("Enter AccountBalance? ");
+    Client.AccountBalance = ReadMoney("Enter AccountBalance? ");
 
     return Client;
 }
 
-bool UpdateClientByAccountNumber(string AccountNumber, vector<stClientData>& vClients)
+bool UpdateClientByAccountNumber(string AccountNumber, clsBankEngine& Engine)
 {
     stClientData Client;
     char Answer = 'n';
 
-    if (FindClientByAccountNumber(AccountNumber, vClients, Client))
+    if (Engine.Find(AccountNumber, Client))
     {
         PrintClientCard(Client);
         cout << "\n\nAre you sure you want update this client? y/n ? ";
         cin >> Answer;
         if (Answer == 'y' || Answer == 'Y')
         {
-            for (stClientData& C : vClients)
+            Client = ChangeClientRecord(AccountNumber);
+
+            stEngineOperation Operation;
+            Operation.Type = eOperationUpdateClient;
+            Operation.Client = Client;
+
+            enEngineResult Result = Engine.Apply(Operation).Result;
+            if (Result != eEngineDone)
             {
-                if (C.AccountNumber == AccountNumber)
-                {
-                    C = ChangeClientRecord(AccountNumber);
-                    break;
-                }
+                cout << "\n\nClient was not updated: " << EngineResultToString(Result) << ".";
+                return false;
             }
-            SaveClientsDataToFile(ClientsFileName, vClients);
             cout << "\n\nClient Updated Successfully.";
             return true;
         }
@@ -362,15 +684,12 @@ bool UpdateClientByAccountNumber(string AccountNumber, vector<stClientData>& vCl
     }
     return false;
 }
-
-// =============================================================
-//                      Transaction Logic
-// =============================================================
-
-void Deposit(stClientData& Client, vector<stClientData>& vClients)
+void Deposit(const stClientData& Client, clsBankEngine& Engine)
 {
-    double amount = 0;
-    amount = ReadDouble("\nPlease enter amount to deposit: ");
+    stEngineOperation Operation;
+    Operation.Type = eOperationDeposit;
+    Operation.AccountNumber = Client.AccountNumber;
+    Operation.Amount = ReadMoney("\nPlease enter amount to deposit: ");
 
     char option = 'n';
     cout << "\nAre you sure you want to perform this transaction? y/n ? ";
@@ -378,33 +697,30 @@ void Deposit(stClientData& Client, vector<stClientData>& vClients)
 
     if (toupper(option) == 'Y')
     {
-        Client.AccountBalance += amount;
-        for (stClientData& C : vClients)
+        stEngineOutcome Outcome = Engine.Apply(Operation);
+        if (Outcome.Result != eEngineDone)
         {
-            if (C.AccountNumber == Client.AccountNumber)
-            {
-                C.AccountBalance = Client.AccountBalance;
-                break;
-            }
+            cout << "\nDeposit refused: " << EngineResultToString(Outcome.Result) << ".\n";
+            return;
         }
-        SaveClientsDataToFile(ClientsFileName, vClients);
         cout << "\nAmount deposited successfully.\n";
-        cout << "New Balance is: " << Client.AccountBalance << endl;
+        cout << "New Balance is: " << FormatMoney(Outcome.Balance) << endl;
     }
 }
 
-void Withdraw(stClientData& Client, vector<stClientData>& vClients)
+void Withdraw(const stClientData& Client, clsBankEngine& Engine)
 {
-    double amount = 0;
-    amount = ReadDouble("\nPlease enter amount to withdraw: ");
+    stEngineOperation Operation;
+    Operation.Type = eOperationWithdraw;
+    Operation.AccountNumber = Client.AccountNumber;
+    Operation.Amount = ReadMoney("\nPlease enter amount to withdraw: ");
 
     // FIX: Use 'while' instead of 'if'
     // This ensures we keep asking until a valid amount is entered
-    while (amount > Client.AccountBalance)
+    while (Operation.Amount > Client.AccountBalance)
     {
-        cout << "\nAmount Exceeds the balance, you can withdraw up to : " << Client.AccountBalance << endl;
-        cout << "Please enter another amount: ";
-        cin >> amount;
+        cout << "\nAmount Exceeds the balance, you can withdraw up to : " << FormatMoney(Client.AccountBalance) << endl;
+        Operation.Amount = ReadMoney("Please enter another amount: ");
     }
 
     char option = 'n';
@@ -413,138 +729,1378 @@ void Withdraw(stClientData& Client, vector<stClientData>& vClients)
 
     if (toupper(option) == 'Y')
     {
-        Client.AccountBalance -= amount;
-        for (stClientData& C : vClients)
+        // The engine checks the balance again, in case it changed meanwhile
+        stEngineOutcome Outcome = Engine.Apply(Operation);
+        if (Outcome.Result != eEngineDone)
         {
-            if (C.AccountNumber == Client.AccountNumber)
-            {
-                C.AccountBalance = Client.AccountBalance;
-                break;
-            }
+            cout << "\nWithdraw refused: " << EngineResultToString(Outcome.Result) << ".\n";
+            return;
         }
-        SaveClientsDataToFile(ClientsFileName, vClients);
         cout << "\nAmount Withdrawn Successfully.\n";
-        cout << "New Balance is: " << Client.AccountBalance << endl;
+        cout << "New Balance is: " << FormatMoney(Outcome.Balance) << endl;
+    }
+}
+
+void Transfer(const stClientData& FromClient, const stClientData& ToClient, clsBankEngine& Engine)
+{
+    stEngineOperation Operation;
+    Operation.Type = eOperationTransfer;
+    Operation.AccountNumber = FromClient.AccountNumber;
+    Operation.ToAccountNumber = ToClient.AccountNumber;
+    Operation.Amount = ReadMoney("\nPlease enter amount to transfer: ");
+
+    while (Operation.Amount > FromClient.AccountBalance)
+    {
+        cout << "\nAmount Exceeds the balance, you can transfer up to : " << FormatMoney(FromClient.AccountBalance) << endl;
+        Operation.Amount = ReadMoney("Please enter another amount: ");
+    }
+
+    char option = 'n';
+    cout << "\nAre you sure you want to perform this transaction? y/n ? ";
+    cin >> option;
+
+    if (toupper(option) == 'Y')
+    {
+        stEngineOutcome Outcome = Engine.Apply(Operation);
+        if (Outcome.Result != eEngineDone)
+        {
+            cout << "\nTransfer refused: " << EngineResultToString(Outcome.Result) << ".\n";
+            return;
+        }
+
+        cout << "\nAmount Transferred Successfully.\n";
+        cout << "New Balance of [" << FromClient.AccountNumber << "] is: " << FormatMoney(Outcome.Balance) << endl;
+        cout << "New Balance of [" << ToClient.AccountNumber << "] is: " << FormatMoney(Outcome.ToBalance) << endl;
     }
 }
 
 // =============================================================
-//                      UI & Main Menu
+//                      Batch Transactions
 // =============================================================
 
-string ReadClientAccountNumber()
-{
-    string AccountNumber = "";
-    cout << "\nPlease enter Account Number: ";
-    cin >> AccountNumber;
-    return AccountNumber;
-}
+// A batch file has one transaction per line:
+//   D#//#AccountNumber#//#Amount      deposit
+//   W#//#AccountNumber#//#Amount      withdraw
+//   T#//#From#//#To#//#Amount         transfer
+// Lines are applied in order. The report gets one line per transaction:
+//   LineNumber#//#OK#//#AccountNumber#//#NewBalance[#//#AccountNumber#//#NewBalance]
+//   LineNumber#//#REJECTED#//#Reason
 
-void ShowDeleteClientScreen(vector<stClientData>& vClients)
-{
-    cout << "\n-----------------------------------\n";
-    cout << "\tDelete Client Screen";
-    cout << "\n-----------------------------------\n";
-    string AccountNumber = ReadClientAccountNumber();
-    DeleteClientByAccountNumber(AccountNumber, vClients);
-}
+// Lines are handed to the engine this many at a time, so the journal
+// records of a whole chunk are written together.
+const size_t BatchChunkSize = 4096;
 
-void ShowUpdateClientScreen(vector<stClientData>& vClients)
+struct stBatchLine
 {
-    cout << "\n-----------------------------------\n";
-    cout << "\tUpdate Client Info Screen";
-    cout << "\n-----------------------------------\n";
-    string AccountNumber = ReadClientAccountNumber();
-    UpdateClientByAccountNumber(AccountNumber, vClients);
-}
+    size_t LineNumber = 0;
+    string Text;
+};
 
-void ShowFindClientScreen(vector<stClientData>& vClients)
+// Reads one batch line into Operation, whose views point into Line.
+// Returns false with Reason set if the line cannot be applied at all.
+bool ParseBatchLine(string_view Line, stEngineOperation& Operation, string& Reason)
 {
-    cout << "\n-----------------------------------\n";
-    cout << "\tFind Client Screen";
-    cout << "\n-----------------------------------\n";
-    string AccountNumber = ReadClientAccountNumber();
-    stClientData Client;
-    if (FindClientByAccountNumber(AccountNumber, vClients, Client))
+    string_view vFields[4];
+    size_t FieldCount = SplitFields(Line, "#//#", vFields, 4);
+    Reason = "malformed line";
+
+    if (vFields[0].size() != 1)
+        return false;
+
+    switch (toupper(vFields[0][0]))
     {
-        PrintClientCard(Client);
+    case 'D':
+        Operation.Type = eOperationDeposit;
+        break;
+    case 'W':
+        Operation.Type = eOperationWithdraw;
+        break;
+    case 'T':
+        Operation.Type = eOperationTransfer;
+        break;
+    default:
+        return false;
     }
-    else
+
+    if (FieldCount != (Operation.Type == eOperationTransfer ? 4u : 3u))
+        return false;
+    if (!ParseMoney(vFields[FieldCount - 1], Operation.Amount))
     {
-        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
+        Reason = EngineResultToString(eEngineInvalidAmount);
+        return false;
     }
+
+    Operation.AccountNumber = vFields[1];
+    if (Operation.Type == eOperationTransfer)
+        Operation.ToAccountNumber = vFields[2];
+    return true;
 }
 
-void ShowDepositScreen(vector<stClientData>& vClients)
+// Batch reports and transfer answers have always called a missing account
+// an unknown account.
+string RejectReason(enEngineResult Result)
 {
-    cout << "\n-----------------------------------\n";
-    cout << "\tDeposit Screen";
-    cout << "\n-----------------------------------\n";
-
-    string AccountNumber = ReadClientAccountNumber();
-    stClientData Client;
-    if (FindClientByAccountNumber(AccountNumber, vClients, Client))
-    {
-        PrintClientCard(Client);
-        Deposit(Client, vClients);
-    }
-    else
-    {
-        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
-    }
+    return (Result == eEngineNotFound) ? "unknown account" : EngineResultToString(Result);
 }
 
-void ShowWithdrawScreen(vector<stClientData>& vClients)
+// Applies one chunk of lines through the engine and writes their report lines.
+void ApplyBatchChunk(clsBankEngine& Engine, const vector<stBatchLine>& vLines, fstream& Report,
+    size_t& Applied, size_t& Rejected)
 {
-    cout << "\n-----------------------------------\n";
-    cout << "\tWithdraw Screen";
-    cout << "\n-----------------------------------\n";
+    vector<stEngineOperation> vOperations;
+    vector<size_t> vOperationOf(vLines.size(), SIZE_MAX);
+    vector<string> vReasons(vLines.size());
 
-    string AccountNumber = ReadClientAccountNumber();
-    stClientData Client;
-    if (FindClientByAccountNumber(AccountNumber, vClients, Client))
+    for (size_t i = 0; i < vLines.size(); i++)
     {
-        PrintClientCard(Client);
-        Withdraw(Client, vClients);
+        stEngineOperation Operation;
+        if (ParseBatchLine(vLines[i].Text, Operation, vReasons[i]))
+        {
+            vOperationOf[i] = vOperations.size();
+            vOperations.push_back(Operation);
+        }
     }
-    else
+
+    vector<stEngineOutcome> vOutcomes(vOperations.size());
+    Engine.ApplyBatch(vOperations, vOutcomes);
+
+    for (size_t i = 0; i < vLines.size(); i++)
     {
-        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
+        Report << vLines[i].LineNumber;
+        if (vOperationOf[i] == SIZE_MAX || vOutcomes[vOperationOf[i]].Result != eEngineDone)
+        {
+            string Reason = (vOperationOf[i] == SIZE_MAX) ? vReasons[i] : RejectReason(vOutcomes[vOperationOf[i]].Result);
+            Report << "#//#REJECTED#//#" << Reason << '\n';
+            Rejected++;
+            continue;
+        }
+
+        const stEngineOperation& Operation = vOperations[vOperationOf[i]];
+        const stEngineOutcome& Outcome = vOutcomes[vOperationOf[i]];
+        Report << "#//#OK#//#" << Operation.AccountNumber << "#//#" << FormatMoney(Outcome.Balance);
+        if (Operation.Type == eOperationTransfer)
+            Report << "#//#" << Operation.ToAccountNumber << "#//#" << FormatMoney(Outcome.ToBalance);
+        Report << '\n';
+        Applied++;
     }
 }
 
-void ShowTotalBalancesScreen(vector<stClientData>& vClients)
+// Applies a batch file without prompts. The book is checkpointed once at
+// the end, and every PersistEvery applied transactions if PersistEvery > 0.
+bool ApplyBatchFile(clsBankEngine& Engine, string BatchFileName, string ReportFileName, size_t PersistEvery)
 {
-    double TotalBalances = 0;
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
 
-    cout << "\n\t\t\t\tBalances List (" << vClients.size() << ") Client(s).";
-    cout << "\n_______________________________________________________";
-    cout << "_________________________________________\n" << endl;
-    cout << "| " << left << setw(15) << "Account Number";
-    cout << "| " << left << setw(40) << "Client Name";
-    cout << "| " << left << setw(12) << "Balance";
-    cout << "\n_______________________________________________________";
-    cout << "_________________________________________\n" << endl;
+    fstream Report;
+    Report.open(ReportFileName, ios::out);
+    if (!Report.is_open())
+    {
+        cout << "Cannot write report file " << ReportFileName << ".\n";
+        return false;
+    }
+
+    size_t Applied = 0, Rejected = 0, CheckpointedAt = 0;
+    size_t ChunkSize = (PersistEvery > 0) ? min(PersistEvery, BatchChunkSize) : BatchChunkSize;
+    vector<stBatchLine> vLines;
+
+    auto FlushLines = [&]()
+        {
+            ApplyBatchChunk(Engine, vLines, Report, Applied, Rejected);
+            vLines.clear();
+
+            if (PersistEvery > 0 && Applied - CheckpointedAt >= PersistEvery)
+            {
+                Engine.Checkpoint();
+                CheckpointedAt = Applied;
+            }
+        };
+
+    bool Found = ForEachLineInFile(BatchFileName, [&](string_view Line, size_t LineNumber, bool)
+        {
+            DumpStatsIfRequested();
+            if (Line.empty())
+                return;
+
+            vLines.push_back({ LineNumber, string(Line) });
+            if (vLines.size() >= ChunkSize)
+                FlushLines();
+        });
+
+    if (!Found)
+    {
+        cout << "Cannot read batch file " << BatchFileName << ".\n";
+        return false;
+    }
+
+    FlushLines();
+    Engine.Checkpoint();
+    Report.close();
+
+    cout << "Batch " << BatchFileName << ": " << Applied << " applied, " << Rejected << " rejected.\n";
+    cout << "Report written to " << ReportFileName << ".\n";
+    return true;
+}
+
+// =============================================================
+//                      Bulk Import
+// =============================================================
+
+// An import file has one new client per line, either in the format of
+// Clients.txt (AccountNumber#//#PinCode#//#Name#//#Phone#//#Balance) or
+// as CSV with the columns of --export csv, whose header row is skipped.
+// Rejected lines go to the rejects file, ready to be fixed and imported
+// again:
+//   LineNumber#//#Reason#//#<the line as it was>
+
+// Lines are handed to the engine this many at a time, with one journal
+// write per chunk.
+const size_t ImportChunkSize = 65536;
+
+struct stImportLine
+{
+    size_t LineNumber = 0;
+    string Text;
+    stClientData Client;
+    string Reason;          // Set if the line was rejected before reaching the engine
+};
+
+// Splits one CSV line. Quoted fields may hold commas and doubled quotes.
+bool SplitCsvLine(string_view Line, vector<string>& vFields)
+{
+    vFields.assign(1, string());
+    bool Quoted = false;
+
+    for (size_t i = 0; i < Line.size(); i++)
+    {
+        char Character = Line[i];
+        if (Quoted)
+        {
+            if (Character != '"')
+                vFields.back().push_back(Character);
+            else if (i + 1 < Line.size() && Line[i + 1] == '"')
+                vFields.back().push_back(Line[++i]);
+            else
+                Quoted = false;
+        }
+        else if (Character == '"' && vFields.back().empty())
+            Quoted = true;
+        else if (Character == ',')
+            vFields.emplace_back();
+        else
+            vFields.back().push_back(Character);
+    }
+    return !Quoted;
+}
+
+bool IsCsvHeader(string_view Line)
+{
+    return Line.substr(0, 14) == "AccountNumber," || Line.substr(0, 16) == "\"AccountNumber\",";
+}
+
+// Reads one import line into Line.Client, or sets Line.Reason. vFields is
+// scratch space, kept by the caller so its strings are reused.
+void ParseImportLine(stImportLine& Line, bool Csv, vector<string>& vFields)
+{
+    if (!Csv)
+    {
+        if (!ConvertLineToRecord(Line.Text, Line.Client))
+            Line.Reason = "malformed line";
+    }
+    else
+    {
+        if (!SplitCsvLine(Line.Text, vFields) || vFields.size() != 5 || vFields[0].empty()
+            || !ParseMoney(vFields[4], Line.Client.AccountBalance))
+        {
+            Line.Reason = "malformed line";
+            return;
+        }
+        Line.Client.AccountNumber = move(vFields[0]);
+        Line.Client.PinCode = move(vFields[1]);
+        Line.Client.Name = move(vFields[2]);
+        Line.Client.Phone = move(vFields[3]);
+    }
+
+    if (!Line.Reason.empty())
+        return;
+
+    // A separator inside a field would split the client in two in Clients.txt
+    for (const string* Field : { &Line.Client.AccountNumber, &Line.Client.PinCode, &Line.Client.Name, &Line.Client.Phone })
+    {
+        if (Field->find("#//#") != string::npos || Field->find_first_of("\r\n") != string::npos)
+            Line.Reason = "field holds the separator or a line break";
+    }
+    if (Line.Client.AccountBalance < 0)
+        Line.Reason = "negative balance";
+}
+
+// Counters of one import.
+struct stImportTotals
+{
+    size_t Imported = 0;
+    size_t Rejected = 0;
+    size_t Duplicates = 0;
+};
+
+// Imports one chunk and writes the rejected lines. FirstLines maps every
+// account number imported so far to its line, which tells a duplicate
+// inside the file from an account that was already a client.
+void ImportChunk(clsBankEngine& Engine, vector<stImportLine>& vLines, unordered_map<string, size_t>& FirstLines,
+    clsReportBuffer& Rejects, stImportTotals& Totals)
+{
+    vector<stClientView> vClients;
+    vector<size_t> vClientOf(vLines.size(), SIZE_MAX);
+    for (size_t i = 0; i < vLines.size(); i++)
+    {
+        if (vLines[i].Reason.empty())
+        {
+            vClientOf[i] = vClients.size();
+            vClients.push_back(vLines[i].Client);
+        }
+    }
+
+    vector<enEngineResult> vResults(vClients.size());
+    Engine.ImportClients(vClients, vResults);
+
+    for (size_t i = 0; i < vLines.size(); i++)
+    {
+        stImportLine& Line = vLines[i];
+        if (vClientOf[i] != SIZE_MAX)
+        {
+            enEngineResult Result = vResults[vClientOf[i]];
+            if (Result == eEngineDone)
+            {
+                FirstLines.emplace(Line.Client.AccountNumber, Line.LineNumber);
+                Totals.Imported++;
+                continue;
+            }
+
+            auto First = FirstLines.find(Line.Client.AccountNumber);
+            if (Result != eEngineAlreadyExists)
+                Line.Reason = EngineResultToString(Result);
+            else if (First != FirstLines.end())
+                Line.Reason = "duplicate of line " + to_string(First->second);
+            else
+                Line.Reason = "already a client";
+            Totals.Duplicates += (Result == eEngineAlreadyExists);
+        }
+
+        Rejects.AppendNumber(Line.LineNumber).Append("#//#").Append(Line.Reason).Append("#//#");
+        Rejects.Append(Line.Text).Append('\n');
+        Totals.Rejected++;
+    }
+}
+
+// --import: streams a file of new clients into the book and saves it once
+// at the end.
+bool ImportClientsFile(clsBankEngine& Engine, string ImportFileName, string RejectsFileName)
+{
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
+    auto Start = chrono::steady_clock::now();
+
+    fstream RejectsFile;
+    RejectsFile.open(RejectsFileName, ios::out | ios::binary);
+    if (!RejectsFile.is_open())
+    {
+        cout << "Cannot write rejects file " << RejectsFileName << ".\n";
+        return false;
+    }
+
+    stImportTotals Totals;
+    unordered_map<string, size_t> FirstLines;
+    vector<stImportLine> vLines;
+    vector<string> vFields;
+    vLines.reserve(ImportChunkSize);
+    bool Csv = false, FirstLine = true;
+    {
+        clsReportBuffer Rejects(RejectsFile);
+
+        bool Found = ForEachLineInFile(ImportFileName, [&](string_view Text, size_t LineNumber, bool)
+            {
+                if (!Text.empty() && Text.back() == '\r')
+                    Text.remove_suffix(1);
+                if (Text.empty())
+                    return;
+
+                // The first line tells the format
+                if (FirstLine)
+                {
+                    FirstLine = false;
+                    Csv = Text.find("#//#") == string_view::npos;
+                    if (Csv && IsCsvHeader(Text))
+                        return;
+                }
+
+                stImportLine& Line = vLines.emplace_back();
+                Line.LineNumber = LineNumber;
+                Line.Text = Text;
+                ParseImportLine(Line, Csv, vFields);
+
+                if (vLines.size() >= ImportChunkSize)
+                {
+                    ImportChunk(Engine, vLines, FirstLines, Rejects, Totals);
+                    vLines.clear();
+                    DumpStatsIfRequested();
+                }
+            });
+
+        if (!Found)
+        {
+            cout << "Cannot read import file " << ImportFileName << ".\n";
+            return false;
+        }
+        ImportChunk(Engine, vLines, FirstLines, Rejects, Totals);
+    }
+    RejectsFile.close();
+
+    if (!Engine.Checkpoint())
+    {
+        cout << "Imported clients are in " << JournalFileName << " but " << Engine.DataFileName() << " could not be saved.\n";
+        return false;
+    }
+    double Seconds = chrono::duration<double>(chrono::steady_clock::now() - Start).count();
+
+    cout << "Import " << ImportFileName << ": " << Totals.Imported << " client(s) added, " << Totals.Rejected
+        << " rejected (" << Totals.Duplicates << " duplicate(s)) in " << fixed << setprecision(2) << Seconds << " s.\n";
+    cout << "Rejected lines written to " << RejectsFileName << ".\n";
+    return true;
+}
+
+// =============================================================
+//                      Interest and Fee Accrual
+// =============================================================
+
+// A tiers file has one balance tier per line, lowest first:
+//   FromBalance#//#RateBasisPoints#//#Fee
+// 0#//#0#//#2.50 charges 2.50 on every balance, 100000#//#15#//#0 pays
+// 0.15% on balances of 100000 and more, and a negative rate charges a
+// percentage. Lines starting with # are comments.
+
+bool ParseAccrualTierLine(string_view Line, stAccrualTier& Tier)
+{
+    string_view vFields[3];
+    if (SplitFields(Line, "#//#", vFields, 3) != 3)
+        return false;
+
+    string_view Rate = vFields[1];
+    if (!Rate.empty() && Rate[0] == '+')
+        Rate.remove_prefix(1);
+    auto [End, Error] = from_chars(Rate.data(), Rate.data() + Rate.size(), Tier.RateBasisPoints);
+
+    return ParseMoney(vFields[0], Tier.FromBalance) && Error == errc() && End == Rate.data() + Rate.size()
+        && ParseMoney(vFields[2], Tier.Fee);
+}
+
+// Reads the tiers file, or returns false with the reasons in vErrors.
+bool LoadAccrualTiers(string TiersFileName, vector<stAccrualTier>& vTiers, vector<stFileLoadError>& vErrors)
+{
+    bool Found = ForEachLineInFile(TiersFileName, [&](string_view Line, size_t LineNumber, bool)
+        {
+            if (Line.empty() || Line[0] == '#')
+                return;
+
+            stAccrualTier Tier;
+            if (!ParseAccrualTierLine(Line, Tier))
+                vErrors.push_back({ LineNumber, "malformed tier" });
+            else if (!vTiers.empty() && Tier.FromBalance <= vTiers.back().FromBalance)
+                vErrors.push_back({ LineNumber, "tiers must go up by balance" });
+            else if (abs(Tier.RateBasisPoints) > MaxAccrualRateBasisPoints || Tier.Fee < 0)
+                vErrors.push_back({ LineNumber, "rate or fee out of range" });
+            else
+                vTiers.push_back(Tier);
+        });
+
+    if (!Found)
+        vErrors.push_back({ 0, "cannot read the file" });
+    else if (vTiers.empty() && vErrors.empty())
+        vErrors.push_back({ 0, "no tiers" });
+    return vErrors.empty();
+}
+
+void RenderAccrualSummary(span<const stAccrualTier> vTiers, const stAccrualSummary& Summary, ostream& Out)
+{
+    clsStatsTimer Timer(eStatReport);
+    clsReportBuffer Report(Out);
+
+    Report.Append("\n\t\t\t\tAccrual of ").AppendNumber(Summary.Accounts).Append(" Account(s).");
+    Report.Append(ReportRule);
+    Report.AppendCell("From Balance", 14).AppendCell("Rate (bp)", 10).AppendCell("Fee", 10);
+    Report.AppendCell("Accounts", 10).AppendCell("Balances", 16).AppendCell("Interest", 14).AppendCell("Fees", 14);
+    Report.Append(ReportRule);
+
+    for (size_t i = 0; i < vTiers.size(); i++)
+    {
+        const stAccrualTierSummary& Tier = Summary.vTiers[i];
+        Report.AppendMoneyCell(vTiers[i].FromBalance, 14).AppendCell(to_string(vTiers[i].RateBasisPoints), 10);
+        Report.AppendMoneyCell(vTiers[i].Fee, 10).AppendCell(to_string(Tier.Accounts), 10);
+        Report.AppendMoneyCell(Tier.BalancesBefore, 16).AppendMoneyCell(Tier.Interest, 14);
+        Report.AppendMoneyCell(Tier.Fees, 14).Append('\n');
+    }
+    Report.Append(ReportRule);
+
+    Report.Append("\t\t\t\t   Interest Paid = ").AppendMoney(Summary.Interest).Append('\n');
+    Report.Append("\t\t\t\t   Fees Charged = ").AppendMoney(Summary.Fees).Append('\n');
+    Report.Append("\t\t\t\t   Total Balances Before = ").AppendMoney(Summary.BalancesBefore).Append('\n');
+    Report.Append("\t\t\t\t   Total Balances After = ").AppendMoney(Summary.BalancesAfter).Append('\n');
+}
+
+// --accrue: applies the tiers to the whole book as one run and writes the
+// summary to the console and to ReportFileName.
+bool RunAccrual(clsBankEngine& Engine, string TiersFileName, string ReportFileName, unsigned ThreadCount)
+{
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
+
+    vector<stAccrualTier> vTiers;
+    vector<stFileLoadError> vErrors;
+    if (!LoadAccrualTiers(TiersFileName, vTiers, vErrors))
+    {
+        PrintFileLoadErrors(TiersFileName, vErrors);
+        cout << "No balance was changed.\n";
+        return false;
+    }
+
+    fstream Report;
+    Report.open(ReportFileName, ios::out);
+    if (!Report.is_open())
+    {
+        cout << "Cannot write report file " << ReportFileName << ".\n";
+        return false;
+    }
+
+    stAccrualSummary Summary;
+    enEngineResult Result = Engine.ApplyAccrual(vTiers, Summary, ThreadCount);
+    if (Result != eEngineDone)
+    {
+        cout << "Accrual failed: " << EngineResultToString(Result) << ". No balance was changed.\n";
+        return false;
+    }
+
+    RenderAccrualSummary(vTiers, Summary, cout);
+    RenderAccrualSummary(vTiers, Summary, Report);
+    Report.close();
+
+    cout << "Accrued " << Summary.Accounts << " account(s) on " << Summary.Threads << " thread(s) in "
+        << fixed << setprecision(3) << Summary.Seconds << " s.\n";
+    cout << "Report written to " << ReportFileName << ".\n";
+    return true;
+}
+
+// =============================================================
+//                      Sockets
+// =============================================================
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+const SocketHandle InvalidSocket = INVALID_SOCKET;
+#else
+typedef int SocketHandle;
+const SocketHandle InvalidSocket = -1;
+#endif
+
+bool InitializeSockets()
+{
+#ifdef _WIN32
+    WSADATA Data;
+    return WSAStartup(MAKEWORD(2, 2), &Data) == 0;
+#else
+    signal(SIGPIPE, SIG_IGN); // A teller that hangs up must not stop the server
+    return true;
+#endif
+}
+
+void CloseSocket(SocketHandle Socket)
+{
+#ifdef _WIN32
+    closesocket(Socket);
+#else
+    close(Socket);
+#endif
+}
+
+// Wakes up a thread that is blocked reading from the socket.
+void ShutdownSocket(SocketHandle Socket)
+{
+#ifdef _WIN32
+    shutdown(Socket, SD_BOTH);
+#else
+    shutdown(Socket, SHUT_RDWR);
+#endif
+}
+
+void DisableNagle(SocketHandle Socket)
+{
+    int Yes = 1;
+    setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&Yes, sizeof(Yes));
+}
+
+sockaddr_in LoopbackAddress(unsigned short Port)
+{
+    sockaddr_in Address = {};
+    Address.sin_family = AF_INET;
+    Address.sin_port = htons(Port);
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return Address;
+}
+
+// Only 127.0.0.1 is served: tellers run on the same host as the book.
+SocketHandle ListenOnLoopback(unsigned short Port)
+{
+    SocketHandle Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (Socket == InvalidSocket)
+        return InvalidSocket;
+
+    int Yes = 1;
+    setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&Yes, sizeof(Yes));
+
+    sockaddr_in Address = LoopbackAddress(Port);
+    if (bind(Socket, (sockaddr*)&Address, sizeof(Address)) != 0 || listen(Socket, SOMAXCONN) != 0)
+    {
+        CloseSocket(Socket);
+        return InvalidSocket;
+    }
+    return Socket;
+}
+
+SocketHandle ConnectToLoopback(unsigned short Port)
+{
+    SocketHandle Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (Socket == InvalidSocket)
+        return InvalidSocket;
+
+    sockaddr_in Address = LoopbackAddress(Port);
+    if (connect(Socket, (sockaddr*)&Address, sizeof(Address)) != 0)
+    {
+        CloseSocket(Socket);
+        return InvalidSocket;
+    }
+    DisableNagle(Socket);
+    return Socket;
+}
+
+// Waits up to TimeoutMs for a connection, so the caller can check for a
+// stop request in between. Returns InvalidSocket on timeout.
+SocketHandle AcceptConnection(SocketHandle Listener, int TimeoutMs)
+{
+    fd_set ReadSet;
+    FD_ZERO(&ReadSet);
+    FD_SET(Listener, &ReadSet);
+    timeval Timeout = { TimeoutMs / 1000, (TimeoutMs % 1000) * 1000 };
+
+    if (select((int)Listener + 1, &ReadSet, nullptr, nullptr, &Timeout) <= 0)
+        return InvalidSocket;
+
+    SocketHandle Socket = accept(Listener, nullptr, nullptr);
+    if (Socket != InvalidSocket)
+        DisableNagle(Socket);
+    return Socket;
+}
+
+// Line-based reading and writing over a connected socket.
+class clsSocketStream
+{
+private:
+    SocketHandle _Socket;
+    vector<char> _Buffer;
+    size_t _Start = 0;
+    size_t _End = 0;
+
+public:
+    clsSocketStream(SocketHandle Socket) : _Socket(Socket), _Buffer(64 * 1024)
+    {
+    }
+
+    bool ReadLine(string& Line)
+    {
+        Line.clear();
+        while (true)
+        {
+            const char* Begin = _Buffer.data() + _Start;
+            const char* NewLine = (const char*)memchr(Begin, '\n', _End - _Start);
+            if (NewLine != nullptr)
+            {
+                Line.append(Begin, NewLine);
+                _Start = (NewLine - _Buffer.data()) + 1;
+                if (!Line.empty() && Line.back() == '\r')
+                    Line.pop_back();
+                return true;
+            }
+
+            Line.append(Begin, _End - _Start);
+            _Start = _End = 0;
+
+            int Received = recv(_Socket, _Buffer.data(), (int)_Buffer.size(), 0);
+            if (Received <= 0)
+                return false;
+            _End = (size_t)Received;
+        }
+    }
+
+    // True if more request bytes already arrived (the peer is pipelining).
+    bool HasBufferedInput() const
+    {
+        return _Start < _End;
+    }
+
+    bool WriteAll(string_view Text)
+    {
+        while (!Text.empty())
+        {
+            int Sent = send(_Socket, Text.data(), (int)Text.size(), 0);
+            if (Sent <= 0)
+                return false;
+            Text.remove_prefix((size_t)Sent);
+        }
+        return true;
+    }
+};
+
+// =============================================================
+//                      Replication
+// =============================================================
+
+// A server started with --replicate listens on a second port for one
+// standby and ships it every committed change; a server started with
+// --standby keeps a read-only copy of the book from that port. Lines,
+// fields separated by #//#:
+//   @@SNAPSHOT#//#Count#//#Position#//#Time   then Count journal lines
+//   @@RECORDS#//#Count#//#Position#//#Time    then Count journal lines
+//   ACK#//#Position                           standby, once a batch is applied
+// Batches go out without waiting for the ACK of the one before. An idle
+// primary sends @@RECORDS with no lines every second, so the standby
+// knows the link is alive and that it has everything.
+
+const int ReplicationHeartbeatMs = 1000;
+const int ReplicationRetryMs = 1000;
+
+// After each batch the shipper lets records gather this long, so a busy
+// primary ships a few large batches instead of one per journal sync; the
+// standby then locks its book and syncs its journal once per batch too.
+const int ReplicationGatherMs = 5;
+
+// The thread of one end of the link. Stop raises StopRequested, which the
+// thread checks between waits, and shuts down the connection it may be
+// blocked on.
+struct stReplicationLink
+{
+    thread Worker;
+    atomic<bool> StopRequested{ false };
+    mutex SocketMutex;
+    SocketHandle Socket = InvalidSocket;
+
+    void SetSocket(SocketHandle NewSocket)
+    {
+        lock_guard<mutex> Lock(SocketMutex);
+        Socket = NewSocket;
+    }
+
+    void Stop()
+    {
+        StopRequested = true;
+        {
+            lock_guard<mutex> Lock(SocketMutex);
+            if (Socket != InvalidSocket)
+                ShutdownSocket(Socket);
+        }
+        if (Worker.joinable())
+            Worker.join();
+    }
+};
+
+// Feeds the standby on Socket until it hangs up or the link is stopped.
+// ACKs are read on a thread of their own, so shipping never waits for them.
+void ShipToStandby(SocketHandle Socket, clsBankEngine& Engine, stReplicationLink& Link)
+{
+    atomic<bool> StandbyGone{ false };
+    thread AckReader([&]()
+        {
+            clsSocketStream Acks(Socket);
+            string Line;
+            string_view vFields[2];
+            while (Acks.ReadLine(Line))
+            {
+                uint64_t Position = 0;
+                if (SplitFields(Line, "#//#", vFields, 2) == 2 && vFields[0] == "ACK"
+                    && from_chars(vFields[1].data(), vFields[1].data() + vFields[1].size(), Position).ec == errc())
+                    Engine.AcknowledgeShipment(Position);
+            }
+            StandbyGone = true;
+        });
+
+    clsSocketStream Stream(Socket);
+    stReplicationBatch Batch;
+    chrono::steady_clock::time_point LastSent = chrono::steady_clock::now();
+    Engine.StartShipping();
+
+    while (!Link.StopRequested && !StandbyGone)
+    {
+        if (!Engine.NextShipment(Batch, 250)
+            && chrono::steady_clock::now() - LastSent < chrono::milliseconds(ReplicationHeartbeatMs))
+            continue;
+
+        string Header = string(Batch.IsSnapshot ? "@@SNAPSHOT" : "@@RECORDS") + "#//#" + to_string(Batch.RecordCount)
+            + "#//#" + to_string(Batch.Position) + "#//#" + to_string(Batch.CommitTime) + "\n";
+        if (!Stream.WriteAll(Header) || !Stream.WriteAll(Batch.Records))
+            break;
+        LastSent = chrono::steady_clock::now();
+        this_thread::sleep_for(chrono::milliseconds(ReplicationGatherMs));
+    }
+
+    Engine.StopShipping();
+    ShutdownSocket(Socket);
+    AckReader.join();
+}
+
+// Listens on ShipPort and feeds one standby at a time on a thread of its own.
+bool StartShipping(clsBankEngine& Engine, unsigned short ShipPort, stReplicationLink& Link)
+{
+    SocketHandle Listener = ListenOnLoopback(ShipPort);
+    if (Listener == InvalidSocket)
+    {
+        cout << "Cannot listen for a standby on 127.0.0.1:" << ShipPort << ".\n";
+        return false;
+    }
+
+    Link.Worker = thread([&Engine, &Link, Listener]()
+        {
+            while (!Link.StopRequested)
+            {
+                SocketHandle Socket = AcceptConnection(Listener, 250);
+                if (Socket == InvalidSocket)
+                    continue;
+
+                cout << "Standby connected, shipping a snapshot.\n";
+                Link.SetSocket(Socket);
+                ShipToStandby(Socket, Engine, Link);
+                Link.SetSocket(InvalidSocket);
+                CloseSocket(Socket);
+                cout << "Standby disconnected.\n";
+            }
+            CloseSocket(Listener);
+        });
+    return true;
+}
+
+// Applies what the primary ships and acknowledges each batch. Returns when
+// the primary hangs up or sends something that cannot be applied, or once
+// the book is promoted.
+void ReceiveFromPrimary(SocketHandle Socket, clsBankEngine& Engine, stReplicationLink& Link)
+{
+    clsSocketStream Stream(Socket);
+    string Header, Line;
+    string_view vFields[4];
+    stReplicationBatch Batch;
+
+    auto ParseNumber = [](string_view Text, auto& Number)
+        {
+            from_chars_result Result = from_chars(Text.data(), Text.data() + Text.size(), Number);
+            return !Text.empty() && Result.ec == errc() && Result.ptr == Text.data() + Text.size();
+        };
+
+    while (!Link.StopRequested && Stream.ReadLine(Header))
+    {
+        Batch = stReplicationBatch();
+        if (SplitFields(Header, "#//#", vFields, 4) != 4 || (vFields[0] != "@@SNAPSHOT" && vFields[0] != "@@RECORDS")
+            || !ParseNumber(vFields[1], Batch.RecordCount) || !ParseNumber(vFields[2], Batch.Position)
+            || !ParseNumber(vFields[3], Batch.CommitTime))
+        {
+            cout << "Replication: unexpected line from the primary, reconnecting.\n";
+            return;
+        }
+
+        Batch.IsSnapshot = (vFields[0] == "@@SNAPSHOT");
+        for (size_t i = 0; i < Batch.RecordCount; i++)
+        {
+            if (!Stream.ReadLine(Line))
+                return;
+            Batch.Records.append(Line).append(1, '\n');
+        }
+
+        enEngineResult Result = Engine.ApplyShipment(Batch);
+        if (Result != eEngineDone)
+        {
+            if (Engine.IsReadOnly())
+                cout << "Replication: cannot apply the batch up to " << Batch.Position << " ("
+                    << EngineResultToString(Result) << "), reconnecting for a snapshot.\n";
+            return;
+        }
+        if (Batch.IsSnapshot)
+            cout << "Replication: snapshot of " << Batch.RecordCount << " client(s) applied.\n";
+
+        if (!Stream.WriteAll("ACK#//#" + to_string(Batch.Position) + "\n"))
+            return;
+    }
+}
+
+// Makes the book a standby of the primary shipping on PrimaryPort and keeps
+// it up to date on a thread of its own, connecting again every second
+// while the primary is away, until the book is promoted.
+void StartReceiving(clsBankEngine& Engine, unsigned short PrimaryPort, stReplicationLink& Link)
+{
+    Engine.BecomeStandby();
+    Link.Worker = thread([&Engine, &Link, PrimaryPort]()
+        {
+            bool Connected = true; // So the first failure is reported
+            auto WaitBeforeRetry = [&Link]()
+                {
+                    for (int Waited = 0; Waited < ReplicationRetryMs && !Link.StopRequested; Waited += 250)
+                        this_thread::sleep_for(chrono::milliseconds(250));
+                };
+
+            while (!Link.StopRequested && Engine.IsReadOnly())
+            {
+                SocketHandle Socket = ConnectToLoopback(PrimaryPort);
+                if (Socket == InvalidSocket)
+                {
+                    if (Connected)
+                        cout << "Replication: no primary on 127.0.0.1:" << PrimaryPort << ", retrying every second.\n";
+                    Connected = false;
+                    WaitBeforeRetry();
+                    continue;
+                }
+
+                cout << "Replication: connected to the primary on 127.0.0.1:" << PrimaryPort << ".\n";
+                Connected = true;
+                Link.SetSocket(Socket);
+                ReceiveFromPrimary(Socket, Engine, Link);
+                Link.SetSocket(InvalidSocket);
+                CloseSocket(Socket);
+
+                // A primary that is shutting down may still accept for a moment
+                if (!Link.StopRequested && Engine.IsReadOnly())
+                    WaitBeforeRetry();
+            }
+            if (!Engine.IsReadOnly())
+                cout << "Replication: promoted, no longer following the primary.\n";
+        });
+}
+
+// =============================================================
+//                      Teller Server
+// =============================================================
+
+// One request per line, fields separated by #//#, one answer line each:
+//   FIND#//#AccountNumber                 OK#//#<client record line>
+//   DEPOSIT#//#AccountNumber#//#Amount    OK#//#NewBalance
+//   WITHDRAW#//#AccountNumber#//#Amount   OK#//#NewBalance
+//   TRANSFER#//#From#//#To#//#Amount      OK
+//   TRANSFERS#//#From#//#To#//#Amount#//#From#//#To#//#Amount...
+//                                         OK, all legs or none
+//   ADD#//#<client record line>           OK
+//   UPDATE#//#<client record line>        OK
+//   DELETE#//#AccountNumber               OK
+//   TOTAL                                 OK#//#ClientCount#//#TotalBalances#//#BookVersion
+//   ACCOUNTS#//#N                         OK#//#AccountNumber#//#...  (first N)
+//   REPLICATION                           OK#//#Role#//#Position#//#PeerPosition#//#LagRecords#//#LagMs
+//   PROMOTE                               OK, the standby takes changes from now on
+//   QUIT                                  closes the connection
+// Failures answer ERR#//#Reason. A standby answers every change with
+// ERR#//#read-only standby until it is promoted.
+
+const unsigned short DefaultServerPort = 5555;
+
+string HandleTellerRequest(string_view Request, clsBankEngine& Engine)
+{
+    string_view vFields[6];
+    size_t FieldCount = SplitFields(Request, "#//#", vFields, 6);
+    string_view Command = vFields[0];
+
+    if (Command == "FIND" && FieldCount == 2)
+    {
+        stClientData Client;
+        if (!Engine.Find(vFields[1], Client))
+            return "ERR#//#not found";
+        return "OK#//#" + ConvertRecordToLine(Client);
+    }
+
+    if ((Command == "DEPOSIT" || Command == "WITHDRAW") && FieldCount == 3)
+    {
+        stEngineOperation Operation;
+        if (!ParseMoney(vFields[2], Operation.Amount))
+            return "ERR#//#invalid amount";
+
+        Operation.Type = (Command == "DEPOSIT") ? eOperationDeposit : eOperationWithdraw;
+        Operation.AccountNumber = vFields[1];
+        stEngineOutcome Outcome = Engine.Apply(Operation);
+        if (Outcome.Result != eEngineDone)
+            return "ERR#//#" + EngineResultToString(Outcome.Result);
+        return "OK#//#" + FormatMoney(Outcome.Balance);
+    }
+
+    if ((Command == "TRANSFER" && FieldCount == 4) || (Command == "TRANSFERS" && FieldCount >= 4))
+    {
+        vector<stEngineOperation> vLegs;
+        string_view Legs = Request.substr(Command.size() + 4);
+        string_view vLegFields[3];
+
+        while (true)
+        {
+            // Take the next three fields of the request as one leg
+            size_t End = 0;
+            for (int i = 0; i < 3 && End != string_view::npos; i++)
+                End = Legs.find("#//#", i == 0 ? 0 : End + 4);
+
+            string_view Leg = Legs.substr(0, End);
+            stEngineOperation TransferLeg;
+            TransferLeg.Type = eOperationTransfer;
+            if (SplitFields(Leg, "#//#", vLegFields, 3) != 3 || !ParseMoney(vLegFields[2], TransferLeg.Amount))
+                return "ERR#//#malformed transfer leg " + to_string(vLegs.size() + 1);
+
+            TransferLeg.AccountNumber = vLegFields[0];
+            TransferLeg.ToAccountNumber = vLegFields[1];
+            vLegs.push_back(TransferLeg);
+
+            if (End == string_view::npos)
+                break;
+            Legs.remove_prefix(End + 4);
+        }
+
+        size_t FailedLeg = 0;
+        enEngineResult Result = Engine.ApplyTransfers(vLegs, FailedLeg);
+        if (Result != eEngineDone)
+            return "ERR#//#leg " + to_string(FailedLeg + 1) + ": " + RejectReason(Result);
+        return "OK";
+    }
+
+    if ((Command == "ADD" || Command == "UPDATE") && FieldCount == 6)
+    {
+        stClientData Client;
+        if (!ConvertLineToRecord(Request.substr(Command.size() + 4), Client))
+            return "ERR#//#malformed client record";
+
+        stEngineOperation Operation;
+        Operation.Type = (Command == "ADD") ? eOperationAddClient : eOperationUpdateClient;
+        Operation.Client = Client;
+        enEngineResult Result = Engine.Apply(Operation).Result;
+        if (Result != eEngineDone)
+            return "ERR#//#" + EngineResultToString(Result);
+        return "OK";
+    }
+
+    if (Command == "DELETE" && FieldCount == 2)
+    {
+        stEngineOperation Operation;
+        Operation.Type = eOperationDeleteClient;
+        Operation.AccountNumber = vFields[1];
+        enEngineResult Result = Engine.Apply(Operation).Result;
+        if (Result != eEngineDone)
+            return "ERR#//#" + EngineResultToString(Result);
+        return "OK";
+    }
+
+    if (Command == "TOTAL" && FieldCount == 1)
+    {
+        clsBookSnapshot Snapshot = Engine.Snapshot();
+        return "OK#//#" + to_string(Snapshot.ClientCount()) + "#//#" + FormatMoney(Snapshot.TotalBalances())
+            + "#//#" + to_string(Snapshot.Version());
+    }
+
+    if (Command == "COUNTABOVE" && FieldCount == 2)
+    {
+        Cents Threshold = 0;
+        if (!ParseMoney(vFields[1], Threshold))
+            return "ERR#//#invalid amount";
+        return "OK#//#" + to_string(Engine.CountBalancesAbove(Threshold));
+    }
+
+    if (Command == "HISTOGRAM" && FieldCount == 3)
+    {
+        Cents BucketWidth = 0;
+        size_t BucketCount = 0;
+        from_chars_result Result = from_chars(vFields[2].data(), vFields[2].data() + vFields[2].size(), BucketCount);
+        if (!ParseMoney(vFields[1], BucketWidth) || BucketWidth <= 0
+            || Result.ec != errc() || BucketCount == 0 || BucketCount > 1000)
+            return "ERR#//#invalid histogram";
+
+        string Answer = "OK";
+        for (size_t Count : Engine.BalanceHistogram(0, BucketWidth, BucketCount))
+            Answer += "#//#" + to_string(Count);
+        return Answer;
+    }
+
+    if (Command == "ACCOUNTS" && FieldCount == 2)
+    {
+        size_t Wanted = (size_t)atoll(string(vFields[1]).c_str());
+        string Answer = "OK";
+        for (const string& AccountNumber : Engine.AccountNumbers(Wanted))
+            Answer.append("#//#").append(AccountNumber);
+        return Answer;
+    }
+
+    if (Command == "REPLICATION" && FieldCount == 1)
+    {
+        stReplicationStatus Status = Engine.ReplicationStatus();
+        return "OK#//#" + ReplicationRoleToString(Status.Role) + "#//#" + to_string(Status.Position)
+            + "#//#" + to_string(Status.PeerPosition) + "#//#" + to_string(Status.LagRecords)
+            + "#//#" + to_string(Status.LagMs);
+    }
+
+    if (Command == "PROMOTE" && FieldCount == 1)
+    {
+        if (!Engine.IsReadOnly())
+            return "ERR#//#not a standby";
+        Engine.Promote();
+        return "OK";
+    }
+
+    return "ERR#//#unknown request";
+}
+
+// Requests are handled while holding one of the server's Workers, so no
+// more run at once than it has, however many tellers are connected.
+void ServeTellerConnection(SocketHandle Socket, clsBankEngine& Engine, counting_semaphore<>& Workers)
+{
+    clsSocketStream Stream(Socket);
+    string Request, Answers;
+
+    while (Stream.ReadLine(Request))
+    {
+        if (Request == "QUIT")
+            break;
+
+        Workers.acquire();
+        Answers += HandleTellerRequest(Request, Engine);
+        Workers.release();
+        Answers += '\n';
+
+        // Pipelined requests are answered together in one send
+        if (!Stream.HasBufferedInput())
+        {
+            if (!Stream.WriteAll(Answers))
+                return;
+            Answers.clear();
+        }
+    }
+    Stream.WriteAll(Answers);
+}
+
+volatile sig_atomic_t ServerStopRequested = 0;
+
+void RequestServerStop(int)
+{
+    ServerStopRequested = 1;
+}
+
+// Serves tellers on 127.0.0.1:Port until Ctrl+C. Every connection has a
+// thread of its own, which mostly waits for its next request, so a teller
+// that stays connected never keeps a new one waiting; at most WorkerCount
+// requests are handled at once. A ShipPort makes the server a primary that feeds a
+// standby on that port; a PrimaryPort makes it a read-only standby of the
+// primary feeding on that port.
+bool RunTellerServer(clsBankEngine& Engine, unsigned short Port, unsigned WorkerCount,
+    unsigned short ShipPort = 0, unsigned short PrimaryPort = 0)
+{
+    if (!InitializeSockets())
+        return false;
+
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
+
+    SocketHandle Listener = ListenOnLoopback(Port);
+    if (Listener == InvalidSocket)
+    {
+        cout << "Cannot listen on 127.0.0.1:" << Port << ".\n";
+        return false;
+    }
+
+    stReplicationLink Replication;
+    if (ShipPort != 0 && !StartShipping(Engine, ShipPort, Replication))
+    {
+        CloseSocket(Listener);
+        return false;
+    }
+    if (PrimaryPort != 0)
+        StartReceiving(Engine, PrimaryPort, Replication);
+
+    counting_semaphore<> Workers(WorkerCount);
+    vector<SocketHandle> ActiveConnections;
+    mutex ConnectionsMutex;
+    condition_variable ConnectionClosed;
+
+    // Detached, so a thread is gone once its connection is; stopping waits
+    // for ActiveConnections to empty instead of joining them
+    auto Serve = [&](SocketHandle Socket)
+        {
+            ServeTellerConnection(Socket, Engine, Workers);
+
+            lock_guard<mutex> Lock(ConnectionsMutex);
+            ActiveConnections.erase(find(ActiveConnections.begin(), ActiveConnections.end(), Socket));
+            CloseSocket(Socket);
+            ConnectionClosed.notify_all();
+        };
+
+    signal(SIGINT, RequestServerStop);
+    signal(SIGTERM, RequestServerStop);
+    cout << "Teller server listening on 127.0.0.1:" << Port << ", handling up to " << WorkerCount
+        << " request(s) at once, " << Engine.ClientCount() << " client(s) loaded. Press Ctrl+C to stop.\n";
+    if (ShipPort != 0)
+        cout << "Shipping every change to a standby on 127.0.0.1:" << ShipPort << ".\n";
+    if (PrimaryPort != 0)
+        cout << "Read-only standby of the primary on 127.0.0.1:" << PrimaryPort << ", PROMOTE to take over.\n";
+
+    while (!ServerStopRequested)
+    {
+        DumpStatsIfRequested();
+        SocketHandle Socket = AcceptConnection(Listener, 250);
+        if (Socket == InvalidSocket)
+            continue;
+
+        lock_guard<mutex> Lock(ConnectionsMutex);
+        ActiveConnections.push_back(Socket);
+        thread(Serve, Socket).detach();
+    }
+
+    CloseSocket(Listener);
+    Replication.Stop();
+    {
+        unique_lock<mutex> Lock(ConnectionsMutex);
+        for (SocketHandle Socket : ActiveConnections)
+            ShutdownSocket(Socket);
+        ConnectionClosed.wait(Lock, [&]() { return ActiveConnections.empty(); });
+    }
+
+    Engine.Checkpoint();
+    cout << "Teller server stopped, book saved.\n";
+    return true;
+}
+
+// =============================================================
+//                      Teller Client
+// =============================================================
+
+// Sends every line of standard input to the server and prints each answer,
+// so the server can be scripted from a shell.
+bool RunTellerClient(unsigned short Port)
+{
+    if (!InitializeSockets())
+        return false;
+
+    SocketHandle Socket = ConnectToLoopback(Port);
+    if (Socket == InvalidSocket)
+    {
+        cout << "Cannot connect to 127.0.0.1:" << Port << ".\n";
+        return false;
+    }
+
+    clsSocketStream Stream(Socket);
+    string Line, Answer;
+    while (getline(cin, Line))
+    {
+        if (Line.empty())
+            continue;
+        if (!Stream.WriteAll(Line + "\n") || Line == "QUIT" || !Stream.ReadLine(Answer))
+            break;
+        cout << Answer << '\n';
+    }
+    CloseSocket(Socket);
+    return true;
+}
+
+double Percentile(vector<double>& vSamples, double Fraction)
+{
+    if (vSamples.empty())
+        return 0;
+    size_t Index = min(vSamples.size() - 1, (size_t)(Fraction * vSamples.size()));
+    nth_element(vSamples.begin(), vSamples.begin() + Index, vSamples.end());
+    return vSamples[Index];
+}
+
+// Opens Connections connections that each send Requests deposits and
+// withdrawals of 1.00 to random accounts, one request at a time, and
+// reports throughput and latency.
+bool RunTellerLoadTest(unsigned short Port, unsigned Connections, size_t Requests)
+{
+    if (!InitializeSockets())
+        return false;
+
+    SocketHandle Socket = ConnectToLoopback(Port);
+    if (Socket == InvalidSocket)
+    {
+        cout << "Cannot connect to 127.0.0.1:" << Port << ".\n";
+        return false;
+    }
+
+    vector<string> vAccounts;
+    {
+        clsSocketStream Stream(Socket);
+        string Answer;
+        Stream.WriteAll("ACCOUNTS#//#10000\n");
+        Stream.ReadLine(Answer);
+        string_view Rest = Answer;
+        while (true)
+        {
+            size_t pos = Rest.find("#//#");
+            if (pos == string_view::npos)
+                break;
+            Rest.remove_prefix(pos + 4);
+            vAccounts.push_back(string(Rest.substr(0, Rest.find("#//#"))));
+        }
+        CloseSocket(Socket);
+    }
+
+    if (vAccounts.empty())
+    {
+        cout << "The server has no clients to load test with.\n";
+        return false;
+    }
 
-    if (vClients.size() == 0)
-        cout << "\t\tNo Clients Available In the System!";
-    else
+    vector<vector<double>> vLatencies(Connections);
+    atomic<size_t> Failed(0);
+    auto Start = chrono::steady_clock::now();
+
+    vector<thread> vThreads;
+    for (unsigned t = 0; t < Connections; t++)
     {
-        for (stClientData Client : vClients)
-        {
-            cout << "| " << left << setw(15) << Client.AccountNumber;
-            cout << "| " << left << setw(40) << Client.Name;
-            cout << "| " << left << setw(12) << Client.AccountBalance;
-            TotalBalances += Client.AccountBalance;
-            cout << endl;
-        }
-    }
+        vThreads.emplace_back([&, t]()
+            {
+                SocketHandle Connection = ConnectToLoopback(Port);
+                if (Connection == InvalidSocket)
+                {
+                    Failed += Requests;
+                    return;
+                }
 
-    cout << "\n_______________________________________________________";
-    cout << "_________________________________________\n" << endl;
-    cout << "\t\t\t\t\t   Total Balances = " << TotalBalances << endl;
+                clsSocketStream Stream(Connection);
+                mt19937_64 Random(t + 1);
+                string Answer;
+                vLatencies[t].reserve(Requests);
+
+                for (size_t i = 0; i < Requests; i++)
+                {
+                    const string& AccountNumber = vAccounts[Random() % vAccounts.size()];
+                    string Request = (i % 2 == 0 ? "DEPOSIT#//#" : "WITHDRAW#//#") + AccountNumber + "#//#1.00\n";
+
+                    auto Sent = chrono::steady_clock::now();
+                    if (!Stream.WriteAll(Request) || !Stream.ReadLine(Answer))
+                    {
+                        Failed += Requests - i;
+                        break;
+                    }
+                    vLatencies[t].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - Sent).count());
+                    if (Answer.compare(0, 2, "OK") != 0)
+                        Failed++;
+                }
+                Stream.WriteAll("QUIT\n");
+                CloseSocket(Connection);
+            });
+    }
+    for (thread& T : vThreads)
+        T.join();
+
+    double Seconds = chrono::duration<double>(chrono::steady_clock::now() - Start).count();
+    vector<double> vAll;
+    for (vector<double>& v : vLatencies)
+        vAll.insert(vAll.end(), v.begin(), v.end());
+
+    cout << "Requests      : " << vAll.size() << " (" << Failed << " failed or rejected)\n";
+    cout << "Connections   : " << Connections << "\n";
+    cout << "Throughput    : " << (size_t)(vAll.size() / Seconds) << " requests/s\n";
+    cout << "Latency p50   : " << Percentile(vAll, 0.50) << " us\n";
+    cout << "Latency p99   : " << Percentile(vAll, 0.99) << " us\n";
+    return true;
 }
 
+// =============================================================
+//                      UI & Main Menu
+// =============================================================
+
 int ReadOption(int start, int end)
 {
     int Choice = 0;
@@ -559,6 +2115,231 @@ int ReadOption(int start, int end)
     return Choice;
 }
 
+string ReadClientAccountNumber()
+{
+    string AccountNumber = "";
+    cout << "\nPlease enter Account Number: ";
+    cin >> AccountNumber;
+    return AccountNumber;
+}
+
+void ShowDeleteClientScreen(clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tDelete Client Screen";
+    cout << "\n-----------------------------------\n";
+    string AccountNumber = ReadClientAccountNumber();
+    DeleteClientByAccountNumber(AccountNumber, Engine);
+}
+
+void ShowUpdateClientScreen(clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tUpdate Client Info Screen";
+    cout << "\n-----------------------------------\n";
+    string AccountNumber = ReadClientAccountNumber();
+    UpdateClientByAccountNumber(AccountNumber, Engine);
+}
+
+void PrintFoundClients(const vector<stClientData>& vClients)
+{
+    clsReportBuffer Report(cout);
+    Report.Append("\n").AppendNumber(vClients.size()).Append(" client(s) found.");
+    Report.Append(ReportRule);
+    Report.AppendCell("Account Number", 15).AppendCell("Client Name", 40).AppendCell("Phone", 12).AppendCell("Balance", 12);
+    Report.Append(ReportRule);
+    for (const stClientData& Client : vClients)
+    {
+        Report.AppendCell(Client.AccountNumber, 15).AppendCell(Client.Name, 40).AppendCell(Client.Phone, 12);
+        Report.AppendMoneyCell(Client.AccountBalance, 12).Append('\n');
+    }
+    Report.Append(ReportRule);
+}
+
+const size_t MaxNameSearchResults = 100;
+
+void FindClientsByName(clsBankEngine& Engine)
+{
+    string Prefix;
+    cout << "\nPlease enter the start of a name (any word, any case): ";
+    getline(cin >> ws, Prefix);
+
+    vector<stClientData> vClients = Engine.FindByNamePrefix(Prefix, MaxNameSearchResults);
+    PrintFoundClients(vClients);
+    if (vClients.size() == MaxNameSearchResults)
+        cout << "Only the first " << MaxNameSearchResults << " matches are shown, type more of the name to narrow it down.\n";
+}
+
+void FindClientsByPhone(clsBankEngine& Engine)
+{
+    string Phone;
+    cout << "\nPlease enter Phone: ";
+    cin >> Phone;
+
+    PrintFoundClients(Engine.FindByPhone(Phone));
+}
+
+void ShowFindClientScreen(clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tFind Client Screen";
+    cout << "\n-----------------------------------\n";
+    cout << "\t[1] By Account Number.\n";
+    cout << "\t[2] By Name.\n";
+    cout << "\t[3] By Phone.\n";
+    cout << "-----------------------------------\n";
+
+    switch ((enFindOptions)ReadOption(1, 3))
+    {
+    case eFindByName:
+        FindClientsByName(Engine);
+        return;
+    case eFindByPhone:
+        FindClientsByPhone(Engine);
+        return;
+    case eFindByAccountNumber:
+        break;
+    }
+
+    string AccountNumber = ReadClientAccountNumber();
+    stClientData Client;
+    if (Engine.Find(AccountNumber, Client))
+    {
+        PrintClientCard(Client);
+    }
+    else
+    {
+        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
+    }
+}
+
+void ShowDepositScreen(clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tDeposit Screen";
+    cout << "\n-----------------------------------\n";
+
+    string AccountNumber = ReadClientAccountNumber();
+    stClientData Client;
+    if (Engine.Find(AccountNumber, Client))
+    {
+        PrintClientCard(Client);
+        Deposit(Client, Engine);
+    }
+    else
+    {
+        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
+    }
+}
+
+void ShowWithdrawScreen(clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tWithdraw Screen";
+    cout << "\n-----------------------------------\n";
+
+    string AccountNumber = ReadClientAccountNumber();
+    stClientData Client;
+    if (Engine.Find(AccountNumber, Client))
+    {
+        PrintClientCard(Client);
+        Withdraw(Client, Engine);
+    }
+    else
+    {
+        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
+    }
+}
+
+void ShowTransferScreen(clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tTransfer Screen";
+    cout << "\n-----------------------------------\n";
+
+    cout << "\nTransfer From:";
+    string FromAccountNumber = ReadClientAccountNumber();
+    stClientData FromClient;
+    if (!Engine.Find(FromAccountNumber, FromClient))
+    {
+        cout << "\nClient with Account Number [" << FromAccountNumber << "] is not found!";
+        return;
+    }
+    PrintClientCard(FromClient);
+
+    cout << "\nTransfer To:";
+    string ToAccountNumber = ReadClientAccountNumber();
+    stClientData ToClient;
+    if (!Engine.Find(ToAccountNumber, ToClient))
+    {
+        cout << "\nClient with Account Number [" << ToAccountNumber << "] is not found!";
+        return;
+    }
+    if (ToClient.AccountNumber == FromClient.AccountNumber)
+    {
+        cout << "\nYou cannot transfer to the same account!";
+        return;
+    }
+    PrintClientCard(ToClient);
+
+    Transfer(FromClient, ToClient, Engine);
+}
+
+void ShowTotalBalancesScreen(const clsBankEngine& Engine)
+{
+    RenderBalancesList(Engine, cout);
+}
+
+// Dates are asked until one like 2024-01-31 is given.
+string ReadStatementDate(string Message)
+{
+    string Date;
+    int64_t Time;
+    cout << Message;
+    while (!(cin >> Date) || !ParseStatementDate(Date, Time)) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Invalid Input. Please enter a date like 2024-01-31: ";
+    }
+    return Date;
+}
+
+void ShowAccountStatementScreen(const clsBankEngine& Engine)
+{
+    cout << "\n-----------------------------------\n";
+    cout << "\tAccount Statement Screen";
+    cout << "\n-----------------------------------\n";
+
+    if (!Engine.HasCompleteLedger())
+    {
+        cout << "\nStatements are not available: " << EngineResultToString(eEngineLedgerPartial) << ".";
+        return;
+    }
+
+    string AccountNumber = ReadClientAccountNumber();
+    stClientData Client;
+    if (!Engine.Find(AccountNumber, Client))
+    {
+        cout << "\nClient with Account Number [" << AccountNumber << "] is not found!";
+        return;
+    }
+    PrintClientCard(Client);
+
+    string FromDate = ReadStatementDate("\nFrom date (YYYY-MM-DD): ");
+    string ToDate = ReadStatementDate("To date (YYYY-MM-DD): ");
+    int64_t FromTime, ToTime;
+    ParseStatementRange(FromDate, ToDate, FromTime, ToTime);
+
+    vector<stLedgerEntry> vEntries;
+    enEngineResult Result = Engine.Statement(AccountNumber, FromTime, ToTime, vEntries);
+    if (Result != eEngineDone)
+    {
+        cout << "\nCannot show the statement: " << EngineResultToString(Result) << ".";
+        return;
+    }
+    RenderAccountStatement(AccountNumber, FromDate, ToDate, vEntries, cout);
+}
+
 void GoBackToTransactions()
 {
     cout << "\n\nPress Enter to go back to Transaction Menu...";
@@ -566,7 +2347,7 @@ void GoBackToTransactions()
     cin.get();
 }
 
-void ShowTransactionsScreen(vector<stClientData>& vClients)
+void ShowTransactionsScreen(clsBankEngine& Engine)
 {
     system("cls");
     cout << "===========================================\n";
@@ -574,33 +2355,49 @@ void ShowTransactionsScreen(vector<stClientData>& vClients)
     cout << "===========================================\n";
     cout << "\t[1] Deposit.\n";
     cout << "\t[2] Withdraw.\n";
-    cout << "\t[3] Total Balances.\n";
-    cout << "\t[4] Main Menu.\n";
+    cout << "\t[3] Transfer.\n";
+    cout << "\t[4] Total Balances.\n";
+    cout << "\t[5] Account Statement.\n";
+    cout << "\t[6] Main Menu.\n";
     cout << "===========================================\n";
 
-    enTransactionsOptions Choice = (enTransactionsOptions)ReadOption(1, 4);
+    enTransactionsOptions Choice = (enTransactionsOptions)ReadOption(1, 6);
 
     switch (Choice)
     {
     case eDeposit:
         system("cls");
-        ShowDepositScreen(vClients);
+        ShowDepositScreen(Engine);
         GoBackToTransactions();
-        ShowTransactionsScreen(vClients);
+        ShowTransactionsScreen(Engine);
         break;
 
     case eWithdraw:
         system("cls");
-        ShowWithdrawScreen(vClients);
+        ShowWithdrawScreen(Engine);
+        GoBackToTransactions();
+        ShowTransactionsScreen(Engine);
+        break;
+
+    case eTransfer:
+        system("cls");
+        ShowTransferScreen(Engine);
         GoBackToTransactions();
-        ShowTransactionsScreen(vClients);
+        ShowTransactionsScreen(Engine);
         break;
 
     case eTotalBalances:
         system("cls");
-        ShowTotalBalancesScreen(vClients);
+        ShowTotalBalancesScreen(Engine);
         GoBackToTransactions();
-        ShowTransactionsScreen(vClients);
+        ShowTransactionsScreen(Engine);
+        break;
+
+    case eAccountStatement:
+        system("cls");
+        ShowAccountStatementScreen(Engine);
+        GoBackToTransactions();
+        ShowTransactionsScreen(Engine);
         break;
 
     case eMainMenue:
@@ -609,6 +2406,47 @@ void ShowTransactionsScreen(vector<stClientData>& vClients)
     }
 }
 
+void ShowStatisticsScreen()
+{
+    cout << "\n\t\t\t\tStatistics (times in microseconds)";
+    cout << "\n_______________________________________________________";
+    cout << "_________________________________________\n" << endl;
+
+    if (!IsStatsOn())
+    {
+        cout << "\t\tStatistics are turned off.\n";
+        return;
+    }
+
+    cout << "| " << left << setw(15) << "Operation";
+    cout << "| " << left << setw(10) << "Count";
+    cout << "| " << left << setw(12) << "Mean";
+    cout << "| " << left << setw(12) << "p50";
+    cout << "| " << left << setw(12) << "p99";
+    cout << "| " << left << setw(12) << "Max";
+    cout << "\n_______________________________________________________";
+    cout << "_________________________________________\n" << endl;
+
+    cout << fixed << setprecision(2);
+    for (int i = 0; i < eStatOperationCount; i++)
+    {
+        const clsOperationStats& Stats = BankStats.Operations[i];
+        cout << "| " << left << setw(15) << StatsOperationNames[i];
+        cout << "| " << left << setw(10) << Stats.Count();
+        cout << "| " << left << setw(12) << Stats.MeanMicroseconds();
+        cout << "| " << left << setw(12) << Stats.PercentileMicroseconds(0.50);
+        cout << "| " << left << setw(12) << Stats.PercentileMicroseconds(0.99);
+        cout << "| " << left << setw(12) << Stats.MaxMicroseconds();
+        cout << endl;
+    }
+    cout << defaultfloat << setprecision(6);
+
+    cout << "\n_______________________________________________________";
+    cout << "_________________________________________\n" << endl;
+    cout << "\t\t\t\t\t   Bytes Read    = " << BankStats.BytesRead.load() << endl;
+    cout << "\t\t\t\t\t   Bytes Written = " << BankStats.BytesWritten.load() << endl;
+}
+
 void GoBackToMainMenue()
 {
     cout << "\n\nPress Enter to go back to Main Menu...";
@@ -620,7 +2458,7 @@ void GoBackToMainMenue()
     cin.get();
 }
 
-void ShowMainMenue()
+void ShowMainMenue(const clsBankEngine& Engine)
 {
     system("cls");
     cout << "===========================================\n";
@@ -632,64 +2470,361 @@ void ShowMainMenue()
     cout << "\t[4] Update Client Info.\n";
     cout << "\t[5] Find Client.\n";
     cout << "\t[6] Transactions.\n";
-    cout << "\t[7] Exit.\n";
+    cout << "\t[7] Statistics.\n";
+    cout << "\t[8] Exit.\n";
     cout << "===========================================\n";
+    PrintFileLoadErrors(Engine.DataFileName(), Engine.LoadErrors());
 }
 
-void StartBankApplication()
+void StartBankApplication(clsBankEngine& Engine)
 {
     bool Running = true;
     while (Running)
     {
-        ShowMainMenue();
-        enMainMenueOptions Choice = (enMainMenueOptions)ReadOption(1, 7);
+        DumpStatsIfRequested();
+        ShowMainMenue(Engine);
+        enMainMenueOptions Choice = (enMainMenueOptions)ReadOption(1, 8);
 
-        vector<stClientData> vClients = LoadClientsDataFromFile(ClientsFileName);
+        // Another program may have changed the files while the menu waited
+        Engine.ReloadIfChanged();
 
         switch (Choice)
         {
         case eListClients:
             system("cls");
-            PrintAllClientsData(vClients);
+            PrintAllClientsData(Engine);
             GoBackToMainMenue();
             break;
         case eAddNewClient:
             system("cls");
-            AddNewClientScreen(vClients);
+            AddNewClientScreen(Engine);
             GoBackToMainMenue();
             break;
         case eDeleteClient:
             system("cls");
-            ShowDeleteClientScreen(vClients);
+            ShowDeleteClientScreen(Engine);
             GoBackToMainMenue();
             break;
         case eUpdateClient:
             system("cls");
-            ShowUpdateClientScreen(vClients);
+            ShowUpdateClientScreen(Engine);
             GoBackToMainMenue();
             break;
         case eFindClient:
             system("cls");
-            ShowFindClientScreen(vClients);
+            ShowFindClientScreen(Engine);
             GoBackToMainMenue();
             break;
         case eTransactions:
             system("cls");
-            ShowTransactionsScreen(vClients);
+            ShowTransactionsScreen(Engine);
+            break;
+        case eStatistics:
+            system("cls");
+            ShowStatisticsScreen();
+            GoBackToMainMenue();
             break;
         case eExit:
             system("cls");
+            Engine.Checkpoint();
             cout << "\n\n-------------------------------------------\n";
             cout << "\t\tProgram Ends :-)";
             cout << "\n-------------------------------------------\n";
             Running = false;
             break;
         }
+
+        // Whatever changed on disk during this pass was written by this screen
+        Engine.RememberFiles();
     }
 }
 
-int main()
+void PrintUsage()
+{
+    cout << "Usage: BANK_SYSTEM [--storage text|binary|columnar] [--load-threads N] [--no-stats] [--stats-file File]\n";
+    cout << "                   [--durability sync|group:<ms>|batch:<n>]\n";
+    cout << "       --load-threads 0 uses one thread per core.\n";
+    cout << "       BANK_SYSTEM [--storage ...] --apply Batch.txt [--report Report.txt] [--persist-every N]\n";
+    cout << "       BANK_SYSTEM [--storage ...] --import Clients.csv [--rejects Rejects.txt]\n";
+    cout << "       BANK_SYSTEM [--storage ...] --accrue Tiers.txt [--report Report.txt] [--threads N]\n";
+    cout << "       BANK_SYSTEM [--storage ...] --serve [Port] [--workers N] [--replicate ShipPort | --standby ShipPort]\n";
+    cout << "       BANK_SYSTEM [--storage ...] --list [--page N] [--page-size K]\n";
+    cout << "       BANK_SYSTEM [--storage ...] --export csv|json [--out File]\n";
+    cout << "       BANK_SYSTEM [--storage ...] --statement AccountNumber [--from YYYY-MM-DD] [--to YYYY-MM-DD]\n";
+    cout << "       BANK_SYSTEM --client [Port]\n";
+    cout << "       BANK_SYSTEM --load-test [Port] [--connections N] [--requests N]\n";
+    cout << "       BANK_SYSTEM --convert-to-binary [Clients.txt] [Clients.dat]\n";
+    cout << "       BANK_SYSTEM --convert-to-text [Clients.dat] [Clients.txt]\n";
+    cout << "       BANK_SYSTEM --convert-to-columnar [Clients.txt] [Clients.col]\n";
+    cout << "       BANK_SYSTEM --convert-columnar-to-text [Clients.col] [Clients.txt]\n";
+}
+
+// The benchmark builds this file with BANK_SYSTEM_NO_MAIN and brings its own main().
+#ifndef BANK_SYSTEM_NO_MAIN
+int main(int argc, char* argv[])
 {
-    StartBankApplication();
+    vector<string> vArgs(argv + 1, argv + argc);
+
+    if (vArgs.size() >= 1 && vArgs[0] == "--convert-to-binary")
+    {
+        string From = vArgs.size() >= 2 ? vArgs[1] : ClientsFileName;
+        string To = vArgs.size() >= 3 ? vArgs[2] : ClientsBinaryFileName;
+        stConversionResult Conversion;
+        enEngineResult Result = ConvertTextFileToBinary(From, To, Conversion);
+        PrintFileLoadErrors(From, Conversion.vErrors);
+        if (Result == eEngineCannotOpen)
+        {
+            cout << "Cannot read " << From << ".\n";
+            return 1;
+        }
+
+        cout << "Converted " << Conversion.Converted << " client(s) from " << From << " to " << To << ".\n";
+        if (Conversion.Skipped > 0)
+            cout << Conversion.Skipped << " client(s) were skipped because a field is too long for the binary format.\n";
+        return Result == eEngineDone ? 0 : 1;
+    }
+
+    if (vArgs.size() >= 1 && vArgs[0] == "--convert-to-text")
+    {
+        string From = vArgs.size() >= 2 ? vArgs[1] : ClientsBinaryFileName;
+        string To = vArgs.size() >= 3 ? vArgs[2] : ClientsFileName;
+        stConversionResult Conversion;
+        if (ConvertBinaryFileToText(From, To, Conversion) != eEngineDone)
+        {
+            cout << "Could not convert " << From << " to " << To << ", is it a valid binary clients file?\n";
+            return 1;
+        }
+        cout << "Converted " << Conversion.Converted << " client(s) from " << From << " to " << To << ".\n";
+        return 0;
+    }
+
+    if (vArgs.size() >= 1 && vArgs[0] == "--convert-to-columnar")
+    {
+        string From = vArgs.size() >= 2 ? vArgs[1] : ClientsFileName;
+        string To = vArgs.size() >= 3 ? vArgs[2] : ClientsColumnarFileName;
+        stConversionResult Conversion;
+        enEngineResult Result = ConvertTextFileToColumnar(From, To, Conversion);
+        PrintFileLoadErrors(From, Conversion.vErrors);
+        if (Result != eEngineDone)
+        {
+            cout << "Could not convert " << From << " to " << To << ".\n";
+            return 1;
+        }
+        cout << "Converted " << Conversion.Converted << " client(s) from " << From << " to " << To << ".\n";
+        return 0;
+    }
+
+    if (vArgs.size() >= 1 && vArgs[0] == "--convert-columnar-to-text")
+    {
+        string From = vArgs.size() >= 2 ? vArgs[1] : ClientsColumnarFileName;
+        string To = vArgs.size() >= 3 ? vArgs[2] : ClientsFileName;
+        stConversionResult Conversion;
+        enEngineResult Result = ConvertColumnarFileToText(From, To, Conversion);
+        PrintFileLoadErrors(From, Conversion.vErrors);
+        if (Result != eEngineDone)
+        {
+            cout << "Could not convert " << From << " to " << To << ", is it an intact columnar clients file?\n";
+            return 1;
+        }
+        cout << "Converted " << Conversion.Converted << " client(s) from " << From << " to " << To << ".\n";
+        return 0;
+    }
+
+    string BatchFileName, ReportFileName, TiersFileName, ImportFileName, RejectsFileName;
+    size_t PersistEvery = 0;
+    unsigned AccrualThreads = 0;
+    enum { eRunMenu, eRunServer, eRunClient, eRunLoadTest, eRunList, eRunExport, eRunStatement } RunMode = eRunMenu;
+    stReportPage Page;
+    enExportFormat ExportFormat = eExportCsv;
+    string ExportFileName;
+    string StatementAccountNumber, StatementFrom, StatementTo;
+    unsigned short Port = DefaultServerPort;
+    unsigned short ShipPort = 0, PrimaryPort = 0;
+    unsigned Workers = max(4u, thread::hardware_concurrency());
+    unsigned Connections = 8;
+    size_t Requests = 10000;
+    stBankEngineOptions Options;
+
+    // An optional port may follow --serve, --client and --load-test
+    auto ReadOptionalPort = [&](size_t& i)
+        {
+            if (i + 1 < vArgs.size() && isdigit((unsigned char)vArgs[i + 1][0]))
+                Port = (unsigned short)atoi(vArgs[++i].c_str());
+        };
+
+    for (size_t i = 0; i < vArgs.size(); i++)
+    {
+        if (vArgs[i] == "--apply" && i + 1 < vArgs.size())
+            BatchFileName = vArgs[++i];
+        else if (vArgs[i] == "--report" && i + 1 < vArgs.size())
+            ReportFileName = vArgs[++i];
+        else if (vArgs[i] == "--persist-every" && i + 1 < vArgs.size())
+            PersistEvery = (size_t)atoll(vArgs[++i].c_str());
+        else if (vArgs[i] == "--import" && i + 1 < vArgs.size())
+            ImportFileName = vArgs[++i];
+        else if (vArgs[i] == "--rejects" && i + 1 < vArgs.size())
+            RejectsFileName = vArgs[++i];
+        else if (vArgs[i] == "--accrue" && i + 1 < vArgs.size())
+            TiersFileName = vArgs[++i];
+        else if (vArgs[i] == "--threads" && i + 1 < vArgs.size())
+            AccrualThreads = (unsigned)max(0, atoi(vArgs[++i].c_str()));
+        else if (vArgs[i] == "--serve")
+        {
+            RunMode = eRunServer;
+            ReadOptionalPort(i);
+        }
+        else if (vArgs[i] == "--client")
+        {
+            RunMode = eRunClient;
+            ReadOptionalPort(i);
+        }
+        else if (vArgs[i] == "--load-test")
+        {
+            RunMode = eRunLoadTest;
+            ReadOptionalPort(i);
+        }
+        else if (vArgs[i] == "--list")
+            RunMode = eRunList;
+        else if (vArgs[i] == "--page" && i + 1 < vArgs.size())
+        {
+            Page.Page = (size_t)max(1LL, atoll(vArgs[++i].c_str()));
+            if (Page.PageSize == 0)
+                Page.PageSize = 20;
+        }
+        else if (vArgs[i] == "--page-size" && i + 1 < vArgs.size())
+            Page.PageSize = (size_t)max(0LL, atoll(vArgs[++i].c_str()));
+        else if (vArgs[i] == "--export" && i + 1 < vArgs.size() && (vArgs[i + 1] == "csv" || vArgs[i + 1] == "json"))
+        {
+            RunMode = eRunExport;
+            ExportFormat = (vArgs[++i] == "csv") ? eExportCsv : eExportJson;
+        }
+        else if (vArgs[i] == "--out" && i + 1 < vArgs.size())
+            ExportFileName = vArgs[++i];
+        else if (vArgs[i] == "--statement" && i + 1 < vArgs.size())
+        {
+            RunMode = eRunStatement;
+            StatementAccountNumber = vArgs[++i];
+        }
+        else if (vArgs[i] == "--from" && i + 1 < vArgs.size())
+            StatementFrom = vArgs[++i];
+        else if (vArgs[i] == "--to" && i + 1 < vArgs.size())
+            StatementTo = vArgs[++i];
+        else if (vArgs[i] == "--replicate" && i + 1 < vArgs.size())
+            ShipPort = (unsigned short)atoi(vArgs[++i].c_str());
+        else if (vArgs[i] == "--standby" && i + 1 < vArgs.size())
+            PrimaryPort = (unsigned short)atoi(vArgs[++i].c_str());
+        else if (vArgs[i] == "--workers" && i + 1 < vArgs.size())
+            Workers = max(1, atoi(vArgs[++i].c_str()));
+        else if (vArgs[i] == "--connections" && i + 1 < vArgs.size())
+            Connections = max(1, atoi(vArgs[++i].c_str()));
+        else if (vArgs[i] == "--requests" && i + 1 < vArgs.size())
+            Requests = (size_t)atoll(vArgs[++i].c_str());
+        else if (vArgs[i] == "--storage" && i + 1 < vArgs.size() && vArgs[i + 1] == "binary")
+        {
+            Options.Storage = eBinaryStorage;
+            i++;
+        }
+        else if (vArgs[i] == "--storage" && i + 1 < vArgs.size() && vArgs[i + 1] == "text")
+        {
+            Options.Storage = eTextStorage;
+            i++;
+        }
+        else if (vArgs[i] == "--storage" && i + 1 < vArgs.size() && vArgs[i + 1] == "columnar")
+        {
+            Options.Storage = eColumnarStorage;
+            i++;
+        }
+        else if (vArgs[i] == "--no-stats")
+            StatsEnabled = false;
+        else if (vArgs[i] == "--stats-file" && i + 1 < vArgs.size())
+            StatsFileName = vArgs[++i];
+        else if (vArgs[i] == "--durability" && i + 1 < vArgs.size() && ParseDurabilityPolicy(vArgs[i + 1], Options.Durability))
+            i++;
+        else if (vArgs[i] == "--load-threads" && i + 1 < vArgs.size())
+            Options.LoadThreads = (unsigned)atoi(vArgs[++i].c_str());
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if ((ShipPort != 0 || PrimaryPort != 0) && (RunMode != eRunServer || (ShipPort != 0 && PrimaryPort != 0)))
+    {
+        PrintUsage();
+        return 1;
+    }
+    if ((ShipPort != 0 || PrimaryPort != 0) && Options.Storage == eBinaryStorage)
+    {
+        cout << "Replication ships the journal, so it needs --storage text or columnar.\n";
+        return 1;
+    }
+
+    if (RunMode == eRunClient)
+        return RunTellerClient(Port) ? 0 : 1;
+    if (RunMode == eRunLoadTest)
+        return RunTellerLoadTest(Port, Connections, Requests) ? 0 : 1;
+
+    // The statistics of whatever mode runs below are written out when it ends
+    atexit(DumpStatsToFile);
+#ifdef SIGUSR1
+    signal(SIGUSR1, RequestStatsDump);
+#endif
+
+    clsBankEngine Engine;
+    enEngineResult Opened = Engine.Open(Options);
+    if (Opened == eEngineCannotOpenLedger)
+    {
+        cout << "Cannot open " << LedgerFileName << ", is it a valid ledger file?\n";
+        return 1;
+    }
+    if (Opened != eEngineDone)
+    {
+        // Name the file of the chosen storage, not always Clients.dat
+        cout << "Cannot open " << Engine.DataFileName() << ": " << EngineResultToString(Opened);
+        if (Options.Storage == eBinaryStorage)
+            cout << ", is it a valid binary clients file?";
+        cout << "\n";
+        return 1;
+    }
+
+    if (BatchFileName != "")
+    {
+        if (ReportFileName == "")
+            ReportFileName = BatchFileName + ".report";
+        return ApplyBatchFile(Engine, BatchFileName, ReportFileName, PersistEvery) ? 0 : 1;
+    }
+
+    if (ImportFileName != "")
+    {
+        if (RejectsFileName == "")
+            RejectsFileName = ImportFileName + ".rejects";
+        return ImportClientsFile(Engine, ImportFileName, RejectsFileName) ? 0 : 1;
+    }
+
+    if (TiersFileName != "")
+    {
+        if (ReportFileName == "")
+            ReportFileName = TiersFileName + ".report";
+        return RunAccrual(Engine, TiersFileName, ReportFileName, AccrualThreads) ? 0 : 1;
+    }
+
+    if (RunMode == eRunServer)
+        return RunTellerServer(Engine, Port, Workers, ShipPort, PrimaryPort) ? 0 : 1;
+
+    if (RunMode == eRunList)
+    {
+        ListClients(Engine, Page);
+        return 0;
+    }
+
+    if (RunMode == eRunExport)
+        return ExportClientsFile(Engine, ExportFormat, ExportFileName) ? 0 : 1;
+
+    if (RunMode == eRunStatement)
+        return PrintAccountStatement(Engine, StatementAccountNumber, StatementFrom, StatementTo) ? 0 : 1;
+
+    StartBankApplication(Engine);
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
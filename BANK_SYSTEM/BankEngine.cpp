@@ -0,0 +1,6000 @@
+#include "BankEngine.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <charconv>
+#include <system_error>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <bit>
+#include <deque>
+#include <condition_variable>
+#include <csignal>
+#include <filesystem>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <xmmintrin.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Once this many operations are journaled, they are folded back into Clients.txt.
+const size_t JournalCheckpointThreshold = 10000;
+
+// After a failed journal write the writer waits this long before it tries again.
+const unsigned JournalRetryDelayMs = 100;
+
+// =============================================================
+//                      Client Store (Hash Indexed)
+// =============================================================
+
+namespace
+{
+
+// A handle is the slot of a client inside the store. Deleted clients are
+// only marked (a tombstone), so a handle stays valid until the store is
+// compacted; the engine never hands handles out.
+typedef size_t ClientHandle;
+
+const ClientHandle NoClientHandle = SIZE_MAX;
+
+// Asks the CPU to start loading Address into the cache.
+inline void PrefetchForRead(const void* Address)
+{
+#ifdef _MSC_VER
+    _mm_prefetch((const char*)Address, _MM_HINT_T0);
+#else
+    __builtin_prefetch(Address);
+#endif
+}
+
+struct stAccountNumberHash
+{
+    using is_transparent = void; // allows lookups by string_view without building a string
+    size_t operator()(string_view AccountNumber) const
+    {
+        return hash<string_view>{}(AccountNumber);
+    }
+};
+
+// Bump allocator for the text of the store. Text is copied into large
+// chunks that never move, so views into it stay valid while the store
+// lives. Nothing is freed one piece at a time: a replaced name stays in its
+// chunk until the whole store is dropped (or compacted). Text only the
+// store itself reads can be written over instead, see Replace. Snapshots
+// share the chunks, which live until the last of them lets go.
+class clsTextArena
+{
+private:
+    static const size_t _ChunkSize = 1 << 20;
+
+    vector<shared_ptr<char[]>> _vChunks;
+    size_t _ChunkUsed = 0;
+    size_t _ChunkCapacity = 0;
+    size_t _BytesReserved = 0;
+
+public:
+    string_view Store(string_view Text)
+    {
+        if (Text.empty())
+            return string_view();
+
+        if (_ChunkCapacity - _ChunkUsed < Text.size())
+        {
+            _ChunkCapacity = max(_ChunkSize, Text.size());
+            _vChunks.push_back(shared_ptr<char[]>(new char[_ChunkCapacity]));
+            _ChunkUsed = 0;
+            _BytesReserved += _ChunkCapacity;
+        }
+
+        char* Copy = _vChunks.back().get() + _ChunkUsed;
+        memcpy(Copy, Text.data(), Text.size());
+        _ChunkUsed += Text.size();
+        return string_view(Copy, Text.size());
+    }
+
+    // Stores Text in place of Stored, a view this arena returned that no
+    // one reads any more. It is written over Stored if it fits.
+    string_view Replace(string_view Stored, string_view Text)
+    {
+        if (Stored == Text)
+            return Stored;
+        if (Text.size() > Stored.size())
+            return Store(Text);
+
+        char* Bytes = const_cast<char*>(Stored.data()); // The arena owns these bytes
+        memcpy(Bytes, Text.data(), Text.size());
+        return string_view(Bytes, Text.size());
+    }
+
+    size_t BytesReserved() const
+    {
+        return _BytesReserved;
+    }
+
+    // Keeps every chunk stored so far alive for as long as the copy lives.
+    vector<shared_ptr<char[]>> SharedChunks() const
+    {
+        return _vChunks;
+    }
+};
+
+// Widths of the text kept inside a compact record. Longer text still works:
+// it is moved to the arena and the inline bytes point to it.
+const size_t InlineAccountNumberWidth = 20;
+const size_t InlinePinCodeWidth = 12;
+const size_t InlinePhoneWidth = 16;
+const uint8_t TextInArena = 0xFF;
+
+// One client in a single 64-byte cache line. The name lives in the arena.
+struct stCompactRecord
+{
+    char AccountNumber[InlineAccountNumberWidth];
+    char PinCode[InlinePinCodeWidth];
+    char Phone[InlinePhoneWidth];
+    const char* Name;
+    uint32_t NameLength;
+    uint8_t AccountNumberLength;    // TextInArena if the text is in the arena
+    uint8_t PinCodeLength;
+    uint8_t PhoneLength;
+    uint8_t Reserved;
+};
+
+static_assert(sizeof(stCompactRecord) == 64, "Compact record should fit one cache line");
+
+string ToLowerText(string_view Text)
+{
+    string Lower(Text);
+    for (char& Character : Lower)
+        Character = (char)tolower((unsigned char)Character);
+    return Lower;
+}
+
+bool StartsWith(string_view Text, string_view Prefix)
+{
+    return Text.size() >= Prefix.size() && Text.compare(0, Prefix.size(), Prefix) == 0;
+}
+
+// Text kept in a record field, inline or (TextInArena) in the arena.
+string_view RecordText(const char* Bytes, uint8_t Length)
+{
+    if (Length != TextInArena)
+        return string_view(Bytes, Length);
+
+    const char* Data;
+    uint32_t Size;
+    memcpy(&Data, Bytes, sizeof(Data));
+    memcpy(&Size, Bytes + sizeof(Data), sizeof(Size));
+    return string_view(Data, Size);
+}
+
+stClientView ViewOfRecord(const stCompactRecord& Record, Cents AccountBalance)
+{
+    stClientView View;
+    View.AccountNumber = RecordText(Record.AccountNumber, Record.AccountNumberLength);
+    View.PinCode = RecordText(Record.PinCode, Record.PinCodeLength);
+    View.Name = string_view(Record.Name, Record.NameLength);
+    View.Phone = RecordText(Record.Phone, Record.PhoneLength);
+    View.AccountBalance = AccountBalance;
+    return View;
+}
+
+// The records of the store, in chunks of a fixed size that snapshots
+// share. A record is only changed in place after its chunk was copied, if
+// a snapshot holds it too (copy on write). Appending to the free end of a
+// shared chunk needs no copy, as no snapshot reads past its own end.
+class clsRecordColumn
+{
+private:
+    static const size_t _ChunkShift = 12;   // 4096 records, 256 KB
+    static const size_t _ChunkSize = size_t(1) << _ChunkShift;
+
+    vector<shared_ptr<stCompactRecord[]>> _vChunks;
+    size_t _Size = 0;
+
+public:
+    static const size_t ChunkSize = _ChunkSize;
+
+    const stCompactRecord& operator[](size_t Index) const
+    {
+        return _vChunks[Index >> _ChunkShift][Index & (_ChunkSize - 1)];
+    }
+
+    // The record at Index, to be changed in place. Only the store's writer
+    // calls this, with no snapshot being taken, so the count it reads can
+    // only be too high (a snapshot letting go), never too low.
+    stCompactRecord& ForUpdate(size_t Index)
+    {
+        shared_ptr<stCompactRecord[]>& Chunk = _vChunks[Index >> _ChunkShift];
+        if (Chunk.use_count() > 1)
+        {
+            shared_ptr<stCompactRecord[]> Copy(new stCompactRecord[_ChunkSize]);
+            copy(Chunk.get(), Chunk.get() + _ChunkSize, Copy.get());
+            Chunk = move(Copy);
+        }
+        return Chunk[Index & (_ChunkSize - 1)];
+    }
+
+    void push_back(const stCompactRecord& Record)
+    {
+        if (_Size == _vChunks.size() * _ChunkSize)
+            _vChunks.push_back(shared_ptr<stCompactRecord[]>(new stCompactRecord[_ChunkSize]));
+        _vChunks[_Size >> _ChunkShift][_Size & (_ChunkSize - 1)] = Record;
+        _Size++;
+    }
+
+    void pop_back()
+    {
+        _Size--;
+    }
+
+    size_t size() const
+    {
+        return _Size;
+    }
+
+    void reserve(size_t Count)
+    {
+        _vChunks.reserve((Count + _ChunkSize - 1) >> _ChunkShift);
+    }
+
+    size_t capacity() const
+    {
+        return _vChunks.size() * _ChunkSize;
+    }
+};
+
+// The clients of a store as they were at one moment. The records and the
+// arena text are shared with the store, the live flags and balances are
+// copies of their columns (the only parts of a slot that change in place).
+struct stFrozenClients
+{
+    clsRecordColumn Records;
+    vector<shared_ptr<char[]>> vArenaChunks;
+    vector<uint8_t> vLive;
+    vector<Cents> vBalances;
+    size_t Count = 0;
+
+    stClientView Get(ClientHandle Handle) const
+    {
+        return ViewOfRecord(Records[Handle], vBalances[Handle]);
+    }
+};
+
+// The clients live in three columns: compact records for the text (in
+// chunks a snapshot can share), a contiguous array of balances in cents
+// and a live flag per slot, so aggregates over the whole book stream
+// through memory without touching any text. A deleted slot keeps a
+// balance of 0.
+//
+// The account index is an open-addressing table of handles, probed with
+// the account number stored in the record, so the account number is kept
+// only once.
+//
+// The name and phone indexes cost memory the server and batch modes never
+// use, so they are only built by BuildSearchIndexes() and from then on kept
+// up to date by Add, Update and Remove.
+class clsClientStore
+{
+private:
+    struct stIndexSlot
+    {
+        uint32_t Handle;
+        uint32_t HashTag;   // Upper bits of the hash, to skip most records without reading them
+    };
+
+    static const uint32_t _EmptySlot = UINT32_MAX;
+
+    static uint32_t _HashTag(size_t Hash)
+    {
+        return (uint32_t)(((uint64_t)Hash * 0x9E3779B97F4A7C15ull) >> 32) | 1;
+    }
+
+    clsRecordColumn _vRecords;
+    vector<Cents> _vBalances;
+    vector<uint8_t> _vLive;
+    clsTextArena _Arena;
+    vector<stIndexSlot> _vIndex;
+    size_t _IndexedCount = 0;
+
+    // Keys point to lowercase copies of the names (and to copies of the
+    // phones) in the arena. Every word of a name is a key of its own, so
+    // "els" finds "Mostafa Elsehy". The handle is part of the name key, so
+    // removing one of thousands of clients sharing a name is one lookup.
+    // _vSearchKeys holds the copies of each handle, so an update writes the
+    // new ones over them instead of taking more of the arena.
+    struct stSearchKeys
+    {
+        string_view Name;
+        string_view Phone;
+    };
+
+    bool _SearchIndexed = false;
+    set<pair<string_view, ClientHandle>> _NameIndex;
+    unordered_multimap<string_view, ClientHandle> _PhoneIndex;
+    vector<stSearchKeys> _vSearchKeys;
+
+    // Calls OnKey once per word of Name with the text from that word to the end.
+    template <typename KeyVisitor>
+    static void _ForEachNameKey(string_view Name, KeyVisitor OnKey)
+    {
+        for (size_t Start = 0; Start < Name.size(); )
+        {
+            if (Name[Start] == ' ')
+            {
+                Start++;
+                continue;
+            }
+            OnKey(Name.substr(Start));
+            size_t Space = Name.find(' ', Start);
+            Start = (Space == string_view::npos) ? Name.size() : Space;
+        }
+    }
+
+    // Copies the search keys of Handle into the arena, over its old ones.
+    stSearchKeys& _StoreSearchKeys(ClientHandle Handle)
+    {
+        if (_vSearchKeys.size() <= Handle)
+            _vSearchKeys.resize(_vRecords.size());
+
+        const stCompactRecord& Record = _vRecords[Handle];
+        stSearchKeys& Keys = _vSearchKeys[Handle];
+        Keys.Name = _Arena.Replace(Keys.Name, ToLowerText(string_view(Record.Name, Record.NameLength)));
+        Keys.Phone = _Arena.Replace(Keys.Phone, RecordText(Record.Phone, Record.PhoneLength));
+        return Keys;
+    }
+
+    void _IndexSearchFields(ClientHandle Handle)
+    {
+        const stSearchKeys& Keys = _StoreSearchKeys(Handle);
+        _ForEachNameKey(Keys.Name, [&](string_view Key) { _NameIndex.emplace(Key, Handle); });
+        if (!Keys.Phone.empty())
+            _PhoneIndex.emplace(Keys.Phone, Handle);
+    }
+
+    void _UnindexSearchFields(ClientHandle Handle)
+    {
+        const stSearchKeys& Keys = _vSearchKeys[Handle];
+        _ForEachNameKey(Keys.Name, [&](string_view Key) { _NameIndex.erase({ Key, Handle }); });
+
+        auto Range = _PhoneIndex.equal_range(Keys.Phone);
+        for (auto It = Range.first; It != Range.second; ++It)
+        {
+            if (It->second == Handle)
+            {
+                _PhoneIndex.erase(It);
+                break;
+            }
+        }
+    }
+
+    template <size_t Width>
+    void _SetText(char (&Bytes)[Width], uint8_t& Length, string_view Text)
+    {
+        if (Text.size() <= Width && Text.size() < TextInArena)
+        {
+            memcpy(Bytes, Text.data(), Text.size());
+            Length = (uint8_t)Text.size();
+            return;
+        }
+
+        string_view Stored = _Arena.Store(Text);
+        const char* Data = Stored.data();
+        uint32_t Size = (uint32_t)Stored.size();
+        memcpy(Bytes, &Data, sizeof(Data));
+        memcpy(Bytes + sizeof(Data), &Size, sizeof(Size));
+        Length = TextInArena;
+    }
+
+    string_view _AccountNumber(ClientHandle Handle) const
+    {
+        const stCompactRecord& Record = _vRecords[Handle];
+        return RecordText(Record.AccountNumber, Record.AccountNumberLength);
+    }
+
+    // Slot holding AccountNumber, or the empty slot where it would go.
+    size_t _Probe(string_view AccountNumber, size_t Hash) const
+    {
+        size_t Mask = _vIndex.size() - 1;
+        uint32_t HashTag = _HashTag(Hash);
+        for (size_t Slot = Hash & Mask; ; Slot = (Slot + 1) & Mask)
+        {
+            const stIndexSlot& Entry = _vIndex[Slot];
+            if (Entry.Handle == _EmptySlot)
+                return Slot;
+            if (Entry.HashTag == HashTag && _AccountNumber(Entry.Handle) == AccountNumber)
+                return Slot;
+        }
+    }
+
+    void _Rehash(size_t Capacity)
+    {
+        vector<stIndexSlot> vOld = move(_vIndex);
+        _vIndex.assign(Capacity, { _EmptySlot, 0 });
+        for (const stIndexSlot& Entry : vOld)
+        {
+            if (Entry.Handle == _EmptySlot)
+                continue;
+            size_t Mask = Capacity - 1;
+            size_t Slot = stAccountNumberHash{}(_AccountNumber(Entry.Handle)) & Mask;
+            while (_vIndex[Slot].Handle != _EmptySlot)
+                Slot = (Slot + 1) & Mask;
+            _vIndex[Slot] = Entry;
+        }
+    }
+
+    // Keeps the table at most 3/4 full.
+    void _GrowIndexFor(size_t Count)
+    {
+        size_t Capacity = max<size_t>(_vIndex.size(), 16);
+        while (Count * 4 > Capacity * 3)
+            Capacity *= 2;
+        if (Capacity != _vIndex.size())
+            _Rehash(Capacity);
+    }
+
+    // Removes the entry at Slot and shifts later entries of the same probe
+    // run back, so lookups never need tombstones.
+    void _EraseSlot(size_t Slot)
+    {
+        size_t Mask = _vIndex.size() - 1;
+        size_t Hole = Slot;
+        for (size_t Next = (Slot + 1) & Mask; _vIndex[Next].Handle != _EmptySlot; Next = (Next + 1) & Mask)
+        {
+            size_t Home = stAccountNumberHash{}(_AccountNumber(_vIndex[Next].Handle)) & Mask;
+            // Move the entry back only if its home is not between the hole and it
+            if (((Next - Home) & Mask) >= ((Next - Hole) & Mask))
+            {
+                _vIndex[Hole] = _vIndex[Next];
+                Hole = Next;
+            }
+        }
+        _vIndex[Hole] = { _EmptySlot, 0 };
+        _IndexedCount--;
+    }
+
+public:
+    bool Find(string_view AccountNumber, ClientHandle& Handle) const
+    {
+        if (_IndexedCount == 0)
+            return false;
+
+        const stIndexSlot& Entry = _vIndex[_Probe(AccountNumber, stAccountNumberHash{}(AccountNumber))];
+        if (Entry.Handle == _EmptySlot)
+            return false;
+        Handle = Entry.Handle;
+        return true;
+    }
+
+    bool Exists(string_view AccountNumber) const
+    {
+        ClientHandle Handle;
+        return Find(AccountNumber, Handle);
+    }
+
+    stClientView Get(ClientHandle Handle) const
+    {
+        return ViewOfRecord(_vRecords[Handle], _vBalances[Handle]);
+    }
+
+    Cents Balance(ClientHandle Handle) const
+    {
+        return _vBalances[Handle];
+    }
+
+    bool IsDeleted(ClientHandle Handle) const
+    {
+        return _vLive[Handle] == 0;
+    }
+
+    // Returns false (and stores nothing) if the account number is already taken.
+    bool Add(const stClientView& Client, ClientHandle& Handle)
+    {
+        _GrowIndexFor(_IndexedCount + 1);
+        size_t Hash = stAccountNumberHash{}(Client.AccountNumber);
+        size_t Slot = _Probe(Client.AccountNumber, Hash);
+        if (_vIndex[Slot].Handle != _EmptySlot)
+            return false;
+
+        Handle = Append(Client);
+        _vIndex[Slot] = { (uint32_t)Handle, _HashTag(Hash) };
+        _IndexedCount++;
+        if (_SearchIndexed)
+            _IndexSearchFields(Handle);
+        return true;
+    }
+
+    // Stores a client without indexing it. A loader that adds a whole book
+    // appends every client first and then calls IndexAppended once.
+    ClientHandle Append(const stClientView& Client)
+    {
+        stCompactRecord Record{};
+        _SetText(Record.AccountNumber, Record.AccountNumberLength, Client.AccountNumber);
+        _SetText(Record.PinCode, Record.PinCodeLength, Client.PinCode);
+        _SetText(Record.Phone, Record.PhoneLength, Client.Phone);
+        Record.Name = _Arena.Store(Client.Name).data();
+        Record.NameLength = (uint32_t)Client.Name.size();
+        _vRecords.push_back(Record);
+        _vBalances.push_back(Client.AccountBalance);
+        _vLive.push_back(1);
+        return _vRecords.size() - 1;
+    }
+
+    // Indexes the clients appended from First on. The slot of a handle a few
+    // rows ahead is fetched while the current one is probed, so the cache
+    // misses of the table overlap instead of coming one after the other. A
+    // client whose account number is already taken is left deleted and its
+    // handle added to vDuplicates.
+    void IndexAppended(ClientHandle First, vector<ClientHandle>& vDuplicates)
+    {
+        const size_t Ahead = 16;
+        size_t Hashes[Ahead];
+
+        _GrowIndexFor(_IndexedCount + (_vRecords.size() - First));
+        size_t Mask = _vIndex.size() - 1;
+        for (ClientHandle Handle = First; Handle < _vRecords.size() + Ahead; Handle++)
+        {
+            // Handle and the one Ahead before it share a place in Hashes
+            if (Handle >= First + Ahead)
+            {
+                ClientHandle Indexed = Handle - Ahead;
+                size_t Hash = Hashes[Indexed % Ahead];
+                size_t Slot = _Probe(_AccountNumber(Indexed), Hash);
+                if (_vIndex[Slot].Handle != _EmptySlot)
+                {
+                    _vLive[Indexed] = 0;
+                    _vBalances[Indexed] = 0;
+                    vDuplicates.push_back(Indexed);
+                }
+                else
+                {
+                    _vIndex[Slot] = { (uint32_t)Indexed, _HashTag(Hash) };
+                    _IndexedCount++;
+                    if (_SearchIndexed)
+                        _IndexSearchFields(Indexed);
+                }
+            }
+            if (Handle < _vRecords.size())
+            {
+                Hashes[Handle % Ahead] = stAccountNumberHash{}(_AccountNumber(Handle));
+                PrefetchForRead(&_vIndex[Hashes[Handle % Ahead] & Mask]);
+            }
+        }
+    }
+
+    // Takes back the Add that returned Handle, as if it never happened.
+    // Only the last handle can be taken back, so no other handle moves.
+    void RemoveLastAdded(ClientHandle Handle)
+    {
+        if (Handle + 1 != _vRecords.size())
+            return;
+        Remove(Handle);
+        _vRecords.pop_back();
+        _vBalances.pop_back();
+        _vLive.pop_back();
+        if (_vSearchKeys.size() > _vRecords.size())
+            _vSearchKeys.pop_back();
+    }
+
+    // The account number is the key of the record, so it is kept as is.
+    void Update(ClientHandle Handle, const stClientData& Client)
+    {
+        if (_SearchIndexed)
+            _UnindexSearchFields(Handle);
+
+        stCompactRecord& Record = _vRecords.ForUpdate(Handle);
+        _SetText(Record.PinCode, Record.PinCodeLength, Client.PinCode);
+        _SetText(Record.Phone, Record.PhoneLength, Client.Phone);
+        if (string_view(Record.Name, Record.NameLength) != Client.Name)
+        {
+            Record.Name = _Arena.Store(Client.Name).data();
+            Record.NameLength = (uint32_t)Client.Name.size();
+        }
+        _vBalances[Handle] = Client.AccountBalance;
+
+        if (_SearchIndexed)
+            _IndexSearchFields(Handle);
+    }
+
+    void SetBalance(ClientHandle Handle, Cents AccountBalance)
+    {
+        _vBalances[Handle] = AccountBalance;
+    }
+
+    void Remove(ClientHandle Handle)
+    {
+        if (_vLive[Handle] == 0)
+            return;
+        if (_SearchIndexed)
+            _UnindexSearchFields(Handle);
+        _vLive[Handle] = 0;
+        _vBalances[Handle] = 0;
+
+        string_view AccountNumber = _AccountNumber(Handle);
+        _EraseSlot(_Probe(AccountNumber, stAccountNumberHash{}(AccountNumber)));
+    }
+
+    bool HasSearchIndexes() const
+    {
+        return _SearchIndexed;
+    }
+
+    // Builds the name and phone indexes; does nothing if they already exist.
+    void BuildSearchIndexes()
+    {
+        if (_SearchIndexed)
+            return;
+
+        // Sorting the keys first lets every insert go straight to the end of
+        // the tree, which is much faster than inserting them one by one.
+        vector<pair<string_view, ClientHandle>> vNameKeys;
+        vNameKeys.reserve(_IndexedCount * 2);
+        _PhoneIndex.reserve(_IndexedCount);
+        _vSearchKeys.resize(_vRecords.size());
+        for (ClientHandle Handle = 0; Handle < _vRecords.size(); Handle++)
+        {
+            if (!_vLive[Handle])
+                continue;
+
+            const stSearchKeys& Keys = _StoreSearchKeys(Handle);
+            _ForEachNameKey(Keys.Name, [&](string_view Key) { vNameKeys.push_back({ Key, Handle }); });
+            if (!Keys.Phone.empty())
+                _PhoneIndex.emplace(Keys.Phone, Handle);
+        }
+
+        sort(vNameKeys.begin(), vNameKeys.end());
+        for (const pair<string_view, ClientHandle>& Key : vNameKeys)
+            _NameIndex.emplace_hint(_NameIndex.end(), Key);
+        _SearchIndexed = true;
+    }
+
+    // Clients with a word of their name starting with Prefix, ignoring case,
+    // in name order. At most MaxResults handles are returned.
+    vector<ClientHandle> FindByNamePrefix(string_view Prefix, size_t MaxResults) const
+    {
+        vector<ClientHandle> vHandles;
+        string LowerPrefix = ToLowerText(Prefix);
+        if (LowerPrefix.empty())
+            return vHandles;
+
+        if (!_SearchIndexed)
+        {
+            // Without the index every name has to be read
+            for (ClientHandle Handle = 0; Handle < _vRecords.size() && vHandles.size() < MaxResults; Handle++)
+            {
+                string Name = " " + ToLowerText(Get(Handle).Name);
+                if (_vLive[Handle] && Name.find(" " + LowerPrefix) != string::npos)
+                    vHandles.push_back(Handle);
+            }
+            return vHandles;
+        }
+
+        // A client whose name has two matching words is listed once
+        unordered_set<ClientHandle> Listed;
+        for (auto It = _NameIndex.lower_bound({ LowerPrefix, 0 });
+            It != _NameIndex.end() && StartsWith(It->first, LowerPrefix) && vHandles.size() < MaxResults; ++It)
+        {
+            if (Listed.insert(It->second).second)
+                vHandles.push_back(It->second);
+        }
+        return vHandles;
+    }
+
+    vector<ClientHandle> FindByPhone(string_view Phone) const
+    {
+        vector<ClientHandle> vHandles;
+        if (!_SearchIndexed)
+        {
+            for (ClientHandle Handle = 0; Handle < _vRecords.size(); Handle++)
+            {
+                if (_vLive[Handle] && Get(Handle).Phone == Phone)
+                    vHandles.push_back(Handle);
+            }
+            return vHandles;
+        }
+
+        auto Range = _PhoneIndex.equal_range(Phone);
+        for (auto It = Range.first; It != Range.second; ++It)
+            vHandles.push_back(It->second);
+        sort(vHandles.begin(), vHandles.end());
+        return vHandles;
+    }
+
+    // Number of slots, deleted clients included. Handles run from 0 to SlotCount() - 1.
+    size_t SlotCount() const
+    {
+        return _vRecords.size();
+    }
+
+    // Number of clients that are not deleted.
+    size_t Size() const
+    {
+        return _IndexedCount;
+    }
+
+    // Number of tombstones: slots of deleted clients not yet compacted away.
+    size_t DeletedCount() const
+    {
+        return _vRecords.size() - _IndexedCount;
+    }
+
+    // A copy of the store without the deleted clients, with its own arena
+    // (so replaced names are dropped too) and account index. The search
+    // indexes are left for the caller to build.
+    // vNewHandles[Handle] is the handle of each client in the copy, or
+    // NoClientHandle if it was deleted. Balances are left at 0: they may
+    // change while the copy is made, so CopyBalancesFrom fills them in once
+    // the caller has stopped all changes.
+    clsClientStore CompactedCopy(vector<ClientHandle>& vNewHandles) const
+    {
+        clsClientStore Copy;
+        stClientData Client;
+        Copy.Reserve(_IndexedCount);
+        vNewHandles.assign(_vRecords.size(), NoClientHandle);
+
+        for (ClientHandle Handle = 0; Handle < _vRecords.size(); Handle++)
+        {
+            if (!_vLive[Handle])
+                continue;
+
+            const stCompactRecord& Record = _vRecords[Handle];
+            Client.AccountNumber = RecordText(Record.AccountNumber, Record.AccountNumberLength);
+            Client.PinCode = RecordText(Record.PinCode, Record.PinCodeLength);
+            Client.Name = string_view(Record.Name, Record.NameLength);
+            Client.Phone = RecordText(Record.Phone, Record.PhoneLength);
+            Copy.Add(Client, vNewHandles[Handle]);
+        }
+        return Copy;
+    }
+
+    void CopyBalancesFrom(const clsClientStore& Original, const vector<ClientHandle>& vNewHandles)
+    {
+        for (ClientHandle Handle = 0; Handle < vNewHandles.size(); Handle++)
+        {
+            if (vNewHandles[Handle] != NoClientHandle)
+                _vBalances[vNewHandles[Handle]] = Original._vBalances[Handle];
+        }
+    }
+
+    // Freezes the clients without copying their text; the caller holds back
+    // adding, updating and deleting clients. Balances are left out, as
+    // they may still change: FreezeBalances adds them once the caller has
+    // stopped that too.
+    void Freeze(stFrozenClients& Frozen) const
+    {
+        Frozen.Records = _vRecords;
+        Frozen.vArenaChunks = _Arena.SharedChunks();
+        Frozen.vLive = _vLive;
+        Frozen.Count = _IndexedCount;
+    }
+
+    void FreezeBalances(stFrozenClients& Frozen) const
+    {
+        Frozen.vBalances = _vBalances;
+    }
+
+    void Reserve(size_t Count)
+    {
+        _vRecords.reserve(Count);
+        _vBalances.reserve(Count);
+        _vLive.reserve(Count);
+        _GrowIndexFor(Count);
+    }
+
+    // Bytes held by the store, arena chunks and spare capacity included.
+    size_t MemoryBytes() const
+    {
+        return _vRecords.capacity() * sizeof(stCompactRecord) + _vBalances.capacity() * sizeof(Cents)
+            + _vLive.capacity() + _vIndex.capacity() * sizeof(stIndexSlot) + _Arena.BytesReserved()
+            + _vSearchKeys.capacity() * sizeof(stSearchKeys);
+    }
+
+    // The balance column, one entry per slot (0 for deleted slots).
+    span<const Cents> BalanceColumn() const
+    {
+        return span<const Cents>(_vBalances);
+    }
+
+    // The same column for jobs that change many balances at once.
+    span<Cents> BalanceColumnForUpdate()
+    {
+        return span<Cents>(_vBalances);
+    }
+
+    // One entry per slot: 1 if the client is not deleted, 0 if it is.
+    span<const uint8_t> LiveColumn() const
+    {
+        return span<const uint8_t>(_vLive);
+    }
+
+    // Visits every client that is not deleted, in insertion order.
+    template <typename Visitor>
+    void ForEach(Visitor Visit) const
+    {
+        for (ClientHandle Handle = 0; Handle < _vRecords.size(); Handle++)
+        {
+            if (_vLive[Handle])
+                Visit(Get(Handle));
+        }
+    }
+};
+
+} // namespace
+
+// =============================================================
+//                      Money
+// =============================================================
+
+const Cents MaxMoneyUnits = INT64_MAX / 100 - 1;
+
+// Largest amount ParseMoney reads back, so no balance may go beyond it.
+const Cents MaxMoneyCents = MaxMoneyUnits * 100 + 99;
+
+// Parses "123", "-5.5" or "100.500000" (the old to_string format) into
+// cents. Digits after the second decimal round half away from zero.
+bool ParseMoney(string_view Text, Cents& Amount)
+{
+    bool Negative = false;
+    if (!Text.empty() && (Text[0] == '-' || Text[0] == '+'))
+    {
+        Negative = (Text[0] == '-');
+        Text.remove_prefix(1);
+    }
+
+    size_t Dot = Text.find('.');
+    string_view Whole = Text.substr(0, Dot);
+    string_view Fraction = (Dot == string_view::npos) ? string_view() : Text.substr(Dot + 1);
+    if (Whole.empty() && Fraction.empty())
+        return false;
+
+    Cents Units = 0;
+    if (!Whole.empty())
+    {
+        if (!isdigit((unsigned char)Whole[0]))
+            return false;
+        from_chars_result Result = from_chars(Whole.data(), Whole.data() + Whole.size(), Units);
+        if (Result.ec != errc() || Result.ptr != Whole.data() + Whole.size() || Units > MaxMoneyUnits)
+            return false;
+    }
+
+    Cents Hundredths = 0;
+    for (size_t i = 0; i < Fraction.size(); i++)
+    {
+        if (!isdigit((unsigned char)Fraction[i]))
+            return false;
+        if (i < 2)
+            Hundredths = Hundredths * 10 + (Fraction[i] - '0');
+    }
+    if (Fraction.size() == 1)
+        Hundredths *= 10;
+    if (Fraction.size() > 2 && Fraction[2] >= '5')
+        Hundredths++;
+
+    Amount = Units * 100 + Hundredths;
+    if (Negative)
+        Amount = -Amount;
+    return true;
+}
+
+// Writes Amount as "-1234.05" at Out and returns the end of the text.
+// Out needs room for 24 characters.
+char* FormatMoney(char* Out, Cents Amount)
+{
+    uint64_t Magnitude = (Amount < 0) ? 0 - (uint64_t)Amount : (uint64_t)Amount;
+    if (Amount < 0)
+        *Out++ = '-';
+
+    Out = to_chars(Out, Out + 20, Magnitude / 100).ptr;
+    *Out++ = '.';
+    *Out++ = (char)('0' + Magnitude % 100 / 10);
+    *Out++ = (char)('0' + Magnitude % 10);
+    return Out;
+}
+
+string FormatMoney(Cents Amount)
+{
+    char Buffer[24];
+    return string(Buffer, FormatMoney(Buffer, Amount));
+}
+
+// =============================================================
+//                      Balance Aggregates
+// =============================================================
+
+// Plain loops over the balance column with no branches in the loop body,
+// so the compiler turns them into SIMD code. Deleted slots hold 0 and are
+// masked out with the live column where a 0 would change the answer.
+
+namespace
+{
+
+Cents TotalBalances(span<const Cents> vBalances)
+{
+    Cents Total = 0;
+    for (size_t i = 0; i < vBalances.size(); i++)
+        Total += vBalances[i];
+    return Total;
+}
+
+Cents MinBalance(span<const Cents> vBalances, span<const uint8_t> vLive)
+{
+    Cents Min = INT64_MAX;
+    for (size_t i = 0; i < vBalances.size(); i++)
+    {
+        Cents Value = vLive[i] ? vBalances[i] : INT64_MAX;
+        Min = Value < Min ? Value : Min;
+    }
+    return Min;
+}
+
+Cents MaxBalance(span<const Cents> vBalances, span<const uint8_t> vLive)
+{
+    Cents Max = INT64_MIN;
+    for (size_t i = 0; i < vBalances.size(); i++)
+    {
+        Cents Value = vLive[i] ? vBalances[i] : INT64_MIN;
+        Max = Value > Max ? Value : Max;
+    }
+    return Max;
+}
+
+size_t CountBalancesAbove(span<const Cents> vBalances, span<const uint8_t> vLive, Cents Threshold)
+{
+    size_t Count = 0;
+    for (size_t i = 0; i < vBalances.size(); i++)
+        Count += (size_t)(vLive[i] & (vBalances[i] > Threshold));
+    return Count;
+}
+
+// Counts live balances in BucketCount buckets of BucketWidth cents starting
+// at From. Balances below From land in the first bucket and balances past
+// the last bucket in the last one.
+vector<size_t> BalanceHistogram(span<const Cents> vBalances, span<const uint8_t> vLive,
+    Cents From, Cents BucketWidth, size_t BucketCount)
+{
+    vector<size_t> vBuckets(BucketCount, 0);
+    if (BucketCount == 0 || BucketWidth <= 0)
+        return vBuckets;
+
+    const Cents LastBucket = (Cents)BucketCount - 1;
+    for (size_t i = 0; i < vBalances.size(); i++)
+    {
+        Cents Offset = vBalances[i] < From ? 0 : vBalances[i] - From;
+        Cents Bucket = Offset / BucketWidth;
+        Bucket = Bucket < LastBucket ? Bucket : LastBucket;
+        vBuckets[(size_t)Bucket] += vLive[i];
+    }
+    return vBuckets;
+}
+
+} // namespace
+
+// =============================================================
+//                      String Helper Functions
+// =============================================================
+
+// Splits Line at every Seperator into views of the original text. Empty
+// fields are kept so that a missing value cannot shift the ones after it.
+// Returns the number of fields found, which may exceed MaxFields.
+size_t SplitFields(string_view Line, string_view Seperator, string_view* Fields, size_t MaxFields)
+{
+    size_t Count = 0;
+    size_t pos = 0;
+
+    while (true)
+    {
+        size_t Next = Line.find(Seperator, pos);
+        string_view Field = Line.substr(pos, Next == string_view::npos ? string_view::npos : Next - pos);
+        if (Count < MaxFields)
+            Fields[Count] = Field;
+        Count++;
+
+        if (Next == string_view::npos)
+            return Count;
+        pos = Next + Seperator.length();
+    }
+}
+
+string ConvertRecordToLine(const stClientView& Client, string_view Seperator)
+{
+    string stClientRecord = "";
+    stClientRecord.reserve(Client.AccountNumber.size() + Client.PinCode.size() + Client.Name.size()
+        + Client.Phone.size() + 4 * Seperator.size() + 24);
+    stClientRecord.append(Client.AccountNumber).append(Seperator);
+    stClientRecord.append(Client.PinCode).append(Seperator);
+    stClientRecord.append(Client.Name).append(Seperator);
+    stClientRecord.append(Client.Phone).append(Seperator);
+    stClientRecord += FormatMoney(Client.AccountBalance);
+    return stClientRecord;
+}
+
+// Returns false if the line is not a valid client record. The view points
+// into Line, so nothing is copied.
+bool ConvertLineToRecord(string_view Line, stClientView& Client, string_view Seperator)
+{
+    string_view vFields[5];
+
+    if (SplitFields(Line, Seperator, vFields, 5) != 5 || vFields[0].empty())
+        return false;
+
+    Cents AccountBalance = 0;
+    if (!ParseMoney(vFields[4], AccountBalance))
+        return false;
+
+    Client.AccountNumber = vFields[0];
+    Client.PinCode = vFields[1];
+    Client.Name = vFields[2];
+    Client.Phone = vFields[3];
+    Client.AccountBalance = AccountBalance;
+    return true;
+}
+
+bool ConvertLineToRecord(string_view Line, stClientData& Client, string_view Seperator)
+{
+    stClientView View;
+    if (!ConvertLineToRecord(Line, View, Seperator))
+        return false;
+
+    Client.AccountNumber.assign(View.AccountNumber);
+    Client.PinCode.assign(View.PinCode);
+    Client.Name.assign(View.Name);
+    Client.Phone.assign(View.Phone);
+    Client.AccountBalance = View.AccountBalance;
+    Client.MarkForDelete = false;
+    return true;
+}
+
+// =============================================================
+//                      Statistics
+// =============================================================
+
+atomic<bool> StatsEnabled{ true };
+string StatsFileName = "Clients.stats.json";
+
+const char* const StatsOperationNames[eStatOperationCount] = {
+    "load", "save", "find", "deposit", "withdraw", "journal_write", "report", "journal_sync",
+    "compaction", "accrual", "statement", "replicate"
+};
+
+namespace
+{
+
+size_t StatsBucketOf(uint64_t Nanoseconds)
+{
+    if (Nanoseconds < StatsSubBucketCount)
+        return (size_t)Nanoseconds;
+
+    unsigned HighestBit = (unsigned)bit_width(Nanoseconds) - 1;
+    unsigned Shift = HighestBit - StatsSubBucketBits;
+    return (HighestBit - StatsSubBucketBits + 1) * StatsSubBucketCount
+        + (size_t)((Nanoseconds >> Shift) & (StatsSubBucketCount - 1));
+}
+
+// Smallest value that falls in Bucket. Percentiles report the largest
+// value of their bucket, as HDR histograms do.
+uint64_t StatsBucketFloor(size_t Bucket)
+{
+    if (Bucket < StatsSubBucketCount)
+        return Bucket;
+
+    unsigned HighestBit = (unsigned)(Bucket / StatsSubBucketCount) + StatsSubBucketBits - 1;
+    uint64_t SubBucket = Bucket % StatsSubBucketCount;
+    return (StatsSubBucketCount + SubBucket) << (HighestBit - StatsSubBucketBits);
+}
+
+volatile sig_atomic_t StatsDumpRequested = 0;
+
+} // namespace
+
+void clsOperationStats::Record(uint64_t Nanoseconds)
+{
+    _Count.fetch_add(1, memory_order_relaxed);
+    _TotalNanoseconds.fetch_add(Nanoseconds, memory_order_relaxed);
+    _Buckets[StatsBucketOf(Nanoseconds)].fetch_add(1, memory_order_relaxed);
+
+    uint64_t Max = _MaxNanoseconds.load(memory_order_relaxed);
+    while (Nanoseconds > Max && !_MaxNanoseconds.compare_exchange_weak(Max, Nanoseconds, memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t clsOperationStats::Count() const
+{
+    return _Count.load(memory_order_relaxed);
+}
+
+double clsOperationStats::MeanMicroseconds() const
+{
+    uint64_t Count = this->Count();
+    return Count == 0 ? 0 : _TotalNanoseconds.load(memory_order_relaxed) / 1000.0 / Count;
+}
+
+double clsOperationStats::MaxMicroseconds() const
+{
+    return _MaxNanoseconds.load(memory_order_relaxed) / 1000.0;
+}
+
+double clsOperationStats::PercentileMicroseconds(double Fraction) const
+{
+    uint64_t Count = this->Count();
+    if (Count == 0)
+        return 0;
+
+    uint64_t Wanted = (uint64_t)(Fraction * Count), Seen = 0;
+    for (size_t Bucket = 0; Bucket < StatsBucketCount; Bucket++)
+    {
+        Seen += _Buckets[Bucket].load(memory_order_relaxed);
+        if (Seen > Wanted && Bucket + 1 < StatsBucketCount)
+            return min(StatsBucketFloor(Bucket + 1) - 1, _MaxNanoseconds.load(memory_order_relaxed)) / 1000.0;
+        if (Seen > Wanted)
+            break;
+    }
+    return MaxMicroseconds();
+}
+
+stBankStats BankStats;
+
+bool IsStatsOn()
+{
+    return StatsCompiledIn && StatsEnabled.load(memory_order_relaxed);
+}
+
+void CountBytesRead(uint64_t Bytes)
+{
+    if (IsStatsOn())
+        BankStats.BytesRead.fetch_add(Bytes, memory_order_relaxed);
+}
+
+void CountBytesWritten(uint64_t Bytes)
+{
+    if (IsStatsOn())
+        BankStats.BytesWritten.fetch_add(Bytes, memory_order_relaxed);
+}
+
+void WriteStatsJson(ostream& Out)
+{
+    Out << fixed << setprecision(3);
+    Out << "{\n  \"bytes_read\": " << BankStats.BytesRead.load() << ",\n";
+    Out << "  \"bytes_written\": " << BankStats.BytesWritten.load() << ",\n";
+    Out << "  \"operations\": {";
+    for (int i = 0; i < eStatOperationCount; i++)
+    {
+        const clsOperationStats& Stats = BankStats.Operations[i];
+        Out << (i == 0 ? "\n" : ",\n");
+        Out << "    \"" << StatsOperationNames[i] << "\": {\"count\": " << Stats.Count();
+        Out << ", \"mean_us\": " << Stats.MeanMicroseconds();
+        Out << ", \"p50_us\": " << Stats.PercentileMicroseconds(0.50);
+        Out << ", \"p90_us\": " << Stats.PercentileMicroseconds(0.90);
+        Out << ", \"p99_us\": " << Stats.PercentileMicroseconds(0.99);
+        Out << ", \"max_us\": " << Stats.MaxMicroseconds() << "}";
+    }
+    Out << "\n  }\n}\n";
+}
+
+void DumpStatsToFile()
+{
+    if (!IsStatsOn())
+        return;
+
+    fstream Out;
+    Out.open(StatsFileName, ios::out);
+    if (Out.is_open())
+        WriteStatsJson(Out);
+}
+
+void RequestStatsDump(int)
+{
+    StatsDumpRequested = 1;
+}
+
+void DumpStatsIfRequested()
+{
+    if (StatsDumpRequested)
+    {
+        StatsDumpRequested = 0;
+        DumpStatsToFile();
+    }
+}
+
+// =============================================================
+//                      Snapshot Trailer
+// =============================================================
+
+namespace
+{
+
+// Every save of Clients.txt ends with one trailer line:
+//   @@SNAPSHOT#//#Version#//#RecordCount#//#Crc32
+// The CRC-32 covers every line before the trailer (without a '\r', with its
+// '\n') and the count is the number of non-empty lines. Files without a trailer
+// (older saves, files written by hand) still load, they just cannot be checked.
+const string_view SnapshotTrailerTag = "@@SNAPSHOT";
+
+// Eight tables let UpdateCrc32 take eight bytes per step (slicing-by-8).
+constexpr array<array<uint32_t, 256>, 8> MakeCrc32Tables()
+{
+    array<array<uint32_t, 256>, 8> Tables{};
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t Crc = i;
+        for (int Bit = 0; Bit < 8; Bit++)
+            Crc = (Crc & 1) ? (Crc >> 1) ^ 0xEDB88320u : (Crc >> 1);
+        Tables[0][i] = Crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (size_t t = 1; t < 8; t++)
+            Tables[t][i] = (Tables[t - 1][i] >> 8) ^ Tables[0][Tables[t - 1][i] & 0xFF];
+    return Tables;
+}
+
+constexpr array<array<uint32_t, 256>, 8> Crc32Tables = MakeCrc32Tables();
+
+// Continues a CRC-32 (the zip/PNG one) over Data. Start with Crc = 0.
+uint32_t UpdateCrc32(uint32_t Crc, string_view Data)
+{
+    const unsigned char* Byte = (const unsigned char*)Data.data();
+    size_t Size = Data.size();
+
+    Crc = ~Crc;
+    for (; Size >= 8; Size -= 8, Byte += 8)
+    {
+        uint32_t Low = Crc ^ (Byte[0] | Byte[1] << 8 | Byte[2] << 16 | (uint32_t)Byte[3] << 24);
+        Crc = Crc32Tables[7][Low & 0xFF] ^ Crc32Tables[6][(Low >> 8) & 0xFF]
+            ^ Crc32Tables[5][(Low >> 16) & 0xFF] ^ Crc32Tables[4][Low >> 24]
+            ^ Crc32Tables[3][Byte[4]] ^ Crc32Tables[2][Byte[5]]
+            ^ Crc32Tables[1][Byte[6]] ^ Crc32Tables[0][Byte[7]];
+    }
+    for (; Size > 0; Size--, Byte++)
+        Crc = Crc32Tables[0][(Crc ^ *Byte) & 0xFF] ^ (Crc >> 8);
+    return ~Crc;
+}
+
+struct stSnapshotTrailer
+{
+    uint64_t Version = 0;
+    size_t RecordCount = 0;
+    uint32_t Crc = 0;
+};
+
+bool IsSnapshotTrailer(string_view Line)
+{
+    return StartsWith(Line, SnapshotTrailerTag);
+}
+
+string ConvertSnapshotTrailerToLine(const stSnapshotTrailer& Trailer, string_view Seperator = "#//#")
+{
+    char Crc[9];
+    snprintf(Crc, sizeof(Crc), "%08x", Trailer.Crc);
+    string Line(SnapshotTrailerTag);
+    Line.append(Seperator).append(to_string(Trailer.Version));
+    Line.append(Seperator).append(to_string(Trailer.RecordCount));
+    Line.append(Seperator).append(Crc);
+    return Line;
+}
+
+bool ConvertLineToSnapshotTrailer(string_view Line, stSnapshotTrailer& Trailer, string_view Seperator = "#//#")
+{
+    string_view vFields[4];
+    if (SplitFields(Line, Seperator, vFields, 4) != 4 || vFields[0] != SnapshotTrailerTag)
+        return false;
+
+    auto ParseNumber = [](string_view Text, auto& Number, int Base)
+        {
+            from_chars_result Result = from_chars(Text.data(), Text.data() + Text.size(), Number, Base);
+            return !Text.empty() && Result.ec == errc() && Result.ptr == Text.data() + Text.size();
+        };
+    return ParseNumber(vFields[1], Trailer.Version, 10)
+        && ParseNumber(vFields[2], Trailer.RecordCount, 10)
+        && ParseNumber(vFields[3], Trailer.Crc, 16);
+}
+
+// What a loader found out about the trailer of the file it read.
+struct stSnapshotStatus
+{
+    bool Found = false;         // The file could be opened
+    bool HasTrailer = false;
+    bool Intact = true;         // False if the checksum or the record count does not match
+    uint64_t Version = 0;
+};
+
+// Checks a trailer line against the CRC and the number of record lines
+// that came before it.
+void CheckSnapshotTrailer(string_view Line, uint32_t Crc, size_t RecordLines, stSnapshotStatus& Status)
+{
+    stSnapshotTrailer Trailer;
+    Status.HasTrailer = true;
+    Status.Intact = ConvertLineToSnapshotTrailer(Line, Trailer)
+        && Trailer.Crc == Crc && Trailer.RecordCount == RecordLines;
+    Status.Version = Trailer.Version;
+}
+
+// Makes sure what was written to File is on the disk, not only in caches.
+bool SyncFile(FILE* File)
+{
+    if (fflush(File) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(File)) == 0;
+#else
+    return fsync(fileno(File)) == 0;
+#endif
+}
+
+// After a rename the directory entry itself must reach the disk too.
+void SyncDirectoryOf(const string& FileName)
+{
+#ifndef _WIN32
+    string Folder = filesystem::path(FileName).parent_path().string();
+    int Directory = open(Folder.empty() ? "." : Folder.c_str(), O_RDONLY);
+    if (Directory >= 0)
+    {
+        fsync(Directory);
+        close(Directory);
+    }
+#else
+    (void)FileName;
+#endif
+}
+
+// Puts TempFileName in place of FileName in one atomic rename. The file it
+// replaces stays reachable as PreviousFileName (a hard link, so nothing is
+// copied), and at every moment FileName is either the old or the new file.
+bool ReplaceFileAtomically(const string& TempFileName, const string& FileName, const string& PreviousFileName)
+{
+    error_code Error;
+    if (filesystem::exists(FileName, Error))
+    {
+        filesystem::remove(PreviousFileName, Error);
+        filesystem::create_hard_link(FileName, PreviousFileName, Error);
+        if (Error)
+            filesystem::copy_file(FileName, PreviousFileName, Error); // File systems without hard links
+    }
+
+    filesystem::rename(TempFileName, FileName, Error);
+    if (Error)
+        return false;
+
+    SyncDirectoryOf(FileName);
+    return true;
+}
+
+// =============================================================
+//                      File I/O Functions
+// =============================================================
+
+// Malformed lines and repeated account numbers are skipped and reported
+// in vErrors with their line numbers. Status tells whether the file ends
+// with a snapshot trailer and whether its records still match it.
+clsClientStore LoadClientsDataFromFile(string FileName, vector<stFileLoadError>& vErrors, stSnapshotStatus& Status)
+{
+    clsClientStore Clients;
+    stClientView Client;
+    ClientHandle Handle;
+    uint32_t Crc = 0;
+    size_t RecordLines = 0;
+
+    Status = stSnapshotStatus();
+    Status.Found = ForEachLineInFile(FileName, [&](string_view Line, size_t LineNumber, bool HasNewline)
+        {
+            if (IsSnapshotTrailer(Line))
+            {
+                CheckSnapshotTrailer(Line, Crc, RecordLines, Status);
+                return;
+            }
+            if (Line.empty()) // Avoid empty lines
+            {
+                Crc = UpdateCrc32(Crc, HasNewline ? "\n" : "");
+                return;
+            }
+            if (Status.HasTrailer)
+                Status.Intact = false; // Records after the trailer are not covered by it
+
+            Crc = UpdateCrc32(UpdateCrc32(Crc, Line), HasNewline ? "\n" : "");
+            RecordLines++;
+
+            if (!ConvertLineToRecord(Line, Client))
+                vErrors.push_back({ LineNumber, "malformed client record" });
+            else if (!Clients.Add(Client, Handle)) // First record wins if an account number repeats
+                vErrors.push_back({ LineNumber, "duplicate account number " + string(Client.AccountNumber) });
+        });
+    return Clients;
+}
+
+// What one loader thread made of its byte range of Clients.txt. The
+// clients point into the file buffer, which outlives the chunk. Line
+// numbers are relative to the start of the range.
+struct stClientsFileChunk
+{
+    vector<stClientView> vClients;
+    vector<size_t> vLineNumbers;
+    vector<stFileLoadError> vErrors;
+    size_t LineCount = 0;
+};
+
+void ParseClientsFileChunk(string_view Text, stClientsFileChunk& Chunk)
+{
+    stClientView Client;
+    size_t Start = 0;
+
+    while (Start < Text.size())
+    {
+        size_t End = Text.find('\n', Start);
+        if (End == string_view::npos)
+            End = Text.size();
+
+        string_view Line = Text.substr(Start, End - Start);
+        if (!Line.empty() && Line.back() == '\r')
+            Line.remove_suffix(1);
+        Chunk.LineCount++;
+        Start = End + 1;
+
+        if (Line.empty() || IsSnapshotTrailer(Line))
+            continue;
+
+        if (ConvertLineToRecord(Line, Client))
+        {
+            Chunk.vClients.push_back(Client);
+            Chunk.vLineNumbers.push_back(Chunk.LineCount);
+        }
+        else
+            Chunk.vErrors.push_back({ Chunk.LineCount, "malformed client record" });
+    }
+}
+
+// Reads Clients.txt in one go, cuts it into ThreadCount byte ranges that
+// end on a newline and parses the ranges on separate threads. The parsed
+// ranges are then added to the store in file order, so the result (which
+// record wins on a repeated account number, the reported line numbers)
+// is the same as with LoadClientsDataFromFile. The snapshot trailer is
+// checked on one more thread while the ranges are parsed.
+clsClientStore LoadClientsDataFromFileParallel(string FileName, unsigned ThreadCount, vector<stFileLoadError>& vErrors,
+    stSnapshotStatus& Status)
+{
+    clsClientStore Clients;
+    vector<char> Buffer;
+
+    Status = stSnapshotStatus();
+    FILE* MyFile = fopen(FileName.c_str(), "rb");
+    if (MyFile == nullptr)
+    {
+        Status.Found = false;
+        return Clients;
+    }
+    Status.Found = true;
+
+    // 64-bit size, ftell returns a 32-bit long on Windows
+    error_code SizeError;
+    uint64_t FileSize = filesystem::file_size(FileName, SizeError);
+    if (!SizeError && FileSize > 0)
+    {
+        Buffer.resize((size_t)FileSize);
+        Buffer.resize(fread(Buffer.data(), 1, Buffer.size(), MyFile));
+        CountBytesRead(Buffer.size());
+    }
+    fclose(MyFile);
+
+    string_view Text(Buffer.data(), Buffer.size());
+    vector<string_view> vRanges;
+    size_t Start = 0;
+
+    for (unsigned i = 1; i <= ThreadCount && Start < Text.size(); i++)
+    {
+        size_t End = (i == ThreadCount) ? Text.size() : Text.size() / ThreadCount * i;
+        if (End < Start)
+            End = Start;
+        End = Text.find('\n', End);
+        End = (End == string_view::npos) ? Text.size() : End + 1;
+        vRanges.push_back(Text.substr(Start, End - Start));
+        Start = End;
+    }
+
+    // The trailer is the last line that starts with its tag
+    size_t TrailerStart = StartsWith(Text, SnapshotTrailerTag) ? 0 : Text.rfind("\n" + string(SnapshotTrailerTag));
+    if (TrailerStart != string_view::npos && TrailerStart > 0)
+        TrailerStart++;
+
+    vector<stClientsFileChunk> vChunks(vRanges.size());
+    vector<thread> vThreads;
+    for (size_t i = 0; i < vRanges.size(); i++)
+        vThreads.emplace_back(ParseClientsFileChunk, vRanges[i], ref(vChunks[i]));
+
+    if (TrailerStart != string_view::npos)
+        vThreads.emplace_back([&]()
+            {
+                string_view Covered = Text.substr(0, TrailerStart);
+                size_t TrailerEnd = Text.find('\n', TrailerStart);
+                string_view Trailer = Text.substr(TrailerStart, TrailerEnd - TrailerStart);
+                if (!Trailer.empty() && Trailer.back() == '\r')
+                    Trailer.remove_suffix(1);
+
+                // Same bytes as the line by line loader sums up: lines
+                // without their '\r', each followed by '\n'
+                uint32_t Crc = 0;
+                size_t RecordLines = 0;
+                for (size_t Start = 0; Start < Covered.size();)
+                {
+                    size_t End = Covered.find('\n', Start);
+                    string_view Line = Covered.substr(Start, End - Start);
+                    if (!Line.empty() && Line.back() == '\r')
+                        Line.remove_suffix(1);
+                    if (!Line.empty())
+                        RecordLines++;
+                    Crc = UpdateCrc32(UpdateCrc32(Crc, Line), "\n");
+                    Start = End + 1;
+                }
+                CheckSnapshotTrailer(Trailer, Crc, RecordLines, Status);
+
+                // Records after the trailer are not covered by it
+                if (TrailerEnd != string_view::npos
+                    && Text.find_first_not_of("\r\n", TrailerEnd) != string_view::npos)
+                    Status.Intact = false;
+            });
+
+    for (thread& T : vThreads)
+        T.join();
+
+    size_t TotalClients = 0;
+    for (const stClientsFileChunk& Chunk : vChunks)
+        TotalClients += Chunk.vClients.size();
+    Clients.Reserve(TotalClients);
+
+    size_t FirstLineNumber = 0;
+    ClientHandle Handle;
+    for (stClientsFileChunk& Chunk : vChunks)
+    {
+        for (stFileLoadError& Error : Chunk.vErrors)
+            Error.LineNumber += FirstLineNumber;
+
+        for (size_t i = 0; i < Chunk.vClients.size(); i++)
+        {
+            if (!Clients.Add(Chunk.vClients[i], Handle))
+                Chunk.vErrors.push_back({ FirstLineNumber + Chunk.vLineNumbers[i],
+                    "duplicate account number " + string(Chunk.vClients[i].AccountNumber) });
+        }
+
+        // Keep the errors of a range in line order
+        sort(Chunk.vErrors.begin(), Chunk.vErrors.end(),
+            [](const stFileLoadError& A, const stFileLoadError& B) { return A.LineNumber < B.LineNumber; });
+        vErrors.insert(vErrors.end(), Chunk.vErrors.begin(), Chunk.vErrors.end());
+        FirstLineNumber += Chunk.LineCount;
+
+        Chunk = stClientsFileChunk(); // Free the parsed range right away
+    }
+    return Clients;
+}
+
+string PreviousSnapshotFileName(const string& FileName)
+{
+    return FileName + ".prev";
+}
+
+// Writes the book to FileName.tmp, makes sure it is on the disk and only
+// then renames it over FileName. A crash at any point leaves either the old
+// or the new snapshot, never a half written one. The replaced snapshot is
+// kept as FileName.prev for LoadClientsData to fall back on. Version goes
+// into the trailer.
+bool SaveClientsDataToFile(string FileName, const clsClientStore& Clients, uint64_t Version)
+{
+    clsStatsTimer Timer(eStatSave);
+    string TempFileName = FileName + ".tmp";
+    FILE* MyFile = fopen(TempFileName.c_str(), "wb");
+    if (MyFile == nullptr)
+        return false;
+
+    vector<char> Buffer(FileReadBlockSize);
+    setvbuf(MyFile, Buffer.data(), _IOFBF, Buffer.size());
+
+    stSnapshotTrailer Trailer;
+    uint64_t BytesWritten = 0;
+    bool Written = true;
+    Clients.ForEach([&](const stClientView& C)
+        {
+            string Line = ConvertRecordToLine(C);
+            Line += '\n';
+            Trailer.Crc = UpdateCrc32(Trailer.Crc, Line);
+            Trailer.RecordCount++;
+            Written = Written && fwrite(Line.data(), 1, Line.size(), MyFile) == Line.size();
+            BytesWritten += Line.size();
+        });
+
+    Trailer.Version = Version;
+    string Line = ConvertSnapshotTrailerToLine(Trailer) + '\n';
+    Written = Written && fwrite(Line.data(), 1, Line.size(), MyFile) == Line.size();
+    BytesWritten += Line.size();
+
+    Written = SyncFile(MyFile) && Written;
+    Written = (fclose(MyFile) == 0) && Written;
+    CountBytesWritten(BytesWritten);
+
+    if (!Written || !ReplaceFileAtomically(TempFileName, FileName, PreviousSnapshotFileName(FileName)))
+    {
+        remove(TempFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// =============================================================
+//                      Columnar Snapshot
+// =============================================================
+
+// Clients.col keeps the same book as Clients.txt one column at a time
+// instead of one line per client:
+//   header | account numbers | PIN codes | names | phones | balances
+// Every column starts with its length in bytes as a varint and lists the
+// clients in account number order, so neighbouring values share the most. The CRC-32 in the header covers all the columns
+// and then the header itself, taken with its Crc set to 0.
+// Header numbers are in the byte order of the machine that wrote the file,
+// column bytes are the same on every machine.
+struct stColumnarHeader
+{
+    char Magic[8];          // "BANKCOL\0"
+    uint32_t FormatVersion;
+    uint32_t Crc;
+    uint64_t ClientCount;
+    uint64_t Version;       // Snapshot version, as in the Clients.txt trailer
+    uint64_t ColumnBytes;
+    char Reserved[24];
+};
+
+static_assert(sizeof(stColumnarHeader) == 64, "Columnar header layout changed");
+
+const char ColumnarFileMagic[8] = { 'B', 'A', 'N', 'K', 'C', 'O', 'L', '\0' };
+const uint32_t ColumnarFileVersion = 1;
+
+uint32_t ColumnarFileCrc(stColumnarHeader Header, string_view Columns)
+{
+    Header.Crc = 0;
+    return UpdateCrc32(UpdateCrc32(0, Columns), string_view((const char*)&Header, sizeof(Header)));
+}
+
+// Numbers are packed in frames of this many values.
+const size_t ColumnarFrameSize = 128;
+
+// Longest digit run kept as a number, so 10^Width still fits an int64_t.
+const size_t MaxColumnarDigits = 18;
+
+// First byte of a text column.
+enum enColumnEncoding : uint8_t {
+    eColumnDigits = 1,      // A common prefix and a fixed number of digits, kept as numbers
+    eColumnDictionary = 2,  // Every distinct value once, then the index of each value
+    eColumnFrontCoded = 3   // Length shared with the value before, then the rest
+};
+
+void AppendVarint(string& Out, uint64_t Value)
+{
+    for (; Value >= 0x80; Value >>= 7)
+        Out += (char)(Value | 0x80);
+    Out += (char)Value;
+}
+
+uint64_t ZigZag(int64_t Value)
+{
+    return ((uint64_t)Value << 1) ^ (uint64_t)(Value >> 63);
+}
+
+int64_t UnZigZag(uint64_t Value)
+{
+    return (int64_t)(Value >> 1) ^ -(int64_t)(Value & 1);
+}
+
+// Appends Count values of Width bits each (0 to 64), lowest bit first.
+void AppendBitPacked(string& Out, const uint64_t* Values, size_t Count, unsigned Width)
+{
+    uint64_t Buffer = 0;
+    unsigned Bits = 0; // Always below 8 between values
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        uint64_t Value = Values[i];
+        for (unsigned Left = Width; Left > 0;)
+        {
+            unsigned Take = min(Left, 56u);
+            Buffer |= (Value & ((1ull << Take) - 1)) << Bits;
+            Value >>= Take;
+            Bits += Take;
+            Left -= Take;
+            for (; Bits >= 8; Bits -= 8, Buffer >>= 8)
+                Out += (char)Buffer;
+        }
+    }
+    if (Bits > 0)
+        Out += (char)Buffer;
+}
+
+// Frames of ColumnarFrameSize values. A frame starts with one byte: the bit
+// width of its values, plus 0x80 if they are zigzag differences from the
+// value before each of them. Otherwise they are offsets from the smallest
+// value of the frame, which follows as a zigzag varint. The packed values
+// come last. Whichever of the two is narrower is written.
+void AppendIntegerFrames(string& Out, span<const int64_t> vValues)
+{
+    uint64_t Offsets[ColumnarFrameSize], Deltas[ColumnarFrameSize];
+    int64_t Previous = 0;
+
+    for (size_t Start = 0; Start < vValues.size(); Start += ColumnarFrameSize)
+    {
+        size_t Count = min(ColumnarFrameSize, vValues.size() - Start);
+        const int64_t* Frame = vValues.data() + Start;
+        int64_t Min = *min_element(Frame, Frame + Count);
+        uint64_t OffsetBits = 0, DeltaBits = 0;
+
+        for (size_t i = 0; i < Count; i++)
+        {
+            Offsets[i] = (uint64_t)Frame[i] - (uint64_t)Min;
+            Deltas[i] = ZigZag((int64_t)((uint64_t)Frame[i] - (uint64_t)Previous));
+            OffsetBits |= Offsets[i];
+            DeltaBits |= Deltas[i];
+            Previous = Frame[i];
+        }
+
+        unsigned OffsetWidth = (unsigned)bit_width(OffsetBits), DeltaWidth = (unsigned)bit_width(DeltaBits);
+        if (DeltaWidth < OffsetWidth)
+        {
+            Out += (char)(0x80 | DeltaWidth);
+            AppendBitPacked(Out, Deltas, Count, DeltaWidth);
+        }
+        else
+        {
+            Out += (char)OffsetWidth;
+            AppendVarint(Out, ZigZag(Min));
+            AppendBitPacked(Out, Offsets, Count, OffsetWidth);
+        }
+    }
+}
+
+// Splits Text into what comes before its trailing digits and the digits.
+void SplitTrailingDigits(string_view Text, string_view& Prefix, string_view& Digits)
+{
+    size_t End = Text.size();
+    while (End > 0 && Text[End - 1] >= '0' && Text[End - 1] <= '9')
+        End--;
+    Prefix = Text.substr(0, End);
+    Digits = Text.substr(End);
+}
+
+// Empty values are written as -1. Returns false if some value is not the
+// same prefix followed by the same number of digits.
+bool AppendDigitsColumn(string& Out, span<const string_view> vValues)
+{
+    string_view Prefix, Digits;
+    size_t Width = 0;
+    vector<int64_t> vNumbers(vValues.size());
+
+    for (size_t i = 0; i < vValues.size(); i++)
+    {
+        if (vValues[i].empty())
+        {
+            vNumbers[i] = -1;
+            continue;
+        }
+
+        string_view ValuePrefix, ValueDigits;
+        SplitTrailingDigits(vValues[i], ValuePrefix, ValueDigits);
+        if (Width == 0)
+        {
+            Prefix = ValuePrefix;
+            Width = ValueDigits.size();
+            if (Width == 0 || Width > MaxColumnarDigits)
+                return false;
+        }
+        if (ValuePrefix != Prefix || ValueDigits.size() != Width)
+            return false;
+        from_chars(ValueDigits.data(), ValueDigits.data() + Width, vNumbers[i]);
+    }
+    if (Width == 0)
+        return false;
+
+    Out += (char)eColumnDigits;
+    AppendVarint(Out, Prefix.size());
+    Out.append(Prefix);
+    Out += (char)Width;
+    AppendIntegerFrames(Out, vNumbers);
+    return true;
+}
+
+// Returns false if the values do not repeat enough to be worth it.
+bool AppendDictionaryColumn(string& Out, span<const string_view> vValues)
+{
+    unordered_map<string_view, int64_t> Indexes;
+    vector<string_view> vDistinct;
+    vector<int64_t> vIndexes(vValues.size());
+
+    for (size_t i = 0; i < vValues.size(); i++)
+    {
+        auto [Entry, IsNew] = Indexes.try_emplace(vValues[i], (int64_t)vDistinct.size());
+        if (IsNew)
+        {
+            vDistinct.push_back(vValues[i]);
+            if (vDistinct.size() * 2 > vValues.size() + 64)
+                return false;
+        }
+        vIndexes[i] = Entry->second;
+    }
+
+    Out += (char)eColumnDictionary;
+    AppendVarint(Out, vDistinct.size());
+    for (string_view Value : vDistinct)
+    {
+        AppendVarint(Out, Value.size());
+        Out.append(Value);
+    }
+    AppendIntegerFrames(Out, vIndexes);
+    return true;
+}
+
+void AppendFrontCodedColumn(string& Out, span<const string_view> vValues)
+{
+    string_view Previous;
+    Out += (char)eColumnFrontCoded;
+    for (string_view Value : vValues)
+    {
+        size_t Shared = mismatch(Value.begin(), Value.end(), Previous.begin(), Previous.end()).first - Value.begin();
+        AppendVarint(Out, Shared);
+        AppendVarint(Out, Value.size() - Shared);
+        Out.append(Value.substr(Shared));
+        Previous = Value;
+    }
+}
+
+// Tries every encoding that applies and appends the smallest one.
+void AppendTextColumn(string& Out, span<const string_view> vValues)
+{
+    string Best, Candidate;
+    AppendFrontCodedColumn(Best, vValues);
+    if (AppendDigitsColumn(Candidate, vValues) && Candidate.size() < Best.size())
+        Best.swap(Candidate);
+    Candidate.clear();
+    if (AppendDictionaryColumn(Candidate, vValues) && Candidate.size() < Best.size())
+        Best.swap(Candidate);
+
+    AppendVarint(Out, Best.size());
+    Out.append(Best);
+}
+
+// Reads the bytes of one column. Every read checks the end of the column,
+// so a damaged file makes a read fail instead of running past the buffer.
+class clsColumnBytes
+{
+private:
+    const unsigned char* _Data = nullptr;
+    size_t _Size = 0;
+    size_t _Position = 0;
+
+public:
+    clsColumnBytes() = default;
+
+    clsColumnBytes(string_view Bytes) : _Data((const unsigned char*)Bytes.data()), _Size(Bytes.size())
+    {
+    }
+
+    bool AtEnd() const
+    {
+        return _Position == _Size;
+    }
+
+    bool ReadByte(uint8_t& Value)
+    {
+        if (_Position >= _Size)
+            return false;
+        Value = _Data[_Position++];
+        return true;
+    }
+
+    bool ReadVarint(uint64_t& Value)
+    {
+        Value = 0;
+        for (unsigned Shift = 0; Shift < 64; Shift += 7)
+        {
+            if (_Position >= _Size)
+                return false;
+            uint8_t Byte = _Data[_Position++];
+            Value |= (uint64_t)(Byte & 0x7F) << Shift;
+            if ((Byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool ReadText(size_t Length, string_view& Text)
+    {
+        if (Length > _Size - _Position)
+            return false;
+        Text = string_view((const char*)_Data + _Position, Length);
+        _Position += Length;
+        return true;
+    }
+
+    // Unpacks what AppendBitPacked wrote.
+    bool ReadBitPacked(uint64_t* Values, size_t Count, unsigned Width)
+    {
+        size_t Bytes = (Count * Width + 7) / 8;
+        if (Width > 64 || Bytes > _Size - _Position)
+            return false;
+
+        const unsigned char* Data = _Data + _Position;
+        uint64_t Mask = (Width == 64) ? ~0ull : (1ull << Width) - 1;
+        for (size_t i = 0, Bit = 0; i < Count; i++, Bit += Width)
+        {
+            size_t Byte = Bit / 8;
+            unsigned Shift = Bit % 8;
+            size_t Available = min<size_t>(8, Bytes - Byte);
+            uint64_t Word = 0;
+            if constexpr (endian::native == endian::little)
+                memcpy(&Word, Data + Byte, Available);
+            else
+                for (size_t b = Available; b > 0; b--)
+                    Word = Word << 8 | Data[Byte + b - 1];
+
+            uint64_t Value = Word >> Shift;
+            if (Shift + Width > 64)
+                Value |= (uint64_t)Data[Byte + 8] << (64 - Shift);
+            Values[i] = Value & Mask;
+        }
+        _Position += Bytes;
+        return true;
+    }
+};
+
+// Reads back the values of AppendIntegerFrames one at a time.
+class clsIntegerFrameReader
+{
+private:
+    clsColumnBytes _Bytes;
+    size_t _Left = 0;       // Values not yet unpacked
+    int64_t _Previous = 0;
+    uint64_t _Frame[ColumnarFrameSize];
+    size_t _Next = 0;
+    size_t _Count = 0;
+
+    bool _ReadFrame()
+    {
+        uint8_t Header = 0;
+        if (_Left == 0 || !_Bytes.ReadByte(Header))
+            return false;
+
+        _Count = min(ColumnarFrameSize, _Left);
+        _Next = 0;
+        _Left -= _Count;
+
+        uint64_t Min = 0;
+        bool IsDelta = (Header & 0x80) != 0;
+        if (!IsDelta && !_Bytes.ReadVarint(Min))
+            return false;
+        if (!_Bytes.ReadBitPacked(_Frame, _Count, Header & 0x7F))
+            return false;
+
+        for (size_t i = 0; i < _Count; i++)
+        {
+            if (IsDelta)
+                _Previous = (int64_t)((uint64_t)_Previous + (uint64_t)UnZigZag(_Frame[i]));
+            else
+                _Previous = (int64_t)((uint64_t)UnZigZag(Min) + _Frame[i]);
+            _Frame[i] = (uint64_t)_Previous;
+        }
+        return true;
+    }
+
+public:
+    void Open(clsColumnBytes Bytes, size_t Count)
+    {
+        _Bytes = Bytes;
+        _Left = Count;
+        _Previous = 0;
+        _Next = _Count = 0;
+    }
+
+    bool Next(int64_t& Value)
+    {
+        if (_Next == _Count && !_ReadFrame())
+            return false;
+        Value = (int64_t)_Frame[_Next++];
+        return true;
+    }
+
+    const clsColumnBytes& Bytes() const
+    {
+        return _Bytes;
+    }
+};
+
+// Reads back a column of AppendTextColumn one value at a time. A value
+// stays valid until the next call to Next.
+class clsTextColumnReader
+{
+private:
+    enColumnEncoding _Encoding = eColumnFrontCoded;
+    clsColumnBytes _Bytes;
+    clsIntegerFrameReader _Numbers;
+    vector<string_view> _vDictionary;
+    string _Value;
+    size_t _Width = 0;
+    int64_t _Limit = 0;     // 10^_Width
+
+public:
+    bool Open(clsColumnBytes Bytes, size_t Count)
+    {
+        uint8_t Encoding = 0;
+        _Bytes = Bytes;
+        if (!_Bytes.ReadByte(Encoding))
+            return false;
+        _Encoding = (enColumnEncoding)Encoding;
+        _Value.clear();
+
+        if (_Encoding == eColumnDigits)
+        {
+            uint64_t PrefixLength = 0;
+            string_view Prefix;
+            uint8_t Width = 0;
+            if (!_Bytes.ReadVarint(PrefixLength) || !_Bytes.ReadText(PrefixLength, Prefix)
+                || !_Bytes.ReadByte(Width) || Width == 0 || Width > MaxColumnarDigits)
+                return false;
+            _Width = Width;
+            _Value = string(Prefix) + string(_Width, '0');
+            _Limit = 1;
+            for (size_t i = 0; i < _Width; i++)
+                _Limit *= 10;
+            _Numbers.Open(_Bytes, Count);
+            return true;
+        }
+        if (_Encoding == eColumnDictionary)
+        {
+            uint64_t DistinctCount = 0, Length = 0;
+            if (!_Bytes.ReadVarint(DistinctCount) || DistinctCount > Count + 64)
+                return false;
+            _vDictionary.resize(DistinctCount);
+            for (string_view& Value : _vDictionary)
+            {
+                if (!_Bytes.ReadVarint(Length) || !_Bytes.ReadText(Length, Value))
+                    return false;
+            }
+            _Numbers.Open(_Bytes, Count);
+            return true;
+        }
+        return _Encoding == eColumnFrontCoded;
+    }
+
+    bool Next(string_view& Value)
+    {
+        int64_t Number = 0;
+        if (_Encoding == eColumnDigits)
+        {
+            if (!_Numbers.Next(Number) || Number < -1 || Number >= _Limit)
+                return false;
+            if (Number == -1)
+            {
+                Value = string_view();
+                return true;
+            }
+
+            // _Value is the prefix and _Width digits, the digits are replaced
+            for (size_t i = _Value.size(); i > _Value.size() - _Width; i--, Number /= 10)
+                _Value[i - 1] = (char)('0' + Number % 10);
+            Value = _Value;
+            return true;
+        }
+        if (_Encoding == eColumnDictionary)
+        {
+            if (!_Numbers.Next(Number) || Number < 0 || (uint64_t)Number >= _vDictionary.size())
+                return false;
+            Value = _vDictionary[Number];
+            return true;
+        }
+
+        uint64_t Shared = 0, Length = 0;
+        string_view Rest;
+        if (!_Bytes.ReadVarint(Shared) || Shared > _Value.size()
+            || !_Bytes.ReadVarint(Length) || !_Bytes.ReadText(Length, Rest))
+            return false;
+        _Value.resize(Shared);
+        _Value.append(Rest);
+        Value = _Value;
+        return true;
+    }
+};
+
+// Writes the book to FileName.tmp and renames it over FileName, keeping
+// the replaced file as FileName.prev, like SaveClientsDataToFile.
+bool SaveClientsDataToColumnarFile(string FileName, const clsClientStore& Clients, uint64_t Version)
+{
+    clsStatsTimer Timer(eStatSave);
+
+    vector<string_view> vAccountNumbers, vPinCodes, vNames, vPhones;
+    vector<Cents> vBalances;
+    vAccountNumbers.reserve(Clients.Size());
+    vPinCodes.reserve(Clients.Size());
+    vNames.reserve(Clients.Size());
+    vPhones.reserve(Clients.Size());
+    vBalances.reserve(Clients.Size());
+
+    // Rows go out sorted by account number; vOrder carries the other
+    // columns along with them
+    vector<ClientHandle> vOrder;
+    vOrder.reserve(Clients.Size());
+    span<const uint8_t> vLive = Clients.LiveColumn();
+    for (ClientHandle Handle = 0; Handle < vLive.size(); Handle++)
+    {
+        if (vLive[Handle])
+            vOrder.push_back(Handle);
+    }
+    sort(vOrder.begin(), vOrder.end(), [&](ClientHandle A, ClientHandle B)
+        {
+            return Clients.Get(A).AccountNumber < Clients.Get(B).AccountNumber;
+        });
+    for (ClientHandle Handle : vOrder)
+    {
+        stClientView C = Clients.Get(Handle);
+        vAccountNumbers.push_back(C.AccountNumber);
+        vPinCodes.push_back(C.PinCode);
+        vNames.push_back(C.Name);
+        vPhones.push_back(C.Phone);
+        vBalances.push_back(C.AccountBalance);
+    }
+
+    // The columns do not depend on each other, so each is encoded on its own thread
+    string Columns[5];
+    {
+        thread Encoders[] = {
+            thread([&]() { AppendTextColumn(Columns[0], vAccountNumbers); }),
+            thread([&]() { AppendTextColumn(Columns[1], vPinCodes); }),
+            thread([&]() { AppendTextColumn(Columns[2], vNames); }),
+            thread([&]() { AppendTextColumn(Columns[3], vPhones); })
+        };
+        string Balances;
+        AppendIntegerFrames(Balances, vBalances);
+        AppendVarint(Columns[4], Balances.size());
+        Columns[4].append(Balances);
+        for (thread& T : Encoders)
+            T.join();
+    }
+
+    stColumnarHeader Header{};
+    memcpy(Header.Magic, ColumnarFileMagic, sizeof(Header.Magic));
+    Header.FormatVersion = ColumnarFileVersion;
+    Header.ClientCount = vBalances.size();
+    Header.Version = Version;
+    uint32_t ColumnsCrc = 0;
+    for (const string& Column : Columns)
+    {
+        ColumnsCrc = UpdateCrc32(ColumnsCrc, Column);
+        Header.ColumnBytes += Column.size();
+    }
+    Header.Crc = UpdateCrc32(ColumnsCrc, string_view((const char*)&Header, sizeof(Header)));
+
+    string TempFileName = FileName + ".tmp";
+    FILE* MyFile = fopen(TempFileName.c_str(), "wb");
+    if (MyFile == nullptr)
+        return false;
+
+    bool Written = fwrite(&Header, sizeof(Header), 1, MyFile) == 1;
+    for (const string& Column : Columns)
+        Written = Written && fwrite(Column.data(), 1, Column.size(), MyFile) == Column.size();
+    Written = SyncFile(MyFile) && Written;
+    Written = (fclose(MyFile) == 0) && Written;
+    CountBytesWritten(sizeof(Header) + Header.ColumnBytes);
+
+    if (!Written || !ReplaceFileAtomically(TempFileName, FileName, PreviousSnapshotFileName(FileName)))
+    {
+        remove(TempFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Decodes the columns side by side, one client at a time, straight into
+// the store. Status works as for Clients.txt: a header or checksum that
+// does not match makes the file not intact, and whatever could still be
+// decoded is loaded.
+clsClientStore LoadClientsDataFromColumnarFile(string FileName, vector<stFileLoadError>& vErrors, stSnapshotStatus& Status)
+{
+    clsClientStore Clients;
+    vector<char> Buffer;
+
+    Status = stSnapshotStatus();
+    FILE* MyFile = fopen(FileName.c_str(), "rb");
+    if (MyFile == nullptr)
+    {
+        Status.Found = false;
+        return Clients;
+    }
+    Status.Found = true;
+
+    // 64-bit size, ftell returns a 32-bit long on Windows
+    error_code SizeError;
+    uint64_t FileSize = filesystem::file_size(FileName, SizeError);
+    if (!SizeError && FileSize > 0)
+    {
+        Buffer.resize((size_t)FileSize);
+        Buffer.resize(fread(Buffer.data(), 1, Buffer.size(), MyFile));
+        CountBytesRead(Buffer.size());
+    }
+    fclose(MyFile);
+
+    stColumnarHeader Header{};
+    if (Buffer.size() < sizeof(Header)
+        || (memcpy(&Header, Buffer.data(), sizeof(Header)), memcmp(Header.Magic, ColumnarFileMagic, sizeof(Header.Magic)) != 0)
+        || Header.FormatVersion != ColumnarFileVersion)
+    {
+        Status.Intact = false;
+        vErrors.push_back({ 0, "not a columnar clients file" });
+        return Clients;
+    }
+
+    string_view Body(Buffer.data() + sizeof(Header), Buffer.size() - sizeof(Header));
+    Status.HasTrailer = true;
+    Status.Version = Header.Version;
+    Status.Intact = Header.ColumnBytes == Body.size() && Header.Crc == ColumnarFileCrc(Header, Body);
+
+    // Cut the body into its five columns
+    clsColumnBytes Columns[5];
+    clsColumnBytes Rest(Body);
+    for (clsColumnBytes& Column : Columns)
+    {
+        uint64_t Length = 0;
+        string_view Bytes;
+        if (!Rest.ReadVarint(Length) || !Rest.ReadText(Length, Bytes))
+        {
+            Status.Intact = false;
+            vErrors.push_back({ 0, "columns are cut short" });
+            return Clients;
+        }
+        Column = clsColumnBytes(Bytes);
+    }
+
+    clsTextColumnReader AccountNumbers, PinCodes, Names, Phones;
+    clsIntegerFrameReader Balances;
+    size_t Count = Header.ClientCount;
+    bool Opened = AccountNumbers.Open(Columns[0], Count) && PinCodes.Open(Columns[1], Count)
+        && Names.Open(Columns[2], Count) && Phones.Open(Columns[3], Count);
+    Balances.Open(Columns[4], Count);
+
+    if (Status.Intact) // Otherwise the count may be anything
+        Clients.Reserve(Count);
+    stClientView Client;
+    for (size_t Row = 0; Opened && Row < Count; Row++)
+    {
+        if (!AccountNumbers.Next(Client.AccountNumber) || !PinCodes.Next(Client.PinCode)
+            || !Names.Next(Client.Name) || !Phones.Next(Client.Phone) || !Balances.Next(Client.AccountBalance))
+        {
+            Opened = false;
+            break;
+        }
+        Clients.Append(Client);
+    }
+
+    // A repeated account number is left as a deleted slot, the first one
+    // wins. The file has rows, not lines, so the row goes into the message.
+    vector<ClientHandle> vDuplicates;
+    Clients.IndexAppended(0, vDuplicates);
+    for (ClientHandle Handle : vDuplicates)
+        vErrors.push_back({ 0, "duplicate account number " + string(Clients.Get(Handle).AccountNumber)
+            + " in row " + to_string(Handle + 1) + " (skipped)" });
+
+    if (!Opened)
+    {
+        Status.Intact = false;
+        vErrors.push_back({ 0, "column data is damaged, loaded " + to_string(Clients.Size()) + " client(s)" });
+    }
+    return Clients;
+}
+
+} // namespace
+
+// =============================================================
+//                      Transaction Journal
+// =============================================================
+
+bool ParseDurabilityPolicy(string_view Text, stDurabilityPolicy& Policy)
+{
+    if (Text == "sync")
+    {
+        Policy = stDurabilityPolicy();
+        return true;
+    }
+
+    size_t Colon = Text.find(':');
+    string_view Mode = Text.substr(0, Colon);
+    if (Colon == string_view::npos || (Mode != "group" && Mode != "batch"))
+        return false;
+
+    string_view Number = Text.substr(Colon + 1);
+    unsigned Interval = 0;
+    from_chars_result Result = from_chars(Number.data(), Number.data() + Number.size(), Interval);
+    if (Number.empty() || Result.ec != errc() || Result.ptr != Number.data() + Number.size() || Interval == 0)
+        return false;
+
+    Policy.Mode = (Mode == "group") ? eDurabilityGroup : eDurabilityBatch;
+    Policy.Interval = Interval;
+    return true;
+}
+
+namespace
+{
+
+// Every change is appended to Clients.journal as one small line instead of
+// rewriting Clients.txt. Records hold the resulting state, not the delta,
+// so replaying a record twice gives the same book:
+//   B#//#AccountNumber#//#Balance      new balance
+//   A#//#<client record line>          new client
+//   U#//#<client record line>          updated client
+//   X#//#AccountNumber                 deleted client
+//   T#//#Account#//#Balance#//#Account#//#Balance...
+//                                      new balances that commit together
+enum enJournalRecordType {
+    eJournalSetBalance = 'B',
+    eJournalAddClient = 'A',
+    eJournalUpdateClient = 'U',
+    eJournalDeleteClient = 'X',
+    eJournalSetBalances = 'T'
+};
+
+// Appends go to an in-memory queue. One writer thread moves the queue to
+// the file in a single write followed by a single fsync, so the cost of a
+// sync is shared by every record that was queued while the last one ran.
+// A write that fails is cut off the file again and stays at the head of
+// the queue for the next try; whoever waited for it is told it failed.
+class clsClientsJournal
+{
+private:
+    string _FileName;
+    FILE* _File = nullptr;
+    uint64_t _FileSize = 0;         // Bytes of the file that are known to be whole
+    size_t _RecordCount = 0;
+    stDurabilityPolicy _Policy;
+
+    mutable mutex _Mutex;           // Tellers of the server append from many threads
+    condition_variable _WorkReady;  // Wakes the writer
+    condition_variable _Synced;     // Wakes appenders and Flush()
+    thread _Writer;
+    string _Pending;                // Queued records, one per line
+    size_t _PendingRecords = 0;
+    uint64_t _QueuedCount = 0;      // Records queued since the start
+    uint64_t _SyncedCount = 0;      // Of those, records known to be on the disk
+    uint64_t _FailedWrites = 0;     // Writes or syncs that failed since the start
+    size_t _FlushWaiters = 0;
+    bool _Writing = false;
+    bool _Stopping = false;
+    function<bool()> _BeforeWrite;
+    function<void(string_view, uint64_t)> _AfterQueue;
+    function<void(uint64_t)> _AfterSync;
+
+    // With nothing queued the writer must sleep even if someone waits for
+    // a flush: that waiter needs _Mutex back to see it is done.
+    bool _IsWriteDue() const
+    {
+        if (_Stopping)
+            return true;
+        if (_PendingRecords == 0)
+            return false;
+        if (_FlushWaiters > 0)
+            return true;
+        if (_Policy.Mode == eDurabilityBatch)
+            return _PendingRecords >= _Policy.Interval;
+        return _Policy.Mode == eDurabilitySync;
+    }
+
+    void _WriteLoop()
+    {
+        string Batch;
+        unique_lock<mutex> Lock(_Mutex);
+
+        while (true)
+        {
+            if (_Policy.Mode == eDurabilityGroup)
+                _WorkReady.wait_for(Lock, chrono::milliseconds(_Policy.Interval), [this] { return _IsWriteDue(); });
+            else
+                _WorkReady.wait(Lock, [this] { return _IsWriteDue(); });
+
+            if (_PendingRecords == 0)
+            {
+                if (_Stopping)
+                    return;
+                continue;
+            }
+
+            Batch.swap(_Pending);
+            size_t BatchRecords = _PendingRecords;
+            _PendingRecords = 0;
+            uint64_t Covered = _QueuedCount;
+            _Writing = true;
+            Lock.unlock();
+
+            bool Written = _Write(Batch);
+
+            Lock.lock();
+            _Writing = false;
+            if (Written)
+            {
+                Batch.clear();
+                _SyncedCount = Covered;
+                if (_AfterSync)
+                    _AfterSync(_SyncedCount);
+                _Synced.notify_all();
+                continue;
+            }
+
+            // Records queued meanwhile go after the batch, as they came
+            Batch.append(_Pending);
+            _Pending.swap(Batch);
+            Batch.clear();
+            _PendingRecords += BatchRecords;
+            _FailedWrites++;
+            _Synced.notify_all();
+            if (_Stopping)
+                return;
+            _WorkReady.wait_for(Lock, chrono::milliseconds(JournalRetryDelayMs), [this] { return _Stopping; });
+        }
+    }
+
+    // Writes and syncs one batch, with _Mutex free. On failure the bytes
+    // that got out are cut off, so the file never holds half a record.
+    bool _Write(const string& Batch)
+    {
+        if (_BeforeWrite && !_BeforeWrite())
+            return false; // The ledger must be on the disk ahead of the records
+
+        clsStatsTimer Timer(eStatJournalSync);
+        if (_File == nullptr)
+        {
+            error_code Error;
+            _FileSize = filesystem::exists(_FileName, Error) ? filesystem::file_size(_FileName, Error) : 0;
+            _File = Error ? nullptr : fopen(_FileName.c_str(), "ab");
+        }
+        if (_File != nullptr && fwrite(Batch.data(), 1, Batch.size(), _File) == Batch.size() && SyncFile(_File))
+        {
+            CountBytesWritten(Batch.size());
+            _FileSize += Batch.size();
+            return true;
+        }
+
+        if (_File != nullptr)
+        {
+            fclose(_File);
+            _File = nullptr;
+            error_code Error;
+            filesystem::resize_file(_FileName, _FileSize, Error);
+        }
+        return false;
+    }
+
+    // Waits, with _Mutex held, until the records up to Ticket are on the
+    // disk or a write failed. Returns true for the former.
+    bool _WaitUntilSynced(unique_lock<mutex>& Lock, uint64_t Ticket)
+    {
+        uint64_t FailedWrites = _FailedWrites;
+        _Synced.wait(Lock, [&] { return _SyncedCount >= Ticket || _FailedWrites != FailedWrites; });
+        return _SyncedCount >= Ticket;
+    }
+
+public:
+    clsClientsJournal(string FileName = JournalFileName)
+    {
+        _FileName = FileName;
+    }
+
+    ~clsClientsJournal()
+    {
+        {
+            lock_guard<mutex> Lock(_Mutex);
+            _Stopping = true;
+        }
+        _WorkReady.notify_one();
+        if (_Writer.joinable())
+            _Writer.join();
+        if (_File != nullptr)
+            fclose(_File);
+    }
+
+    // Set before the first append.
+    void SetFileName(string FileName)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _FileName = FileName;
+    }
+
+    // Set before the first append.
+    void SetPolicy(const stDurabilityPolicy& Policy)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _Policy = Policy;
+    }
+
+    // Called by the writer before each write, for files that must reach
+    // the disk ahead of the records (the ledger). If it returns false the
+    // write counts as failed. Set before the first append.
+    void SetBeforeWrite(function<bool()> BeforeWrite)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _BeforeWrite = BeforeWrite;
+    }
+
+    // Called with the journal locked: AfterQueue with the records of every
+    // append and the queue count after them, AfterSync with the count of
+    // records now on the disk (or in a checkpoint). Set before the first append.
+    void SetObservers(function<void(string_view, uint64_t)> AfterQueue, function<void(uint64_t)> AfterSync)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _AfterQueue = AfterQueue;
+        _AfterSync = AfterSync;
+    }
+
+    // Queues RecordCount records, each ending with a newline, and returns
+    // the ticket Wait takes for them. Callers queue while they hold the
+    // locks that order their changes and wait once they let go.
+    uint64_t Enqueue(string_view Records, size_t RecordCount = 1)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (!_Writer.joinable())
+            _Writer = thread(&clsClientsJournal::_WriteLoop, this);
+
+        _Pending.append(Records);
+        _PendingRecords += RecordCount;
+        _RecordCount += RecordCount;
+        _QueuedCount += RecordCount;
+        if (_AfterQueue)
+            _AfterQueue(Records, _QueuedCount);
+        if (_IsWriteDue())
+            _WorkReady.notify_one();
+        return _QueuedCount;
+    }
+
+    // Returns once the records up to Ticket are on the disk if the policy
+    // is sync or MustBeSynced is set, otherwise right away. False if the
+    // write that carried them failed: they stay queued, but are not on the
+    // disk yet.
+    bool Wait(uint64_t Ticket, bool MustBeSynced = false)
+    {
+        if (_Policy.Mode != eDurabilitySync && !MustBeSynced)
+            return true;
+
+        unique_lock<mutex> Lock(_Mutex);
+        if (_SyncedCount >= Ticket)
+            return true;
+        _FlushWaiters += MustBeSynced;
+        _WorkReady.notify_one();
+        bool Synced = _WaitUntilSynced(Lock, Ticket);
+        _FlushWaiters -= MustBeSynced;
+        return Synced;
+    }
+
+    bool Append(string_view Records, size_t RecordCount = 1, bool MustBeSynced = false)
+    {
+        return Wait(Enqueue(Records, RecordCount), MustBeSynced);
+    }
+
+    // Writes and syncs everything queued so far. False if that write failed.
+    bool Flush()
+    {
+        unique_lock<mutex> Lock(_Mutex);
+        _FlushWaiters++;
+        _WorkReady.notify_one();
+        bool Synced = _WaitUntilSynced(Lock, _QueuedCount);
+        _FlushWaiters--;
+        return Synced;
+    }
+
+    // Records queued since the start of the process.
+    uint64_t QueuedCount() const
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        return _QueuedCount;
+    }
+
+    // Number of records in the journal since the last checkpoint.
+    size_t RecordCount() const
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        return _RecordCount;
+    }
+
+    void SetRecordCount(size_t RecordCount)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _RecordCount = RecordCount;
+    }
+
+    // Called once a checkpoint holds every change made so far. Records that
+    // are still queued are in that checkpoint, so they are dropped. False if
+    // the empty journal could not be created.
+    bool Truncate()
+    {
+        unique_lock<mutex> Lock(_Mutex);
+        _Synced.wait(Lock, [this] { return !_Writing; });
+        _Pending.clear();
+        _PendingRecords = 0;
+        _SyncedCount = _QueuedCount;
+        if (_AfterSync)
+            _AfterSync(_SyncedCount);
+        _Synced.notify_all();
+
+        if (_File != nullptr)
+            fclose(_File);
+        _File = fopen(_FileName.c_str(), "wb");
+        if (_File == nullptr || !SyncFile(_File))
+        {
+            if (_File != nullptr)
+                fclose(_File);
+            _File = nullptr; // The next write opens it again and learns its size
+            return false;
+        }
+        _FileSize = 0;
+        _RecordCount = 0;
+        return true;
+    }
+};
+
+string ConvertJournalRecordToLine(enJournalRecordType Type, string Payload, string Seperator = "#//#")
+{
+    return string(1, (char)Type) + Seperator + Payload;
+}
+
+// Applies one journal line to the store. Returns false for lines it cannot understand.
+bool ApplyJournalLine(string_view Line, clsClientStore& Clients, string_view Seperator = "#//#")
+{
+    size_t pos = Line.find(Seperator);
+    if (pos != 1)
+        return false;
+
+    string_view Payload = Line.substr(pos + Seperator.length());
+    ClientHandle Handle;
+
+    switch ((enJournalRecordType)Line[0])
+    {
+    case eJournalSetBalance:
+    {
+        string_view vFields[2];
+        Cents AccountBalance = 0;
+        if (SplitFields(Payload, Seperator, vFields, 2) != 2 || !ParseMoney(vFields[1], AccountBalance))
+            return false;
+        if (Clients.Find(vFields[0], Handle))
+            Clients.SetBalance(Handle, AccountBalance);
+        return true;
+    }
+    case eJournalAddClient:
+    case eJournalUpdateClient:
+    {
+        stClientData Client;
+        if (!ConvertLineToRecord(Payload, Client))
+            return false;
+        if (Clients.Find(Client.AccountNumber, Handle))
+            Clients.Update(Handle, Client);
+        else
+            Clients.Add(Client, Handle);
+        return true;
+    }
+    case eJournalDeleteClient:
+        if (Clients.Find(Payload, Handle))
+            Clients.Remove(Handle);
+        return true;
+
+    case eJournalSetBalances:
+    {
+        // Check every pair before applying any, so the group lands whole or not at all
+        vector<pair<string_view, Cents>> vBalances;
+        size_t Start = 0;
+        while (Start <= Payload.size())
+        {
+            size_t AccountEnd = Payload.find(Seperator, Start);
+            if (AccountEnd == string_view::npos)
+                return false;
+            size_t BalanceStart = AccountEnd + Seperator.length();
+            size_t BalanceEnd = min(Payload.find(Seperator, BalanceStart), Payload.size());
+
+            Cents AccountBalance = 0;
+            if (!ParseMoney(Payload.substr(BalanceStart, BalanceEnd - BalanceStart), AccountBalance))
+                return false;
+            vBalances.push_back({ Payload.substr(Start, AccountEnd - Start), AccountBalance });
+            Start = BalanceEnd + Seperator.length();
+        }
+
+        for (const pair<string_view, Cents>& Balance : vBalances)
+        {
+            if (Clients.Find(Balance.first, Handle))
+                Clients.SetBalance(Handle, Balance.second);
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+// Replays the journal over a book loaded from Clients.txt and returns the
+// number of records applied. A last line without its newline was cut off
+// by a crash in the middle of a write, so it is ignored.
+size_t ReplayJournalFile(string FileName, clsClientStore& Clients)
+{
+    size_t RecordCount = 0;
+
+    ForEachLineInFile(FileName, [&](string_view Line, size_t, bool HasNewline)
+        {
+            if (!HasNewline)
+                return; // Torn write
+
+            if (!Line.empty() && ApplyJournalLine(Line, Clients))
+                RecordCount++;
+        });
+    return RecordCount;
+}
+
+} // namespace
+
+// =============================================================
+//                      Replication Log
+// =============================================================
+
+string ReplicationRoleToString(enReplicationRole Role)
+{
+    switch (Role)
+    {
+    case eReplicationNone: return "none";
+    case eReplicationPrimary: return "primary";
+    case eReplicationStandby: return "standby";
+    }
+    return "";
+}
+
+namespace
+{
+
+// Past this many unshipped bytes the standby is too far behind to catch up
+// from records; it gets a new snapshot instead.
+const size_t MaxReplicationBacklog = 64 << 20;
+const size_t MaxReplicationBatch = 1 << 20;
+
+int64_t NowMilliseconds()
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The journal records a primary still has to ship. They are copied here as
+// they are queued (under the journal lock, so in journal order) and leave
+// once the journal reports them on disk, so a standby never applies a change
+// the primary could still lose in a crash. Positions are journal queue
+// counts, which only grow while the process runs.
+class clsReplicationLog
+{
+private:
+    struct stAppend
+    {
+        uint64_t Position;  // Queue count after the append
+        size_t End;         // Offset in _Records just past its lines
+    };
+
+    struct stShipment
+    {
+        uint64_t Position;
+        int64_t CommitTime;
+    };
+
+    mutable mutex _Mutex;
+    condition_variable _Ready;
+    bool _Enabled = false;
+    bool _SnapshotDue = false;
+    string _Records;
+    size_t _Start = 0;              // Bytes of _Records already shipped
+    deque<stAppend> _Appends;
+    uint64_t _Synced = 0;
+    int64_t _OldestSyncedTime = 0;  // When the oldest unshipped record was on disk, 0 if none is
+    uint64_t _Shipped = 0;
+    uint64_t _Acknowledged = 0;
+    deque<stShipment> _Unacknowledged;
+    size_t _Snapshots = 0;
+    size_t _Batches = 0;
+
+    bool _IsShipmentReady() const
+    {
+        return _SnapshotDue || (!_Appends.empty() && _Appends.front().Position <= _Synced);
+    }
+
+    void _Clear()
+    {
+        _Records.clear();
+        _Start = 0;
+        _Appends.clear();
+        _OldestSyncedTime = 0;
+    }
+
+public:
+    void AfterQueue(string_view Records, uint64_t Position)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (!_Enabled)
+            return;
+
+        if (_Records.size() - _Start + Records.size() > MaxReplicationBacklog)
+        {
+            _Clear();
+            _SnapshotDue = true;
+            _Ready.notify_one();
+        }
+        _Records.append(Records);
+        _Appends.push_back({ Position, _Records.size() });
+    }
+
+    void AfterSync(uint64_t Position)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _Synced = max(_Synced, Position);
+        if (_OldestSyncedTime == 0 && !_Appends.empty() && _Appends.front().Position <= _Synced)
+        {
+            _OldestSyncedTime = NowMilliseconds();
+            _Ready.notify_one();
+        }
+    }
+
+    void Start()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _Clear();
+        _Unacknowledged.clear();
+        _Enabled = true;
+        _SnapshotDue = true;
+    }
+
+    void Stop()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _Clear();
+        _Unacknowledged.clear();
+        _Enabled = false;
+        _SnapshotDue = false;
+    }
+
+    // For changes that leave no journal record (an accrual run, a book
+    // loaded again): only a snapshot brings the standby up to date.
+    void RequireSnapshot()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (!_Enabled)
+            return;
+        _SnapshotDue = true;
+        _Ready.notify_one();
+    }
+
+    bool WaitForShipment(unsigned TimeoutMs)
+    {
+        unique_lock<mutex> Lock(_Mutex);
+        return _Ready.wait_for(Lock, chrono::milliseconds(TimeoutMs), [this] { return _Enabled && _IsShipmentReady(); });
+    }
+
+    // Returns true if the next shipment has to be a snapshot. From then on
+    // every record queued is kept, so the caller reads the queue count and
+    // then the book; SnapshotTaken drops the records the book already has.
+    bool BeginSnapshot()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (!_SnapshotDue)
+            return false;
+        _SnapshotDue = false;
+        return true;
+    }
+
+    void SnapshotTaken(uint64_t Position, int64_t CommitTime)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        while (!_Appends.empty() && _Appends.front().Position <= Position)
+        {
+            _Start = _Appends.front().End;
+            _Appends.pop_front();
+        }
+        _OldestSyncedTime = (!_Appends.empty() && _Appends.front().Position <= _Synced) ? NowMilliseconds() : 0;
+        _Shipped = Position;
+        _Acknowledged = 0;
+        _Unacknowledged.clear();
+        _Unacknowledged.push_back({ Position, CommitTime });
+        _Snapshots++;
+    }
+
+    // Moves the records that are on disk, up to about MaxReplicationBatch
+    // bytes, into Batch.
+    bool TakeRecords(stReplicationBatch& Batch)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (_SnapshotDue || _Appends.empty() || _Appends.front().Position > _Synced)
+            return false;
+
+        size_t End = _Start;
+        uint64_t Position = _Shipped;
+        while (!_Appends.empty() && _Appends.front().Position <= _Synced
+            && (End == _Start || _Appends.front().End - _Start <= MaxReplicationBatch))
+        {
+            End = _Appends.front().End;
+            Position = _Appends.front().Position;
+            _Appends.pop_front();
+        }
+
+        Batch = stReplicationBatch();
+        Batch.Records.assign(_Records, _Start, End - _Start);
+        Batch.RecordCount = (size_t)(Position - _Shipped);
+        Batch.Position = Position;
+        Batch.CommitTime = _OldestSyncedTime;
+        _Unacknowledged.push_back({ Position, _OldestSyncedTime });
+        _Shipped = Position;
+        _Batches++;
+
+        _Start = End;
+        if (_Appends.empty() || _Appends.front().Position > _Synced)
+            _OldestSyncedTime = 0;
+
+        // Drop what was shipped once it is most of the buffer
+        if (_Start * 2 > _Records.size())
+        {
+            _Records.erase(0, _Start);
+            for (stAppend& Append : _Appends)
+                Append.End -= _Start;
+            _Start = 0;
+        }
+        return true;
+    }
+
+    void Acknowledge(uint64_t Position)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _Acknowledged = max(_Acknowledged, min(Position, _Shipped));
+        while (!_Unacknowledged.empty() && _Unacknowledged.front().Position <= _Acknowledged)
+            _Unacknowledged.pop_front();
+    }
+
+    uint64_t Shipped() const
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        return _Shipped;
+    }
+
+    void FillStatus(stReplicationStatus& Status) const
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        Status.Position = max(_Synced, _Shipped);
+        Status.PeerPosition = _Acknowledged;
+        Status.LagRecords = _Enabled ? Status.Position - _Acknowledged : 0;
+        Status.BacklogBytes = _Records.size() - _Start;
+        Status.Snapshots = _Snapshots;
+        Status.Batches = _Batches;
+
+        int64_t Oldest = !_Unacknowledged.empty() ? _Unacknowledged.front().CommitTime : _OldestSyncedTime;
+        Status.LagMs = (_Enabled && Oldest != 0) ? max<int64_t>(0, NowMilliseconds() - Oldest) : 0;
+    }
+};
+
+} // namespace
+
+// =============================================================
+//                      Account Ledger
+// =============================================================
+
+string LedgerEntryTypeToString(enLedgerEntryType Type)
+{
+    switch (Type)
+    {
+    case eLedgerDeposit: return "Deposit";
+    case eLedgerWithdraw: return "Withdraw";
+    case eLedgerTransferOut: return "Transfer Out";
+    case eLedgerTransferIn: return "Transfer In";
+    case eLedgerAccrual: return "Interest/Fees";
+    case eLedgerOpening: return "Opening";
+    case eLedgerAdjustment: return "Adjustment";
+    }
+    return "";
+}
+
+namespace
+{
+
+// Clients.ledger is a header followed by fixed-width entries in the order
+// they were made; it is only ever appended to. Every entry holds the
+// number of the previous entry of its account, so the entries of one
+// account form a chain that is walked back from the newest one without
+// reading any other account's entries. Entries name their account by an
+// id the ledger gives it when it is opened, in a name entry that ties the
+// id to the account number, so a client added later under the number of a
+// deleted one starts a chain of its own. The newest entry of each account
+// (its head) and the ids are kept in memory and saved to Clients.ledger.idx
+// now and then, so opening the ledger only reads the entries written since.
+// Numbers are stored in the byte order of the machine that wrote the file.
+const uint32_t LedgerVersion = 2;
+
+// Version 1 named accounts by a hash of the account number. Such a ledger
+// is moved aside to Clients.ledger.v1, and a new one started.
+const uint32_t LedgerVersionWithHashes = 1;
+
+// Entries wait in memory until this many bytes are queued or the ledger
+// is synced; the heads are saved again after this many new entries.
+const size_t LedgerBufferSize = 1 << 20;
+const uint64_t LedgerIndexInterval = 1 << 20;
+
+struct stLedgerHeader
+{
+    char Magic[8];          // "BANKLDG\0"
+    uint32_t Version;
+    uint32_t EntrySize;
+    uint32_t Flags;         // LedgerPartial
+    char Reserved[44];
+};
+
+// The book took changes that have no entries here: the engine was a
+// standby, whose changes come from the primary's journal. Never cleared.
+const uint32_t LedgerPartial = 1;
+
+struct stLedgerRecord
+{
+    uint64_t OperationId;
+    int64_t Time;           // Milliseconds since 1970, never going back in the file
+    Cents Amount;
+    Cents Balance;
+    uint64_t PreviousLink;  // Number of the account's previous entry plus 1, 0 for its first
+    uint64_t AccountId;     // Given to the account by its name entry
+    char Type;
+    char Reserved[11];
+    uint32_t Crc;           // Of the bytes before it, so a torn last entry is noticed
+};
+
+// Ties AccountId to an account number. A number longer than one piece
+// takes several name entries in a row, all but the last with Continued set.
+const char LedgerNameEntry = 'N';
+
+struct stLedgerNameRecord
+{
+    uint64_t OperationId;   // The last operation id when it was written
+    int64_t Time;
+    char AccountNumber[24]; // A piece of the account number
+    uint64_t AccountId;
+    char Type;              // LedgerNameEntry
+    uint8_t Length;         // Bytes of the piece
+    uint8_t Continued;
+    char Reserved[9];
+    uint32_t Crc;
+};
+
+struct stLedgerIndexHeader
+{
+    char Magic[8];          // "BANKLIX\0"
+    uint32_t Version;
+    uint32_t Crc;           // Of the heads that follow
+    uint64_t EntryCount;    // Entries of the ledger the heads cover
+    uint64_t HeadCount;
+    uint64_t AccountCount;  // Account ids after the heads
+    uint64_t LastAccountId;
+    char Reserved[16];
+};
+
+struct stLedgerHead
+{
+    uint64_t AccountId;
+    uint64_t Link;
+};
+
+// Followed by the Length bytes of the account number.
+struct stLedgerIndexAccount
+{
+    uint64_t AccountId;
+    uint64_t Length;
+};
+
+static_assert(sizeof(stLedgerHeader) == 64, "Ledger header layout changed");
+static_assert(sizeof(stLedgerRecord) == 64, "Ledger entry layout changed");
+static_assert(sizeof(stLedgerNameRecord) == sizeof(stLedgerRecord)
+    && offsetof(stLedgerNameRecord, Time) == offsetof(stLedgerRecord, Time)
+    && offsetof(stLedgerNameRecord, AccountId) == offsetof(stLedgerRecord, AccountId)
+    && offsetof(stLedgerNameRecord, Type) == offsetof(stLedgerRecord, Type)
+    && offsetof(stLedgerNameRecord, Crc) == offsetof(stLedgerRecord, Crc), "Ledger name entry layout changed");
+static_assert(sizeof(stLedgerIndexHeader) == 64, "Ledger index header layout changed");
+
+// Both kinds of entry keep their checksum in the last four bytes.
+uint32_t LedgerRecordCrc(const void* Record)
+{
+    return UpdateCrc32(0, string_view((const char*)Record, offsetof(stLedgerRecord, Crc)));
+}
+
+uint32_t LedgerRecordCrc(const stLedgerRecord& Record)
+{
+    return LedgerRecordCrc(&Record);
+}
+
+// Seeks with 64-bit offsets, the ledger grows past 2 GB.
+bool SeekFile(FILE* File, uint64_t Offset)
+{
+#ifdef _WIN32
+    return _fseeki64(File, (long long)Offset, SEEK_SET) == 0;
+#else
+    return fseeko(File, (off_t)Offset, SEEK_SET) == 0;
+#endif
+}
+
+// One balance change for clsAccountLedger::Append.
+struct stLedgerChange
+{
+    string_view AccountNumber;
+    enLedgerEntryType Type;
+    Cents Amount;
+    Cents Balance;
+};
+
+class clsAccountLedger
+{
+private:
+    string _FileName;
+    string _IndexFileName;
+    FILE* _File = nullptr;          // Appends
+    mutable FILE* _ReadFile = nullptr;
+
+    mutable mutex _Mutex;           // Appends come from many teller threads
+    mutable mutex _ReadMutex;       // Guards _ReadFile
+    unordered_map<uint64_t, uint64_t> _Heads;   // Account id -> link of its newest entry
+    unordered_map<string, uint64_t, stAccountNumberHash, equal_to<>> _AccountIds; // Account number -> its id
+    uint64_t _LastAccountId = 0;
+    string _NameRead;               // Pieces of a name entry read so far
+    uint64_t _WrittenCount = 0;     // Entries in the file
+    string _Pending;                // Entries after those, not written yet
+    uint64_t _IndexedCount = 0;     // Entries covered by Clients.ledger.idx
+    bool _Unsynced = false;
+    bool _Partial = false;          // LedgerPartial is set in the header
+    int64_t _LastTime = 0;
+    atomic<uint64_t> _LastOperationId{ 0 };
+
+    static uint64_t _Offset(uint64_t Entry)
+    {
+        return sizeof(stLedgerHeader) + Entry * sizeof(stLedgerRecord);
+    }
+
+    uint64_t _EntryCount() const
+    {
+        return _WrittenCount + _Pending.size() / sizeof(stLedgerRecord);
+    }
+
+    // Moves the queued entries to the file. They are flushed out of the
+    // stdio buffer, since statements read the file through _ReadFile. On a
+    // failed write they stay queued and the next try writes them again at
+    // the same place.
+    bool _WritePending()
+    {
+        if (_Pending.empty() || _File == nullptr)
+            return true;
+
+        bool Written = fwrite(_Pending.data(), 1, _Pending.size(), _File) == _Pending.size()
+            && fflush(_File) == 0;
+        if (!Written)
+        {
+            clearerr(_File);
+            SeekFile(_File, _Offset(_WrittenCount));
+            return false;
+        }
+        CountBytesWritten(_Pending.size());
+        _WrittenCount += _Pending.size() / sizeof(stLedgerRecord);
+        _Pending.clear();
+        _Unsynced = true;
+        return true;
+    }
+
+    void _SetAccountId(string_view AccountNumber, uint64_t Id)
+    {
+        auto Account = _AccountIds.find(AccountNumber);
+        if (Account == _AccountIds.end())
+            _AccountIds.emplace(string(AccountNumber), Id);
+        else
+        {
+            _Heads.erase(Account->second); // The chain of the client that had the number before
+            Account->second = Id;
+        }
+        _LastAccountId = max(_LastAccountId, Id);
+    }
+
+    // Gives AccountNumber a new id and queues the name entries saying so.
+    uint64_t _OpenAccount(string_view AccountNumber)
+    {
+        uint64_t Id = _LastAccountId + 1;
+        size_t Offset = 0;
+        do
+        {
+            stLedgerNameRecord Record;
+            memset(&Record, 0, sizeof(Record));
+            Record.OperationId = _LastOperationId;
+            Record.Time = _LastTime;
+            Record.Length = (uint8_t)min(AccountNumber.size() - Offset, sizeof(Record.AccountNumber));
+            memcpy(Record.AccountNumber, AccountNumber.data() + Offset, Record.Length);
+            Offset += Record.Length;
+            Record.Continued = Offset < AccountNumber.size();
+            Record.AccountId = Id;
+            Record.Type = LedgerNameEntry;
+            Record.Crc = LedgerRecordCrc(&Record);
+            _Pending.append((const char*)&Record, sizeof(Record));
+        } while (Offset < AccountNumber.size());
+
+        _SetAccountId(AccountNumber, Id);
+        return Id;
+    }
+
+    uint64_t _AccountIdOf(string_view AccountNumber)
+    {
+        auto Account = _AccountIds.find(AccountNumber);
+        return (Account != _AccountIds.end()) ? Account->second : _OpenAccount(AccountNumber);
+    }
+
+    // Takes entry number Link - 1, read from the file, into the heads (or,
+    // for a name entry, the ids).
+    void _TakeEntry(const stLedgerRecord& Record, uint64_t Link)
+    {
+        _LastTime = max(_LastTime, Record.Time);
+        _LastOperationId = max(_LastOperationId.load(), Record.OperationId);
+        if (Record.Type != LedgerNameEntry)
+        {
+            _Heads[Record.AccountId] = Link;
+            return;
+        }
+
+        stLedgerNameRecord Name;
+        memcpy(&Name, &Record, sizeof(Name));
+        _NameRead.append(Name.AccountNumber, min<size_t>(Name.Length, sizeof(Name.AccountNumber)));
+        if (Name.Continued)
+            return;
+        _SetAccountId(_NameRead, Name.AccountId);
+        _NameRead.clear();
+    }
+
+    // Reads the heads and ids saved in Clients.ledger.idx and returns the
+    // number of entries they cover, 0 if the file is missing or damaged.
+    uint64_t _LoadIndex()
+    {
+        _Heads.clear();
+        _AccountIds.clear();
+        _LastAccountId = 0;
+        FILE* File = fopen(_IndexFileName.c_str(), "rb");
+        if (File == nullptr)
+            return 0;
+
+        stLedgerIndexHeader Header;
+        vector<stLedgerHead> vHeads;
+        vector<pair<string, uint64_t>> vAccounts;
+        uint64_t Bytes = 0;
+        bool Valid = fread(&Header, sizeof(Header), 1, File) == 1
+            && memcmp(Header.Magic, "BANKLIX", 8) == 0 && Header.Version == LedgerVersion;
+        if (Valid)
+        {
+            vHeads.resize(Header.HeadCount);
+            Valid = fread(vHeads.data(), sizeof(stLedgerHead), vHeads.size(), File) == vHeads.size();
+            Bytes = vHeads.size() * sizeof(stLedgerHead);
+        }
+        uint32_t Crc = UpdateCrc32(0, string_view((const char*)vHeads.data(), Bytes));
+        for (uint64_t i = 0; Valid && i < Header.AccountCount; i++)
+        {
+            stLedgerIndexAccount Account;
+            Valid = fread(&Account, sizeof(Account), 1, File) == 1 && Account.Length <= LedgerBufferSize;
+            if (!Valid)
+                break;
+            string AccountNumber(Account.Length, '\0');
+            Valid = fread(AccountNumber.data(), 1, AccountNumber.size(), File) == AccountNumber.size();
+            Crc = UpdateCrc32(Crc, string_view((const char*)&Account, sizeof(Account)));
+            Crc = UpdateCrc32(Crc, AccountNumber);
+            Bytes += sizeof(Account) + AccountNumber.size();
+            vAccounts.push_back({ move(AccountNumber), Account.AccountId });
+        }
+        fclose(File);
+        if (!Valid || Crc != Header.Crc)
+            return 0;
+
+        CountBytesRead(sizeof(Header) + Bytes);
+        _Heads.reserve(vHeads.size());
+        for (const stLedgerHead& Head : vHeads)
+            _Heads[Head.AccountId] = Head.Link;
+        _AccountIds.reserve(vAccounts.size());
+        for (pair<string, uint64_t>& Account : vAccounts)
+            _AccountIds.emplace(move(Account.first), Account.second);
+        _LastAccountId = Header.LastAccountId;
+        return Header.EntryCount;
+    }
+
+    // Reads the entries from First to the end of the file into the heads.
+    // The file is cut back to the last whole entry with a good checksum,
+    // which drops an entry torn by a crash in the middle of a write.
+    void _ReadEntriesFrom(uint64_t First, uint64_t FileEntries)
+    {
+        vector<stLedgerRecord> vBlock(FileReadBlockSize / sizeof(stLedgerRecord));
+        uint64_t Entry = First;
+        SeekFile(_File, _Offset(First));
+        _NameRead.clear();
+
+        while (Entry < FileEntries)
+        {
+            size_t Count = fread(vBlock.data(), sizeof(stLedgerRecord), (size_t)min<uint64_t>(vBlock.size(), FileEntries - Entry), _File);
+            CountBytesRead(Count * sizeof(stLedgerRecord));
+            size_t i = 0;
+            for (; i < Count && LedgerRecordCrc(vBlock[i]) == vBlock[i].Crc; i++)
+                _TakeEntry(vBlock[i], Entry + i + 1);
+            Entry += i;
+            if (i < Count || Count == 0)
+                break;
+        }
+
+        if (Entry < FileEntries)
+        {
+            error_code Error;
+            filesystem::resize_file(_FileName, _Offset(Entry), Error);
+        }
+        _WrittenCount = Entry;
+    }
+
+    // The last entry of the file also gives the last time and operation id
+    // when the heads came from the index.
+    void _ReadLastEntry()
+    {
+        stLedgerRecord Record;
+        if (_WrittenCount > 0 && SeekFile(_File, _Offset(_WrittenCount - 1)) && fread(&Record, sizeof(Record), 1, _File) == 1)
+        {
+            _LastTime = max(_LastTime, Record.Time);
+            _LastOperationId = max(_LastOperationId.load(), Record.OperationId);
+        }
+    }
+
+    bool _ReadEntry(uint64_t Entry, stLedgerRecord& Record) const
+    {
+        lock_guard<mutex> Lock(_ReadMutex);
+        if (_ReadFile == nullptr)
+            _ReadFile = fopen(_FileName.c_str(), "rb");
+        if (_ReadFile == nullptr || !SeekFile(_ReadFile, _Offset(Entry)) || fread(&Record, sizeof(Record), 1, _ReadFile) != 1
+            || LedgerRecordCrc(Record) != Record.Crc)
+            return false;
+        CountBytesRead(sizeof(Record));
+        return true;
+    }
+
+public:
+    clsAccountLedger(string FileName = LedgerFileName, string IndexFileName = LedgerIndexFileName)
+    {
+        _FileName = FileName;
+        _IndexFileName = IndexFileName;
+    }
+
+    // Set before Open.
+    void SetFileNames(string FileName, string IndexFileName)
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        _FileName = FileName;
+        _IndexFileName = IndexFileName;
+    }
+
+    ~clsAccountLedger()
+    {
+        SaveIndex();
+        if (_File != nullptr)
+            fclose(_File);
+        if (_ReadFile != nullptr)
+            fclose(_ReadFile);
+    }
+
+    // Opens the ledger, creating it if needed, and reads the heads. Opening
+    // it again picks up entries another program appended meanwhile.
+    bool Open()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (_File != nullptr)
+        {
+            _WritePending();
+            fflush(_File);
+            fclose(_File);
+            _File = nullptr;
+        }
+
+        _File = fopen(_FileName.c_str(), "r+b");
+        if (_File == nullptr)
+            _File = fopen(_FileName.c_str(), "w+b");
+        if (_File == nullptr)
+            return false;
+
+        stLedgerHeader Header;
+        bool HeaderRead = fread(&Header, sizeof(Header), 1, _File) == 1;
+        uint32_t Flags = 0;
+        if (HeaderRead && memcmp(Header.Magic, "BANKLDG", 8) == 0 && Header.Version == LedgerVersionWithHashes)
+        {
+            // Its entries cannot be told apart by client, so it is kept as
+            // it is and the new ledger only keeps its partial mark
+            Flags = Header.Flags & LedgerPartial;
+            fclose(_File);
+            _File = nullptr;
+            error_code Error;
+            filesystem::rename(_FileName, _FileName + ".v1", Error);
+            if (Error)
+                return false;
+            filesystem::remove(_IndexFileName, Error);
+            _File = fopen(_FileName.c_str(), "w+b");
+            if (_File == nullptr)
+                return false;
+            HeaderRead = false;
+        }
+
+        if (!HeaderRead)
+        {
+            memset(&Header, 0, sizeof(Header));
+            memcpy(Header.Magic, "BANKLDG", 8);
+            Header.Version = LedgerVersion;
+            Header.EntrySize = sizeof(stLedgerRecord);
+            Header.Flags = Flags;
+            SeekFile(_File, 0);
+            fwrite(&Header, sizeof(Header), 1, _File);
+            fflush(_File);
+        }
+        else if (memcmp(Header.Magic, "BANKLDG", 8) != 0 || Header.Version != LedgerVersion
+            || Header.EntrySize != sizeof(stLedgerRecord))
+        {
+            fclose(_File);
+            _File = nullptr;
+            return false;
+        }
+        _Partial = (Header.Flags & LedgerPartial) != 0;
+
+        error_code Error;
+        uint64_t FileSize = filesystem::file_size(_FileName, Error);
+        uint64_t FileEntries = (Error || FileSize < sizeof(stLedgerHeader)) ? 0 : (FileSize - sizeof(stLedgerHeader)) / sizeof(stLedgerRecord);
+
+        // Heads already in memory cover what this process wrote
+        uint64_t Known = _WrittenCount;
+        if (Known == 0 || Known > FileEntries)
+        {
+            Known = _LoadIndex();
+            if (Known > FileEntries)
+            {
+                _Heads.clear();
+                _AccountIds.clear();
+                _LastAccountId = 0;
+                Known = 0;
+            }
+            _IndexedCount = Known;
+        }
+        _WrittenCount = Known;
+        _ReadLastEntry();
+        _ReadEntriesFrom(Known, FileEntries);
+        SeekFile(_File, _Offset(_WrittenCount));
+        return true;
+    }
+
+    uint64_t NewOperationId()
+    {
+        return ++_LastOperationId;
+    }
+
+    // Sets LedgerPartial in the header, on the disk before it returns.
+    bool MarkPartial()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (_File == nullptr)
+            return false;
+        if (_Partial)
+            return true;
+
+        stLedgerHeader Header;
+        bool Written = _WritePending() && SeekFile(_File, 0) && fread(&Header, sizeof(Header), 1, _File) == 1;
+        if (Written)
+        {
+            Header.Flags |= LedgerPartial;
+            Written = SeekFile(_File, 0) && fwrite(&Header, sizeof(Header), 1, _File) == 1 && SyncFile(_File);
+        }
+        SeekFile(_File, _Offset(_WrittenCount));
+        _Partial = Written;
+        return Written;
+    }
+
+    bool IsPartial() const
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        return _Partial;
+    }
+
+    // Starts a new chain for a client added under AccountNumber, so the
+    // entries of a deleted client that had the number are not its. A number
+    // that never had entries gets its id with its first one.
+    void OpenAccount(string_view AccountNumber)
+    {
+        int64_t Now = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        lock_guard<mutex> Lock(_Mutex);
+        if (_File == nullptr || _AccountIds.find(AccountNumber) == _AccountIds.end())
+            return;
+
+        _LastTime = max(_LastTime, Now);
+        _OpenAccount(AccountNumber);
+        if (_Pending.size() >= LedgerBufferSize)
+            _WritePending();
+    }
+
+    // Queues one entry per change, in order, all with the same time.
+    void Append(uint64_t OperationId, span<const stLedgerChange> vChanges)
+    {
+        int64_t Now = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        lock_guard<mutex> Lock(_Mutex);
+        if (_File == nullptr)
+            return;
+
+        _LastTime = max(_LastTime, Now); // A clock set back must not break the order of the chains
+        for (const stLedgerChange& Change : vChanges)
+        {
+            stLedgerRecord Record;
+            memset(&Record, 0, sizeof(Record));
+            Record.OperationId = OperationId;
+            Record.Time = _LastTime;
+            Record.Amount = Change.Amount;
+            Record.Balance = Change.Balance;
+            Record.AccountId = _AccountIdOf(Change.AccountNumber); // May queue name entries first
+            Record.Type = (char)Change.Type;
+
+            uint64_t& Head = _Heads[Record.AccountId];
+            Record.PreviousLink = Head;
+            Record.Crc = LedgerRecordCrc(Record);
+            _Pending.append((const char*)&Record, sizeof(Record));
+            Head = _EntryCount();
+        }
+
+        if (_Pending.size() >= LedgerBufferSize)
+            _WritePending();
+    }
+
+    void Append(uint64_t OperationId, const stLedgerChange& Change)
+    {
+        Append(OperationId, span<const stLedgerChange>(&Change, 1));
+    }
+
+    // Writes everything queued and makes sure it is on the disk. False if
+    // the write or the sync failed; the entries are then still queued.
+    bool Sync()
+    {
+        lock_guard<mutex> Lock(_Mutex);
+        if (!_WritePending())
+            return false;
+        if (_Unsynced && _File != nullptr && !SyncFile(_File))
+            return false;
+        _Unsynced = false;
+        return true;
+    }
+
+    // Saves the heads and ids to Clients.ledger.idx (through a temporary
+    // file and a rename), after syncing the entries they point to.
+    void SaveIndex()
+    {
+        Sync();
+        lock_guard<mutex> Lock(_Mutex);
+        if (_File == nullptr || _IndexedCount == _WrittenCount)
+            return;
+
+        vector<stLedgerHead> vHeads;
+        vHeads.reserve(_Heads.size());
+        for (const pair<const uint64_t, uint64_t>& Head : _Heads)
+            vHeads.push_back({ Head.first, Head.second });
+
+        string Accounts;
+        for (const pair<const string, uint64_t>& Account : _AccountIds)
+        {
+            stLedgerIndexAccount Entry{ Account.second, Account.first.size() };
+            Accounts.append((const char*)&Entry, sizeof(Entry)).append(Account.first);
+        }
+
+        stLedgerIndexHeader Header;
+        memset(&Header, 0, sizeof(Header));
+        memcpy(Header.Magic, "BANKLIX", 8);
+        Header.Version = LedgerVersion;
+        Header.Crc = UpdateCrc32(UpdateCrc32(0, string_view((const char*)vHeads.data(), vHeads.size() * sizeof(stLedgerHead))), Accounts);
+        Header.EntryCount = _WrittenCount;
+        Header.HeadCount = vHeads.size();
+        Header.AccountCount = _AccountIds.size();
+        Header.LastAccountId = _LastAccountId;
+
+        string TempFileName = _IndexFileName + ".tmp";
+        FILE* File = fopen(TempFileName.c_str(), "wb");
+        if (File == nullptr)
+            return;
+        bool Written = fwrite(&Header, sizeof(Header), 1, File) == 1
+            && fwrite(vHeads.data(), sizeof(stLedgerHead), vHeads.size(), File) == vHeads.size()
+            && fwrite(Accounts.data(), 1, Accounts.size(), File) == Accounts.size()
+            && SyncFile(File);
+        fclose(File);
+
+        error_code Error;
+        if (Written)
+            filesystem::rename(TempFileName, _IndexFileName, Error);
+        if (!Written || Error)
+            return;
+
+        SyncDirectoryOf(_IndexFileName);
+        CountBytesWritten(sizeof(Header) + vHeads.size() * sizeof(stLedgerHead) + Accounts.size());
+        _IndexedCount = Header.EntryCount;
+    }
+
+    void SaveIndexIfDue()
+    {
+        {
+            lock_guard<mutex> Lock(_Mutex);
+            if (_EntryCount() - _IndexedCount < LedgerIndexInterval)
+                return;
+        }
+        SaveIndex();
+    }
+
+    // Walks the chain of the account back from its newest entry. Entries
+    // still queued are read from memory, the rest from the file; the file
+    // part never changes, so appends go on while it is read. An entry of
+    // another id ends the walk, as the chain cannot go on from there. False
+    // if an entry of the chain could not be read.
+    bool Statement(string_view AccountNumber, int64_t FromTime, int64_t ToTime, vector<stLedgerEntry>& vEntries) const
+    {
+        clsStatsTimer Timer(eStatStatement);
+        uint64_t Id = 0;
+        vEntries.clear();
+
+        auto Visit = [&](const stLedgerRecord& Record, uint64_t& Link)
+            {
+                if (Record.AccountId != Id || Record.Type == LedgerNameEntry || Record.Time < FromTime)
+                    return false;
+                if (Record.Time <= ToTime)
+                    vEntries.push_back({ Record.OperationId, Record.Time, (enLedgerEntryType)Record.Type, Record.Amount, Record.Balance });
+                Link = Record.PreviousLink;
+                return true;
+            };
+
+        uint64_t Link;
+        {
+            lock_guard<mutex> Lock(_Mutex);
+            auto Account = _AccountIds.find(AccountNumber);
+            if (Account == _AccountIds.end())
+                return true;
+            Id = Account->second;
+            auto Head = _Heads.find(Id);
+            Link = (Head == _Heads.end()) ? 0 : Head->second;
+
+            while (Link > _WrittenCount)
+            {
+                stLedgerRecord Record;
+                memcpy(&Record, _Pending.data() + (Link - 1 - _WrittenCount) * sizeof(stLedgerRecord), sizeof(Record));
+                if (!Visit(Record, Link))
+                {
+                    Link = 0;
+                    break;
+                }
+            }
+        }
+
+        stLedgerRecord Record;
+        while (Link > 0)
+        {
+            if (!_ReadEntry(Link - 1, Record))
+                return false;
+            if (!Visit(Record, Link))
+                break;
+        }
+        reverse(vEntries.begin(), vEntries.end());
+        return true;
+    }
+};
+
+// =============================================================
+//                      Memory Mapped File
+// =============================================================
+
+// Maps a whole file read/write into memory. Growing the file remaps it,
+// so pointers into Data() must not be kept across a call to Resize().
+class clsMappedFile
+{
+private:
+    char* _Data = nullptr;
+    size_t _Size = 0;
+#ifdef _WIN32
+    HANDLE _File = INVALID_HANDLE_VALUE;
+    HANDLE _Mapping = NULL;
+#else
+    int _File = -1;
+#endif
+
+    void _Unmap()
+    {
+#ifdef _WIN32
+        if (_Data != nullptr)
+            UnmapViewOfFile(_Data);
+        if (_Mapping != NULL)
+            CloseHandle(_Mapping);
+        _Mapping = NULL;
+#else
+        if (_Data != nullptr)
+            munmap(_Data, _Size);
+#endif
+        _Data = nullptr;
+    }
+
+    bool _Map()
+    {
+        if (_Size == 0)
+            return true;
+#ifdef _WIN32
+        _Mapping = CreateFileMappingA(_File, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (_Mapping == NULL)
+            return false;
+        _Data = (char*)MapViewOfFile(_Mapping, FILE_MAP_ALL_ACCESS, 0, 0, _Size);
+#else
+        void* Data = mmap(nullptr, _Size, PROT_READ | PROT_WRITE, MAP_SHARED, _File, 0);
+        _Data = (Data == MAP_FAILED) ? nullptr : (char*)Data;
+#endif
+        return _Data != nullptr;
+    }
+
+public:
+    ~clsMappedFile()
+    {
+        Close();
+    }
+
+    // Opens (creating it if needed) and maps the file.
+    bool Open(string FileName)
+    {
+        Close();
+#ifdef _WIN32
+        _File = CreateFileA(FileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (_File == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER FileSize;
+        GetFileSizeEx(_File, &FileSize);
+        _Size = (size_t)FileSize.QuadPart;
+#else
+        _File = open(FileName.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_File < 0)
+            return false;
+        struct stat FileInfo;
+        fstat(_File, &FileInfo);
+        _Size = (size_t)FileInfo.st_size;
+#endif
+        return _Map();
+    }
+
+    bool IsOpen() const
+    {
+#ifdef _WIN32
+        return _File != INVALID_HANDLE_VALUE;
+#else
+        return _File >= 0;
+#endif
+    }
+
+    bool Resize(size_t NewSize)
+    {
+        _Unmap();
+#ifdef _WIN32
+        LARGE_INTEGER FileSize;
+        FileSize.QuadPart = (LONGLONG)NewSize;
+        bool Resized = SetFilePointerEx(_File, FileSize, NULL, FILE_BEGIN) && SetEndOfFile(_File);
+#else
+        bool Resized = ftruncate(_File, (off_t)NewSize) == 0;
+#endif
+        if (!Resized)
+        {
+            _Map(); // The file keeps its old size, mapped again
+            return false;
+        }
+        _Size = NewSize;
+        return _Map();
+    }
+
+    // Pushes dirty pages to disk. False if they may not be there.
+    bool Flush()
+    {
+        if (_Data == nullptr)
+            return false;
+#ifdef _WIN32
+        return FlushViewOfFile(_Data, _Size) && FlushFileBuffers(_File);
+#else
+        return msync(_Data, _Size, MS_SYNC) == 0;
+#endif
+    }
+
+    void Close()
+    {
+        _Unmap();
+#ifdef _WIN32
+        if (_File != INVALID_HANDLE_VALUE)
+            CloseHandle(_File);
+        _File = INVALID_HANDLE_VALUE;
+#else
+        if (_File >= 0)
+            close(_File);
+        _File = -1;
+#endif
+        _Size = 0;
+    }
+
+    char* Data() const
+    {
+        return _Data;
+    }
+
+    size_t Size() const
+    {
+        return _Size;
+    }
+};
+
+// =============================================================
+//                      Binary Client File
+// =============================================================
+
+// Clients.dat is a header followed by fixed-width records, so the record of
+// a client is found by offset and a balance change writes 8 bytes in place.
+// Fields are zero padded and are not null terminated when they are full.
+// Numbers are stored in the byte order of the machine that wrote the file.
+const size_t BinaryAccountNumberWidth = 20;
+const size_t BinaryPinCodeWidth = 12;
+const size_t BinaryNameWidth = 64;
+const size_t BinaryPhoneWidth = 16;
+
+struct stClientBinaryHeader
+{
+    char Magic[8];          // "BANKDAT\0"
+    uint32_t Version;
+    uint32_t RecordSize;
+    uint64_t RecordCount;   // Records in use, deleted ones included
+    char Reserved[40];
+};
+
+struct stClientBinaryRecord
+{
+    char AccountNumber[BinaryAccountNumberWidth];
+    char PinCode[BinaryPinCodeWidth];
+    char Name[BinaryNameWidth];
+    char Phone[BinaryPhoneWidth];
+    Cents AccountBalance;   // Version 1 stored a double here
+    uint8_t MarkForDelete;
+    char Reserved[7];
+};
+
+static_assert(sizeof(stClientBinaryHeader) == 64, "Binary header layout changed");
+static_assert(sizeof(stClientBinaryRecord) == 128, "Binary record layout changed");
+
+const char BinaryFileMagic[8] = { 'B', 'A', 'N', 'K', 'D', 'A', 'T', '\0' };
+const uint32_t BinaryFileVersion = 2;
+
+// True if every field fits its fixed-width slot in Clients.dat.
+bool FitsBinaryRecord(const stClientView& Client)
+{
+    return Client.AccountNumber.length() <= BinaryAccountNumberWidth
+        && Client.PinCode.length() <= BinaryPinCodeWidth
+        && Client.Name.length() <= BinaryNameWidth
+        && Client.Phone.length() <= BinaryPhoneWidth;
+}
+
+void WriteBinaryField(char* Field, size_t Width, string_view Value)
+{
+    memset(Field, 0, Width);
+    memcpy(Field, Value.data(), min(Width, Value.length()));
+}
+
+string ReadBinaryField(const char* Field, size_t Width)
+{
+    return string(Field, find(Field, Field + Width, '\0'));
+}
+
+// Only clients that are not deleted are written, so the record starts live.
+void ConvertRecordToBinary(const stClientView& Client, stClientBinaryRecord& Record)
+{
+    WriteBinaryField(Record.AccountNumber, BinaryAccountNumberWidth, Client.AccountNumber);
+    WriteBinaryField(Record.PinCode, BinaryPinCodeWidth, Client.PinCode);
+    WriteBinaryField(Record.Name, BinaryNameWidth, Client.Name);
+    WriteBinaryField(Record.Phone, BinaryPhoneWidth, Client.Phone);
+    Record.AccountBalance = Client.AccountBalance;
+    Record.MarkForDelete = 0;
+    memset(Record.Reserved, 0, sizeof(Record.Reserved));
+}
+
+stClientData ConvertBinaryToRecord(const stClientBinaryRecord& Record)
+{
+    stClientData Client;
+    Client.AccountNumber = ReadBinaryField(Record.AccountNumber, BinaryAccountNumberWidth);
+    Client.PinCode = ReadBinaryField(Record.PinCode, BinaryPinCodeWidth);
+    Client.Name = ReadBinaryField(Record.Name, BinaryNameWidth);
+    Client.Phone = ReadBinaryField(Record.Phone, BinaryPhoneWidth);
+    Client.AccountBalance = Record.AccountBalance;
+    Client.MarkForDelete = Record.MarkForDelete != 0;
+    return Client;
+}
+
+class clsClientsBinaryFile
+{
+private:
+    clsMappedFile _File;
+    vector<uint64_t> _vSlots;       // Record slot of every store handle, in handle order
+    vector<uint64_t> _vFreeSlots;   // Slots of deleted records, reused by Append
+
+    stClientBinaryHeader* _Header() const
+    {
+        return (stClientBinaryHeader*)_File.Data();
+    }
+
+    stClientBinaryRecord* _Record(uint64_t Slot) const
+    {
+        return (stClientBinaryRecord*)(_File.Data() + sizeof(stClientBinaryHeader)) + Slot;
+    }
+
+    uint64_t _Capacity() const
+    {
+        return (_File.Size() - sizeof(stClientBinaryHeader)) / sizeof(stClientBinaryRecord);
+    }
+
+    // Version 1 kept balances as doubles in the same 8 bytes. They are
+    // rounded to cents in place once, then the file is marked as version 2.
+    void _MigrateFromVersion1()
+    {
+        for (uint64_t Slot = 0; Slot < _Header()->RecordCount; Slot++)
+        {
+            stClientBinaryRecord* Record = _Record(Slot);
+            double OldBalance;
+            memcpy(&OldBalance, &Record->AccountBalance, sizeof(OldBalance));
+            Record->AccountBalance = (Cents)llround(OldBalance * 100);
+        }
+        _Header()->Version = BinaryFileVersion;
+        _File.Flush();
+    }
+
+    bool _Reserve(uint64_t RecordCount)
+    {
+        if (RecordCount <= _Capacity())
+            return true;
+
+        uint64_t NewCapacity = max<uint64_t>(RecordCount, _Capacity() * 2);
+        return _File.Resize(sizeof(stClientBinaryHeader) + NewCapacity * sizeof(stClientBinaryRecord));
+    }
+
+public:
+    // Opens Clients.dat, writing an empty header if the file is new.
+    // Returns false if the file cannot be mapped or is not a client file.
+    bool Open(string FileName)
+    {
+        if (!_File.Open(FileName))
+            return false;
+
+        if (_File.Size() == 0)
+        {
+            if (!_File.Resize(sizeof(stClientBinaryHeader) + 1024 * sizeof(stClientBinaryRecord)))
+                return false;
+            stClientBinaryHeader* Header = _Header();
+            memset(Header, 0, sizeof(stClientBinaryHeader));
+            memcpy(Header->Magic, BinaryFileMagic, sizeof(BinaryFileMagic));
+            Header->Version = BinaryFileVersion;
+            Header->RecordSize = sizeof(stClientBinaryRecord);
+            Header->RecordCount = 0;
+        }
+
+        if (_File.Size() < sizeof(stClientBinaryHeader)
+            || memcmp(_Header()->Magic, BinaryFileMagic, sizeof(BinaryFileMagic)) != 0
+            || (_Header()->Version != BinaryFileVersion && _Header()->Version != 1)
+            || _Header()->RecordSize != sizeof(stClientBinaryRecord)
+            || _Header()->RecordCount > _Capacity())
+        {
+            _File.Close();
+            return false;
+        }
+
+        if (_Header()->Version == 1)
+            _MigrateFromVersion1();
+        return true;
+    }
+
+    bool IsOpen() const
+    {
+        return _File.IsOpen();
+    }
+
+    // Builds the in-memory book from the mapped records: no text is parsed,
+    // each record is copied straight out of the mapping.
+    clsClientStore Load()
+    {
+        clsClientStore Clients;
+        ClientHandle Handle;
+        uint64_t RecordCount = _Header()->RecordCount;
+
+        _vSlots.clear();
+        _vSlots.reserve(RecordCount);
+        _vFreeSlots.clear();
+        Clients.Reserve(RecordCount);
+
+        for (uint64_t Slot = 0; Slot < RecordCount; Slot++)
+        {
+            const stClientBinaryRecord* Record = _Record(Slot);
+            if (Record->MarkForDelete)
+            {
+                _vFreeSlots.push_back(Slot);
+                continue;
+            }
+
+            if (Clients.Add(ConvertBinaryToRecord(*Record), Handle))
+                _vSlots.push_back(Slot);
+        }
+        return Clients;
+    }
+
+    // Writes the record of a client that was just added to the store, into
+    // the slot of a deleted record if there is one, so the file does not
+    // grow with every account opened and closed.
+    bool Append(const stClientView& Client)
+    {
+        if (!_vFreeSlots.empty())
+        {
+            uint64_t Slot = _vFreeSlots.back();
+            _vFreeSlots.pop_back();
+            ConvertRecordToBinary(Client, *_Record(Slot));
+            _vSlots.push_back(Slot);
+            return true;
+        }
+
+        uint64_t Slot = _Header()->RecordCount;
+        if (!_Reserve(Slot + 1))
+            return false;
+
+        ConvertRecordToBinary(Client, *_Record(Slot));
+        _Header()->RecordCount = Slot + 1;
+        _vSlots.push_back(Slot);
+        return true;
+    }
+
+    void WriteRecord(ClientHandle Handle, const stClientView& Client)
+    {
+        ConvertRecordToBinary(Client, *_Record(_vSlots[Handle]));
+    }
+
+    void WriteBalance(ClientHandle Handle, Cents AccountBalance)
+    {
+        _Record(_vSlots[Handle])->AccountBalance = AccountBalance;
+    }
+
+    void MarkDeleted(ClientHandle Handle)
+    {
+        _Record(_vSlots[Handle])->MarkForDelete = 1;
+        _vFreeSlots.push_back(_vSlots[Handle]);
+    }
+
+    // Follows a compaction of the store: the records stay where they are,
+    // only the handles that point to them change.
+    void RemapHandles(const vector<ClientHandle>& vNewHandles)
+    {
+        vector<uint64_t> vSlots(_vSlots.size());
+        size_t Count = 0;
+        for (ClientHandle Handle = 0; Handle < vNewHandles.size(); Handle++)
+        {
+            if (vNewHandles[Handle] != NoClientHandle)
+            {
+                vSlots[vNewHandles[Handle]] = _vSlots[Handle];
+                Count++;
+            }
+        }
+        vSlots.resize(Count);
+        _vSlots.swap(vSlots);
+    }
+
+    bool Flush()
+    {
+        return _File.Flush();
+    }
+};
+
+// Writes a fresh Clients.dat holding every client of the store.
+// Returns the number of clients that did not fit the fixed-width fields.
+size_t SaveClientsDataToBinaryFile(string FileName, const clsClientStore& Clients)
+{
+    size_t Skipped = 0;
+    remove(FileName.c_str());
+
+    clsClientsBinaryFile BinaryFile;
+    if (!BinaryFile.Open(FileName))
+        return Clients.Size();
+
+    Clients.ForEach([&](const stClientView& C)
+        {
+            if (!FitsBinaryRecord(C) || !BinaryFile.Append(C))
+                Skipped++;
+        });
+    BinaryFile.Flush();
+    return Skipped;
+}
+
+// =============================================================
+//                      Persistence
+// =============================================================
+
+// Journal records of several changes, written to the journal together.
+struct stJournalBatch
+{
+    string Records;
+    size_t RecordCount = 0;
+};
+
+// The files of one engine and what it knows about them. The journal is
+// declared last so it is destroyed first: until its writer stops, it
+// syncs the ledger and reports to the replication log.
+struct stEngineFiles
+{
+    string Folder;                  // Empty for the working directory
+    enStorageFormat Storage = eTextStorage;
+    unsigned LoadThreads = 1;       // Threads that parse Clients.txt
+
+    // Version written into the trailer of the last snapshot loaded or saved.
+    uint64_t SnapshotVersion = 0;
+
+    // Lines of Clients.txt that were skipped by the last load.
+    vector<stFileLoadError> vLoadErrors;
+
+    clsAccountLedger Ledger;
+    clsReplicationLog ReplicationLog;
+    clsClientsBinaryFile BinaryFile;
+    clsClientsJournal Journal;
+
+    string PathOf(const string& FileName) const
+    {
+        return Folder.empty() ? FileName : (filesystem::path(Folder) / FileName).string();
+    }
+
+    // The file that checkpoints save the book to, unless it is Clients.dat.
+    string SnapshotFileName() const
+    {
+        return PathOf((Storage == eColumnarStorage) ? ClientsColumnarFileName : ClientsFileName);
+    }
+
+    clsClientStore LoadSnapshot(string FileName, vector<stFileLoadError>& vErrors, stSnapshotStatus& Status) const
+    {
+        if (Storage == eColumnarStorage)
+            return LoadClientsDataFromColumnarFile(FileName, vErrors, Status);
+        return (LoadThreads > 1)
+            ? LoadClientsDataFromFileParallel(FileName, LoadThreads, vErrors, Status)
+            : LoadClientsDataFromFile(FileName, vErrors, Status);
+    }
+
+    clsClientStore LoadClientsData()
+    {
+        clsStatsTimer Timer(eStatLoad);
+
+        if (Storage == eBinaryStorage)
+        {
+            // Only grouped balance changes go through the journal in binary
+            // mode. If some are left, the last run may have stopped before
+            // they all reached Clients.dat, so they are written again.
+            clsClientStore Clients = BinaryFile.Load();
+            if (ReplayJournalFile(PathOf(JournalFileName), Clients) > 0)
+            {
+                for (ClientHandle Handle = 0; Handle < Clients.SlotCount(); Handle++)
+                    BinaryFile.WriteBalance(Handle, Clients.Balance(Handle));
+                BinaryFile.Flush();
+            }
+            Journal.Truncate();
+            return Clients;
+        }
+
+        string FileName = SnapshotFileName();
+        vLoadErrors.clear();
+        stSnapshotStatus Status;
+        clsClientStore Clients = LoadSnapshot(FileName, vLoadErrors, Status);
+
+        // A damaged or missing snapshot falls back to the one it replaced
+        if (!Status.Found || !Status.Intact)
+        {
+            vector<stFileLoadError> vPreviousErrors;
+            stSnapshotStatus PreviousStatus;
+            clsClientStore Previous = LoadSnapshot(PreviousSnapshotFileName(FileName), vPreviousErrors, PreviousStatus);
+
+            string Problem = Status.Found ? "records do not match the snapshot checksum" : "file is missing";
+            if (PreviousStatus.Found && PreviousStatus.Intact)
+            {
+                // Move the damaged file aside so the next save keeps the good .prev
+                if (Status.Found)
+                {
+                    error_code Error;
+                    filesystem::rename(FileName, FileName + ".damaged", Error);
+                    Problem += Error ? "" : " (moved to " + FileName + ".damaged)";
+                }
+                Clients = move(Previous);
+                vLoadErrors = move(vPreviousErrors);
+                Status = PreviousStatus;
+                Problem += ", loaded the previous snapshot " + PreviousSnapshotFileName(FileName)
+                    + " (version " + to_string(Status.Version) + ")";
+            }
+            if (Status.Found || PreviousStatus.Found)
+                vLoadErrors.insert(vLoadErrors.begin(), { 0, Problem });
+        }
+
+        SnapshotVersion = Status.Version;
+        Journal.SetRecordCount(ReplayJournalFile(PathOf(JournalFileName), Clients));
+        return Clients;
+    }
+
+    // Folds the journal back into Clients.txt (or Clients.col) and starts an
+    // empty journal. Clients.dat is already up to date, so it only has to
+    // reach the disk.
+    bool CheckpointClientsData(const clsClientStore& Clients)
+    {
+        if (Storage == eBinaryStorage)
+        {
+            if (!BinaryFile.Flush())
+                return false;
+        }
+        else
+        {
+            bool Saved = (Storage == eColumnarStorage)
+                ? SaveClientsDataToColumnarFile(SnapshotFileName(), Clients, SnapshotVersion + 1)
+                : SaveClientsDataToFile(SnapshotFileName(), Clients, SnapshotVersion + 1);
+            if (!Saved)
+                return false; // Keep the journal, it still holds the changes
+            SnapshotVersion++;
+        }
+
+        Ledger.Sync();
+        Ledger.SaveIndexIfDue();
+        return Journal.Truncate();
+    }
+
+    bool IsCheckpointDue() const
+    {
+        return Journal.RecordCount() >= JournalCheckpointThreshold;
+    }
+
+    // Called after a change was persisted, at a point where no one else is
+    // changing the store.
+    void CheckpointClientsDataIfDue(const clsClientStore& Clients)
+    {
+        if (IsCheckpointDue())
+            CheckpointClientsData(Clients);
+    }
+
+    // Writes one record to the journal, or adds it to Batch if there is one.
+    // False if the journal write it waited for failed.
+    bool CommitJournalRecord(enJournalRecordType Type, string Payload, stJournalBatch* Batch = nullptr,
+        bool MustBeSynced = false)
+    {
+        string Record = ConvertJournalRecordToLine(Type, Payload) + '\n';
+        if (Batch != nullptr && !MustBeSynced)
+        {
+            Batch->Records += Record;
+            Batch->RecordCount++;
+            return true;
+        }
+
+        clsStatsTimer Timer(eStatJournalWrite);
+        return Journal.Append(Record, 1, MustBeSynced);
+    }
+
+    bool CommitJournalBatch(const stJournalBatch& Batch)
+    {
+        return WaitForJournal(QueueJournalBatch(Batch));
+    }
+
+    // Queues the records of Batch and returns the ticket to wait for; 0,
+    // which is never waited for, if there are none.
+    uint64_t QueueJournalBatch(const stJournalBatch& Batch)
+    {
+        if (Batch.RecordCount == 0)
+            return 0;
+        return Journal.Enqueue(Batch.Records, Batch.RecordCount);
+    }
+
+    bool WaitForJournal(uint64_t Ticket)
+    {
+        clsStatsTimer Timer(eStatJournalWrite);
+        return Journal.Wait(Ticket);
+    }
+
+    // The Persist* functions write one change that was already made to the
+    // store. They return false if its journal record did not reach the disk
+// (or, for a new client, Clients.dat could not grow).
+
+    bool PersistClientBalance(ClientHandle Handle, const clsClientStore& Clients, stJournalBatch* Batch = nullptr)
+    {
+        stClientView Client = Clients.Get(Handle);
+
+        if (Storage == eBinaryStorage)
+        {
+            BinaryFile.WriteBalance(Handle, Client.AccountBalance);
+            return true;
+        }
+        return CommitJournalRecord(eJournalSetBalance, string(Client.AccountNumber) + "#//#" + FormatMoney(Client.AccountBalance), Batch);
+    }
+
+    // Persists the balances of several clients as one unit: a single journal
+    // line that is either replayed whole or, if cut off by a crash, ignored.
+    // Clients.dat is only written in place after that line is in the journal.
+    bool PersistClientBalances(const vector<ClientHandle>& vHandles, const clsClientStore& Clients, stJournalBatch* Batch = nullptr)
+    {
+        string Payload;
+        for (ClientHandle Handle : vHandles)
+        {
+            stClientView Client = Clients.Get(Handle);
+            if (!Payload.empty())
+                Payload += "#//#";
+            Payload.append(Client.AccountNumber).append("#//#") += FormatMoney(Client.AccountBalance);
+        }
+        if (!CommitJournalRecord(eJournalSetBalances, Payload, Batch, Storage == eBinaryStorage))
+            return false; // Clients.dat must not get ahead of the journal line
+
+        if (Storage == eBinaryStorage)
+        {
+            for (ClientHandle Handle : vHandles)
+                BinaryFile.WriteBalance(Handle, Clients.Balance(Handle));
+        }
+        return true;
+    }
+
+    bool PersistNewClient(ClientHandle Handle, const clsClientStore& Clients, stJournalBatch* Batch = nullptr)
+    {
+        if (Storage != eBinaryStorage)
+            return CommitJournalRecord(eJournalAddClient, ConvertRecordToLine(Clients.Get(Handle)), Batch);
+        return BinaryFile.Append(Clients.Get(Handle));
+    }
+
+    bool PersistUpdatedClient(ClientHandle Handle, const clsClientStore& Clients, stJournalBatch* Batch = nullptr)
+    {
+        if (Storage != eBinaryStorage)
+            return CommitJournalRecord(eJournalUpdateClient, ConvertRecordToLine(Clients.Get(Handle)), Batch);
+        BinaryFile.WriteRecord(Handle, Clients.Get(Handle));
+        return true;
+    }
+
+    bool PersistDeletedClient(ClientHandle Handle, const clsClientStore& Clients, stJournalBatch* Batch = nullptr)
+    {
+        if (Storage != eBinaryStorage)
+            return CommitJournalRecord(eJournalDeleteClient, string(Clients.Get(Handle).AccountNumber), Batch);
+        BinaryFile.MarkDeleted(Handle);
+        return true;
+    }
+};
+
+// =============================================================
+//                      File Stamps
+// =============================================================
+
+// Size and modification time of a file, enough to tell that it was
+// rewritten since it was last looked at.
+struct stFileStamp
+{
+    bool Exists = false;
+    uintmax_t Size = 0;
+    filesystem::file_time_type ModifiedAt;
+
+    bool operator==(const stFileStamp& Other) const
+    {
+        return Exists == Other.Exists && Size == Other.Size && ModifiedAt == Other.ModifiedAt;
+    }
+};
+
+stFileStamp ReadFileStamp(const string& FileName)
+{
+    stFileStamp Stamp;
+    error_code Error;
+    Stamp.Size = filesystem::file_size(FileName, Error);
+    if (Error)
+        return stFileStamp();
+    Stamp.ModifiedAt = filesystem::last_write_time(FileName, Error);
+    Stamp.Exists = !Error;
+    return Stamp;
+}
+
+} // namespace
+
+// =============================================================
+//                      Format Conversion
+// =============================================================
+
+enEngineResult ConvertTextFileToBinary(string TextFileName, string BinaryFileName, stConversionResult& Result)
+{
+    stSnapshotStatus Status;
+    Result = stConversionResult();
+    clsClientStore Clients = LoadClientsDataFromFile(TextFileName, Result.vErrors, Status);
+    if (!Status.Found)
+        return eEngineCannotOpen;
+    if (!Status.Intact)
+        Result.vErrors.insert(Result.vErrors.begin(), { 0, "records do not match the snapshot checksum" });
+    if (TextFileName == ClientsFileName)
+        ReplayJournalFile(JournalFileName, Clients);
+
+    Result.Skipped = SaveClientsDataToBinaryFile(BinaryFileName, Clients);
+    Result.Converted = Clients.Size() - Result.Skipped;
+    return Result.Skipped == 0 ? eEngineDone : eEngineFieldTooLong;
+}
+
+enEngineResult ConvertBinaryFileToText(string BinaryFileName, string TextFileName, stConversionResult& Result)
+{
+    clsClientsBinaryFile BinaryFile;
+    Result = stConversionResult();
+    if (!BinaryFile.Open(BinaryFileName))
+        return eEngineCannotOpen;
+
+    clsClientStore Clients = BinaryFile.Load();
+    if (!SaveClientsDataToFile(TextFileName, Clients, 1))
+        return eEngineCannotOpen;
+    Result.Converted = Clients.Size();
+    return eEngineDone;
+}
+
+enEngineResult ConvertTextFileToColumnar(string TextFileName, string ColumnarFileName, stConversionResult& Result)
+{
+    stSnapshotStatus Status;
+    Result = stConversionResult();
+    clsClientStore Clients = LoadClientsDataFromFile(TextFileName, Result.vErrors, Status);
+    if (!Status.Found)
+        return eEngineCannotOpen;
+    if (!Status.Intact)
+        Result.vErrors.insert(Result.vErrors.begin(), { 0, "records do not match the snapshot checksum" });
+    if (TextFileName == ClientsFileName)
+        ReplayJournalFile(JournalFileName, Clients);
+
+    if (!SaveClientsDataToColumnarFile(ColumnarFileName, Clients, Status.Version + 1))
+        return eEngineCannotOpen;
+    Result.Converted = Clients.Size();
+    return eEngineDone;
+}
+
+enEngineResult ConvertColumnarFileToText(string ColumnarFileName, string TextFileName, stConversionResult& Result)
+{
+    stSnapshotStatus Status;
+    Result = stConversionResult();
+    clsClientStore Clients = LoadClientsDataFromColumnarFile(ColumnarFileName, Result.vErrors, Status);
+    if (!Status.Found || !Status.Intact)
+        return eEngineCannotOpen;
+
+    if (!SaveClientsDataToFile(TextFileName, Clients, Status.Version + 1))
+        return eEngineCannotOpen;
+    Result.Converted = Clients.Size();
+    return eEngineDone;
+}
+
+// =============================================================
+//                      Transaction Logic
+// =============================================================
+
+string EngineResultToString(enEngineResult Result)
+{
+    switch (Result)
+    {
+    case eEngineDone: return "OK";
+    case eEngineNotFound: return "not found";
+    case eEngineAlreadyExists: return "account number already exists";
+    case eEngineInvalidAmount: return "invalid amount";
+    case eEngineInsufficientFunds: return "amount exceeds the balance";
+    case eEngineSameAccount: return "cannot transfer to the same account";
+    case eEngineFieldTooLong: return "field too long for the binary clients file";
+    case eEngineInvalidOperation: return "invalid operation";
+    case eEngineCannotOpen: return "cannot open the clients file";
+    case eEngineCannotOpenLedger: return "cannot open the ledger";
+    case eEngineReadOnly: return "read-only standby";
+    case eEngineCannotReadLedger: return "cannot read the ledger";
+    case eEngineCannotWriteJournal: return "cannot write the journal";
+    case eEngineLedgerPartial: return "the ledger lacks the changes replicated from a primary";
+    }
+    return "";
+}
+
+namespace
+{
+
+// Sum = A + B, or false if the sum is beyond what a balance may hold.
+// The test is made without adding, so it cannot overflow itself.
+bool AddCents(Cents A, Cents B, Cents& Sum)
+{
+    if (A > MaxMoneyCents || A < -MaxMoneyCents || B > MaxMoneyCents || B < -MaxMoneyCents
+        || (B > 0 && A > MaxMoneyCents - B) || (B < 0 && A < -MaxMoneyCents - B))
+        return false;
+    Sum = A + B;
+    return true;
+}
+
+// ApplyDeposit and ApplyWithdraw only change the balance in the store;
+// the caller decides when the change is persisted.
+enEngineResult ApplyDeposit(ClientHandle Handle, Cents Amount, clsClientStore& Clients)
+{
+    clsStatsTimer Timer(eStatDeposit);
+    Cents Balance;
+    if (!(Amount > 0) || !AddCents(Clients.Balance(Handle), Amount, Balance))
+        return eEngineInvalidAmount;
+
+    Clients.SetBalance(Handle, Balance);
+    return eEngineDone;
+}
+
+enEngineResult ApplyWithdraw(ClientHandle Handle, Cents Amount, clsClientStore& Clients)
+{
+    clsStatsTimer Timer(eStatWithdraw);
+    if (!(Amount > 0))
+        return eEngineInvalidAmount;
+
+    // Same rule as the Withdraw screen: never more than the balance
+    if (Amount > Clients.Balance(Handle))
+        return eEngineInsufficientFunds;
+
+    Clients.SetBalance(Handle, Clients.Balance(Handle) - Amount);
+    return eEngineDone;
+}
+
+// Applies every leg in order or none of them: the legs are first checked
+// against running balances, and the store is only touched once all pass.
+// A leg may spend money that an earlier leg of the same batch brought in.
+// On success vTouched holds every client whose balance changed, for
+// PersistClientBalances, and vChanges the two ledger entries of each leg;
+// on failure FailedLeg is the index of the leg that was refused.
+enEngineResult ApplyTransferBatch(span<const stEngineOperation> vLegs, clsClientStore& Clients,
+    vector<ClientHandle>& vTouched, vector<stLedgerChange>& vChanges, size_t& FailedLeg)
+{
+    vector<pair<ClientHandle, Cents>> vBalances; // Running balance of each touched client
+
+    auto BalanceOf = [&](ClientHandle Handle) -> Cents&
+        {
+            for (pair<ClientHandle, Cents>& Balance : vBalances)
+            {
+                if (Balance.first == Handle)
+                    return Balance.second;
+            }
+            vBalances.push_back({ Handle, Clients.Balance(Handle) });
+            return vBalances.back().second;
+        };
+
+    vTouched.clear();
+    vChanges.clear();
+    for (FailedLeg = 0; FailedLeg < vLegs.size(); FailedLeg++)
+    {
+        const stEngineOperation& Leg = vLegs[FailedLeg];
+        ClientHandle From, To;
+
+        if (Leg.Type != eOperationTransfer)
+            return eEngineInvalidOperation;
+        if (!Clients.Find(Leg.AccountNumber, From) || !Clients.Find(Leg.ToAccountNumber, To))
+            return eEngineNotFound;
+        if (From == To)
+            return eEngineSameAccount;
+        if (!(Leg.Amount > 0))
+            return eEngineInvalidAmount;
+        if (Leg.Amount > BalanceOf(From))
+            return eEngineInsufficientFunds;
+        Cents ToBalance;
+        if (!AddCents(BalanceOf(To), Leg.Amount, ToBalance))
+            return eEngineInvalidAmount;
+
+        BalanceOf(From) -= Leg.Amount;
+        BalanceOf(To) = ToBalance;
+        vChanges.push_back({ Leg.AccountNumber, eLedgerTransferOut, -Leg.Amount, BalanceOf(From) });
+        vChanges.push_back({ Leg.ToAccountNumber, eLedgerTransferIn, Leg.Amount, BalanceOf(To) });
+    }
+
+    for (const pair<ClientHandle, Cents>& Balance : vBalances)
+    {
+        Clients.SetBalance(Balance.first, Balance.second);
+        vTouched.push_back(Balance.first);
+    }
+    return eEngineDone;
+}
+
+// Deposits, withdrawals and transfers only change balances; the other
+// operations change which clients there are or what they hold.
+bool IsBalanceOperation(enEngineOperationType Type)
+{
+    return Type == eOperationDeposit || Type == eOperationWithdraw || Type == eOperationTransfer;
+}
+
+void CopyClient(const stClientView& From, stClientData& To)
+{
+    To.AccountNumber = From.AccountNumber;
+    To.PinCode = From.PinCode;
+    To.Name = From.Name;
+    To.Phone = From.Phone;
+    To.AccountBalance = From.AccountBalance;
+    To.MarkForDelete = false;
+}
+
+// A balance change a failed journal write takes back, by its amount.
+struct stBalanceChange
+{
+    string AccountNumber;
+    enLedgerEntryType Type;
+    Cents Amount;
+};
+
+// What ApplyOperation changed, for TakeBackOperation.
+struct stOperationUndo
+{
+    enEngineOperationType Type = eOperationDeposit;
+    vector<stBalanceChange> vBalanceChanges;    // Deposits, withdrawals and transfers
+    ClientHandle Handle = NoClientHandle;       // The client added
+    stClientData Client;                        // The client before an update or a delete
+};
+
+// Takes back balance changes whose journal record did not reach the disk.
+// Each balance goes back by the amount of its change, so changes other
+// tellers made to the account since then stay. The ledger gets entries
+// taking the changes back, and the journal a record of the balances now,
+// queued after the one that failed so a replay ends with them. The caller
+// holds the stripes of the accounts.
+void TakeBackBalanceChanges(stEngineFiles& Files, clsClientStore& Clients, span<const stBalanceChange> vChanges)
+{
+    vector<ClientHandle> vHandles;
+    vector<stLedgerChange> vLedgerChanges;
+    for (const stBalanceChange& Change : vChanges)
+    {
+        ClientHandle Handle;
+        Cents Balance;
+        if (!Clients.Find(Change.AccountNumber, Handle) || !AddCents(Clients.Balance(Handle), -Change.Amount, Balance))
+            continue; // Deleted since, or the balance moved too far to go back
+
+        Clients.SetBalance(Handle, Balance);
+        vLedgerChanges.push_back({ Change.AccountNumber, Change.Type, -Change.Amount, Balance });
+        if (find(vHandles.begin(), vHandles.end(), Handle) == vHandles.end())
+            vHandles.push_back(Handle);
+    }
+    if (vHandles.empty())
+        return;
+
+    stJournalBatch Batch;
+    Files.Ledger.Append(Files.Ledger.NewOperationId(), vLedgerChanges);
+    Files.PersistClientBalances(vHandles, Clients, &Batch);
+    Files.QueueJournalBatch(Batch);
+}
+
+// Takes back an operation whose journal record did not reach the disk,
+// with the locks the operation took still held, so nothing changed the
+// clients it touched meanwhile. Balances go back by the amounts they
+// changed (see TakeBackBalanceChanges).
+void TakeBackOperation(stEngineFiles& Files, const stOperationUndo& Undo, clsClientStore& Clients)
+{
+    stJournalBatch Batch;
+
+    switch (Undo.Type)
+    {
+    case eOperationAddClient:
+    {
+        Cents Balance = Clients.Balance(Undo.Handle);
+        string AccountNumber(Clients.Get(Undo.Handle).AccountNumber);
+        Clients.Remove(Undo.Handle);
+        if (Balance != 0)
+            Files.Ledger.Append(Files.Ledger.NewOperationId(), { AccountNumber, eLedgerOpening, -Balance, 0 });
+        Files.PersistDeletedClient(Undo.Handle, Clients, &Batch);
+        break;
+    }
+
+    case eOperationUpdateClient:
+    {
+        ClientHandle Handle;
+        if (!Clients.Find(Undo.Client.AccountNumber, Handle))
+            break;
+        Cents Balance = Clients.Balance(Handle);
+        Clients.Update(Handle, Undo.Client);
+        if (Balance != Undo.Client.AccountBalance)
+            Files.Ledger.Append(Files.Ledger.NewOperationId(), { Undo.Client.AccountNumber, eLedgerAdjustment,
+                Undo.Client.AccountBalance - Balance, Undo.Client.AccountBalance });
+        Files.PersistUpdatedClient(Handle, Clients, &Batch);
+        break;
+    }
+
+    case eOperationDeleteClient:
+    {
+        ClientHandle Handle;
+        if (Clients.Add(Undo.Client, Handle))
+            Files.PersistNewClient(Handle, Clients, &Batch);
+        break;
+    }
+
+    default:
+        TakeBackBalanceChanges(Files, Clients, Undo.vBalanceChanges);
+    }
+    Files.QueueJournalBatch(Batch);
+}
+
+// Applies and persists one operation. The caller holds the locks the
+// operation needs (see clsBankEngine::Apply). The journal records are
+// collected in Batch for the caller to queue, and what was changed in
+// Undo for the caller to take back if they do not reach the disk.
+// eEngineCannotWriteJournal means a record that had to be on the disk at
+// once did not get there (Clients.dat is only written after its journal
+// line): the change is in the book and the caller takes it back.
+stEngineOutcome ApplyOperation(stEngineFiles& Files, const stEngineOperation& Operation, clsClientStore& Clients,
+    stJournalBatch& Batch, stOperationUndo& Undo)
+{
+    stEngineOutcome Outcome;
+    ClientHandle Handle;
+    Undo = stOperationUndo();
+    Undo.Type = Operation.Type;
+
+    switch (Operation.Type)
+    {
+    case eOperationDeposit:
+    case eOperationWithdraw:
+        if (!Clients.Find(Operation.AccountNumber, Handle))
+            Outcome.Result = eEngineNotFound;
+        else
+        {
+            Outcome.Result = (Operation.Type == eOperationDeposit)
+                ? ApplyDeposit(Handle, Operation.Amount, Clients)
+                : ApplyWithdraw(Handle, Operation.Amount, Clients);
+            Outcome.Balance = Clients.Balance(Handle);
+            if (Outcome.Result != eEngineDone)
+                break;
+
+            // The ledger entry is queued first, so it reaches the disk before the journal record
+            stLedgerChange Change = (Operation.Type == eOperationDeposit)
+                ? stLedgerChange{ Operation.AccountNumber, eLedgerDeposit, Operation.Amount, Outcome.Balance }
+                : stLedgerChange{ Operation.AccountNumber, eLedgerWithdraw, -Operation.Amount, Outcome.Balance };
+            Files.Ledger.Append(Files.Ledger.NewOperationId(), Change);
+            Undo.vBalanceChanges.push_back({ string(Change.AccountNumber), Change.Type, Change.Amount });
+            if (!Files.PersistClientBalance(Handle, Clients, &Batch))
+                Outcome.Result = eEngineCannotWriteJournal;
+        }
+        break;
+
+    case eOperationTransfer:
+    {
+        vector<ClientHandle> vTouched;
+        vector<stLedgerChange> vChanges;
+        size_t FailedLeg;
+        Outcome.Result = ApplyTransferBatch(span<const stEngineOperation>(&Operation, 1), Clients, vTouched, vChanges, FailedLeg);
+        if (Outcome.Result != eEngineDone)
+            break;
+
+        Files.Ledger.Append(Files.Ledger.NewOperationId(), vChanges);
+        for (const stLedgerChange& Change : vChanges)
+            Undo.vBalanceChanges.push_back({ string(Change.AccountNumber), Change.Type, Change.Amount });
+        if (!Files.PersistClientBalances(vTouched, Clients, &Batch))
+            Outcome.Result = eEngineCannotWriteJournal;
+        Clients.Find(Operation.AccountNumber, Handle);
+        Outcome.Balance = Clients.Balance(Handle);
+        Clients.Find(Operation.ToAccountNumber, Handle);
+        Outcome.ToBalance = Clients.Balance(Handle);
+        break;
+    }
+
+    case eOperationAddClient:
+    case eOperationUpdateClient:
+    {
+        if (Files.Storage == eBinaryStorage && !FitsBinaryRecord(Operation.Client))
+        {
+            Outcome.Result = eEngineFieldTooLong;
+            break;
+        }
+
+        stClientData Client;
+        Client.AccountNumber = Operation.Client.AccountNumber;
+        Client.PinCode = Operation.Client.PinCode;
+        Client.Name = Operation.Client.Name;
+        Client.Phone = Operation.Client.Phone;
+        Client.AccountBalance = Operation.Client.AccountBalance;
+
+        if (Operation.Type == eOperationAddClient)
+        {
+            if (!Clients.Add(Client, Handle))
+                Outcome.Result = eEngineAlreadyExists;
+            else if (Files.Storage == eBinaryStorage && !Files.PersistNewClient(Handle, Clients, &Batch))
+            {
+                // Clients.dat could not grow, so the client is dropped before anything else is written
+                Clients.RemoveLastAdded(Handle);
+                Outcome.Result = eEngineCannotOpen;
+            }
+            else
+            {
+                Files.Ledger.OpenAccount(Client.AccountNumber);
+                if (Client.AccountBalance != 0)
+                    Files.Ledger.Append(Files.Ledger.NewOperationId(), { Client.AccountNumber, eLedgerOpening, Client.AccountBalance, Client.AccountBalance });
+                Undo.Handle = Handle;
+                if (Files.Storage != eBinaryStorage)
+                    Files.PersistNewClient(Handle, Clients, &Batch);
+            }
+        }
+        else if (!Clients.Find(Client.AccountNumber, Handle))
+            Outcome.Result = eEngineNotFound;
+        else
+        {
+            CopyClient(Clients.Get(Handle), Undo.Client);
+            Clients.Update(Handle, Client);
+            if (Client.AccountBalance != Undo.Client.AccountBalance)
+                Files.Ledger.Append(Files.Ledger.NewOperationId(), { Client.AccountNumber, eLedgerAdjustment,
+                    Client.AccountBalance - Undo.Client.AccountBalance, Client.AccountBalance });
+            Files.PersistUpdatedClient(Handle, Clients, &Batch);
+        }
+        Outcome.Balance = Client.AccountBalance;
+        break;
+    }
+
+    case eOperationDeleteClient:
+        if (!Clients.Find(Operation.AccountNumber, Handle))
+            Outcome.Result = eEngineNotFound;
+        else
+        {
+            CopyClient(Clients.Get(Handle), Undo.Client);
+            Clients.Remove(Handle);
+            Files.PersistDeletedClient(Handle, Clients, &Batch);
+        }
+        break;
+
+    default:
+        Outcome.Result = eEngineInvalidOperation;
+    }
+    return Outcome;
+}
+
+// =============================================================
+//                      Interest and Fee Accrual
+// =============================================================
+
+enEngineResult CheckAccrualTiers(span<const stAccrualTier> vTiers)
+{
+    if (vTiers.empty())
+        return eEngineInvalidOperation;
+
+    for (size_t i = 0; i < vTiers.size(); i++)
+    {
+        if (i > 0 && vTiers[i].FromBalance <= vTiers[i - 1].FromBalance)
+            return eEngineInvalidOperation; // Tiers must go up
+        if (abs(vTiers[i].RateBasisPoints) > MaxAccrualRateBasisPoints || vTiers[i].Fee < 0)
+            return eEngineInvalidAmount;
+    }
+    return eEngineDone;
+}
+
+// Balance * RateBasisPoints / 10000, rounded half away from zero. The
+// balance is split so no product can overflow 64 bits.
+Cents AccrualInterest(Cents Balance, int RateBasisPoints)
+{
+    Cents Whole = Balance / 10000;
+    Cents Rest = Balance % 10000;
+    Cents Scaled = Rest * RateBasisPoints;
+    Cents Rounded = (Scaled >= 0) ? (Scaled + 5000) / 10000 : (Scaled - 5000) / 10000;
+    return Whole * RateBasisPoints + Rounded;
+}
+
+// Applies the tiers to the balances of the slots [Begin, End). Threads get
+// ranges of their own, so they never write the same balance. A balance the
+// interest would take beyond MaxMoneyCents is left as it is and sets
+// Overflowed, which stops every thread.
+void AccrueBalances(span<Cents> vBalances, span<const uint8_t> vLive, size_t Begin, size_t End,
+    span<const stAccrualTier> vTiers, atomic<bool>& Overflowed, stAccrualSummary& Summary)
+{
+    Summary.vTiers.assign(vTiers.size(), stAccrualTierSummary());
+
+    for (size_t Handle = Begin; Handle < End; Handle++)
+    {
+        Cents Balance = vBalances[Handle];
+        if (!vLive[Handle] || Balance < vTiers[0].FromBalance)
+            continue;
+
+        // The last tier whose FromBalance the balance reaches
+        size_t Tier = upper_bound(vTiers.begin(), vTiers.end(), Balance,
+            [](Cents Value, const stAccrualTier& Tier) { return Value < Tier.FromBalance; }) - vTiers.begin() - 1;
+
+        Cents Interest = AccrualInterest(Balance, vTiers[Tier].RateBasisPoints);
+        Cents WithInterest;
+        if (!AddCents(Balance, Interest, WithInterest) || Overflowed)
+        {
+            Overflowed = true;
+            return;
+        }
+        Cents Fee = min(vTiers[Tier].Fee, max<Cents>(0, WithInterest)); // A fee never makes a balance negative
+
+        stAccrualTierSummary& TierSummary = Summary.vTiers[Tier];
+        TierSummary.Accounts++;
+        TierSummary.BalancesBefore += Balance;
+        TierSummary.Interest += Interest;
+        TierSummary.Fees += Fee;
+
+        vBalances[Handle] = WithInterest - Fee;
+    }
+}
+
+// One ledger entry per account whose balance the run changed, all under
+// one operation id. With Undo the entries take the run back.
+void RecordAccrualInLedger(clsAccountLedger& Ledger, const clsClientStore& Clients, span<const Cents> vOldBalances, bool Undo)
+{
+    const size_t ChunkSize = 65536;
+    uint64_t OperationId = Ledger.NewOperationId();
+    span<const Cents> vBalances = Clients.BalanceColumn();
+    span<const uint8_t> vLive = Clients.LiveColumn();
+    vector<stLedgerChange> vChanges;
+
+    for (ClientHandle Handle = 0; Handle < vBalances.size(); Handle++)
+    {
+        if (!vLive[Handle] || vBalances[Handle] == vOldBalances[Handle])
+            continue;
+
+        Cents Change = vBalances[Handle] - vOldBalances[Handle];
+        vChanges.push_back({ Clients.Get(Handle).AccountNumber, eLedgerAccrual, Undo ? -Change : Change,
+            Undo ? vOldBalances[Handle] : vBalances[Handle] });
+        if (vChanges.size() == ChunkSize)
+        {
+            Ledger.Append(OperationId, vChanges);
+            vChanges.clear();
+        }
+    }
+    Ledger.Append(OperationId, vChanges);
+}
+
+// Runs AccrueBalances over the whole store on ThreadCount threads and adds
+// up what each thread saw. False if a balance would overflow; the caller
+// puts the old balances back.
+bool AccrueAllBalances(clsClientStore& Clients, span<const stAccrualTier> vTiers, unsigned ThreadCount,
+    stAccrualSummary& Summary)
+{
+    span<Cents> vBalances = Clients.BalanceColumnForUpdate();
+    span<const uint8_t> vLive = Clients.LiveColumn();
+    size_t SlotCount = vBalances.size();
+    ThreadCount = (unsigned)max<size_t>(1, min<size_t>(ThreadCount, SlotCount / 65536 + 1));
+
+    vector<stAccrualSummary> vParts(ThreadCount);
+    atomic<bool> Overflowed{ false };
+    vector<thread> vThreads;
+    for (unsigned i = 1; i < ThreadCount; i++)
+    {
+        vThreads.emplace_back(AccrueBalances, vBalances, vLive, SlotCount / ThreadCount * i,
+            (i + 1 == ThreadCount) ? SlotCount : SlotCount / ThreadCount * (i + 1), vTiers,
+            ref(Overflowed), ref(vParts[i]));
+    }
+    AccrueBalances(vBalances, vLive, 0, SlotCount / ThreadCount, vTiers, Overflowed, vParts[0]);
+    for (thread& T : vThreads)
+        T.join();
+    if (Overflowed)
+        return false;
+
+    Summary = stAccrualSummary();
+    Summary.vTiers.assign(vTiers.size(), stAccrualTierSummary());
+    Summary.Threads = ThreadCount;
+    for (const stAccrualSummary& Part : vParts)
+    {
+        for (size_t Tier = 0; Tier < vTiers.size(); Tier++)
+        {
+            stAccrualTierSummary& Total = Summary.vTiers[Tier];
+            Total.Accounts += Part.vTiers[Tier].Accounts;
+            Total.BalancesBefore += Part.vTiers[Tier].BalancesBefore;
+            Total.Interest += Part.vTiers[Tier].Interest;
+            Total.Fees += Part.vTiers[Tier].Fees;
+        }
+    }
+    for (const stAccrualTierSummary& Tier : Summary.vTiers)
+    {
+        Summary.Accounts += Tier.Accounts;
+        Summary.Interest += Tier.Interest;
+        Summary.Fees += Tier.Fees;
+    }
+    return true;
+}
+
+// =============================================================
+//                      Client Locks
+// =============================================================
+
+const size_t AccountLockStripes = 256;
+
+// Locks that let many tellers share one book. The store lock is taken
+// exclusively only when the indexes change (add, update, delete) or when
+// the whole book has to be seen at once (total, checkpoint). Everything else takes it
+// shared plus the stripe of its account, so tellers working on unrelated
+// accounts never wait for each other.
+class clsClientLocks
+{
+private:
+    shared_mutex _StoreMutex;
+    array<mutex, AccountLockStripes> _vStripes;
+
+public:
+    shared_mutex& Store()
+    {
+        return _StoreMutex;
+    }
+
+    size_t StripeOf(string_view AccountNumber) const
+    {
+        return stAccountNumberHash{}(AccountNumber) % AccountLockStripes;
+    }
+
+    mutex& ForAccount(string_view AccountNumber)
+    {
+        return _vStripes[StripeOf(AccountNumber)];
+    }
+
+    // Locks the stripes of several accounts. Stripes are always taken in
+    // increasing order, so two tellers locking overlapping sets of accounts
+    // cannot deadlock, and a stripe shared by two accounts is taken once.
+    vector<unique_lock<mutex>> ForAccounts(const vector<string_view>& vAccountNumbers)
+    {
+        vector<size_t> vIndexes;
+        for (string_view AccountNumber : vAccountNumbers)
+            vIndexes.push_back(StripeOf(AccountNumber));
+        sort(vIndexes.begin(), vIndexes.end());
+        vIndexes.erase(unique(vIndexes.begin(), vIndexes.end()), vIndexes.end());
+
+        vector<unique_lock<mutex>> vLocks;
+        for (size_t Index : vIndexes)
+            vLocks.emplace_back(_vStripes[Index]);
+        return vLocks;
+    }
+
+    // Locks every stripe, in the same order. With the store lock held
+    // shared as well, no balance can change until they are released.
+    vector<unique_lock<mutex>> ForAllAccounts()
+    {
+        vector<unique_lock<mutex>> vLocks;
+        vLocks.reserve(AccountLockStripes);
+        for (mutex& Stripe : _vStripes)
+            vLocks.emplace_back(Stripe);
+        return vLocks;
+    }
+};
+
+} // namespace
+
+// =============================================================
+//                      Bank Engine
+// =============================================================
+
+// A compaction starts once tombstones are at least this many and at least
+// a quarter of the slots, so a few deletes never trigger a full copy.
+const size_t CompactionMinTombstones = 1024;
+const chrono::milliseconds CompactionRetryDelay(100);
+
+struct stBankEngineState
+{
+    stEngineFiles Files;
+    clsClientStore Clients;
+    clsClientLocks Locks;
+    stFileStamp DataStamp;
+    stFileStamp JournalStamp;
+
+    // Bumped under the exclusive store lock whenever a client is added,
+    // updated or deleted, or the book is loaded again, so a compaction can
+    // tell that its copy is out of date.
+    uint64_t LayoutVersion = 0;
+
+    // Bumped by every committed change while it still holds its locks, so
+    // a snapshot taken with every balance frozen reads an exact version.
+    atomic<uint64_t> BookVersion{ 0 };
+    thread Compactor;
+    atomic<bool> Compacting{ false };
+
+    // Replication. ReadOnly only changes under the exclusive store lock.
+    atomic<bool> ReadOnly{ false };
+    mutable mutex ReplicationMutex;
+    enReplicationRole Role = eReplicationNone;
+    uint64_t AppliedPosition = 0;   // Standby: primary records applied
+    uint64_t PrimaryPosition = 0;   // Standby: primary records announced
+    int64_t ApplyLagMs = 0;
+    bool InSync = false;            // Standby: a snapshot and every batch since are applied
+    size_t SnapshotsApplied = 0;
+    size_t BatchesApplied = 0;
+
+    ~stBankEngineState()
+    {
+        if (Compactor.joinable())
+            Compactor.join();
+    }
+
+    string DataFileName() const
+    {
+        return (Files.Storage == eBinaryStorage) ? Files.PathOf(ClientsBinaryFileName) : Files.SnapshotFileName();
+    }
+
+    // Returns the store lock shared with the search indexes built. The flag
+    // is only read under the store lock; the first search builds them with
+    // the lock exclusive and takes it shared again.
+    shared_lock<shared_mutex> LockSearchIndexes()
+    {
+        shared_lock<shared_mutex> StoreLock(Locks.Store());
+        while (!Clients.HasSearchIndexes())
+        {
+            StoreLock.unlock();
+            {
+                unique_lock<shared_mutex> BuildLock(Locks.Store());
+                Clients.BuildSearchIndexes();
+            }
+            StoreLock.lock();
+        }
+        return StoreLock;
+    }
+
+    // Runs Read with the store lock shared and every stripe held, so it sees
+    // all balances at one moment while lookups go on.
+    template <typename Reader>
+    auto WithBalancesFrozen(Reader Read)
+    {
+        shared_lock<shared_mutex> StoreLock(Locks.Store());
+        vector<unique_lock<mutex>> Stripes = Locks.ForAllAccounts();
+        return Read(Clients);
+    }
+
+    // Folds the journal into Clients.txt once it is long enough. The store
+    // lock is taken exclusively so no change can slip in between the save
+    // and the truncation of the journal.
+    void CheckpointIfDue()
+    {
+        if (!Files.IsCheckpointDue())
+            return;
+
+        unique_lock<shared_mutex> StoreLock(Locks.Store());
+        Files.CheckpointClientsDataIfDue(Clients);
+    }
+
+    // The copy is built under the shared lock, so finds, deposits and
+    // withdrawals go on meanwhile (adding, updating and deleting wait);
+    // only the swap takes the store lock exclusively.
+    bool Compact()
+    {
+        clsStatsTimer Timer(eStatCompaction);
+        vector<ClientHandle> vNewHandles;
+        clsClientStore Copy;
+        uint64_t Version;
+        bool SearchIndexed;
+        {
+            shared_lock<shared_mutex> StoreLock(Locks.Store());
+            Version = LayoutVersion;
+            SearchIndexed = Clients.HasSearchIndexes();
+            Copy = Clients.CompactedCopy(vNewHandles);
+        }
+
+        // Nobody else sees the copy yet, so no lock is needed for this
+        if (SearchIndexed)
+            Copy.BuildSearchIndexes();
+
+        unique_lock<shared_mutex> StoreLock(Locks.Store());
+        if (LayoutVersion != Version)
+            return false;
+
+        // Balances kept changing during the copy; no change can run now
+        Copy.CopyBalancesFrom(Clients, vNewHandles);
+        if (Files.Storage == eBinaryStorage)
+            Files.BinaryFile.RemapHandles(vNewHandles);
+        Clients = move(Copy);
+        LayoutVersion++;
+        return true;
+    }
+
+    bool IsCompactionDue()
+    {
+        shared_lock<shared_mutex> StoreLock(Locks.Store());
+        size_t Tombstones = Clients.DeletedCount();
+        return Tombstones >= CompactionMinTombstones && Tombstones * 4 >= Clients.SlotCount();
+    }
+
+    // Starts a compaction on a thread of its own, unless one is running.
+    // While clients keep being deleted each copy goes out of date before
+    // it can be swapped in, so the thread tries again after a pause.
+    void CompactInBackgroundIfDue()
+    {
+        if (!IsCompactionDue() || Compacting.exchange(true))
+            return;
+
+        if (Compactor.joinable())
+            Compactor.join();
+        Compactor = thread([this]()
+            {
+                while (!Compact() && IsCompactionDue())
+                    this_thread::sleep_for(CompactionRetryDelay);
+                Compacting = false;
+            });
+    }
+};
+
+clsBankEngine::clsBankEngine() : _State(make_unique<stBankEngineState>())
+{
+}
+
+clsBankEngine::~clsBankEngine() = default;
+
+enEngineResult clsBankEngine::Open(const stBankEngineOptions& Options)
+{
+    stEngineFiles& Files = _State->Files;
+    Files.Folder = Options.Folder;
+    Files.Storage = Options.Storage;
+    Files.LoadThreads = (Options.LoadThreads == 0) ? max(1u, thread::hardware_concurrency()) : Options.LoadThreads;
+    Files.Journal.SetFileName(Files.PathOf(JournalFileName));
+    Files.Journal.SetPolicy(Options.Durability);
+    Files.Journal.SetBeforeWrite([&Files]() { return Files.Ledger.Sync(); });
+    Files.Journal.SetObservers(
+        [&Files](string_view Records, uint64_t Position) { Files.ReplicationLog.AfterQueue(Records, Position); },
+        [&Files](uint64_t Position) { Files.ReplicationLog.AfterSync(Position); });
+    Files.Ledger.SetFileNames(Files.PathOf(LedgerFileName), Files.PathOf(LedgerIndexFileName));
+
+    if (Files.Storage == eBinaryStorage && !Files.BinaryFile.Open(Files.PathOf(ClientsBinaryFileName)))
+        return eEngineCannotOpen;
+    if (!Files.Ledger.Open())
+        return eEngineCannotOpenLedger;
+
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    _State->Clients = Files.LoadClientsData();
+    _State->LayoutVersion++;
+    StoreLock.unlock();
+    RememberFiles();
+
+    // Deletes replayed from the journal leave tombstones too
+    _State->CompactInBackgroundIfDue();
+    return eEngineDone;
+}
+
+string clsBankEngine::DataFileName() const
+{
+    return _State->DataFileName();
+}
+
+const vector<stFileLoadError>& clsBankEngine::LoadErrors() const
+{
+    return _State->Files.vLoadErrors;
+}
+
+bool clsBankEngine::ReloadIfChanged()
+{
+    if (ReadFileStamp(_State->DataFileName()) == _State->DataStamp
+        && ReadFileStamp(_State->Files.PathOf(JournalFileName)) == _State->JournalStamp)
+        return false;
+
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    _State->Clients = _State->Files.LoadClientsData();
+    _State->LayoutVersion++;
+    _State->Files.Ledger.Open(); // Picks up the entries of the other program
+    _State->Files.ReplicationLog.RequireSnapshot();
+    _State->BookVersion++;
+    StoreLock.unlock();
+    RememberFiles();
+    return true;
+}
+
+// Called after this process wrote the files (journal appends,
+// checkpoints), so its own writes are not taken for outside changes.
+void clsBankEngine::RememberFiles()
+{
+    _State->Files.Journal.Flush(); // Queued records would change the journal later
+    _State->DataStamp = ReadFileStamp(_State->DataFileName());
+    _State->JournalStamp = ReadFileStamp(_State->Files.PathOf(JournalFileName));
+}
+
+bool clsBankEngine::Checkpoint()
+{
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    return _State->Files.CheckpointClientsData(_State->Clients);
+}
+
+bool clsBankEngine::Compact()
+{
+    return _State->Compact();
+}
+
+size_t clsBankEngine::TombstoneCount() const
+{
+    shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    return _State->Clients.DeletedCount();
+}
+
+bool clsBankEngine::Find(string_view AccountNumber, stClientData& Client) const
+{
+    clsStatsTimer Timer(eStatFind);
+    ClientHandle Handle;
+    shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    if (!_State->Clients.Find(AccountNumber, Handle))
+        return false;
+
+    lock_guard<mutex> AccountLock(_State->Locks.ForAccount(AccountNumber));
+    CopyClient(_State->Clients.Get(Handle), Client);
+    return true;
+}
+
+bool clsBankEngine::Exists(string_view AccountNumber) const
+{
+    shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    return _State->Clients.Exists(AccountNumber);
+}
+
+vector<stClientData> clsBankEngine::FindByNamePrefix(string_view Prefix, size_t MaxResults)
+{
+    clsStatsTimer Timer(eStatFind);
+
+    // Changes to the indexes take the store lock exclusively, so the shared
+    // lock is enough to read them
+    shared_lock<shared_mutex> StoreLock = _State->LockSearchIndexes();
+    vector<stClientData> vClients;
+    for (ClientHandle Handle : _State->Clients.FindByNamePrefix(Prefix, MaxResults))
+        CopyClient(_State->Clients.Get(Handle), vClients.emplace_back());
+    return vClients;
+}
+
+vector<stClientData> clsBankEngine::FindByPhone(string_view Phone)
+{
+    clsStatsTimer Timer(eStatFind);
+    shared_lock<shared_mutex> StoreLock = _State->LockSearchIndexes();
+    vector<stClientData> vClients;
+    for (ClientHandle Handle : _State->Clients.FindByPhone(Phone))
+        CopyClient(_State->Clients.Get(Handle), vClients.emplace_back());
+    return vClients;
+}
+
+size_t clsBankEngine::ClientCount() const
+{
+    shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    return _State->Clients.Size();
+}
+
+size_t clsBankEngine::MemoryBytes() const
+{
+    shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    return _State->Clients.MemoryBytes();
+}
+
+void clsBankEngine::ForEachClient(const function<void(const stClientView&)>& Visit) const
+{
+    Snapshot().ForEachClient(Visit);
+}
+
+// Stops at the Count-th client, so a short list does not freeze the whole
+// book the way a snapshot does.
+vector<string> clsBankEngine::AccountNumbers(size_t Count) const
+{
+    vector<string> vAccountNumbers;
+    shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    span<const uint8_t> vLive = _State->Clients.LiveColumn();
+    vAccountNumbers.reserve(min(Count, _State->Clients.Size()));
+    for (ClientHandle Handle = 0; Handle < vLive.size() && vAccountNumbers.size() < Count; Handle++)
+    {
+        if (vLive[Handle])
+            vAccountNumbers.push_back(string(_State->Clients.Get(Handle).AccountNumber));
+    }
+    return vAccountNumbers;
+}
+
+// The snapshot shares the book's records, so no lock is held once it is
+// taken. Deleted slots stay in it; vLiveBefore[C] counts the clients in
+// the record chunks before chunk C, so a page is found without walking
+// every row before it.
+struct stBookSnapshotState
+{
+    stFrozenClients Clients;
+    vector<size_t> vLiveBefore;
+    uint64_t Version = 0;
+};
+
+// The text columns are frozen under the shared lock, while balance changes
+// go on, and then the balances with every stripe held. Neither copies any
+// text or builds an index; adding, updating and deleting wait for the
+// live column to be copied only.
+clsBookSnapshot clsBankEngine::Snapshot() const
+{
+    unique_ptr<stBookSnapshotState> Snapshot = make_unique<stBookSnapshotState>();
+    {
+        shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+        _State->Clients.Freeze(Snapshot->Clients);
+        vector<unique_lock<mutex>> Stripes = _State->Locks.ForAllAccounts();
+        _State->Clients.FreezeBalances(Snapshot->Clients);
+        Snapshot->Version = _State->BookVersion;
+    }
+
+    const vector<uint8_t>& vLive = Snapshot->Clients.vLive;
+    size_t Live = 0;
+    for (size_t Handle = 0; Handle < vLive.size(); Handle++)
+    {
+        if (Handle % clsRecordColumn::ChunkSize == 0)
+            Snapshot->vLiveBefore.push_back(Live);
+        Live += vLive[Handle];
+    }
+    return clsBookSnapshot(move(Snapshot));
+}
+
+uint64_t clsBankEngine::Version() const
+{
+    return _State->BookVersion;
+}
+
+clsBookSnapshot::clsBookSnapshot(unique_ptr<stBookSnapshotState> State) : _State(move(State))
+{
+}
+
+clsBookSnapshot::clsBookSnapshot(clsBookSnapshot&& Other) noexcept = default;
+
+clsBookSnapshot::~clsBookSnapshot() = default;
+
+uint64_t clsBookSnapshot::Version() const
+{
+    return _State->Version;
+}
+
+size_t clsBookSnapshot::ClientCount() const
+{
+    return _State->Clients.Count;
+}
+
+void clsBookSnapshot::ForEachClient(const function<void(const stClientView&)>& Visit) const
+{
+    ForEachClient(0, _State->Clients.Count, Visit);
+}
+
+// Jumps to the chunk holding row FirstRow, then skips deleted slots.
+void clsBookSnapshot::ForEachClient(size_t FirstRow, size_t RowCount, const function<void(const stClientView&)>& Visit) const
+{
+    const stFrozenClients& Clients = _State->Clients;
+    const vector<size_t>& vLiveBefore = _State->vLiveBefore;
+    if (FirstRow >= Clients.Count || RowCount == 0)
+        return;
+
+    size_t Chunk = upper_bound(vLiveBefore.begin(), vLiveBefore.end(), FirstRow) - vLiveBefore.begin() - 1;
+    size_t Row = vLiveBefore[Chunk];
+    for (ClientHandle Handle = Chunk * clsRecordColumn::ChunkSize; Handle < Clients.vLive.size() && RowCount > 0; Handle++)
+    {
+        if (!Clients.vLive[Handle])
+            continue;
+        if (Row++ < FirstRow)
+            continue;
+        Visit(Clients.Get(Handle));
+        RowCount--;
+    }
+}
+
+Cents clsBookSnapshot::TotalBalances() const
+{
+    return ::TotalBalances(_State->Clients.vBalances);
+}
+
+Cents clsBookSnapshot::MinBalance() const
+{
+    return ::MinBalance(_State->Clients.vBalances, _State->Clients.vLive);
+}
+
+Cents clsBookSnapshot::MaxBalance() const
+{
+    return ::MaxBalance(_State->Clients.vBalances, _State->Clients.vLive);
+}
+
+size_t clsBookSnapshot::CountBalancesAbove(Cents Threshold) const
+{
+    return ::CountBalancesAbove(_State->Clients.vBalances, _State->Clients.vLive, Threshold);
+}
+
+vector<size_t> clsBookSnapshot::BalanceHistogram(Cents From, Cents Width, size_t Count) const
+{
+    return ::BalanceHistogram(_State->Clients.vBalances, _State->Clients.vLive, From, Width, Count);
+}
+
+// Balance changes take the store lock shared plus the stripes of their
+// accounts; adding, updating and deleting clients take it exclusively.
+// A balance change queues its journal record under its locks, which keeps
+// the records in the order of the changes, and waits for the disk after
+// letting go of them; if the write fails it takes the stripes again to
+// take the change back. Adding, updating and deleting wait under the
+// exclusive lock, so they are taken back exactly.
+stEngineOutcome clsBankEngine::Apply(const stEngineOperation& Operation)
+{
+    stEngineOutcome Outcome;
+    clsClientLocks& Locks = _State->Locks;
+    if (_State->ReadOnly)
+    {
+        Outcome.Result = eEngineReadOnly;
+        return Outcome;
+    }
+
+    stJournalBatch Batch;
+    stOperationUndo Undo;
+    if (IsBalanceOperation(Operation.Type))
+    {
+        vector<string_view> vAccountNumbers = { Operation.AccountNumber };
+        if (Operation.Type == eOperationTransfer)
+            vAccountNumbers.push_back(Operation.ToAccountNumber);
+
+        uint64_t Ticket;
+        {
+            shared_lock<shared_mutex> StoreLock(Locks.Store());
+            vector<unique_lock<mutex>> AccountLocks = Locks.ForAccounts(vAccountNumbers);
+            Outcome = ApplyOperation(_State->Files, Operation, _State->Clients, Batch, Undo);
+            Ticket = _State->Files.QueueJournalBatch(Batch);
+            if (Outcome.Result == eEngineCannotWriteJournal)
+                TakeBackOperation(_State->Files, Undo, _State->Clients);
+            _State->BookVersion += (Outcome.Result == eEngineDone);
+        }
+
+        if (Outcome.Result == eEngineDone && !_State->Files.WaitForJournal(Ticket))
+        {
+            shared_lock<shared_mutex> StoreLock(Locks.Store());
+            vector<unique_lock<mutex>> AccountLocks = Locks.ForAccounts(vAccountNumbers);
+            TakeBackBalanceChanges(_State->Files, _State->Clients, Undo.vBalanceChanges);
+            _State->BookVersion++;
+            Outcome.Result = eEngineCannotWriteJournal;
+        }
+    }
+    else
+    {
+        unique_lock<shared_mutex> StoreLock(Locks.Store());
+        Outcome = ApplyOperation(_State->Files, Operation, _State->Clients, Batch, Undo);
+        if (Outcome.Result == eEngineDone && !_State->Files.CommitJournalBatch(Batch))
+        {
+            TakeBackOperation(_State->Files, Undo, _State->Clients);
+            Outcome.Result = eEngineCannotWriteJournal;
+        }
+        _State->LayoutVersion++;
+        _State->BookVersion += (Outcome.Result == eEngineDone);
+    }
+
+    if (Outcome.Result != eEngineDone)
+        return Outcome;
+
+    _State->CheckpointIfDue();
+    if (Operation.Type == eOperationDeleteClient)
+        _State->CompactInBackgroundIfDue();
+    return Outcome;
+}
+
+void clsBankEngine::ApplyBatch(span<const stEngineOperation> vOperations, span<stEngineOutcome> vOutcomes)
+{
+    if (_State->ReadOnly)
+    {
+        for (stEngineOutcome& Outcome : vOutcomes)
+            Outcome = stEngineOutcome{ eEngineReadOnly };
+        return;
+    }
+
+    // The batch waits for its records under the exclusive lock, so if they
+    // do not reach the disk every change is taken back exactly, newest first
+    stJournalBatch Batch;
+    {
+        unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+        size_t Count = min(vOperations.size(), vOutcomes.size());
+        vector<stOperationUndo> vUndo(Count);
+        for (size_t i = 0; i < Count; i++)
+        {
+            vOutcomes[i] = ApplyOperation(_State->Files, vOperations[i], _State->Clients, Batch, vUndo[i]);
+            if (vOutcomes[i].Result == eEngineCannotWriteJournal)
+                TakeBackOperation(_State->Files, vUndo[i], _State->Clients);
+            if (!IsBalanceOperation(vOperations[i].Type))
+                _State->LayoutVersion++;
+        }
+
+        if (!_State->Files.CommitJournalBatch(Batch))
+        {
+            for (size_t i = Count; i-- > 0;)
+            {
+                if (vOutcomes[i].Result != eEngineDone)
+                    continue;
+                TakeBackOperation(_State->Files, vUndo[i], _State->Clients);
+                vOutcomes[i].Result = eEngineCannotWriteJournal;
+            }
+            return;
+        }
+        _State->BookVersion += count_if(vOutcomes.begin(), vOutcomes.begin() + Count,
+            [](const stEngineOutcome& Outcome) { return Outcome.Result == eEngineDone; });
+    }
+    _State->CheckpointIfDue();
+    _State->CompactInBackgroundIfDue();
+}
+
+void clsBankEngine::ImportClients(span<const stClientView> vClients, span<enEngineResult> vResults)
+{
+    if (_State->ReadOnly)
+    {
+        fill(vResults.begin(), vResults.end(), eEngineReadOnly);
+        return;
+    }
+
+    stJournalBatch Batch;
+    stEngineOperation Operation;
+    Operation.Type = eOperationAddClient;
+    size_t Count = min(vClients.size(), vResults.size());
+    vector<ClientHandle> vAdded;
+    stOperationUndo Undo;
+
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    for (size_t i = 0; i < Count; i++)
+    {
+        Operation.Client = vClients[i];
+        vResults[i] = ApplyOperation(_State->Files, Operation, _State->Clients, Batch, Undo).Result;
+        if (vResults[i] == eEngineDone)
+            vAdded.push_back(Undo.Handle);
+    }
+    _State->LayoutVersion++;
+    if (!_State->Files.CommitJournalBatch(Batch))
+    {
+        for (ClientHandle Handle : vAdded)
+        {
+            Undo.Handle = Handle;
+            TakeBackOperation(_State->Files, Undo, _State->Clients);
+        }
+        replace(vResults.begin(), vResults.begin() + Count, eEngineDone, eEngineCannotWriteJournal);
+        return;
+    }
+    _State->BookVersion += vAdded.size();
+}
+
+enEngineResult clsBankEngine::ApplyTransfers(span<const stEngineOperation> vLegs, size_t& FailedLeg)
+{
+    FailedLeg = 0;
+    if (_State->ReadOnly)
+        return eEngineReadOnly;
+
+    vector<string_view> vAccountNumbers;
+    for (const stEngineOperation& Leg : vLegs)
+    {
+        vAccountNumbers.push_back(Leg.AccountNumber);
+        vAccountNumbers.push_back(Leg.ToAccountNumber);
+    }
+
+    // Queued under the stripes and waited for without them, as in Apply
+    enEngineResult Result;
+    vector<stBalanceChange> vUndo;
+    uint64_t Ticket = 0;
+    {
+        shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+        vector<unique_lock<mutex>> AccountLocks = _State->Locks.ForAccounts(vAccountNumbers);
+
+        vector<ClientHandle> vTouched;
+        vector<stLedgerChange> vChanges;
+        Result = ApplyTransferBatch(vLegs, _State->Clients, vTouched, vChanges, FailedLeg);
+        if (Result == eEngineDone)
+        {
+            _State->Files.Ledger.Append(_State->Files.Ledger.NewOperationId(), vChanges);
+            for (const stLedgerChange& Change : vChanges)
+                vUndo.push_back({ string(Change.AccountNumber), Change.Type, Change.Amount });
+
+            stJournalBatch Batch;
+            bool Persisted = _State->Files.PersistClientBalances(vTouched, _State->Clients, &Batch);
+            Ticket = _State->Files.QueueJournalBatch(Batch);
+            if (!Persisted)
+            {
+                TakeBackBalanceChanges(_State->Files, _State->Clients, vUndo);
+                Result = eEngineCannotWriteJournal;
+            }
+            _State->BookVersion += (Result == eEngineDone);
+        }
+    }
+
+    if (Result == eEngineDone && !_State->Files.WaitForJournal(Ticket))
+    {
+        shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+        vector<unique_lock<mutex>> AccountLocks = _State->Locks.ForAccounts(vAccountNumbers);
+        TakeBackBalanceChanges(_State->Files, _State->Clients, vUndo);
+        _State->BookVersion++;
+        Result = eEngineCannotWriteJournal;
+    }
+
+    if (Result == eEngineDone)
+        _State->CheckpointIfDue();
+    return Result;
+}
+
+// The whole run holds the store lock exclusively: no teller sees half of
+// it, and the checkpoint that persists it holds exactly the book before
+// the run plus the run. No journal record is written per account, only a
+// ledger entry. If the checkpoint fails the old balances are put back, in
+// the store and in Clients.dat (and the ledger gets entries taking the run
+// back), so the run either happened on disk or not at all.
+enEngineResult clsBankEngine::ApplyAccrual(span<const stAccrualTier> vTiers, stAccrualSummary& Summary,
+    unsigned ThreadCount)
+{
+    clsStatsTimer Timer(eStatAccrual);
+    auto Start = chrono::steady_clock::now();
+    Summary = stAccrualSummary();
+
+    enEngineResult Result = _State->ReadOnly ? eEngineReadOnly : CheckAccrualTiers(vTiers);
+    if (Result != eEngineDone)
+        return Result;
+    if (ThreadCount == 0)
+        ThreadCount = max(1u, thread::hardware_concurrency());
+
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    clsClientStore& Clients = _State->Clients;
+    Cents BalancesBefore = ::TotalBalances(Clients.BalanceColumn());
+
+    vector<Cents> vOldBalances(Clients.BalanceColumn().begin(), Clients.BalanceColumn().end());
+
+    bool Accrued = AccrueAllBalances(Clients, vTiers, ThreadCount, Summary);
+
+    // Only live clients change, so no slot a deleted client left is written
+    vector<ClientHandle> vChanged;
+    for (ClientHandle Handle = 0; Handle < vOldBalances.size(); Handle++)
+    {
+        if (Clients.Balance(Handle) != vOldBalances[Handle])
+            vChanged.push_back(Handle);
+    }
+    auto PutOldBalancesBack = [&](clsClientsBinaryFile* BinaryFile)
+        {
+            for (ClientHandle Handle : vChanged)
+            {
+                Clients.SetBalance(Handle, vOldBalances[Handle]);
+                if (BinaryFile != nullptr)
+                    BinaryFile->WriteBalance(Handle, vOldBalances[Handle]);
+            }
+        };
+
+    if (!Accrued)
+    {
+        PutOldBalancesBack(nullptr); // Part of the book was accrued before the overflow was seen
+        Summary = stAccrualSummary();
+        return eEngineInvalidAmount;
+    }
+    Summary.BalancesBefore = BalancesBefore;
+    Summary.BalancesAfter = ::TotalBalances(Clients.BalanceColumn());
+    RecordAccrualInLedger(_State->Files.Ledger, Clients, vOldBalances, false);
+
+    // Clients.dat only gets the run now that it is complete
+    clsClientsBinaryFile* BinaryFile = (_State->Files.Storage == eBinaryStorage) ? &_State->Files.BinaryFile : nullptr;
+    if (BinaryFile != nullptr)
+    {
+        for (ClientHandle Handle : vChanged)
+            BinaryFile->WriteBalance(Handle, Clients.Balance(Handle));
+    }
+
+    if (!_State->Files.CheckpointClientsData(Clients))
+    {
+        RecordAccrualInLedger(_State->Files.Ledger, Clients, vOldBalances, true);
+        PutOldBalancesBack(BinaryFile);
+        if (BinaryFile != nullptr)
+            BinaryFile->Flush();
+        return eEngineCannotOpen;
+    }
+    _State->Files.ReplicationLog.RequireSnapshot(); // The run leaves no journal records
+    _State->BookVersion++;
+
+    Summary.Seconds = chrono::duration<double>(chrono::steady_clock::now() - Start).count();
+    return eEngineDone;
+}
+
+// The aggregates freeze every balance, so they see the book at one moment
+// and never half of a transfer, but lookups go on meanwhile.
+
+enEngineResult clsBankEngine::Statement(string_view AccountNumber, int64_t FromTime, int64_t ToTime, vector<stLedgerEntry>& vEntries) const
+{
+    vEntries.clear();
+    if (!HasCompleteLedger())
+        return eEngineLedgerPartial;
+    return _State->Files.Ledger.Statement(AccountNumber, FromTime, ToTime, vEntries) ? eEngineDone : eEngineCannotReadLedger;
+}
+
+Cents clsBankEngine::TotalBalances() const
+{
+    return _State->WithBalancesFrozen([](const clsClientStore& Clients) { return ::TotalBalances(Clients.BalanceColumn()); });
+}
+
+Cents clsBankEngine::MinBalance() const
+{
+    return _State->WithBalancesFrozen([](const clsClientStore& Clients) { return ::MinBalance(Clients.BalanceColumn(), Clients.LiveColumn()); });
+}
+
+Cents clsBankEngine::MaxBalance() const
+{
+    return _State->WithBalancesFrozen([](const clsClientStore& Clients) { return ::MaxBalance(Clients.BalanceColumn(), Clients.LiveColumn()); });
+}
+
+size_t clsBankEngine::CountBalancesAbove(Cents Threshold) const
+{
+    return _State->WithBalancesFrozen([Threshold](const clsClientStore& Clients)
+        {
+            return ::CountBalancesAbove(Clients.BalanceColumn(), Clients.LiveColumn(), Threshold);
+        });
+}
+
+vector<size_t> clsBankEngine::BalanceHistogram(Cents From, Cents Width, size_t Count) const
+{
+    return _State->WithBalancesFrozen([=](const clsClientStore& Clients)
+        {
+            return ::BalanceHistogram(Clients.BalanceColumn(), Clients.LiveColumn(), From, Width, Count);
+        });
+}
+
+// A snapshot for the standby is frozen the way Snapshot freezes the book:
+// the text columns under the shared lock, then the balances with every
+// stripe held, which is also where the position is read. Every change
+// queues its record while it holds the store lock and its stripes, so the
+// snapshot holds exactly the records up to that position. Nothing takes
+// the exclusive lock; deposits and withdrawals wait only while the
+// balance column is copied, and the lines are written with no lock held.
+// The journal is flushed up to the position before the snapshot is shipped.
+
+void clsBankEngine::StartShipping()
+{
+    {
+        lock_guard<mutex> Lock(_State->ReplicationMutex);
+        _State->Role = eReplicationPrimary;
+    }
+    _State->Files.ReplicationLog.Start();
+}
+
+void clsBankEngine::StopShipping()
+{
+    _State->Files.ReplicationLog.Stop();
+}
+
+bool clsBankEngine::NextShipment(stReplicationBatch& Batch, unsigned TimeoutMs)
+{
+    if (!_State->Files.ReplicationLog.WaitForShipment(TimeoutMs))
+    {
+        Batch = stReplicationBatch();
+        Batch.Position = _State->Files.ReplicationLog.Shipped();
+        Batch.CommitTime = NowMilliseconds();
+        return false;
+    }
+
+    clsStatsTimer Timer(eStatReplicate);
+    if (!_State->Files.ReplicationLog.BeginSnapshot())
+        return _State->Files.ReplicationLog.TakeRecords(Batch);
+
+    stFrozenClients Frozen;
+    Batch = stReplicationBatch();
+    Batch.IsSnapshot = true;
+    {
+        shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+        _State->Clients.Freeze(Frozen);
+        vector<unique_lock<mutex>> Stripes = _State->Locks.ForAllAccounts();
+        _State->Clients.FreezeBalances(Frozen);
+        Batch.Position = _State->Files.Journal.QueuedCount();
+    }
+
+    // The copy may hold changes whose records are still queued; it goes out
+    // only once they are on disk, like any record would
+    if (!_State->Files.Journal.Flush())
+    {
+        _State->Files.ReplicationLog.RequireSnapshot();
+        Batch = stReplicationBatch();
+        Batch.Position = _State->Files.ReplicationLog.Shipped();
+        Batch.CommitTime = NowMilliseconds();
+        return false;
+    }
+
+    Batch.RecordCount = Frozen.Count;
+    for (ClientHandle Handle = 0; Handle < Frozen.vLive.size(); Handle++)
+    {
+        if (Frozen.vLive[Handle])
+            Batch.Records += ConvertJournalRecordToLine(eJournalAddClient, ConvertRecordToLine(Frozen.Get(Handle))) + '\n';
+    }
+    Batch.CommitTime = NowMilliseconds();
+    _State->Files.ReplicationLog.SnapshotTaken(Batch.Position, Batch.CommitTime);
+    return true;
+}
+
+void clsBankEngine::AcknowledgeShipment(uint64_t Position)
+{
+    _State->Files.ReplicationLog.Acknowledge(Position);
+}
+
+// Replicated changes get no ledger entries, so from here on the ledger
+// cannot give statements; the mark stays after a promotion and a restart.
+void clsBankEngine::BecomeStandby()
+{
+    _State->Files.Ledger.MarkPartial();
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    lock_guard<mutex> Lock(_State->ReplicationMutex);
+    _State->ReadOnly = true;
+    _State->Role = eReplicationStandby;
+}
+
+namespace
+{
+
+// Applies every line of Records to Clients. Returns false if a line is damaged.
+bool ApplyReplicatedRecords(string_view Records, clsClientStore& Clients)
+{
+    while (!Records.empty())
+    {
+        size_t End = Records.find('\n');
+        if (End == string_view::npos || !ApplyJournalLine(Records.substr(0, End), Clients))
+            return false;
+        Records.remove_prefix(End + 1);
+    }
+    return true;
+}
+
+} // namespace
+
+// A snapshot is built aside and swapped in whole, then saved, so the
+// journal of the standby starts over from it. Records are applied under
+// the exclusive lock, so a reader sees a batch all or not at all, and then
+// journaled like the standby's own changes. Only this thread changes the
+// book of a standby, so the journal write can wait until the lock is let go.
+enEngineResult clsBankEngine::ApplyShipment(const stReplicationBatch& Batch)
+{
+    clsStatsTimer Timer(eStatReplicate);
+
+    if (Batch.IsSnapshot)
+    {
+        clsClientStore Clients;
+        Clients.Reserve(Batch.RecordCount);
+        if (!ApplyReplicatedRecords(Batch.Records, Clients))
+            return eEngineInvalidOperation;
+
+        bool SearchIndexed;
+        {
+            shared_lock<shared_mutex> StoreLock(_State->Locks.Store());
+            SearchIndexed = _State->Clients.HasSearchIndexes();
+        }
+        if (SearchIndexed)
+            Clients.BuildSearchIndexes();
+
+        unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+        if (!_State->ReadOnly)
+            return eEngineInvalidOperation;
+        _State->Clients = move(Clients);
+        _State->LayoutVersion++;
+        _State->BookVersion++;
+        if (!_State->Files.CheckpointClientsData(_State->Clients))
+            return eEngineCannotOpen;
+    }
+    else if (Batch.RecordCount > 0)
+    {
+        {
+            unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+            if (!_State->ReadOnly)
+                return eEngineInvalidOperation;
+
+            lock_guard<mutex> Lock(_State->ReplicationMutex);
+            if (!_State->InSync || Batch.Position - Batch.RecordCount != _State->AppliedPosition)
+                return eEngineInvalidOperation;
+            if (!ApplyReplicatedRecords(Batch.Records, _State->Clients))
+            {
+                _State->InSync = false; // Applied in part, so only a snapshot can follow
+                _State->BookVersion++;
+                return eEngineInvalidOperation;
+            }
+            _State->LayoutVersion++;
+            _State->BookVersion += Batch.RecordCount;
+        }
+        if (!_State->Files.Journal.Append(Batch.Records, Batch.RecordCount))
+        {
+            // The records are in the book but maybe never on disk, so only
+            // a snapshot, which is checkpointed whole, can follow
+            lock_guard<mutex> Lock(_State->ReplicationMutex);
+            _State->InSync = false;
+            return eEngineCannotWriteJournal;
+        }
+    }
+    else
+    {
+        // A heartbeat: the primary has shipped nothing beyond Position
+        lock_guard<mutex> Lock(_State->ReplicationMutex);
+        if (!_State->ReadOnly || !_State->InSync || Batch.Position != _State->AppliedPosition)
+            return eEngineInvalidOperation;
+        _State->PrimaryPosition = Batch.Position;
+        _State->ApplyLagMs = 0;
+        return eEngineDone;
+    }
+
+    {
+        lock_guard<mutex> Lock(_State->ReplicationMutex);
+        _State->AppliedPosition = _State->PrimaryPosition = Batch.Position;
+        _State->ApplyLagMs = max<int64_t>(0, NowMilliseconds() - Batch.CommitTime);
+        _State->InSync = true;
+        if (Batch.IsSnapshot)
+            _State->SnapshotsApplied++;
+        else
+            _State->BatchesApplied++;
+    }
+
+    _State->CheckpointIfDue();
+    _State->CompactInBackgroundIfDue();
+    return eEngineDone;
+}
+
+void clsBankEngine::Promote()
+{
+    unique_lock<shared_mutex> StoreLock(_State->Locks.Store());
+    lock_guard<mutex> Lock(_State->ReplicationMutex);
+    _State->ReadOnly = false;
+    _State->Role = eReplicationPrimary;
+}
+
+bool clsBankEngine::IsReadOnly() const
+{
+    return _State->ReadOnly;
+}
+
+bool clsBankEngine::HasCompleteLedger() const
+{
+    return !_State->Files.Ledger.IsPartial();
+}
+
+stReplicationStatus clsBankEngine::ReplicationStatus() const
+{
+    stReplicationStatus Status;
+    lock_guard<mutex> Lock(_State->ReplicationMutex);
+    Status.Role = _State->Role;
+    if (Status.Role != eReplicationStandby)
+    {
+        _State->Files.ReplicationLog.FillStatus(Status);
+        return Status;
+    }
+
+    Status.Position = _State->AppliedPosition;
+    Status.PeerPosition = _State->PrimaryPosition;
+    Status.LagRecords = _State->PrimaryPosition - _State->AppliedPosition;
+    Status.LagMs = _State->ApplyLagMs;
+    Status.Snapshots = _State->SnapshotsApplied;
+    Status.Batches = _State->BatchesApplied;
+    return Status;
+}
@@ -0,0 +1,627 @@
+// The bank engine: the book of clients, its files and every operation on
+// it, with no console input or output. The console menu, the teller server
+// and the batch runner in BANK_SYSTEM.cpp are clients of it; other programs
+// can link the BankEngine library and call clsBankEngine directly.
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <ostream>
+
+using namespace std;
+
+const string ClientsFileName = "Clients.txt";
+const string JournalFileName = "Clients.journal";
+const string ClientsBinaryFileName = "Clients.dat";
+const string ClientsColumnarFileName = "Clients.col";
+const string LedgerFileName = "Clients.ledger";
+const string LedgerIndexFileName = "Clients.ledger.idx";
+
+// Clients.txt and the journal are read in blocks of this size.
+const size_t FileReadBlockSize = 1 << 20;
+
+// =============================================================
+//                      Client Data
+// =============================================================
+
+// Money is kept as a whole number of cents, so sums and comparisons are exact.
+typedef int64_t Cents;
+
+struct stClientData
+{
+    string AccountNumber;
+    string PinCode;
+    string Name;
+    string Phone;
+    Cents AccountBalance = 0;
+    bool MarkForDelete = false;
+};
+
+// Read-only view of one client. The text fields point into the store (or
+// into the stClientData it was made from), so a view must not outlive it.
+struct stClientView
+{
+    string_view AccountNumber;
+    string_view PinCode;
+    string_view Name;
+    string_view Phone;
+    Cents AccountBalance = 0;
+
+    stClientView() = default;
+
+    stClientView(const stClientData& Client)
+        : AccountNumber(Client.AccountNumber), PinCode(Client.PinCode), Name(Client.Name),
+        Phone(Client.Phone), AccountBalance(Client.AccountBalance)
+    {
+    }
+};
+
+// Reads an amount such as "120", "-3.5" or "20.125" (rounded to 20.13).
+bool ParseMoney(string_view Text, Cents& Amount);
+
+// Writes Amount with two decimals at Out and returns the end of the text.
+char* FormatMoney(char* Out, Cents Amount);
+string FormatMoney(Cents Amount);
+
+size_t SplitFields(string_view Line, string_view Seperator, string_view* Fields, size_t MaxFields);
+string ConvertRecordToLine(const stClientView& Client, string_view Seperator = "#//#");
+bool ConvertLineToRecord(string_view Line, stClientData& Client, string_view Seperator = "#//#");
+bool ConvertLineToRecord(string_view Line, stClientView& Client, string_view Seperator = "#//#");
+
+// =============================================================
+//                      Statistics
+// =============================================================
+
+// Build with BANK_SYSTEM_NO_STATS to compile the timers out entirely.
+// Otherwise they can still be switched off at run time with --no-stats,
+// which leaves one relaxed atomic load per timed call.
+#ifdef BANK_SYSTEM_NO_STATS
+const bool StatsCompiledIn = false;
+#else
+const bool StatsCompiledIn = true;
+#endif
+
+extern atomic<bool> StatsEnabled;
+extern string StatsFileName;
+
+enum enStatsOperation {
+    eStatLoad = 0,
+    eStatSave = 1,
+    eStatFind = 2,
+    eStatDeposit = 3,
+    eStatWithdraw = 4,
+    eStatJournalWrite = 5,
+    eStatReport = 6,
+    eStatJournalSync = 7,
+    eStatCompaction = 8,
+    eStatAccrual = 9,
+    eStatStatement = 10,
+    eStatReplicate = 11,
+    eStatOperationCount = 12
+};
+
+extern const char* const StatsOperationNames[eStatOperationCount];
+
+// Latencies in nanoseconds, counted in log-linear buckets like an HDR
+// histogram: values below 16 get a bucket each, and every power of two
+// above that is split into 16 equal buckets, so any percentile read back
+// is within about 6% of the true value.
+const unsigned StatsSubBucketBits = 4;
+const unsigned StatsSubBucketCount = 1u << StatsSubBucketBits;
+const size_t StatsBucketCount = (64 - StatsSubBucketBits + 1) * StatsSubBucketCount;
+
+// Counters of one kind of operation. Every field is a relaxed atomic, so
+// teller threads record without taking a lock.
+class clsOperationStats
+{
+private:
+    atomic<uint64_t> _Count{ 0 };
+    atomic<uint64_t> _TotalNanoseconds{ 0 };
+    atomic<uint64_t> _MaxNanoseconds{ 0 };
+    array<atomic<uint64_t>, StatsBucketCount> _Buckets{};
+
+public:
+    void Record(uint64_t Nanoseconds);
+    uint64_t Count() const;
+    double MeanMicroseconds() const;
+    double MaxMicroseconds() const;
+    double PercentileMicroseconds(double Fraction) const;
+};
+
+struct stBankStats
+{
+    array<clsOperationStats, eStatOperationCount> Operations;
+    atomic<uint64_t> BytesRead{ 0 };
+    atomic<uint64_t> BytesWritten{ 0 };
+};
+
+extern stBankStats BankStats;
+
+bool IsStatsOn();
+void CountBytesRead(uint64_t Bytes);
+void CountBytesWritten(uint64_t Bytes);
+
+// Times the scope it lives in and records it under Operation.
+class clsStatsTimer
+{
+private:
+    enStatsOperation _Operation;
+    bool _Running;
+    chrono::steady_clock::time_point _Start;
+
+public:
+    clsStatsTimer(enStatsOperation Operation) : _Operation(Operation), _Running(IsStatsOn())
+    {
+        if (_Running)
+            _Start = chrono::steady_clock::now();
+    }
+
+    ~clsStatsTimer()
+    {
+        if (_Running)
+            BankStats.Operations[_Operation].Record(
+                (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - _Start).count());
+    }
+};
+
+void WriteStatsJson(ostream& Out);
+void DumpStatsToFile();
+
+// SIGUSR1 only raises a flag; the dump itself happens at the next safe
+// point (the main menu, the server loop, the batch loop).
+void RequestStatsDump(int);
+void DumpStatsIfRequested();
+
+// =============================================================
+//                      File Reading
+// =============================================================
+
+struct stFileLoadError
+{
+    size_t LineNumber = 0; // 0 when the message is about the whole file
+    string Message;
+};
+
+// Calls OnLine(Line, LineNumber, HasNewline) for every line of the file.
+// The file is read in large blocks and each line is handed over as a view
+// into the block, so lines are never copied one by one. HasNewline is false
+// only for a last line that is not terminated.
+template <typename LineVisitor>
+bool ForEachLineInFile(string FileName, LineVisitor OnLine)
+{
+    FILE* MyFile = fopen(FileName.c_str(), "rb");
+    if (MyFile == nullptr)
+        return false;
+
+    vector<char> Buffer(FileReadBlockSize);
+    size_t Carry = 0;       // Bytes of an unfinished line kept from the previous block
+    size_t LineNumber = 0;
+
+    while (true)
+    {
+        size_t Read = fread(Buffer.data() + Carry, 1, Buffer.size() - Carry, MyFile);
+        CountBytesRead(Read);
+        if (Read == 0)
+        {
+            if (Carry > 0)
+                OnLine(string_view(Buffer.data(), Carry), ++LineNumber, false);
+            break;
+        }
+
+        const char* Block = Buffer.data();
+        size_t End = Carry + Read;
+        size_t Start = 0;
+        const char* NewLine;
+
+        while ((NewLine = (const char*)memchr(Block + Start, '\n', End - Start)) != nullptr)
+        {
+            string_view Line(Block + Start, NewLine - (Block + Start));
+            if (!Line.empty() && Line.back() == '\r')
+                Line.remove_suffix(1);
+
+            OnLine(Line, ++LineNumber, true);
+            Start = (NewLine - Block) + 1;
+        }
+
+        Carry = End - Start;
+        memmove(Buffer.data(), Block + Start, Carry);
+        if (Carry == Buffer.size())
+            Buffer.resize(Buffer.size() * 2); // A single line is longer than a block
+    }
+
+    fclose(MyFile);
+    return true;
+}
+
+// =============================================================
+//                      Engine Options
+// =============================================================
+
+enum enStorageFormat {
+    eTextStorage = 1,       // Clients.txt plus Clients.journal
+    eBinaryStorage = 2,     // Memory-mapped Clients.dat, updated in place
+    eColumnarStorage = 3    // Compressed Clients.col plus Clients.journal
+};
+
+// When an appended journal record has to be on the disk:
+//   sync       before the operation returns; tellers that change the book
+//              at the same time share one write and one fsync (group commit)
+//   group:<ms> as soon as it is queued; the writer thread writes and syncs
+//              everything queued every <ms> milliseconds
+//   batch:<n>  as soon as it is queued; the writer thread writes and syncs
+//              once <n> records are queued
+// Queued records are also written at checkpoints and when the program ends.
+enum enDurabilityMode {
+    eDurabilitySync = 1,
+    eDurabilityGroup = 2,
+    eDurabilityBatch = 3
+};
+
+struct stDurabilityPolicy
+{
+    enDurabilityMode Mode = eDurabilitySync;
+    unsigned Interval = 0; // Milliseconds for group, records for batch
+};
+
+bool ParseDurabilityPolicy(string_view Text, stDurabilityPolicy& Policy);
+
+struct stBankEngineOptions
+{
+    string Folder;              // Where the files are; the working directory if empty
+    enStorageFormat Storage = eTextStorage;
+    unsigned LoadThreads = 1;   // Threads that parse Clients.txt
+    stDurabilityPolicy Durability;
+};
+
+// =============================================================
+//                      Engine Operations
+// =============================================================
+
+enum enEngineResult {
+    eEngineDone = 0,
+    eEngineNotFound = 1,
+    eEngineAlreadyExists = 2,
+    eEngineInvalidAmount = 3,
+    eEngineInsufficientFunds = 4,
+    eEngineSameAccount = 5,
+    eEngineFieldTooLong = 6,     // Does not fit the fixed-width fields of Clients.dat
+    eEngineInvalidOperation = 7,
+    eEngineCannotOpen = 8,
+    eEngineCannotOpenLedger = 9,
+    eEngineReadOnly = 10,        // The book is a standby; changes come from its primary
+    eEngineCannotReadLedger = 11, // An entry of the ledger could not be read back
+    eEngineCannotWriteJournal = 12, // The change did not reach the disk, so it was taken back
+    eEngineLedgerPartial = 13   // The engine was a standby, so the ledger lacks changes
+};
+
+string EngineResultToString(enEngineResult Result);
+
+enum enEngineOperationType {
+    eOperationDeposit = 'D',
+    eOperationWithdraw = 'W',
+    eOperationTransfer = 'T',
+    eOperationAddClient = 'A',
+    eOperationUpdateClient = 'U',
+    eOperationDeleteClient = 'X'
+};
+
+// One change to the book. The views must stay valid for the call that
+// applies the operation; the engine copies what it keeps.
+struct stEngineOperation
+{
+    enEngineOperationType Type = eOperationDeposit;
+    string_view AccountNumber;      // Deposit, withdraw, delete; the payer of a transfer
+    string_view ToAccountNumber;    // Transfer
+    Cents Amount = 0;               // Deposit, withdraw, transfer
+    stClientView Client;            // Add, update
+};
+
+struct stEngineOutcome
+{
+    enEngineResult Result = eEngineDone;
+    Cents Balance = 0;      // Balance of AccountNumber after the operation
+    Cents ToBalance = 0;    // Balance of ToAccountNumber after a transfer
+};
+
+// =============================================================
+//                      Interest and Fee Accrual
+// =============================================================
+
+// One balance tier of an accrual run. A balance falls in the last tier
+// whose FromBalance it reaches; balances below the first tier are left as
+// they are. Tiers go up strictly by FromBalance.
+struct stAccrualTier
+{
+    Cents FromBalance = 0;
+    int RateBasisPoints = 0;    // Interest per run in hundredths of a percent, negative for a charge
+    Cents Fee = 0;              // Flat fee per run, never taking a balance below 0
+};
+
+const int MaxAccrualRateBasisPoints = 10000; // 100% per run
+
+struct stAccrualTierSummary
+{
+    size_t Accounts = 0;
+    Cents BalancesBefore = 0;
+    Cents Interest = 0;
+    Cents Fees = 0;
+};
+
+struct stAccrualSummary
+{
+    vector<stAccrualTierSummary> vTiers;    // One per tier, in the same order
+    size_t Accounts = 0;                    // Accounts in some tier
+    Cents Interest = 0;
+    Cents Fees = 0;
+    Cents BalancesBefore = 0;               // Of the whole book
+    Cents BalancesAfter = 0;
+    unsigned Threads = 0;
+    double Seconds = 0;
+};
+
+// =============================================================
+//                      Account Ledger
+// =============================================================
+
+// Every balance change is also kept for good in Clients.ledger, one entry
+// per account it touched. The legs of one transfer, and every account of
+// one accrual run, share an operation id.
+enum enLedgerEntryType {
+    eLedgerDeposit = 'D',
+    eLedgerWithdraw = 'W',
+    eLedgerTransferOut = 'O',
+    eLedgerTransferIn = 'I',
+    eLedgerAccrual = 'R',       // Interest minus fees of one accrual run
+    eLedgerOpening = 'A',       // Balance of a new client
+    eLedgerAdjustment = 'U'     // Balance changed by updating the client
+};
+
+struct stLedgerEntry
+{
+    uint64_t OperationId = 0;
+    int64_t Time = 0;           // Milliseconds since 1970
+    enLedgerEntryType Type = eLedgerDeposit;
+    Cents Amount = 0;           // Signed change of the balance
+    Cents Balance = 0;          // Balance after the change
+};
+
+string LedgerEntryTypeToString(enLedgerEntryType Type);
+
+// =============================================================
+//                      Format Conversion
+// =============================================================
+
+struct stConversionResult
+{
+    size_t Converted = 0;
+    size_t Skipped = 0;     // Clients with a field too long for Clients.dat
+    vector<stFileLoadError> vErrors;
+};
+
+// Converts Clients.txt (with its journal applied) into Clients.dat.
+enEngineResult ConvertTextFileToBinary(string TextFileName, string BinaryFileName, stConversionResult& Result);
+enEngineResult ConvertBinaryFileToText(string BinaryFileName, string TextFileName, stConversionResult& Result);
+
+// Converts Clients.txt (with its journal applied) into Clients.col and back.
+enEngineResult ConvertTextFileToColumnar(string TextFileName, string ColumnarFileName, stConversionResult& Result);
+enEngineResult ConvertColumnarFileToText(string ColumnarFileName, string TextFileName, stConversionResult& Result);
+
+// =============================================================
+//                      Replication
+// =============================================================
+
+// A primary ships the journal records of its committed changes to one
+// standby, which applies them in order to a copy of the book of its own.
+struct stReplicationBatch
+{
+    bool IsSnapshot = false;    // The records rebuild the whole book instead of continuing it
+    string Records;             // Journal lines, each ending with a newline
+    size_t RecordCount = 0;
+    uint64_t Position = 0;      // Records of the primary covered once this batch is applied
+    int64_t CommitTime = 0;     // When the oldest change in the batch was on disk (ms since 1970)
+};
+
+enum enReplicationRole {
+    eReplicationNone = 0,
+    eReplicationPrimary = 1,
+    eReplicationStandby = 2
+};
+
+string ReplicationRoleToString(enReplicationRole Role);
+
+// A primary's Position counts the records it committed and PeerPosition
+// those the standby confirmed; a standby's Position counts the records it
+// applied and PeerPosition those the primary announced. LagMs is, on a
+// primary, the age of the oldest change the standby has not confirmed and,
+// on a standby, how long after its commit the last batch was applied.
+struct stReplicationStatus
+{
+    enReplicationRole Role = eReplicationNone;
+    uint64_t Position = 0;
+    uint64_t PeerPosition = 0;
+    uint64_t LagRecords = 0;
+    int64_t LagMs = 0;
+    size_t BacklogBytes = 0;    // Primary: records waiting to be shipped
+    size_t Snapshots = 0;
+    size_t Batches = 0;
+};
+
+// =============================================================
+//                      Book Snapshots
+// =============================================================
+
+struct stBookSnapshotState;
+
+// The book as it was at one moment, for reports, exports and aggregates.
+// It shares the clients' text with the book (a chunk changed later is
+// copied first) and copies only the live flags and balances: taking one
+// holds back adding, updating and deleting clients while the flags are
+// copied, and balance changes only while the balances are; after that it
+// holds no lock, so the book goes on changing (and checkpoints run) while
+// a report is rendered.
+class clsBookSnapshot
+{
+private:
+    unique_ptr<stBookSnapshotState> _State;
+
+public:
+    clsBookSnapshot(unique_ptr<stBookSnapshotState> State);
+    clsBookSnapshot(clsBookSnapshot&& Other) noexcept;
+    ~clsBookSnapshot();
+
+    // Changes committed since the book was loaded, up to this snapshot.
+    uint64_t Version() const;
+    size_t ClientCount() const;
+
+    // Visits every client in insertion order, or only the RowCount clients
+    // from row FirstRow (0 based) on, without walking the rows before.
+    void ForEachClient(const function<void(const stClientView&)>& Visit) const;
+    void ForEachClient(size_t FirstRow, size_t RowCount, const function<void(const stClientView&)>& Visit) const;
+
+    Cents TotalBalances() const;
+    Cents MinBalance() const;
+    Cents MaxBalance() const;
+    size_t CountBalancesAbove(Cents Threshold) const;
+    vector<size_t> BalanceHistogram(Cents From, Cents Width, size_t Count) const;
+};
+
+// =============================================================
+//                      Bank Engine
+// =============================================================
+
+struct stBankEngineState;
+
+// The book of one process. It is loaded by Open and every call after that
+// is safe from many threads at once: lookups and balance changes of
+// unrelated accounts run side by side, adding and deleting clients take
+// the whole book for a moment. Every change is persisted before the call
+// returns, as the durability policy says. Engines with different folders
+// are independent of each other.
+class clsBankEngine
+{
+private:
+    unique_ptr<stBankEngineState> _State;
+
+public:
+    clsBankEngine();
+    ~clsBankEngine();
+
+    enEngineResult Open(const stBankEngineOptions& Options = stBankEngineOptions());
+
+    // Lines of Clients.txt that the last load skipped.
+    const vector<stFileLoadError>& LoadErrors() const;
+
+    // The file the book is loaded from: Clients.txt, Clients.dat or Clients.col.
+    string DataFileName() const;
+
+    // Loads the book again if another program changed its files since
+    // RememberFiles. Returns true if it did.
+    bool ReloadIfChanged();
+    void RememberFiles();
+
+    // Folds the journal into Clients.txt (or flushes Clients.dat).
+    bool Checkpoint();
+
+    // Deleted clients stay behind as tombstones until a compaction drops
+    // them. One starts in the background once tombstones are a quarter of
+    // the slots (and at least 1024); Compact runs one now. Returns false if
+    // the book changed shape meanwhile, in which case nothing was replaced.
+    bool Compact();
+    size_t TombstoneCount() const;
+
+    // Lookup
+    bool Find(string_view AccountNumber, stClientData& Client) const;
+    bool Exists(string_view AccountNumber) const;
+    vector<stClientData> FindByNamePrefix(string_view Prefix, size_t MaxResults);
+    vector<stClientData> FindByPhone(string_view Phone);
+    size_t ClientCount() const;
+    size_t MemoryBytes() const;
+
+    // Visits every client in insertion order, as a snapshot sees them, so
+    // Visit must not change the book.
+    void ForEachClient(const function<void(const stClientView&)>& Visit) const;
+
+    // The account numbers of the first Count clients in insertion order.
+    vector<string> AccountNumbers(size_t Count) const;
+
+    // A consistent view of the whole book; see clsBookSnapshot.
+    clsBookSnapshot Snapshot() const;
+    uint64_t Version() const;
+
+    // Changes. A change whose journal record does not reach the disk is
+    // taken back and comes back as eEngineCannotWriteJournal; a balance
+    // goes back by the amount it changed, with ledger entries saying so.
+    stEngineOutcome Apply(const stEngineOperation& Operation);
+
+    // Applies the operations in order, each on its own, and writes their
+    // outcomes to vOutcomes (same size). The book is locked once and the
+    // journal records of the whole span are written together.
+    void ApplyBatch(span<const stEngineOperation> vOperations, span<stEngineOutcome> vOutcomes);
+
+    // Adds new clients in order, writing each result to vResults (same
+    // size), with one journal write for the whole span. Unlike ApplyBatch
+    // it never checkpoints: an import calls Checkpoint once at the end
+    // instead of every few thousand clients.
+    void ImportClients(span<const stClientView> vClients, span<enEngineResult> vResults);
+
+    // Applies a group of transfers as one unit: every leg or none. A leg
+    // may spend money an earlier leg brought in. On failure FailedLeg is
+    // the index of the leg that was refused.
+    enEngineResult ApplyTransfers(span<const stEngineOperation> vLegs, size_t& FailedLeg);
+
+    // Applies interest and fees to every account on ThreadCount threads (0
+    // means one per core) and persists the result as one checkpoint.
+    enEngineResult ApplyAccrual(span<const stAccrualTier> vTiers, stAccrualSummary& Summary, unsigned ThreadCount = 0);
+
+    // Ledger entries of one account with FromTime <= Time <= ToTime
+    // (milliseconds since 1970), oldest first. Only that account's entries
+    // from the newest one back to FromTime are read. An entry that cannot be
+    // read gives eEngineCannotReadLedger rather than a short statement.
+    enEngineResult Statement(string_view AccountNumber, int64_t FromTime, int64_t ToTime, vector<stLedgerEntry>& vEntries) const;
+
+    // Aggregates over the balance column, at one moment. Balance changes
+    // wait while one runs; lookups do not.
+    Cents TotalBalances() const;
+    Cents MinBalance() const;
+    Cents MaxBalance() const;
+    size_t CountBalancesAbove(Cents Threshold) const;
+    vector<size_t> BalanceHistogram(Cents From, Cents Width, size_t Count) const;
+
+    // Replication, primary side. After StartShipping the first shipment
+    // is a snapshot of the book and the next ones carry the records of every
+    // change once they are on disk, oldest first, as many as are ready. If
+    // nothing came within TimeoutMs, NextShipment returns false and leaves a
+    // heartbeat in Batch: no records, at the last position shipped. One
+    // standby is fed at a time, from one thread. Needs the journal, so the
+    // storage must be text or columnar.
+    void StartShipping();
+    void StopShipping();
+    bool NextShipment(stReplicationBatch& Batch, unsigned TimeoutMs);
+    void AcknowledgeShipment(uint64_t Position);
+
+    // Standby side. A standby refuses every change (eEngineReadOnly) except
+    // the shipments of its primary, until Promote makes it a primary of its
+    // own. A batch that does not continue the last one is refused, and the
+    // standby then needs a new snapshot.
+    void BecomeStandby();
+    enEngineResult ApplyShipment(const stReplicationBatch& Batch);
+    void Promote();
+    bool IsReadOnly() const;
+
+    // False once the engine was a standby (even in an earlier run): the
+    // replicated changes have no ledger entries, so Statement refuses
+    // with eEngineLedgerPartial.
+    bool HasCompleteLedger() const;
+
+    stReplicationStatus ReplicationStatus() const;
+};
@@ -0,0 +1,504 @@
+// Benchmarks the bank system on a generated book of clients.
+//
+//   BANK_SYSTEM_Benchmark --generate N [Clients.txt]
+//   BANK_SYSTEM_Benchmark [--clients N] [--operations N] [--storage text|binary|columnar]
+//                         [--load-threads N] [--dir Folder] [--out Results.json]
+//
+// The benchmark works inside its own folder (bench_data by default), so it
+// never touches the Clients.txt next to the application.
+
+#include "BANK_SYSTEM.cpp"
+
+#include <filesystem>
+
+// =============================================================
+//                      Book Generator
+// =============================================================
+
+const char* const GeneratorFirstNames[] = {
+    "Mostafa", "Ahmed", "Mohamed", "Omar", "Youssef", "Ali", "Hassan", "Karim", "Mahmoud", "Tarek",
+    "Sara", "Mariam", "Nour", "Hana", "Laila", "Salma", "Yasmin", "Farida", "Dina", "Rana"
+};
+
+const char* const GeneratorLastNames[] = {
+    "Elsehy", "Hassan", "Ibrahim", "Mostafa", "Saleh", "Fathy", "Nabil", "Adel", "Samir", "Kamal",
+    "Fouad", "Hamdy", "Said", "Ragab", "Shawky", "Zaki", "Lotfy", "Gamal", "Ezzat", "Mansour"
+};
+
+string GeneratedAccountNumber(size_t Index)
+{
+    char Text[24];
+    snprintf(Text, sizeof(Text), "A%08zu", Index + 1);
+    return Text;
+}
+
+// Writes Count clients to FileName. The same Seed always gives the same
+// book, so runs on different builds compare like with like.
+bool GenerateClientsFile(string FileName, size_t Count, uint64_t Seed = 20240101)
+{
+    FILE* File = fopen(FileName.c_str(), "wb");
+    if (File == nullptr)
+        return false;
+
+    mt19937_64 Random(Seed);
+    exponential_distribution<double> BalanceDistribution(1.0 / 250000); // Mean of 2500.00, in cents
+    const size_t FirstNameCount = sizeof(GeneratorFirstNames) / sizeof(GeneratorFirstNames[0]);
+    const size_t LastNameCount = sizeof(GeneratorLastNames) / sizeof(GeneratorLastNames[0]);
+
+    string Buffer;
+    Buffer.reserve(FileReadBlockSize + 256);
+    stClientData Client;
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        Client.AccountNumber = GeneratedAccountNumber(i);
+        Client.PinCode = to_string(1000 + Random() % 9000);
+        Client.Name = string(GeneratorFirstNames[Random() % FirstNameCount]) + " " + GeneratorLastNames[Random() % LastNameCount];
+        Client.Phone = "01" + to_string(100000000 + Random() % 900000000);
+        Client.AccountBalance = (Cents)BalanceDistribution(Random);
+
+        Buffer += ConvertRecordToLine(Client);
+        Buffer += '\n';
+        if (Buffer.size() >= FileReadBlockSize)
+        {
+            fwrite(Buffer.data(), 1, Buffer.size(), File);
+            Buffer.clear();
+        }
+    }
+
+    fwrite(Buffer.data(), 1, Buffer.size(), File);
+    return fclose(File) == 0;
+}
+
+// =============================================================
+//                      Measurements
+// =============================================================
+
+struct stBenchmarkResult
+{
+    string Name;
+    size_t Operations = 0;
+    double Seconds = 0;
+    double P50Microseconds = 0;
+    double P99Microseconds = 0;
+};
+
+// Times each operation on its own, so the report has a latency
+// distribution and not only an average.
+class clsLatencyRecorder
+{
+private:
+    vector<double> _vSamples;
+    chrono::steady_clock::time_point _Start;
+    chrono::steady_clock::time_point _OperationStart;
+
+public:
+    clsLatencyRecorder(size_t ExpectedOperations)
+    {
+        _vSamples.reserve(ExpectedOperations);
+        _Start = chrono::steady_clock::now();
+    }
+
+    void StartOperation()
+    {
+        _OperationStart = chrono::steady_clock::now();
+    }
+
+    void StopOperation()
+    {
+        _vSamples.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - _OperationStart).count());
+    }
+
+    stBenchmarkResult Result(string Name)
+    {
+        stBenchmarkResult Result;
+        Result.Name = Name;
+        Result.Operations = _vSamples.size();
+        Result.Seconds = chrono::duration<double>(chrono::steady_clock::now() - _Start).count();
+        Result.P50Microseconds = Percentile(_vSamples, 0.50);
+        Result.P99Microseconds = Percentile(_vSamples, 0.99);
+        return Result;
+    }
+};
+
+// Swallows whatever is written to it, so list rendering is measured
+// without the cost of a terminal.
+class clsNullBuffer : public streambuf
+{
+protected:
+    streamsize xsputn(const char*, streamsize Count) override
+    {
+        return Count;
+    }
+
+    int overflow(int Character) override
+    {
+        return traits_type::not_eof(Character);
+    }
+};
+
+void PrintBenchmarkResult(const stBenchmarkResult& Result)
+{
+    double PerSecond = Result.Seconds > 0 ? Result.Operations / Result.Seconds : 0;
+    cout << left << setw(18) << Result.Name;
+    cout << right << setw(10) << Result.Operations;
+    cout << setw(14) << fixed << setprecision(0) << PerSecond << " ops/s";
+    cout << setw(12) << setprecision(2) << Result.P50Microseconds << " us p50";
+    cout << setw(12) << Result.P99Microseconds << " us p99\n";
+}
+
+string StorageFormatName(enStorageFormat Storage)
+{
+    return (Storage == eBinaryStorage) ? "binary" : (Storage == eColumnarStorage) ? "columnar" : "text";
+}
+
+bool SaveBenchmarkResults(string FileName, const vector<stBenchmarkResult>& vResults, const stBankEngineOptions& Options,
+    size_t ClientCount, size_t Operations, size_t StoreBytes)
+{
+    fstream Out;
+    Out.open(FileName, ios::out);
+    if (!Out.is_open())
+        return false;
+
+    Out << "{\n  \"storage\": \"" << StorageFormatName(Options.Storage) << "\",\n";
+    Out << "  \"clients\": " << ClientCount << ",\n";
+    Out << "  \"operations\": " << Operations << ",\n";
+    Out << "  \"load_threads\": " << Options.LoadThreads << ",\n";
+    Out << "  \"store_bytes\": " << StoreBytes << ",\n";
+    Out << "  \"results\": [";
+    for (size_t i = 0; i < vResults.size(); i++)
+    {
+        const stBenchmarkResult& Result = vResults[i];
+        Out << (i == 0 ? "\n" : ",\n");
+        Out << "    {\"name\": \"" << Result.Name << "\", \"operations\": " << Result.Operations;
+        Out << ", \"seconds\": " << Result.Seconds;
+        Out << ", \"ops_per_second\": " << (Result.Seconds > 0 ? Result.Operations / Result.Seconds : 0);
+        Out << ", \"p50_us\": " << Result.P50Microseconds << ", \"p99_us\": " << Result.P99Microseconds << "}";
+    }
+    Out << "\n  ]\n}\n";
+    return true;
+}
+
+// =============================================================
+//                      Benchmark Run
+// =============================================================
+
+// Operations handed to one ApplyBatch call in the apply_batch measurement.
+const size_t BenchmarkBatchSize = 1000;
+
+// StoreBytes gets the memory held by the freshly loaded book.
+vector<stBenchmarkResult> RunBenchmarks(const stBankEngineOptions& Options, size_t ClientCount, size_t Operations,
+    size_t& StoreBytes)
+{
+    vector<stBenchmarkResult> vResults;
+    mt19937_64 Random(7);
+
+    {
+        const size_t Runs = 3;
+        clsLatencyRecorder Recorder(Runs);
+        for (size_t i = 0; i < Runs; i++)
+        {
+            clsBankEngine Loaded;
+            Recorder.StartOperation();
+            Loaded.Open(Options);
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("load"));
+    }
+
+    clsBankEngine Engine;
+    Engine.Open(Options);
+    StoreBytes = Engine.MemoryBytes();
+    cout << "Book in memory: " << StoreBytes / (1024 * 1024) << " MiB, "
+        << StoreBytes / max<size_t>(1, Engine.ClientCount()) << " bytes per client\n";
+
+    vector<string> vAccountNumbers(Operations);
+    for (string& AccountNumber : vAccountNumbers)
+        AccountNumber = GeneratedAccountNumber(Random() % ClientCount);
+
+    {
+        clsLatencyRecorder Recorder(Operations);
+        stClientData Client;
+        size_t Found = 0;
+        for (const string& AccountNumber : vAccountNumbers)
+        {
+            Recorder.StartOperation();
+            Found += Engine.Find(AccountNumber, Client);
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("find"));
+        if (Found != Operations)
+            cout << "Warning: only " << Found << " of " << Operations << " lookups found their client.\n";
+    }
+
+    {
+        clsLatencyRecorder Recorder(Operations);
+        stEngineOperation Operation;
+        Operation.Amount = 1000;
+        for (size_t i = 0; i < Operations; i++)
+        {
+            // Deposit on even steps, withdraw the same amount on odd ones
+            Operation.Type = (i % 2 == 0) ? eOperationDeposit : eOperationWithdraw;
+            Operation.AccountNumber = vAccountNumbers[i];
+            Recorder.StartOperation();
+            Engine.Apply(Operation);
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("deposit_withdraw"));
+    }
+
+    {
+        // The same deposits and withdrawals, BenchmarkBatchSize per call.
+        // Each sample is one call; the result is scaled back to operations.
+        size_t Batches = max<size_t>(1, Operations / BenchmarkBatchSize);
+        clsLatencyRecorder Recorder(Batches);
+        vector<stEngineOperation> vOperations(BenchmarkBatchSize);
+        vector<stEngineOutcome> vOutcomes(BenchmarkBatchSize);
+
+        for (size_t Batch = 0; Batch < Batches; Batch++)
+        {
+            for (size_t i = 0; i < BenchmarkBatchSize; i++)
+            {
+                vOperations[i].Type = (i % 2 == 0) ? eOperationDeposit : eOperationWithdraw;
+                vOperations[i].AccountNumber = vAccountNumbers[(Batch * BenchmarkBatchSize + i) % Operations];
+                vOperations[i].Amount = 1000;
+            }
+            Recorder.StartOperation();
+            Engine.ApplyBatch(vOperations, vOutcomes);
+            Recorder.StopOperation();
+        }
+
+        stBenchmarkResult Result = Recorder.Result("apply_batch");
+        Result.Operations *= BenchmarkBatchSize;
+        Result.P50Microseconds /= BenchmarkBatchSize;
+        Result.P99Microseconds /= BenchmarkBatchSize;
+        vResults.push_back(Result);
+    }
+
+    vector<string> vAdded;
+    {
+        clsLatencyRecorder Recorder(Operations);
+        stClientData Client;
+        Client.PinCode = "1234";
+        Client.Name = "Benchmark Client";
+        Client.Phone = "01000000000";
+        Client.AccountBalance = 10000;
+
+        stEngineOperation Operation;
+        Operation.Type = eOperationAddClient;
+        for (size_t i = 0; i < Operations; i++)
+        {
+            Client.AccountNumber = GeneratedAccountNumber(ClientCount + i);
+            Operation.Client = Client;
+            Recorder.StartOperation();
+            if (Engine.Apply(Operation).Result == eEngineDone)
+                vAdded.push_back(Client.AccountNumber);
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("add"));
+    }
+
+    {
+        clsLatencyRecorder Recorder(Operations);
+        stClientData Client;
+        stEngineOperation Operation;
+        Operation.Type = eOperationUpdateClient;
+        for (size_t i = 0; i < Operations; i++)
+        {
+            Recorder.StartOperation();
+            if (Engine.Find(vAccountNumbers[i], Client))
+            {
+                Client.Phone = "01" + to_string(100000000 + i % 900000000);
+                Operation.Client = Client;
+                Engine.Apply(Operation);
+            }
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("update"));
+    }
+
+    {
+        // Deletes the clients added above, so the book ends at its starting size
+        clsLatencyRecorder Recorder(vAdded.size());
+        stEngineOperation Operation;
+        Operation.Type = eOperationDeleteClient;
+        for (const string& AccountNumber : vAdded)
+        {
+            Operation.AccountNumber = AccountNumber;
+            Recorder.StartOperation();
+            Engine.Apply(Operation);
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("delete"));
+    }
+
+    {
+        const size_t Runs = 100;
+        clsLatencyRecorder Recorder(Runs);
+        Cents Total = 0;
+        for (size_t i = 0; i < Runs; i++)
+        {
+            Recorder.StartOperation();
+            Total += Engine.TotalBalances();
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("total_balances"));
+        cout << "Total balances: " << FormatMoney(Total / (Cents)Runs) << "\n";
+    }
+
+    {
+        const size_t Runs = 5;
+        clsNullBuffer NullBuffer;
+        ostream Discard(&NullBuffer);
+        clsLatencyRecorder Recorder(Runs);
+        for (size_t i = 0; i < Runs; i++)
+        {
+            Recorder.StartOperation();
+            RenderClientList(Engine, Discard);
+            Recorder.StopOperation();
+        }
+        vResults.push_back(Recorder.Result("list_render"));
+    }
+
+    {
+        // Deposits while another thread keeps rendering the whole client
+        // list; reports read a snapshot, so these should barely slow down
+        clsNullBuffer NullBuffer;
+        ostream Discard(&NullBuffer);
+        atomic<bool> Stop{ false };
+        thread Reporter([&]()
+            {
+                while (!Stop)
+                    RenderClientList(Engine, Discard);
+            });
+
+        clsLatencyRecorder Recorder(Operations);
+        stEngineOperation Operation;
+        Operation.Type = eOperationDeposit;
+        Operation.Amount = 1;
+        for (size_t i = 0; i < Operations; i++)
+        {
+            Operation.AccountNumber = vAccountNumbers[i];
+            Recorder.StartOperation();
+            Engine.Apply(Operation);
+            Recorder.StopOperation();
+        }
+        Stop = true;
+        Reporter.join();
+        vResults.push_back(Recorder.Result("deposit_during_report"));
+    }
+
+    Engine.Checkpoint();
+    return vResults;
+}
+
+void PrintBenchmarkUsage()
+{
+    cout << "Usage: BANK_SYSTEM_Benchmark --generate N [Clients.txt]\n";
+    cout << "       BANK_SYSTEM_Benchmark [--clients N] [--operations N] [--storage text|binary|columnar]\n";
+    cout << "                             [--load-threads N] [--dir Folder] [--out Results.json]\n";
+}
+
+int main(int argc, char* argv[])
+{
+    vector<string> vArgs(argv + 1, argv + argc);
+
+    if (vArgs.size() >= 2 && vArgs[0] == "--generate")
+    {
+        string FileName = vArgs.size() >= 3 ? vArgs[2] : ClientsFileName;
+        size_t Count = (size_t)atoll(vArgs[1].c_str());
+        if (!GenerateClientsFile(FileName, Count))
+        {
+            cout << "Cannot write " << FileName << ".\n";
+            return 1;
+        }
+        cout << "Wrote " << Count << " clients to " << FileName << ".\n";
+        return 0;
+    }
+
+    size_t ClientCount = 100000, Operations = 100000;
+    stBankEngineOptions Options;
+    string Folder = "bench_data", ResultsFileName = "benchmark_results.json";
+
+    for (size_t i = 0; i < vArgs.size(); i++)
+    {
+        if (vArgs[i] == "--clients" && i + 1 < vArgs.size())
+            ClientCount = max<size_t>(1, (size_t)atoll(vArgs[++i].c_str()));
+        else if (vArgs[i] == "--operations" && i + 1 < vArgs.size())
+            Operations = max<size_t>(1, (size_t)atoll(vArgs[++i].c_str()));
+        else if (vArgs[i] == "--storage" && i + 1 < vArgs.size()
+            && (vArgs[i + 1] == "text" || vArgs[i + 1] == "binary" || vArgs[i + 1] == "columnar"))
+        {
+            i++;
+            Options.Storage = (vArgs[i] == "binary") ? eBinaryStorage
+                : (vArgs[i] == "columnar") ? eColumnarStorage : eTextStorage;
+        }
+        else if (vArgs[i] == "--load-threads" && i + 1 < vArgs.size())
+        {
+            Options.LoadThreads = (unsigned)atoi(vArgs[++i].c_str());
+            if (Options.LoadThreads == 0)
+                Options.LoadThreads = max(1u, thread::hardware_concurrency());
+        }
+        else if (vArgs[i] == "--dir" && i + 1 < vArgs.size())
+            Folder = vArgs[++i];
+        else if (vArgs[i] == "--out" && i + 1 < vArgs.size())
+            ResultsFileName = vArgs[++i];
+        else
+        {
+            PrintBenchmarkUsage();
+            return 1;
+        }
+    }
+
+    // The results file is named relative to where the benchmark was started
+    error_code Error;
+    ResultsFileName = filesystem::absolute(ResultsFileName).string();
+    filesystem::create_directories(Folder, Error);
+    filesystem::current_path(Folder, Error);
+    if (Error)
+    {
+        cout << "Cannot work in folder " << Folder << ".\n";
+        return 1;
+    }
+
+    cout << "Generating " << ClientCount << " clients in " << Folder << "...\n";
+    remove(JournalFileName.c_str());
+    remove(ClientsBinaryFileName.c_str());
+    remove(ClientsColumnarFileName.c_str());
+    if (!GenerateClientsFile(ClientsFileName, ClientCount))
+    {
+        cout << "Cannot write " << ClientsFileName << ".\n";
+        return 1;
+    }
+
+    stConversionResult Conversion;
+    if (Options.Storage == eBinaryStorage)
+    {
+        if (ConvertTextFileToBinary(ClientsFileName, ClientsBinaryFileName, Conversion) != eEngineDone)
+        {
+            cout << "Cannot build " << ClientsBinaryFileName << ".\n";
+            return 1;
+        }
+    }
+    else if (Options.Storage == eColumnarStorage)
+    {
+        if (ConvertTextFileToColumnar(ClientsFileName, ClientsColumnarFileName, Conversion) != eEngineDone)
+        {
+            cout << "Cannot build " << ClientsColumnarFileName << ".\n";
+            return 1;
+        }
+    }
+
+    size_t StoreBytes = 0;
+    vector<stBenchmarkResult> vResults = RunBenchmarks(Options, ClientCount, Operations, StoreBytes);
+    for (const stBenchmarkResult& Result : vResults)
+        PrintBenchmarkResult(Result);
+
+    if (!SaveBenchmarkResults(ResultsFileName, vResults, Options, ClientCount, Operations, StoreBytes))
+    {
+        cout << "Cannot write " << ResultsFileName << ".\n";
+        return 1;
+    }
+    cout << "Results written to " << ResultsFileName << ".\n";
+    return 0;
+}
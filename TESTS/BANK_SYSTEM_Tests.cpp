@@ -0,0 +1,1261 @@
+// Round-trip tests of the engine's files (format conversion, recovery from
+// a torn journal and a damaged snapshot, ledger statements, transfer
+// batches, failed writes, compaction) and of its behaviour under change
+// (snapshots, replication, the teller server, bulk import). Each test runs
+// in a folder of its own under the temp directory, the working directory
+// of the engines it opens. A test that has to reload the book runs its
+// steps as separate processes of this same program, the way a restart (or
+// a crash) would.
+//
+//   BANK_SYSTEM_Tests <Test>             runs one test, 0 if it passed
+//   BANK_SYSTEM_Tests <Test> <Step>      one step, in the current folder
+
+#include "BankEngine.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <set>
+#include <cstdlib>
+#include <cstdio>
+#include <csignal>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// =============================================================
+//                      Checks
+// =============================================================
+
+int FailedChecks = 0;
+
+void Check(bool Passed, string What)
+{
+    if (Passed)
+        return;
+    cout << "FAILED: " << What << "\n";
+    FailedChecks++;
+}
+
+void CheckResult(enEngineResult Result, enEngineResult Expected, string What)
+{
+    Check(Result == Expected, What + ": got \"" + EngineResultToString(Result) + "\", expected \""
+        + EngineResultToString(Expected) + "\"");
+}
+
+// Runs one step of the current test in a new process and folder it shares.
+string ProgramFileName;
+string TestName;
+
+bool RunStep(string Step)
+{
+    string Command = "\"" + ProgramFileName + "\" " + TestName + " " + Step;
+    int Status = system(Command.c_str());
+    Check(Status == 0, "step " + Step + " exited with " + to_string(Status));
+    return Status == 0;
+}
+
+// Ends the process the way a crash would: no checkpoint, no destructors.
+// With sync durability every change already returned is on the disk.
+[[noreturn]] void Crash()
+{
+    cout.flush();
+    _Exit(FailedChecks == 0 ? 0 : 1);
+}
+
+// =============================================================
+//                      Helpers
+// =============================================================
+
+void WriteTextFile(string FileName, string Text)
+{
+    ofstream File(FileName, ios::out | ios::binary | ios::trunc);
+    File << Text;
+}
+
+// The client lines of a Clients.txt, without its trailer.
+multiset<string> ReadClientLines(string FileName)
+{
+    multiset<string> Lines;
+    ifstream File(FileName, ios::in | ios::binary);
+    string Line;
+    while (getline(File, Line))
+    {
+        if (!Line.empty() && Line.back() == '\r')
+            Line.pop_back();
+        if (!Line.empty() && Line.rfind("@@", 0) != 0)
+            Lines.insert(Line);
+    }
+    return Lines;
+}
+
+bool OpenEngine(clsBankEngine& Engine, string Durability = "sync", string Folder = "")
+{
+    stBankEngineOptions Options;
+    Options.Folder = Folder;
+    ParseDurabilityPolicy(Durability, Options.Durability);
+    enEngineResult Result = Engine.Open(Options);
+    CheckResult(Result, eEngineDone, "Open");
+    return Result == eEngineDone;
+}
+
+enEngineResult AddClient(clsBankEngine& Engine, string AccountNumber, Cents Balance)
+{
+    string Name = "Client " + AccountNumber;
+    stEngineOperation Operation;
+    Operation.Type = eOperationAddClient;
+    Operation.Client.AccountNumber = AccountNumber;
+    Operation.Client.PinCode = "1234";
+    Operation.Client.Name = Name;
+    Operation.Client.Phone = "0100000000";
+    Operation.Client.AccountBalance = Balance;
+    return Engine.Apply(Operation).Result;
+}
+
+enEngineResult Deposit(clsBankEngine& Engine, string_view AccountNumber, Cents Amount)
+{
+    stEngineOperation Operation;
+    Operation.Type = eOperationDeposit;
+    Operation.AccountNumber = AccountNumber;
+    Operation.Amount = Amount;
+    return Engine.Apply(Operation).Result;
+}
+
+enEngineResult UpdateClient(clsBankEngine& Engine, string AccountNumber, string Name, string Phone, string PinCode = "1234")
+{
+    stClientData Client;
+    if (!Engine.Find(AccountNumber, Client))
+        return eEngineNotFound;
+
+    stEngineOperation Operation;
+    Operation.Type = eOperationUpdateClient;
+    Operation.Client = Client;
+    Operation.Client.Name = Name;
+    Operation.Client.Phone = Phone;
+    Operation.Client.PinCode = PinCode;
+    return Engine.Apply(Operation).Result;
+}
+
+stEngineOperation TransferLeg(string_view From, string_view To, Cents Amount)
+{
+    stEngineOperation Leg;
+    Leg.Type = eOperationTransfer;
+    Leg.AccountNumber = From;
+    Leg.ToAccountNumber = To;
+    Leg.Amount = Amount;
+    return Leg;
+}
+
+void CheckBalance(const clsBankEngine& Engine, string AccountNumber, Cents Expected, string When)
+{
+    stClientData Client;
+    if (!Engine.Find(AccountNumber, Client))
+    {
+        Check(false, When + ": " + AccountNumber + " is missing");
+        return;
+    }
+    Check(Client.AccountBalance == Expected, When + ": balance of " + AccountNumber + " is "
+        + to_string(Client.AccountBalance) + " cents, expected " + to_string(Expected));
+}
+
+// Lets the clock move on, so entries on either side get different times.
+int64_t TimeBetweenEntries()
+{
+    this_thread::sleep_for(chrono::milliseconds(5));
+    int64_t Time = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    this_thread::sleep_for(chrono::milliseconds(5));
+    return Time;
+}
+
+// =============================================================
+//                      Format Conversion
+// =============================================================
+
+// Clients.txt -> Clients.dat -> text -> Clients.col -> text keeps every client.
+void TestFormatRoundTrip()
+{
+    string Text;
+    for (int i = 1; i <= 300; i++)
+    {
+        Text += "A" + to_string(100000 + i) + "#//#" + to_string(1000 + i % 9000) + "#//#Name " + to_string(i % 17)
+            + " Family#//#01" + to_string(100000000 + i * 7) + "#//#" + to_string(i * 13) + "." + to_string(10 + i % 90) + "\n";
+    }
+    WriteTextFile("Original.txt", Text);
+    multiset<string> Original = ReadClientLines("Original.txt");
+
+    stConversionResult Result;
+    CheckResult(ConvertTextFileToBinary("Original.txt", "Clients.dat", Result), eEngineDone, "text to binary");
+    Check(Result.Converted == Original.size() && Result.Skipped == 0, "text to binary converts every client");
+
+    Result = stConversionResult();
+    CheckResult(ConvertBinaryFileToText("Clients.dat", "FromBinary.txt", Result), eEngineDone, "binary to text");
+    Check(ReadClientLines("FromBinary.txt") == Original, "binary round trip keeps every client");
+
+    Result = stConversionResult();
+    CheckResult(ConvertTextFileToColumnar("FromBinary.txt", "Clients.col", Result), eEngineDone, "text to columnar");
+    Check(Result.Converted == Original.size(), "text to columnar converts every client");
+
+    Result = stConversionResult();
+    CheckResult(ConvertColumnarFileToText("Clients.col", "FromColumnar.txt", Result), eEngineDone, "columnar to text");
+    Check(Result.vErrors.empty(), "columnar file loads without errors");
+    Check(ReadClientLines("FromColumnar.txt") == Original, "columnar round trip keeps every client");
+}
+
+// =============================================================
+//                      Recovery
+// =============================================================
+
+// A record cut off by a crash in the middle of its write is ignored, and
+// every record before it is replayed.
+void TornJournalStep(string Step)
+{
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine))
+        Crash();
+
+    if (Step == "write")
+    {
+        CheckResult(AddClient(Engine, "A1", 10000), eEngineDone, "add A1");
+        Check(Engine.Checkpoint(), "checkpoint");
+        CheckResult(Deposit(Engine, "A1", 500), eEngineDone, "first deposit");
+        CheckResult(Deposit(Engine, "A1", 700), eEngineDone, "second deposit");
+        Crash();
+    }
+
+    // Deposits are journaled as the new balance, so the torn record alone is lost
+    CheckBalance(Engine, "A1", 10500, "after the torn record");
+    CheckResult(Deposit(Engine, "A1", 100), eEngineDone, "deposit after recovery");
+    CheckBalance(Engine, "A1", 10600, "after recovery");
+}
+
+void TestTornJournal()
+{
+    if (!RunStep("write"))
+        return;
+
+    // Cut the last record before its newline
+    uintmax_t Size = filesystem::file_size("Clients.journal");
+    Check(Size > 3, "the journal holds the deposits");
+    filesystem::resize_file("Clients.journal", Size - 3);
+    RunStep("check");
+}
+
+// A snapshot that does not match its trailer is set aside and the
+// previous one is loaded instead.
+void DamagedSnapshotStep(string Step)
+{
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine))
+        Crash();
+
+    if (Step == "write")
+    {
+        CheckResult(AddClient(Engine, "A1", 10000), eEngineDone, "add A1");
+        Check(Engine.Checkpoint(), "first checkpoint");
+        CheckResult(AddClient(Engine, "A2", 20000), eEngineDone, "add A2");
+        Check(Engine.Checkpoint(), "second checkpoint");
+        Crash();
+    }
+
+    Check(filesystem::exists("Clients.txt.damaged"), "the damaged snapshot is kept aside");
+    CheckBalance(Engine, "A1", 10000, "from the previous snapshot");
+    Check(!Engine.Exists("A2"), "A2 is not in the previous snapshot");
+}
+
+void TestDamagedSnapshot()
+{
+    if (!RunStep("write"))
+        return;
+    Check(filesystem::exists("Clients.txt.prev"), "the previous snapshot is kept");
+
+    // Change one balance digit of the last snapshot, keeping its size
+    fstream File("Clients.txt", ios::in | ios::out | ios::binary);
+    string Text((istreambuf_iterator<char>(File)), istreambuf_iterator<char>());
+    size_t Digit = Text.find("200.00");
+    Check(Digit != string::npos, "the snapshot holds A2");
+    if (Digit == string::npos)
+        return;
+    File.seekp(Digit);
+    File.put('9');
+    File.close();
+    RunStep("check");
+}
+
+// =============================================================
+//                      Ledger Statements
+// =============================================================
+
+void StatementStep(string Step)
+{
+    static const string RangeFile = "Range.txt";
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine, Step == "write" ? "batch:1000000" : "sync"))
+        Crash();
+
+    if (Step == "write")
+    {
+        CheckResult(AddClient(Engine, "A1", 1000), eEngineDone, "add A1");
+        CheckResult(AddClient(Engine, "B1", 0), eEngineDone, "add B1");
+        CheckResult(AddClient(Engine, "C1", 0), eEngineDone, "add C1");
+        int64_t From = TimeBetweenEntries();
+        CheckResult(Deposit(Engine, "A1", 200), eEngineDone, "deposit in the range");
+        CheckResult(Deposit(Engine, "B1", 10000), eEngineDone, "deposit to another account");
+        int64_t To = TimeBetweenEntries();
+        CheckResult(Deposit(Engine, "A1", 400), eEngineDone, "deposit after the range");
+        WriteTextFile(RangeFile, to_string(From) + " " + to_string(To));
+
+        // More entries than the ledger buffers, none of them synced yet. With
+        // 5 entries before them, the first ledger write is 16385 entries, one
+        // past a multiple of the stdio buffer, and that last one is B1's.
+        CheckResult(Deposit(Engine, "C1", 1), eEngineDone, "deposit to C1");
+        vector<stEngineOperation> vLegs = { TransferLeg("B1", "C1", 1), TransferLeg("C1", "B1", 1) };
+        size_t FailedLeg;
+        for (int i = 0; i < 5000; i++)
+            Engine.ApplyTransfers(vLegs, FailedLeg);
+        vector<stLedgerEntry> vEntries;
+        CheckResult(Engine.Statement("B1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of B1");
+        Check(vEntries.size() == 10001, "statement of B1 has every entry, got " + to_string(vEntries.size()));
+        Check(Engine.Checkpoint(), "checkpoint");
+        Crash();
+    }
+
+    // After a restart the entries come from the file
+    int64_t From = 0, To = 0;
+    ifstream(RangeFile) >> From >> To;
+
+    vector<stLedgerEntry> vEntries;
+    CheckResult(Engine.Statement("A1", From, To, vEntries), eEngineDone, "statement of the range");
+    Check(vEntries.size() == 1, "the range holds one entry of A1, got " + to_string(vEntries.size()));
+    if (vEntries.size() == 1)
+    {
+        Check(vEntries[0].Type == eLedgerDeposit && vEntries[0].Amount == 200 && vEntries[0].Balance == 1200,
+            "the entry in the range is the deposit of 2.00");
+    }
+
+    CheckResult(Engine.Statement("A1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "whole statement");
+    Check(vEntries.size() == 3, "A1 has an opening and two deposits, got " + to_string(vEntries.size()));
+    if (vEntries.size() == 3)
+    {
+        Check(vEntries[0].Type == eLedgerOpening && vEntries[2].Balance == 1600, "entries are oldest first");
+        Check(vEntries[0].Time <= vEntries[1].Time && vEntries[1].Time <= vEntries[2].Time, "times never go back");
+    }
+
+    CheckResult(Engine.Statement("A1", To + 1, To + 2, vEntries), eEngineDone, "statement of an empty range");
+    Check(vEntries.empty(), "no entry of A1 between the range and the last deposit");
+
+    CheckResult(Engine.Statement("B1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of B1 after a restart");
+    Check(vEntries.size() == 10001, "B1 keeps every entry after a restart, got " + to_string(vEntries.size()));
+}
+
+void TestStatement()
+{
+    if (RunStep("write"))
+        RunStep("check");
+}
+
+// A client added under the number of a deleted one starts a statement of
+// its own, also after a restart with or without the ledger index. A ledger
+// of the first format, which told accounts apart by a hash, is moved aside.
+void LedgerIdentityStep(string Step)
+{
+    static const string LongAccountNumber = "ACCOUNT-NUMBER-LONGER-THAN-ONE-NAME-ENTRY";
+    if (Step == "write")
+    {
+        // The header of a first-format ledger with no entries
+        string Header(64, '\0');
+        Header.replace(0, 7, "BANKLDG");
+        Header[8] = 1;
+        Header[12] = 64;
+        WriteTextFile(LedgerFileName, Header);
+    }
+
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine))
+        Crash();
+    vector<stLedgerEntry> vEntries;
+
+    if (Step == "write")
+    {
+        Check(filesystem::exists(LedgerFileName + ".v1"), "the first-format ledger is moved aside");
+        CheckResult(AddClient(Engine, "A1", 1000), eEngineDone, "add A1");
+        CheckResult(Deposit(Engine, "A1", 200), eEngineDone, "deposit to A1");
+        stEngineOperation Delete;
+        Delete.Type = eOperationDeleteClient;
+        Delete.AccountNumber = "A1";
+        CheckResult(Engine.Apply(Delete).Result, eEngineDone, "delete A1");
+        CheckResult(AddClient(Engine, "A1", 500), eEngineDone, "add A1 again");
+        CheckResult(AddClient(Engine, LongAccountNumber, 100), eEngineDone, "add a long account number");
+        CheckResult(Deposit(Engine, LongAccountNumber, 50), eEngineDone, "deposit to the long account number");
+        CheckResult(AddClient(Engine, "B1", 0), eEngineDone, "add B1 with nothing to record");
+        Check(Engine.Checkpoint(), "checkpoint");
+    }
+
+    CheckResult(Engine.Statement("A1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of A1");
+    Check(vEntries.size() == 1, Step + ": the new A1 only has its own opening, got " + to_string(vEntries.size()));
+    if (vEntries.size() == 1)
+        Check(vEntries[0].Type == eLedgerOpening && vEntries[0].Amount == 500, Step + ": the opening is the new one");
+
+    CheckResult(Engine.Statement(LongAccountNumber, INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of the long account number");
+    Check(vEntries.size() == 2 && vEntries[1].Balance == 150, Step + ": the long account number keeps its entries");
+
+    CheckResult(Engine.Statement("B1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of B1");
+    Check(vEntries.empty(), Step + ": B1 has no entries");
+}
+
+void TestLedgerIdentity()
+{
+    if (!RunStep("write") || !RunStep("check"))
+        return;
+
+    // Without the index the ids come from the name entries of the ledger
+    error_code Error;
+    filesystem::remove(LedgerIndexFileName, Error);
+    RunStep("scan");
+}
+
+// =============================================================
+//                      Transfer Batches
+// =============================================================
+
+// A batch of transfers is applied whole or not at all, in memory and on
+// the disk.
+void TransferBatchStep(string Step)
+{
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine))
+        Crash();
+
+    if (Step == "write")
+    {
+        CheckResult(AddClient(Engine, "A1", 10000), eEngineDone, "add A1");
+        CheckResult(AddClient(Engine, "B1", 1000), eEngineDone, "add B1");
+        CheckResult(AddClient(Engine, "C1", 0), eEngineDone, "add C1");
+
+        // The third leg overdraws C1, so the first two are taken back
+        vector<stEngineOperation> vLegs = { TransferLeg("A1", "B1", 5000), TransferLeg("B1", "C1", 6000),
+            TransferLeg("C1", "A1", 7000) };
+        size_t FailedLeg = 0;
+        CheckResult(Engine.ApplyTransfers(vLegs, FailedLeg), eEngineInsufficientFunds, "overdrawing batch");
+        Check(FailedLeg == 2, "the third leg is the one refused, got " + to_string(FailedLeg));
+        CheckBalance(Engine, "A1", 10000, "after the refused batch");
+        CheckBalance(Engine, "B1", 1000, "after the refused batch");
+        CheckBalance(Engine, "C1", 0, "after the refused batch");
+
+        vLegs = { TransferLeg("A1", "B1", 5000), TransferLeg("B1", "X9", 100) };
+        CheckResult(Engine.ApplyTransfers(vLegs, FailedLeg), eEngineNotFound, "batch to a missing account");
+        Check(FailedLeg == 1, "the leg to the missing account is refused");
+        CheckBalance(Engine, "A1", 10000, "after the batch to a missing account");
+
+        // A leg may spend what an earlier leg of the batch brought in
+        vLegs = { TransferLeg("A1", "B1", 5000), TransferLeg("B1", "C1", 6000), TransferLeg("C1", "A1", 1000) };
+        CheckResult(Engine.ApplyTransfers(vLegs, FailedLeg), eEngineDone, "batch within the balances");
+        Crash();
+    }
+
+    CheckBalance(Engine, "A1", 6000, "after a restart");
+    CheckBalance(Engine, "B1", 0, "after a restart");
+    CheckBalance(Engine, "C1", 5000, "after a restart");
+
+    vector<stLedgerEntry> vEntries;
+    CheckResult(Engine.Statement("B1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of B1");
+    Check(vEntries.size() == 3, "B1 has an opening and the two legs of the batch, got " + to_string(vEntries.size()));
+    if (vEntries.size() == 3)
+        Check(vEntries[1].OperationId == vEntries[2].OperationId, "the legs of a batch share one operation");
+}
+
+void TestTransferBatch()
+{
+    if (RunStep("write"))
+        RunStep("check");
+}
+
+// =============================================================
+//                      Failed Writes
+// =============================================================
+
+// A client Clients.dat has no room for is not kept: the add fails, the
+// clients added before it keep their records, and the handles of the book
+// stay in step with the slots of the file.
+void BinaryAddFailureStep(string Step)
+{
+    clsBankEngine Engine;
+    stBankEngineOptions Options;
+    Options.Storage = eBinaryStorage;
+    CheckResult(Engine.Open(Options), eEngineDone, "Open");
+
+    if (Step == "write")
+    {
+#ifndef _WIN32
+        // Clients.dat may not grow past the size it was created with
+        signal(SIGXFSZ, SIG_IGN);
+        rlimit Limit;
+        getrlimit(RLIMIT_FSIZE, &Limit);
+        Limit.rlim_cur = filesystem::file_size("Clients.dat");
+        setrlimit(RLIMIT_FSIZE, &Limit);
+#endif
+        int Added = 0;
+        enEngineResult Result = eEngineDone;
+        while (Added < 100000 && (Result = AddClient(Engine, "A" + to_string(Added), 0)) == eEngineDone)
+            Added++;
+        CheckResult(Result, eEngineCannotOpen, "add once Clients.dat is full");
+        Check(!Engine.Exists("A" + to_string(Added)), "the refused client is not in the book");
+        Check(Engine.ClientCount() == (size_t)Added, "the clients added before stay");
+        CheckResult(AddClient(Engine, "A" + to_string(Added), 0), eEngineCannotOpen, "the same add again");
+
+        CheckResult(Deposit(Engine, "A" + to_string(Added - 1), 500), eEngineDone, "deposit to the last client added");
+        WriteTextFile("Added.txt", to_string(Added));
+        Check(Engine.Checkpoint(), "checkpoint");
+        Crash();
+    }
+
+    int Added = 0;
+    ifstream("Added.txt") >> Added;
+    Check(Engine.ClientCount() == (size_t)Added, "Clients.dat holds the clients added before the failure");
+    CheckBalance(Engine, "A" + to_string(Added - 1), 500, "after a restart");
+    CheckResult(AddClient(Engine, "A" + to_string(Added), 700), eEngineDone, "add once Clients.dat can grow");
+    CheckBalance(Engine, "A" + to_string(Added), 700, "after the add");
+}
+
+void TestBinaryAddFailure()
+{
+#ifndef _WIN32
+    if (RunStep("write"))
+        RunStep("check");
+#endif
+}
+
+// Changes whose journal write fails are taken back: balances by their
+// amounts, with ledger entries saying so, and clients exactly. The records
+// that failed stay queued and go out with the ones taking them back once
+// the disk has room, so a replay ends where the book did.
+void JournalFailureStep(string Step)
+{
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine))
+        return;
+
+    if (Step == "write")
+    {
+        AddClient(Engine, "A1", 1000);
+        AddClient(Engine, "B1", 500);
+#ifndef _WIN32
+        // Neither the journal nor the ledger may grow any more
+        signal(SIGXFSZ, SIG_IGN);
+        rlimit Limit;
+        getrlimit(RLIMIT_FSIZE, &Limit);
+        rlim_t Unlimited = Limit.rlim_cur;
+        Limit.rlim_cur = filesystem::file_size("Clients.journal");
+        setrlimit(RLIMIT_FSIZE, &Limit);
+#endif
+        CheckResult(Deposit(Engine, "A1", 200), eEngineCannotWriteJournal, "deposit");
+        CheckResult(Engine.Apply(TransferLeg("A1", "B1", 100)).Result, eEngineCannotWriteJournal, "transfer");
+        CheckResult(AddClient(Engine, "C1", 300), eEngineCannotWriteJournal, "add");
+        CheckResult(UpdateClient(Engine, "B1", "Renamed", "0100000009"), eEngineCannotWriteJournal, "update");
+        stEngineOperation Delete;
+        Delete.Type = eOperationDeleteClient;
+        Delete.AccountNumber = "B1";
+        CheckResult(Engine.Apply(Delete).Result, eEngineCannotWriteJournal, "delete");
+
+        CheckBalance(Engine, "A1", 1000, "after the failed deposit and transfer");
+        CheckBalance(Engine, "B1", 500, "after the failed transfer and delete");
+        Check(!Engine.Exists("C1"), "the failed add is taken back");
+        stClientData Client;
+        Check(Engine.Find("B1", Client) && Client.Name == "Client B1", "the failed update is taken back");
+#ifndef _WIN32
+        Limit.rlim_cur = Unlimited;
+        setrlimit(RLIMIT_FSIZE, &Limit);
+#endif
+        CheckResult(Deposit(Engine, "A1", 50), eEngineDone, "deposit once the disk has room");
+        Crash();
+    }
+
+    CheckBalance(Engine, "A1", 1050, "after a restart");
+    CheckBalance(Engine, "B1", 500, "after a restart");
+    Check(!Engine.Exists("C1"), "the failed add is not replayed");
+    stClientData Client;
+    Check(Engine.Find("B1", Client) && Client.Name == "Client B1", "the failed update is not replayed");
+
+    vector<stLedgerEntry> vEntries;
+    CheckResult(Engine.Statement("A1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement of A1");
+    Check(vEntries.size() == 6, "A1 has an opening, two changes, the two taking them back and a deposit, got "
+        + to_string(vEntries.size()));
+    if (vEntries.size() == 6)
+    {
+        Check(vEntries[2].Type == eLedgerDeposit && vEntries[2].Amount == -200 && vEntries[2].Balance == 1000,
+            "the deposit is taken back in the ledger");
+        Check(vEntries[4].Type == eLedgerTransferOut && vEntries[4].Amount == 100 && vEntries[4].Balance == 1000,
+            "the transfer is taken back in the ledger");
+        Check(vEntries[5].Balance == 1050, "the ledger ends with the balance of the book");
+    }
+}
+
+void TestJournalFailure()
+{
+#ifndef _WIN32
+    if (RunStep("write"))
+        RunStep("check");
+#endif
+}
+
+// A deposit, transfer or accrual that would take a balance past the
+// largest amount is refused and changes nothing, in memory or on disk.
+void TestBalanceOverflow()
+{
+    const Cents Largest = 9223372036854775700; // 92233720368547757.00, the most ParseMoney reads
+    for (enStorageFormat Storage : { eTextStorage, eBinaryStorage })
+    {
+        string Folder = (Storage == eTextStorage) ? "Text" : "Binary";
+        error_code Error;
+        filesystem::create_directories(Folder, Error);
+
+        stBankEngineOptions Options;
+        Options.Folder = Folder;
+        Options.Storage = Storage;
+        {
+            clsBankEngine Engine;
+            CheckResult(Engine.Open(Options), eEngineDone, Folder + ": open");
+            CheckResult(AddClient(Engine, "S1", 100000), eEngineDone, Folder + ": add S1");
+            CheckResult(AddClient(Engine, "B1", Largest), eEngineDone, Folder + ": add B1");
+
+            CheckResult(Deposit(Engine, "B1", 100), eEngineInvalidAmount, Folder + ": deposit past the largest amount");
+            vector<stEngineOperation> vLegs = { TransferLeg("S1", "B1", 100) };
+            size_t FailedLeg = 0;
+            CheckResult(Engine.ApplyTransfers(vLegs, FailedLeg), eEngineInvalidAmount, Folder + ": transfer past the largest amount");
+
+            // S1 is accrued before B1 overflows and has to be taken back
+            stAccrualTier Tier;
+            Tier.RateBasisPoints = 100;
+            stAccrualSummary Summary;
+            CheckResult(Engine.ApplyAccrual(span<const stAccrualTier>(&Tier, 1), Summary, 1), eEngineInvalidAmount,
+                Folder + ": accrual past the largest amount");
+
+            CheckBalance(Engine, "S1", 100000, Folder + ": after the refused changes");
+            CheckBalance(Engine, "B1", Largest, Folder + ": after the refused changes");
+            vector<stLedgerEntry> vEntries;
+            Engine.Statement("B1", INT64_MIN, INT64_MAX, vEntries);
+            Check(vEntries.size() == 1, Folder + ": the ledger of B1 only has its opening, got " + to_string(vEntries.size()));
+        }
+
+        clsBankEngine Reopened;
+        CheckResult(Reopened.Open(Options), eEngineDone, Folder + ": open again");
+        CheckBalance(Reopened, "S1", 100000, Folder + ": reopened");
+        CheckBalance(Reopened, "B1", Largest, Folder + ": reopened");
+    }
+}
+
+// =============================================================
+//                      Accrual
+// =============================================================
+
+// A run applies the tier each balance falls in and reaches the disk
+// through a checkpoint. If the checkpoint fails, the run is taken back in
+// memory and on disk: Clients.dat too, which is written in place.
+void TestAccrual()
+{
+    stAccrualTier vTiers[2];
+    vTiers[0].RateBasisPoints = 100;
+    vTiers[1].FromBalance = 100000;
+    vTiers[1].RateBasisPoints = 200;
+    vTiers[1].Fee = 50;
+
+    for (enStorageFormat Storage : { eTextStorage, eBinaryStorage })
+    {
+        string Folder = (Storage == eTextStorage) ? "Text" : "Binary";
+        error_code Error;
+        filesystem::create_directories(Folder, Error);
+
+        stBankEngineOptions Options;
+        Options.Folder = Folder;
+        Options.Storage = Storage;
+        {
+            clsBankEngine Engine;
+            CheckResult(Engine.Open(Options), eEngineDone, Folder + ": open");
+            AddClient(Engine, "A1", 50000);
+            AddClient(Engine, "B1", 200000);
+            AddClient(Engine, "C1", 0);
+            AddClient(Engine, "D1", -1000);
+
+            stAccrualSummary Summary;
+            CheckResult(Engine.ApplyAccrual(vTiers, Summary, 2), eEngineDone, Folder + ": accrual");
+            Check(Summary.Accounts == 3 && Summary.Interest == 4500 && Summary.Fees == 50,
+                Folder + ": summary counts 3 accounts, 45.00 of interest and 0.50 of fees");
+            Check(Summary.BalancesAfter - Summary.BalancesBefore == 4450, Folder + ": total grows by the run");
+        }
+
+        // Nothing can replace Clients.txt or empty the journal now
+        string Blocker = Folder + "/" + ((Storage == eTextStorage) ? "Clients.txt.tmp" : "Clients.journal");
+        filesystem::remove(Blocker, Error);
+        filesystem::create_directories(Blocker, Error);
+        {
+            clsBankEngine Engine;
+            CheckResult(Engine.Open(Options), eEngineDone, Folder + ": open again");
+            CheckBalance(Engine, "A1", 50500, Folder + ": after the run");
+            CheckBalance(Engine, "B1", 203950, Folder + ": after the run");
+            CheckBalance(Engine, "C1", 0, Folder + ": after the run");
+            CheckBalance(Engine, "D1", -1000, Folder + ": a balance below every tier");
+
+            stAccrualSummary Summary;
+            CheckResult(Engine.ApplyAccrual(vTiers, Summary, 2), eEngineCannotOpen, Folder + ": accrual that cannot be checkpointed");
+            CheckBalance(Engine, "A1", 50500, Folder + ": after the failed run");
+            CheckBalance(Engine, "B1", 203950, Folder + ": after the failed run");
+
+            // Opening, the run, the failed run and the entry taking it back
+            vector<stLedgerEntry> vEntries;
+            Engine.Statement("B1", INT64_MIN, INT64_MAX, vEntries);
+            Check(vEntries.size() == 4 && vEntries[3].Amount == -vEntries[2].Amount && vEntries[3].Balance == 203950,
+                Folder + ": the ledger takes the failed run back");
+        }
+        filesystem::remove(Blocker, Error);
+
+        clsBankEngine Engine;
+        CheckResult(Engine.Open(Options), eEngineDone, Folder + ": open after the failed run");
+        CheckBalance(Engine, "A1", 50500, Folder + ": the failed run is not on disk");
+        CheckBalance(Engine, "B1", 203950, Folder + ": the failed run is not on disk");
+    }
+}
+
+// =============================================================
+//                      Client Search
+// =============================================================
+
+set<string> AccountNumbersOf(const vector<stClientData>& vClients)
+{
+    set<string> AccountNumbers;
+    for (const stClientData& Client : vClients)
+        AccountNumbers.insert(Client.AccountNumber);
+    return AccountNumbers;
+}
+
+// Name and phone searches follow adds, updates and deletes, list a client
+// once even if two words of its name match, and updates that keep the
+// name and phone take no more memory.
+void TestClientSearch()
+{
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine, "batch:1000"))
+        return;
+
+    for (int i = 1; i <= 4; i++)
+        AddClient(Engine, "A" + to_string(i), 0);
+    UpdateClient(Engine, "A1", "Mostafa Elsehy", "0100000001");
+    UpdateClient(Engine, "A2", "Ella Elsayed", "0100000002");
+    UpdateClient(Engine, "A3", "Omar Said", "0100000002");
+
+    Check(AccountNumbersOf(Engine.FindByNamePrefix("els", 10)) == set<string>{ "A1", "A2" }, "prefix \"els\"");
+    Check(Engine.FindByNamePrefix("el", 10).size() == 2, "a client with two matching words is listed once");
+    Check(Engine.FindByNamePrefix("EL", 1).size() == 1, "results stop at the limit, ignoring case");
+    Check(AccountNumbersOf(Engine.FindByPhone("0100000002")) == set<string>{ "A2", "A3" }, "shared phone");
+
+    // Now that the indexes exist they are kept up to date
+    UpdateClient(Engine, "A3", "Elsa Omar", "0100000003");
+    AddClient(Engine, "A5", 0);
+    UpdateClient(Engine, "A5", "Elias Nader", "0100000002");
+    stEngineOperation Delete;
+    Delete.Type = eOperationDeleteClient;
+    Delete.AccountNumber = "A2";
+    CheckResult(Engine.Apply(Delete).Result, eEngineDone, "delete A2");
+
+    Check(AccountNumbersOf(Engine.FindByNamePrefix("el", 10)) == set<string>{ "A1", "A3", "A5" }, "prefix \"el\" after changes");
+    Check(Engine.FindByNamePrefix("said", 10).empty(), "a replaced name is no longer found");
+    Check(AccountNumbersOf(Engine.FindByPhone("0100000002")) == set<string>{ "A5" }, "phone after changes");
+    Check(AccountNumbersOf(Engine.FindByPhone("0100000003")) == set<string>{ "A3" }, "new phone");
+
+    size_t Bytes = Engine.MemoryBytes();
+    for (int i = 0; i < 100000; i++)
+        UpdateClient(Engine, "A1", "Mostafa Elsehy", "0100000001", to_string(1000 + i % 9000));
+    Check(Engine.MemoryBytes() == Bytes, "updates keeping the name reuse its search keys, "
+        + to_string(Bytes) + " bytes became " + to_string(Engine.MemoryBytes()));
+    Check(AccountNumbersOf(Engine.FindByNamePrefix("mostafa", 10)) == set<string>{ "A1" }, "prefix after the updates");
+}
+
+// =============================================================
+//                      Bulk Import
+// =============================================================
+
+// The console program rejects the lines of an import file whose account
+// is already a client or appeared earlier in the file, keeping the first,
+// and names the reason in the rejects file.
+void TestImportDuplicates()
+{
+    {
+        clsBankEngine Engine;
+        if (!OpenEngine(Engine))
+            return;
+        CheckResult(AddClient(Engine, "A1", 1000), eEngineDone, "add A1");
+        Check(Engine.Checkpoint(), "checkpoint");
+    }
+
+    WriteTextFile("Import.csv",
+        "AccountNumber,PinCode,Name,Phone,Balance\n"
+        "A1,1111,Already There,0100000001,1.00\n"
+        "B1,2222,\"Nader, Elias\",0100000002,2.00\n"
+        "B2,3333,Second,0100000003,3.00\n"
+        "B1,4444,Again,0100000004,4.00\n"
+        "B3,5555,Short\n"
+        "B4,6666,Fourth,0100000006,6.00\n");
+    string Command = string("\"") + BANK_SYSTEM_PROGRAM + "\" --import Import.csv --rejects Rejects.txt > Import.out";
+    Check(system(Command.c_str()) == 0, "the import runs");
+
+    vector<string> vRejects;
+    ifstream Rejects("Rejects.txt");
+    for (string Line; getline(Rejects, Line);)
+        vRejects.push_back(Line);
+    vector<string> vExpected = {
+        "2#//#already a client#//#A1,1111,Already There,0100000001,1.00",
+        "5#//#duplicate of line 3#//#B1,4444,Again,0100000004,4.00",
+        "6#//#malformed line#//#B3,5555,Short" };
+    Check(vRejects == vExpected, "the rejects file names each rejected line and its reason");
+
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine))
+        return;
+    Check(Engine.ClientCount() == 4, "A1 and three imported clients, got " + to_string(Engine.ClientCount()));
+    CheckBalance(Engine, "A1", 1000, "a client the file repeats");
+    CheckBalance(Engine, "B1", 200, "the first line of a repeated account");
+    CheckBalance(Engine, "B4", 600, "after the import");
+    stClientData Client;
+    Check(Engine.Find("B1", Client) && Client.Name == "Nader, Elias", "a quoted field keeps its comma");
+}
+
+// =============================================================
+//                      Compaction
+// =============================================================
+
+// A compaction drops the tombstones of deleted clients. The clients left
+// keep their order, balances and search entries, and changes made after
+// it reach their own records on the disk, in every storage format.
+vector<string> AccountNumbersInOrder(const clsBankEngine& Engine)
+{
+    vector<string> vAccountNumbers;
+    Engine.ForEachClient([&](const stClientView& Client) { vAccountNumbers.push_back(string(Client.AccountNumber)); });
+    return vAccountNumbers;
+}
+
+// A compaction drops the tombstones of deleted clients. The clients left
+// keep their order, balances and search entries, and changes made after
+// it reach their own records on the disk, in every storage format.
+void CompactionStep(string Step)
+{
+    string Format = Step.substr(Step.find('-') + 1);
+    stBankEngineOptions Options;
+    Options.Folder = Format;
+    Options.Storage = (Format == "binary") ? eBinaryStorage : (Format == "columnar") ? eColumnarStorage : eTextStorage;
+    ParseDurabilityPolicy(Step.rfind("write", 0) == 0 ? "batch:1000000" : "sync", Options.Durability);
+    clsBankEngine Engine;
+    enEngineResult Result = Engine.Open(Options);
+    CheckResult(Result, eEngineDone, Format + ": Open");
+    if (Result != eEngineDone)
+        Crash();
+
+    vector<string> vExpected;
+    for (int i = 1; i < 2000; i += 2)
+        vExpected.push_back("A" + to_string(i));
+
+    if (Step.rfind("write", 0) == 0)
+    {
+        for (int i = 0; i < 2000; i++)
+            AddClient(Engine, "A" + to_string(i), i);
+        Engine.FindByPhone("0100000000"); // So the search indexes exist and are compacted too
+
+        // Fewer tombstones than start a compaction in the background
+        stEngineOperation Delete;
+        Delete.Type = eOperationDeleteClient;
+        for (int i = 0; i < 2000; i += 2)
+        {
+            string AccountNumber = "A" + to_string(i);
+            Delete.AccountNumber = AccountNumber;
+            Engine.Apply(Delete);
+        }
+        Check(Engine.TombstoneCount() == 1000, Format + ": deletes leave tombstones, got " + to_string(Engine.TombstoneCount()));
+        Check(Engine.Compact(), Format + ": compact");
+        Check(Engine.TombstoneCount() == 0, Format + ": no tombstones after the compaction");
+        Check(AccountNumbersInOrder(Engine) == vExpected, Format + ": the clients left keep their order");
+
+        CheckResult(Deposit(Engine, "A1999", 1), eEngineDone, Format + ": deposit after the compaction");
+        CheckResult(AddClient(Engine, "A0", 7), eEngineDone, Format + ": add a deleted number again");
+        Check(Engine.Checkpoint(), Format + ": checkpoint");
+        Crash();
+    }
+
+    // The files may keep the clients in another order (Clients.col sorts
+    // them, Clients.dat reuses free slots)
+    vector<string> vAccountNumbers = AccountNumbersInOrder(Engine);
+    vExpected.push_back("A0");
+    Check(multiset<string>(vAccountNumbers.begin(), vAccountNumbers.end()) == multiset<string>(vExpected.begin(), vExpected.end()),
+        Format + ": the clients left are reloaded, and only they");
+    Check(!Engine.Exists("A2"), Format + ": a deleted client stays deleted");
+    CheckBalance(Engine, "A1", 1, Format);
+    CheckBalance(Engine, "A1999", 2000, Format);
+    CheckBalance(Engine, "A0", 7, Format);
+    Check(Engine.FindByPhone("0100000000").size() == 1001, Format + ": every client left is found by phone");
+}
+
+void TestCompaction()
+{
+    for (string Format : { "text", "binary", "columnar" })
+    {
+        error_code Error;
+        filesystem::create_directories(Format, Error);
+        if (RunStep("write-" + Format))
+            RunStep("check-" + Format);
+    }
+}
+
+// =============================================================
+//                      Book Snapshots
+// =============================================================
+
+vector<string> SnapshotLines(const clsBookSnapshot& Snapshot, size_t FirstRow, size_t RowCount)
+{
+    vector<string> vLines;
+    Snapshot.ForEachClient(FirstRow, RowCount, [&](const stClientView& Client)
+        {
+            vLines.push_back(string(Client.AccountNumber) + "|" + string(Client.Name) + "|" + string(Client.Phone)
+                + "|" + to_string(Client.AccountBalance));
+        });
+    return vLines;
+}
+
+// A snapshot keeps the book as it was while clients are updated, deleted
+// and added after it, and its pages skip deleted clients, across the
+// chunks the records are kept in.
+void TestBookSnapshot()
+{
+    clsBankEngine Engine;
+    if (!OpenEngine(Engine, "batch:1000"))
+        return;
+
+    const int Count = 10000;
+    for (int i = 1; i <= Count; i++)
+    {
+        AddClient(Engine, "A" + to_string(i), i);
+        if (i % 7 == 0)
+            UpdateClient(Engine, "A" + to_string(i), "Client A" + to_string(i), "+20 100 000 0000 extension " + to_string(i));
+    }
+    stEngineOperation Delete;
+    Delete.Type = eOperationDeleteClient;
+    for (int i = 3; i <= Count; i += 3)
+    {
+        Delete.AccountNumber = "A" + to_string(i);
+        Engine.Apply(Delete);
+    }
+
+    clsBookSnapshot Snapshot = Engine.Snapshot();
+    vector<string> vBefore = SnapshotLines(Snapshot, 0, SIZE_MAX);
+    Check(Snapshot.ClientCount() == Count - Count / 3 && vBefore.size() == Snapshot.ClientCount(),
+        "the snapshot lists every client left, got " + to_string(vBefore.size()));
+    Cents Total = Snapshot.TotalBalances();
+
+    for (int i = 1; i <= Count; i += 2)
+    {
+        UpdateClient(Engine, "A" + to_string(i), "Renamed", "+20 199 999 9999 extension changed");
+        Deposit(Engine, "A" + to_string(i), 1000);
+    }
+    size_t Deleted = 0;
+    for (int i = 4; i <= Count; i += 10)
+    {
+        Delete.AccountNumber = "A" + to_string(i);
+        Deleted += (Engine.Apply(Delete).Result == eEngineDone);
+    }
+    AddClient(Engine, "B1", 500);
+
+    Check(SnapshotLines(Snapshot, 0, SIZE_MAX) == vBefore, "the snapshot does not follow later changes");
+    Check(Snapshot.TotalBalances() == Total, "the snapshot's total does not follow later changes");
+    Check(Engine.Snapshot().ClientCount() == Snapshot.ClientCount() - Deleted + 1, "a new snapshot has the changes");
+
+    for (size_t FirstRow : { size_t(0), size_t(2729), size_t(2731), size_t(5000), vBefore.size() - 3, vBefore.size() })
+    {
+        vector<string> vPage = SnapshotLines(Snapshot, FirstRow, 5);
+        vector<string> vExpected(vBefore.begin() + min(FirstRow, vBefore.size()),
+            vBefore.begin() + min(FirstRow + 5, vBefore.size()));
+        Check(vPage == vExpected, "page from row " + to_string(FirstRow));
+    }
+}
+
+// =============================================================
+//                      Replication
+// =============================================================
+
+// Applies every shipment the primary has ready; the last one applied is
+// left in Batch.
+void ShipAll(clsBankEngine& Primary, clsBankEngine& Standby, stReplicationBatch& Batch)
+{
+    stReplicationBatch Next;
+    while (Primary.NextShipment(Next, 50))
+    {
+        CheckResult(Standby.ApplyShipment(Next), eEngineDone, "apply a shipment at " + to_string(Next.Position));
+        Primary.AcknowledgeShipment(Next.Position);
+        Batch = Next;
+    }
+}
+
+// A standby starts from a snapshot of the primary, follows its changes,
+// refuses changes of its own and batches that do not continue the last,
+// and once promoted takes changes but gives no statements.
+void TestReplication()
+{
+    error_code Error;
+    filesystem::create_directories("Primary", Error);
+    filesystem::create_directories("Standby", Error);
+    {
+        clsBankEngine Primary, Standby;
+        if (!OpenEngine(Primary, "sync", "Primary") || !OpenEngine(Standby, "sync", "Standby"))
+            return;
+
+        AddClient(Primary, "A1", 1000);
+        AddClient(Primary, "A2", 500);
+        AddClient(Primary, "A3", 0);
+        stEngineOperation Delete;
+        Delete.Type = eOperationDeleteClient;
+        Delete.AccountNumber = "A3";
+        Primary.Apply(Delete);
+
+        Primary.StartShipping();
+        Standby.BecomeStandby();
+        stReplicationBatch Batch;
+        Check(Primary.NextShipment(Batch, 1000), "the first shipment is ready");
+        Check(Batch.IsSnapshot && Batch.RecordCount == 2, "the first shipment is a snapshot of the two clients left");
+        CheckResult(Standby.ApplyShipment(Batch), eEngineDone, "apply the snapshot");
+        Primary.AcknowledgeShipment(Batch.Position);
+        CheckBalance(Standby, "A1", 1000, "standby after the snapshot");
+        Check(!Standby.Exists("A3"), "the deleted client is not in the snapshot");
+        CheckResult(Deposit(Standby, "A1", 100), eEngineReadOnly, "deposit on the standby");
+
+        Deposit(Primary, "A1", 250);
+        CheckResult(Primary.Apply(TransferLeg("A2", "A1", 100)).Result, eEngineDone, "transfer on the primary");
+        AddClient(Primary, "B1", 700);
+        ShipAll(Primary, Standby, Batch);
+        Check(!Batch.IsSnapshot && Batch.Position == Primary.ReplicationStatus().Position,
+            "the records follow the snapshot up to the primary's position");
+        CheckBalance(Standby, "A1", 1350, "standby after the records");
+        CheckBalance(Standby, "A2", 400, "standby after the records");
+        CheckBalance(Standby, "B1", 700, "standby after the records");
+        CheckResult(Standby.ApplyShipment(Batch), eEngineInvalidOperation, "a batch applied twice");
+
+        stReplicationBatch Heartbeat;
+        Check(!Primary.NextShipment(Heartbeat, 10), "nothing more to ship");
+        CheckResult(Standby.ApplyShipment(Heartbeat), eEngineDone, "apply a heartbeat");
+        Primary.StopShipping();
+
+        Standby.Promote();
+        Check(!Standby.IsReadOnly(), "the promoted standby takes changes");
+        CheckResult(Deposit(Standby, "A2", 50), eEngineDone, "deposit on the promoted standby");
+        Check(!Standby.HasCompleteLedger(), "the promoted standby's ledger is partial");
+        vector<stLedgerEntry> vEntries;
+        CheckResult(Standby.Statement("A2", INT64_MIN, INT64_MAX, vEntries), eEngineLedgerPartial, "statement on the promoted standby");
+    }
+
+    clsBankEngine Reopened;
+    if (!OpenEngine(Reopened, "sync", "Standby"))
+        return;
+    CheckBalance(Reopened, "A2", 450, "promoted standby reopened");
+    CheckBalance(Reopened, "B1", 700, "promoted standby reopened");
+    Check(!Reopened.HasCompleteLedger(), "the ledger stays partial after a restart");
+}
+
+// =============================================================
+//                      Engine Folders
+// =============================================================
+
+// Engines opened on different folders share no files and no state.
+void TestEngineFolders()
+{
+    error_code Error;
+    filesystem::create_directories("First", Error);
+    filesystem::create_directories("Second", Error);
+    {
+        clsBankEngine First, Second;
+        if (!OpenEngine(First, "sync", "First") || !OpenEngine(Second, "sync", "Second"))
+            return;
+
+        CheckResult(AddClient(First, "A1", 1000), eEngineDone, "add A1 to the first engine");
+        CheckResult(AddClient(Second, "A1", 5000), eEngineDone, "add A1 to the second engine");
+        CheckResult(Deposit(First, "A1", 250), eEngineDone, "deposit in the first engine");
+        CheckBalance(First, "A1", 1250, "first engine");
+        CheckBalance(Second, "A1", 5000, "second engine");
+
+        vector<stLedgerEntry> vEntries;
+        CheckResult(Second.Statement("A1", INT64_MIN, INT64_MAX, vEntries), eEngineDone, "statement in the second engine");
+        Check(vEntries.size() == 1, "the second ledger only has its own opening, got " + to_string(vEntries.size()));
+        Check(First.Checkpoint() && Second.Checkpoint(), "checkpoint both engines");
+    }
+    Check(!filesystem::exists("Clients.txt"), "nothing is written to the working directory");
+
+    clsBankEngine Reopened;
+    if (OpenEngine(Reopened, "sync", "First"))
+        CheckBalance(Reopened, "A1", 1250, "first engine reopened");
+}
+
+// =============================================================
+//                      Teller Server
+// =============================================================
+
+#ifndef _WIN32
+// A connection to the teller server on 127.0.0.1:Port, -1 if there is none.
+// An answer is waited for 5 seconds at most.
+int ConnectToTellerServer(unsigned short Port)
+{
+    int Socket = socket(AF_INET, SOCK_STREAM, 0);
+    timeval Timeout{ 5, 0 };
+    setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+
+    sockaddr_in Address{};
+    Address.sin_family = AF_INET;
+    Address.sin_port = htons(Port);
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(Socket, (sockaddr*)&Address, sizeof(Address)) != 0)
+    {
+        close(Socket);
+        return -1;
+    }
+    return Socket;
+}
+
+// Sends one request and returns its answer, "" if none came.
+string AskTellerServer(int Socket, string Request)
+{
+    Request += '\n';
+    if (Socket < 0 || send(Socket, Request.data(), Request.size(), 0) != (ssize_t)Request.size())
+        return "";
+
+    string Answer;
+    char c;
+    while (recv(Socket, &c, 1, 0) == 1 && c != '\n')
+        Answer += c;
+    return Answer;
+}
+#endif
+
+// With a single worker, a teller that stays connected does not keep
+// another one waiting, and stopping the server closes the connections
+// still open and saves the book.
+void TestTellerServer()
+{
+#ifndef _WIN32
+    unsigned short Port = (unsigned short)(20000 + getpid() % 20000);
+    string PortText = to_string(Port);
+    pid_t Server = fork();
+    if (Server == 0)
+    {
+        freopen("Server.txt", "w", stdout);
+        execl(BANK_SYSTEM_PROGRAM, BANK_SYSTEM_PROGRAM, "--serve", PortText.c_str(), "--workers", "1", (char*)nullptr);
+        _Exit(127);
+    }
+
+    int First = -1;
+    for (int i = 0; i < 100 && First < 0; i++)
+    {
+        this_thread::sleep_for(chrono::milliseconds(50));
+        First = ConnectToTellerServer(Port);
+    }
+    Check(First >= 0, "connect to the server");
+
+    Check(AskTellerServer(First, "ADD#//#A1#//#1234#//#Client A1#//#0100000000#//#10.00") == "OK", "add A1");
+    int Second = ConnectToTellerServer(Port);
+    Check(AskTellerServer(Second, "DEPOSIT#//#A1#//#2.50") == "OK#//#12.50", "deposit on a second connection");
+    Check(AskTellerServer(Second, "ACCOUNTS#//#5") == "OK#//#A1", "accounts on a second connection");
+    Check(AskTellerServer(First, "TOTAL").rfind("OK#//#1#//#12.50", 0) == 0, "the first connection is still served");
+    if (Second >= 0)
+        close(Second);
+
+    kill(Server, SIGTERM);
+    int Status = 0;
+    waitpid(Server, &Status, 0);
+    Check(WIFEXITED(Status) && WEXITSTATUS(Status) == 0, "the server stops with a connection open");
+    if (First >= 0)
+        close(First);
+
+    clsBankEngine Engine;
+    if (OpenEngine(Engine))
+        CheckBalance(Engine, "A1", 1250, "after the server stopped");
+#endif
+}
+
+// =============================================================
+//                      Main
+// =============================================================
+
+struct stTest
+{
+    string Name;
+    void (*Run)();
+    void (*Step)(string);
+};
+
+const stTest Tests[] = {
+    { "format_round_trip", TestFormatRoundTrip, nullptr },
+    { "torn_journal", TestTornJournal, TornJournalStep },
+    { "damaged_snapshot", TestDamagedSnapshot, DamagedSnapshotStep },
+    { "ledger_statement", TestStatement, StatementStep },
+    { "transfer_batch", TestTransferBatch, TransferBatchStep },
+    { "engine_folders", TestEngineFolders, nullptr },
+    { "client_search", TestClientSearch, nullptr },
+    { "binary_add_failure", TestBinaryAddFailure, BinaryAddFailureStep },
+    { "balance_overflow", TestBalanceOverflow, nullptr },
+    { "accrual", TestAccrual, nullptr },
+    { "book_snapshot", TestBookSnapshot, nullptr },
+    { "replication", TestReplication, nullptr },
+    { "journal_failure", TestJournalFailure, JournalFailureStep },
+    { "ledger_identity", TestLedgerIdentity, LedgerIdentityStep },
+    { "teller_server", TestTellerServer, nullptr },
+    { "compaction", TestCompaction, CompactionStep },
+    { "import_duplicates", TestImportDuplicates, nullptr },
+};
+
+int main(int argc, char* argv[])
+{
+    vector<string> vArgs(argv + 1, argv + argc);
+    const stTest* Test = nullptr;
+    for (const stTest& Candidate : Tests)
+    {
+        if (!vArgs.empty() && vArgs[0] == Candidate.Name)
+            Test = &Candidate;
+    }
+    if (Test == nullptr)
+    {
+        cout << "Usage: BANK_SYSTEM_Tests <Test> [Step]\nTests:";
+        for (const stTest& Candidate : Tests)
+            cout << " " << Candidate.Name;
+        cout << "\n";
+        return 2;
+    }
+
+    TestName = Test->Name;
+    if (vArgs.size() >= 2 && Test->Step != nullptr)
+    {
+        Test->Step(vArgs[1]);
+        return FailedChecks == 0 ? 0 : 1;
+    }
+
+    error_code Error;
+    ProgramFileName = filesystem::absolute(argv[0], Error).string();
+    filesystem::path Folder = filesystem::temp_directory_path(Error) / ("BANK_SYSTEM_Tests_" + TestName);
+    filesystem::remove_all(Folder, Error);
+    filesystem::create_directories(Folder, Error);
+    filesystem::current_path(Folder, Error);
+    if (Error)
+    {
+        cout << "Cannot work in " << Folder.string() << ".\n";
+        return 1;
+    }
+
+    Test->Run();
+    cout << TestName << (FailedChecks == 0 ? ": passed\n" : ": FAILED\n");
+    if (FailedChecks == 0)
+    {
+        filesystem::current_path(Folder.parent_path(), Error);
+        filesystem::remove_all(Folder, Error);
+    }
+    return FailedChecks == 0 ? 0 : 1;
+}